@@ -26,8 +26,35 @@
 
 #include <windows.h>
 
+#include <process.h>
+#include <dbt.h>
+#pragma comment(lib,"user32.lib")
+#include <psapi.h>
+#pragma comment(lib,"psapi.lib")
+
+#include <algorithm>
+#include <deque>
+#include <new>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+// content hash kernels, picked at run time by what the processor has
+#if defined(_M_IX86) || defined(_M_X64)
+#define WPD_HASH_SSE2
+#include <emmintrin.h>
+#include <intrin.h>
+// AVX2 intrinsics and _xgetbv() are there from VS2012 (v110) on, without /arch; the VS2008 build has SSE2
+#if defined(_MSC_VER) && (_MSC_VER >= 1700)
+#define WPD_HASH_AVX2
+#include <immintrin.h>
+#endif
+#endif
+
 #include <objbase.h>
 #pragma comment(lib,"ole32.lib")
+#pragma comment(lib,"oleaut32.lib")
 
 #include <PortableDevice.h>
 #include <PortableDeviceApi.h>
@@ -44,58 +71,466 @@ static
 bool s_optUsePortableDeviceFTM = false;
 static
 DWORD s_optCountOfFetch = 10U;
+static
+bool s_optAdaptiveFetch = false;
+static
+DWORD s_optCountOfFetchMax = 1024U;
+static
+bool s_optUseBulk = false;
+static
+DWORD s_optBulkBatch = 100U;
+static
+LPCWSTR s_optProps = NULL;
+static
+DWORD s_optCountOfJobs = 1U;
+static
+DWORD s_optCountOfWalkers = 1U;
+static
+LPCWSTR s_optResumeFile = NULL;
+static
+DWORD s_optCheckpointInterval = 1000U;
+static
+LPCWSTR s_optCacheDir = NULL;
+static
+bool    s_optWatch = false;
+static
+DWORD s_optWatchSeconds = 0U;
+static
+DWORD s_optWatchDebounce = 500U;
+static
+DWORD s_optDiscoveryTimeout = 30U * 1000U;
+static
+LPCWSTR s_optOnly = NULL;
+static
+LPCWSTR s_optExcludeFolders = NULL;
+static
+LPCWSTR s_optOutputFile = NULL;
+static
+LPCWSTR s_optOutputFormat = L"ndjson";
+static
+DWORD s_optOutputBench = 0U;
+static
+DWORD s_optLogBench = 0U;
+static
+bool    s_optTree = false;
+static
+DWORD s_optTreeBench = 0U;
+static
+bool    s_optAllocStats = false;
+static
+LPCWSTR s_optSimulate = NULL;
+static
+DWORD s_optSimDepth = 4U;
+static
+DWORD s_optSimFanout = 8U;
+static
+DWORD s_optSimFiles = 0U;
+// microseconds: EnumObjects, Next, Next per id, GetValues
+static
+DWORD s_optSimLatency[4] = { 3000U, 1500U, 20U, 800U };
+static
+LPCWSTR s_optBenchJson = NULL;
+static
+LPCWSTR s_optBenchBaseline = NULL;
+static
+bool    s_optStats = false;
+static
+bool    s_optNoSessionPool = false;
+static
+DWORD s_optSimOpen = 200U * 1000U;
+static
+DWORD s_optSimRuns = 1U;
+static
+LPCWSTR s_optStatsJson = NULL;
+static
+bool    s_optDaemon = false;
+static
+LPCWSTR s_optPipe = NULL;
+static
+DWORD s_optDaemonRefresh = 60U;
+static
+DWORD s_optDaemonSeconds = 0U;
+static
+DWORD s_optDaemonThreads = 4U;
+static
+DWORD s_optDaemonLoad = 0U;
+static
+DWORD s_optDaemonLoadQueries = 1000U;
+static
+LPCWSTR s_optQuery = NULL;
+static
+LPCWSTR s_optResolve = NULL;
+static
+LPCWSTR s_optDownload = NULL;
+static
+DWORD s_optDownloadJobs = 4U;
+// KiB per read, rounded up to the device's optimal transfer size
+static
+DWORD s_optDownloadBuffer = 1024U;
+// interrupted attempts in a row that got no further before a file is given up
+static
+DWORD s_optDownloadRetries = 3U;
+// MiB/s of the simulated device's streams
+static
+DWORD s_optSimBandwidth = 32U;
+// chance per Read of the simulated device, in 1/1000, to drop the stream at a random offset
+static
+DWORD s_optSimDisconnect = 0U;
+// camera files the simulated phone holds a second copy of
+static
+DWORD s_optSimCopies = 0U;
+// chance per object of a simulated bulk request, in 1/1000, to be left out of its batch
+static
+DWORD s_optSimBulkShort = 0U;
+// chance per Next of the simulated device, in 1/1000, to kill the walk there; --resume= picks it up again
+static
+DWORD s_optSimKill = 0U;
+// share of the simulated files, in 1/1000, rewritten before every run after the first
+static
+DWORD s_optSimChange = 0U;
+// --sim-compare=bulk|jobs|walkers|fetch: the simulated device walked once per setting
+static
+LPCWSTR s_optSimCompare = NULL;
+// simulated devices scanned side by side by the --jobs= pool
+static
+DWORD s_optSimDevices = 1U;
+// +<ms> plugs the next simulated device in, -<ms> pulls the oldest one still in, comma separated
+static
+LPCWSTR s_optSimPlug = NULL;
+static
+bool    s_optDedup = false;
+static
+DWORD s_optHashBench = 0U;
+static
+LPCWSTR s_optDiff = NULL;
+static
+DWORD s_optDiffBench = 0U;
+static
+LPCWSTR s_optCatalog = NULL;
+static
+LPCWSTR s_optCatalogQuery = NULL;
+static
+DWORD s_optCatalogBench = 0U;
+
+static
+LARGE_INTEGER s_qpcFrequency = { 0 };
+
+double
+wpdTicksToMicroseconds( const ULONGLONG qwTicks )
+{
+    if ( 0 == s_qpcFrequency.QuadPart )
+    {
+        return 0.0;
+    }
+    return (double)qwTicks * 1000000.0 / (double)s_qpcFrequency.QuadPart;
+}
+
+ULONGLONG
+wpdTicksNow( void )
+{
+    LARGE_INTEGER li;
+    ::QueryPerformanceCounter( &li );
+    return (ULONGLONG)li.QuadPart;
+}
+
+enum WpdLogLevel
+{
+    WPD_LOG_LEVEL_VERBOSE
+    , WPD_LOG_LEVEL_INFO
+    , WPD_LOG_LEVEL_ERROR
+};
+
+#define WPD_LOG_LINE_MAX    (512)
+// power of two
+#define WPD_LOG_RING_SIZE   (1024)
+
+// one formatted line; nSequence tells who owns the cell (bounded MPMC queue by D. Vyukov, used as MPSC)
+struct WpdLogCell
+{
+    volatile LONG   nSequence;
+    LONG            level;
+    wchar_t         text[WPD_LOG_LINE_MAX];
+};
+
+// lines are formatted by the calling thread into a ring and written by a background thread.
+// a full ring drops the line and counts it; an error is never dropped, the caller writes it itself
+// and it may come out ahead of lines still in the ring
+struct WpdLogger
+{
+    WpdLogCell*     pCells;
+    volatile LONG   nEnqueuePos;
+    LONG            nDequeuePos;
+    volatile LONG   nCountDropped;
+    volatile LONG   nCountOverflow;     // errors written past a full ring
+    volatile LONG   nCountWritten;
+    volatile LONG   nWriterIdle;
+    volatile LONG   nStop;
+    HANDLE          hEventWake;
+    HANDLE          hThread;
+    bool            discard;    // --log-bench: measure without the console
+    bool            toStderr;   // --output=-: stdout carries the records
+};
+
+static
+WpdLogger s_logger = { 0 };
 
 void
-LOGV( LPCWSTR format, ... )
+wpdLog_WriteLine( const LONG level, LPCWSTR pszText )
 {
-    if ( false == s_optVerbose )
+    // the line is data, never a format string
+    ::fputws( pszText, (WPD_LOG_LEVEL_ERROR == level || s_logger.toStderr)?(stderr):(stdout) );
+    if ( ::IsDebuggerPresent() )
     {
-        return;
+        ::OutputDebugStringW( pszText );
     }
+}
 
-    wchar_t buff[512];
+unsigned __stdcall
+wpdLog_Writer( void* /*pParam*/ )
+{
+    WpdLogger* pLogger = &s_logger;
+    bool pendingFlush = false;
+    for ( ;; )
+    {
+        WpdLogCell* pCell = &pLogger->pCells[pLogger->nDequeuePos & (WPD_LOG_RING_SIZE - 1)];
+        if ( pCell->nSequence == pLogger->nDequeuePos + 1 )
+        {
+            if ( false == pLogger->discard )
+            {
+                wpdLog_WriteLine( pCell->level, pCell->text );
+                pendingFlush = true;
+            }
+            ::InterlockedIncrement( &pLogger->nCountWritten );
+            // hand the cell back to the producers for the next lap
+            ::InterlockedExchange( &pCell->nSequence, pLogger->nDequeuePos + WPD_LOG_RING_SIZE );
+            pLogger->nDequeuePos += 1;
+            continue;
+        }
 
-    va_list argPtr;
-    va_start( argPtr, format );
+        if ( pendingFlush )
+        {
+            ::fflush( stdout );
+            ::fflush( stderr );
+            pendingFlush = false;
+        }
+        if ( 0 != pLogger->nStop )
+        {
+            break;
+        }
 
-    ::_vsnwprintf_s( buff, sizeof(buff)/sizeof(buff[0]), _TRUNCATE, format, argPtr );
+        ::InterlockedExchange( &pLogger->nWriterIdle, 1 );
+        // a line published before the idle flag was visible is not waited for
+        if ( pCell->nSequence != pLogger->nDequeuePos + 1 && 0 == pLogger->nStop )
+        {
+            ::WaitForSingleObject( pLogger->hEventWake, 100 );
+        }
+        ::InterlockedExchange( &pLogger->nWriterIdle, 0 );
+    }
+    return 0;
+}
 
-    ::fwprintf( stdout, buff );
-    ::OutputDebugStringW( buff );
+bool
+wpdLog_Start( void )
+{
+    WpdLogger* pLogger = &s_logger;
+    pLogger->pCells = new WpdLogCell[WPD_LOG_RING_SIZE];
+    for ( LONG index = 0; index < WPD_LOG_RING_SIZE; ++index )
+    {
+        pLogger->pCells[index].nSequence = index;
+    }
+    pLogger->hEventWake = ::CreateEventW( NULL, FALSE, FALSE, NULL );
+    if ( NULL != pLogger->hEventWake )
+    {
+        pLogger->hThread = reinterpret_cast<HANDLE>(
+            ::_beginthreadex( NULL, 0, wpdLog_Writer, NULL, 0, NULL )
+            );
+    }
+    if ( NULL == pLogger->hThread )
+    {
+        // synchronous writes as before
+        if ( NULL != pLogger->hEventWake )
+        {
+            ::CloseHandle( pLogger->hEventWake );
+            pLogger->hEventWake = NULL;
+        }
+        delete [] pLogger->pCells;
+        pLogger->pCells = NULL;
+        return false;
+    }
+    return true;
 }
 
+// write what is left in the ring and report the lines dropped
 void
-LOGI( LPCWSTR format, ... )
+wpdLog_Stop( void )
+{
+    WpdLogger* pLogger = &s_logger;
+    if ( NULL == pLogger->hThread )
+    {
+        return;
+    }
+
+    ::InterlockedExchange( &pLogger->nStop, 1 );
+    ::SetEvent( pLogger->hEventWake );
+    ::WaitForSingleObject( pLogger->hThread, INFINITE );
+    ::CloseHandle( pLogger->hThread );
+    pLogger->hThread = NULL;
+    ::CloseHandle( pLogger->hEventWake );
+    pLogger->hEventWake = NULL;
+
+    WpdLogCell* pCells = pLogger->pCells;
+    pLogger->pCells = NULL;
+    delete [] pCells;
+
+    if ( 0 < pLogger->nCountDropped || 0 < pLogger->nCountOverflow )
+    {
+        ::fwprintf( stderr, L"Log lines dropped=%ld, errors written past a full ring=%ld\n", pLogger->nCountDropped, pLogger->nCountOverflow );
+    }
+}
+
+void
+wpdLog_VPrintf( const LONG level, LPCWSTR format, va_list argPtr )
 {
-    wchar_t buff[512];
+    WpdLogger* pLogger = &s_logger;
+    if ( NULL == pLogger->pCells )
+    {
+        wchar_t buff[WPD_LOG_LINE_MAX];
+        ::_vsnwprintf_s( buff, sizeof(buff)/sizeof(buff[0]), _TRUNCATE, format, argPtr );
+        wpdLog_WriteLine( level, buff );
+        return;
+    }
+
+    // claim a cell
+    WpdLogCell* pCell = NULL;
+    LONG nPos = pLogger->nEnqueuePos;
+    for ( ;; )
+    {
+        pCell = &pLogger->pCells[nPos & (WPD_LOG_RING_SIZE - 1)];
+        const LONG nDiff = pCell->nSequence - nPos;
+        if ( 0 == nDiff )
+        {
+            const LONG nPrev = ::InterlockedCompareExchange( &pLogger->nEnqueuePos, nPos + 1, nPos );
+            if ( nPrev == nPos )
+            {
+                break;
+            }
+            nPos = nPrev;
+        }
+        else
+        if ( nDiff < 0 )
+        {
+            // the writer is a full lap behind: other lines are dropped and counted,
+            // an error is written right here rather than waiting for a cell
+            if ( WPD_LOG_LEVEL_ERROR != level )
+            {
+                ::InterlockedIncrement( &pLogger->nCountDropped );
+                return;
+            }
+            ::InterlockedIncrement( &pLogger->nCountOverflow );
+            wchar_t buff[WPD_LOG_LINE_MAX];
+            ::_vsnwprintf_s( buff, sizeof(buff)/sizeof(buff[0]), _TRUNCATE, format, argPtr );
+            wpdLog_WriteLine( level, buff );
+            ::fflush( stderr );
+            ::SetEvent( pLogger->hEventWake );
+            return;
+        }
+        else
+        {
+            nPos = pLogger->nEnqueuePos;
+        }
+    }
+
+    ::_vsnwprintf_s( pCell->text, sizeof(pCell->text)/sizeof(pCell->text[0]), _TRUNCATE, format, argPtr );
+    pCell->level = level;
+    // publish: the text is visible before the sequence
+    ::InterlockedExchange( &pCell->nSequence, nPos + 1 );
+
+    if ( 0 != pLogger->nWriterIdle && 0 != ::InterlockedExchange( &pLogger->nWriterIdle, 0 ) )
+    {
+        ::SetEvent( pLogger->hEventWake );
+    }
+}
 
+void
+wpdLog_Printf( const LONG level, LPCWSTR format, ... )
+{
     va_list argPtr;
     va_start( argPtr, format );
+    wpdLog_VPrintf( level, format, argPtr );
+    va_end( argPtr );
+}
 
-    ::_vsnwprintf_s( buff, sizeof(buff)/sizeof(buff[0]), _TRUNCATE, format, argPtr );
+// disabled verbose lines cost one load and a branch: the arguments are not even evaluated
+#define LOGV(...)   ((s_optVerbose)?(wpdLog_Printf( WPD_LOG_LEVEL_VERBOSE, __VA_ARGS__ )):((void)0))
 
-    ::fwprintf( stdout, buff );
-    ::OutputDebugStringW( buff );
+void
+LOGI( LPCWSTR format, ... )
+{
+    va_list argPtr;
+    va_start( argPtr, format );
+    wpdLog_VPrintf( WPD_LOG_LEVEL_INFO, format, argPtr );
+    va_end( argPtr );
 }
 
 void
 LOGE( LPCWSTR format, ... )
 {
-    wchar_t buff[512];
-
     va_list argPtr;
     va_start( argPtr, format );
+    wpdLog_VPrintf( WPD_LOG_LEVEL_ERROR, format, argPtr );
+    va_end( argPtr );
 
-    ::_vsnwprintf_s( buff, sizeof(buff)/sizeof(buff[0]), _TRUNCATE, format, argPtr );
-
-    ::fwprintf( stderr, buff );
-    ::OutputDebugStringW( buff );
     if ( ::IsDebuggerPresent() )
     {
         ::DebugBreak();
     }
 }
 
+// --log-bench=N: cost of a disabled and an enabled call, and the lines per second the writer keeps up with
+void
+wpdLog_Bench( const DWORD dwCountLine )
+{
+    WpdLogger* pLogger = &s_logger;
+    const bool optVerbose = s_optVerbose;
+
+    s_optVerbose = false;
+    ULONGLONG qwTicksStart = wpdTicksNow();
+    for ( DWORD index = 0; index < dwCountLine; ++index )
+    {
+        LOGV( L"bench %u %s\n", index, L"disabled" );
+    }
+    const double dDisabled = wpdTicksToMicroseconds( wpdTicksNow() - qwTicksStart );
+
+    pLogger->discard = true;
+    const LONG nDroppedStart = pLogger->nCountDropped;
+    const LONG nWrittenStart = pLogger->nCountWritten;
+    s_optVerbose = true;
+    qwTicksStart = wpdTicksNow();
+    for ( DWORD index = 0; index < dwCountLine; ++index )
+    {
+        LOGV( L"bench %u %s\n", index, L"enabled" );
+    }
+    const double dEnabled = wpdTicksToMicroseconds( wpdTicksNow() - qwTicksStart );
+    s_optVerbose = optVerbose;
+
+    // until the writer drained what the ring took
+    const LONG nDropped = pLogger->nCountDropped - nDroppedStart;
+    const LONG nAccepted = (LONG)dwCountLine - nDropped;
+    while ( NULL != pLogger->hThread && pLogger->nCountWritten - nWrittenStart < nAccepted )
+    {
+        ::SwitchToThread();
+    }
+    const double dDrained = wpdTicksToMicroseconds( wpdTicksNow() - qwTicksStart );
+    pLogger->discard = false;
+
+    LOGI( L"Log bench: lines=%u, disabled=%.1fns/call, enabled=%.1fns/call, sustained=%.0f lines/sec, dropped=%ld\n"
+        , dwCountLine
+        , (0 < dwCountLine)?(dDisabled * 1000.0 / dwCountLine):(0.0)
+        , (0 < dwCountLine)?(dEnabled * 1000.0 / dwCountLine):(0.0)
+        , (0.0 < dDrained)?(nAccepted / (dDrained / 1000000.0)):(0.0)
+        , nDropped
+        );
+}
 
 void
 DumpPropertyKey( const PROPERTYKEY* pKey )
@@ -321,6 +756,54 @@ dispDeviceValues( IPortableDeviceValues* pAttributes )
                 pValue = NULL;
             }
         }
+        {
+            LPWSTR pValue = NULL;
+            const HRESULT hr = pAttributes->GetStringValue(
+                WPD_OBJECT_PERSISTENT_UNIQUE_ID
+                , &pValue
+                );
+            if ( SUCCEEDED(hr) )
+            {
+                LOGV( L" ObjectPersistentUniqueId: %s\n", pValue );
+            }
+
+            if ( NULL != pValue )
+            {
+                ::CoTaskMemFree( pValue );
+                pValue = NULL;
+            }
+        }
+        {
+            ULONGLONG qwValue = 0;
+            const HRESULT hr = pAttributes->GetUnsignedLargeIntegerValue(
+                WPD_OBJECT_SIZE
+                , &qwValue
+                );
+            if ( SUCCEEDED(hr) )
+            {
+                LOGV( L" ObjectSize: %I64u\n", qwValue );
+            }
+        }
+        {
+            PROPVARIANT pv;
+            ::PropVariantInit( &pv );
+            const HRESULT hr = pAttributes->GetValue(
+                WPD_OBJECT_DATE_MODIFIED
+                , &pv
+                );
+            if ( SUCCEEDED(hr) && VT_DATE == pv.vt )
+            {
+                SYSTEMTIME st;
+                if ( ::VariantTimeToSystemTime( pv.date, &st ) )
+                {
+                    LOGV( L" ObjectDateModified: %04u/%02u/%02u %02u:%02u:%02u\n"
+                        , st.wYear, st.wMonth, st.wDay
+                        , st.wHour, st.wMinute, st.wSecond
+                        );
+                }
+            }
+            ::PropVariantClear( &pv );
+        }
         {
             GUID guid;
             const HRESULT hr = pAttributes->GetGuidValue(
@@ -343,694 +826,16812 @@ dispDeviceValues( IPortableDeviceValues* pAttributes )
     }
 }
 
+struct WpdPropertyKeyName
+{
+    LPCWSTR             pszName;
+    const PROPERTYKEY*  pKey;
+    bool                forFolder;
+};
+
 static
-DWORD   s_dwCountContent = 0;
+const WpdPropertyKeyName s_propertyKeyNames[] =
+{
+    { L"name",          &WPD_OBJECT_NAME,                   true  },
+    { L"type",          &WPD_OBJECT_CONTENT_TYPE,           true  },
+    { L"size",          &WPD_OBJECT_SIZE,                   false },
+    { L"modified",      &WPD_OBJECT_DATE_MODIFIED,          true  },
+    { L"created",       &WPD_OBJECT_DATE_CREATED,           true  },
+    { L"puid",          &WPD_OBJECT_PERSISTENT_UNIQUE_ID,   true  },
+    { L"parent",        &WPD_OBJECT_PARENT_ID,              true  },
+    { L"original-name", &WPD_OBJECT_ORIGINAL_FILE_NAME,     false },
+    { L"format",        &WPD_OBJECT_FORMAT,                 false },
+};
 
-bool
-wpdEnumContent_RecursiveEnumerate(
-    LPCWSTR pszObjectId
-    , IPortableDeviceContent* pPortableDeviceContent
-)
+static
+const WCHAR s_szPropsMinimal[] = L"name,type,size,modified,puid";
+
+// per content type accounting, used to estimate what a NULL key collection would have cost
+struct WpdContentTypeStat
 {
-    if ( NULL == pszObjectId )
-    {
-        LOGV( L"wpdEnumContent_RecursiveEnumerate: pszObjectId is NULL" );
-        return false;
-    }
-    if ( NULL == pPortableDeviceContent )
-    {
-        LOGV( L"wpdEnumContent_RecursiveEnumerate: pPortableDeviceContent is NULL" );
-        return false;
-    }
+    GUID        guidContentType;
+    DWORD       dwCountObject;
+    DWORD       dwBytesFull;
+    bool        sampled;
+    LPWSTR      pszSampleObjectId;
+};
 
+#define WPD_CONTENT_TYPE_STAT_MAX   (16)
+// requested Next() sizes by power of two: 1, 2-3, 4-7, ...
+#define WPD_FETCH_HISTOGRAM_MAX     (16)
 
-    LOGV( L"enum content: %s\n", pszObjectId );
-    if ( NULL != pPortableDeviceContent )
-    {
-        IPortableDeviceProperties* pPortableDeviceProperties = NULL;
-        IPortableDeviceValues* pAttributes = NULL;
+// --stats: per device, per operation call counters and log2 latency histograms
+enum WpdStatOp
+{
+    WPD_STAT_OP_OPEN
+    , WPD_STAT_OP_CONTENT
+    , WPD_STAT_OP_PROPERTIES
+    , WPD_STAT_OP_ENUM_OBJECTS
+    , WPD_STAT_OP_NEXT
+    , WPD_STAT_OP_GET_VALUES
+    , WPD_STAT_OP_BULK
+    , WPD_STAT_OP_FRIENDLY_NAME
+    , WPD_STAT_OP_MANUFACTURER
+    , WPD_STAT_OP_DESCRIPTION
+    , WPD_STAT_OP_GET_STREAM
+    , WPD_STAT_OP_READ
+    , WPD_STAT_OP_MAX
+};
 
-        {
-            const HRESULT hr = pPortableDeviceContent->Properties( &pPortableDeviceProperties );
-            if ( FAILED(hr) )
-            {
-                LOGE( L"! Failed. pPortableDeviceContent Properties, hr=0x%08x\n", hr );
-                return false;
-            }
-        }
+static
+const LPCWSTR s_statOpNames[WPD_STAT_OP_MAX] =
+{
+    L"Open"
+    , L"Content"
+    , L"Properties"
+    , L"EnumObjects"
+    , L"Next"
+    , L"GetValues"
+    , L"Bulk"
+    , L"FriendlyName"
+    , L"Manufacturer"
+    , L"Description"
+    , L"GetStream"
+    , L"Read"
+};
 
-        if ( NULL != pPortableDeviceProperties )
-        {
-            const HRESULT hr = pPortableDeviceProperties->GetValues(
-                pszObjectId
-                , NULL
-                , &pAttributes
-                );
-            if ( FAILED(hr) )
-            {
-                LOGE( L"! Failed. pPortableDeviceProperties GetValues, hr=0x%08x\n", hr );
-                return false;
-            }
-        }
+// bucket n counts calls of [2^n, 2^(n+1)) microseconds, bucket 0 also takes < 1us
+#define WPD_STAT_BUCKET_MAX     (32)
+#define WPD_STAT_HRESULT_MAX    (8)
 
-        dispDeviceValues( pAttributes );
+struct WpdStatCounters
+{
+    volatile LONG       nCountCall;
+    volatile LONG       nCountFailure;
+    volatile LONG       nCountObject;
+    volatile LONGLONG   qwBytes;
+    volatile LONGLONG   qwMicroseconds;
+    volatile LONG       nBucket[WPD_STAT_BUCKET_MAX];
+    // distinct failure codes, guarded by WpdDeviceStats::cs; the codes after the first WPD_STAT_HRESULT_MAX go to other
+    HRESULT             hrFailure[WPD_STAT_HRESULT_MAX];
+    LONG                nCountFailureByHr[WPD_STAT_HRESULT_MAX];
+    LONG                nCountFailureOtherHr;
+};
 
-        if ( NULL != pAttributes )
-        {
-            const DWORD dwCount = pAttributes->Release();
-            LOGV( L"pAttributes::Release, count=%u\n", dwCount );
-            pAttributes = NULL;
-        }
+struct WpdDeviceStats
+{
+    std::wstring        pnpDeviceId;
+    CRITICAL_SECTION    cs;
+    WpdStatCounters     ops[WPD_STAT_OP_MAX];
+};
+
+struct WpdStatsRegistry
+{
+    CRITICAL_SECTION                cs;
+    std::vector<WpdDeviceStats*>    devices;
+};
+
+static
+WpdStatsRegistry s_stats;
+
+void
+wpdStats_Start(
+    void
+)
+{
+    ::InitializeCriticalSection( &s_stats.cs );
+}
+
+void
+wpdStats_Stop(
+    void
+)
+{
+    for ( size_t index = 0; index < s_stats.devices.size(); ++index )
+    {
+        ::DeleteCriticalSection( &s_stats.devices[index]->cs );
+        delete s_stats.devices[index];
+    }
+    s_stats.devices.clear();
+    ::DeleteCriticalSection( &s_stats.cs );
+}
 
-        if ( NULL != pPortableDeviceProperties )
+// counters of one device, created on first use. NULL without --stats, call sites then skip timing
+WpdDeviceStats*
+wpdStats_Device(
+    LPCWSTR pszPnPDeviceID
+)
+{
+    if ( false == s_optStats || NULL == pszPnPDeviceID )
+    {
+        return NULL;
+    }
+
+    WpdDeviceStats* pStats = NULL;
+    ::EnterCriticalSection( &s_stats.cs );
+    for ( size_t index = 0; index < s_stats.devices.size(); ++index )
+    {
+        if ( s_stats.devices[index]->pnpDeviceId == pszPnPDeviceID )
         {
-            const DWORD dwCount = pPortableDeviceProperties->Release();
-            LOGV( L"pPortableDeviceProperties::Release, count=%u\n", dwCount );
-            pPortableDeviceProperties = NULL;
+            pStats = s_stats.devices[index];
+            break;
         }
     }
+    if ( NULL == pStats )
+    {
+        pStats = new WpdDeviceStats();
+        pStats->pnpDeviceId.assign( pszPnPDeviceID );
+        ::InitializeCriticalSection( &pStats->cs );
+        ::memset( pStats->ops, 0, sizeof(pStats->ops) );
+        s_stats.devices.push_back( pStats );
+    }
+    ::LeaveCriticalSection( &s_stats.cs );
 
-    bool result = true;
+    return pStats;
+}
 
-    IEnumPortableDeviceObjectIDs* pEnumPortableDeviceObjectIDs = NULL;
-    if ( NULL != pPortableDeviceContent )
+void
+wpdStats_Add64(
+    volatile LONGLONG* pTarget
+    , const LONGLONG qwValue
+)
+{
+    LONGLONG qwOld = *pTarget;
+    for ( ;; )
     {
-        const DWORD dwFlags = 0;
-        IPortableDeviceValues* pFilter = NULL;
-
-        const HRESULT hr = pPortableDeviceContent->EnumObjects(
-            dwFlags
-            , pszObjectId
-            , pFilter
-            , &pEnumPortableDeviceObjectIDs
-            );
-        if ( FAILED(hr) )
+        const LONGLONG qwSeen = ::InterlockedCompareExchange64( pTarget, qwOld + qwValue, qwOld );
+        if ( qwSeen == qwOld )
         {
-            LOGE( L"! Failed. pPortableDeviceContent EnumObjects, hr=0x%08x\n", hr );
-            result = false;
+            break;
         }
+        qwOld = qwSeen;
     }
+}
 
-    if ( false != result && NULL != pEnumPortableDeviceObjectIDs )
-    {
-        const DWORD MY_FETCH_COUNT = s_optCountOfFetch;
-        LPWSTR* pszObjectIdArray = new LPWSTR[MY_FETCH_COUNT];
+ULONGLONG
+wpdStats_Begin(
+    const WpdDeviceStats* pStats
+)
+{
+    return (NULL != pStats)?(wpdTicksNow()):(0);
+}
 
-        if ( NULL != pszObjectIdArray )
-        {
-            HRESULT hr = S_OK;
-            while ( S_OK == hr ) // not SUCCEEDED(hr)
-            {
-                DWORD nFetched = 0;
+void
+wpdStats_End(
+    WpdDeviceStats* pStats
+    , const WpdStatOp op
+    , const ULONGLONG qwTicksStart
+    , const HRESULT hr
+    , const DWORD dwCountObject
+)
+{
+    if ( NULL == pStats )
+    {
+        return;
+    }
 
-                for ( size_t index = 0; index < MY_FETCH_COUNT; ++index )
-                {
-                    pszObjectIdArray[index] = NULL;
-                }
+    const ULONGLONG qwMicroseconds = (ULONGLONG)wpdTicksToMicroseconds( wpdTicksNow() - qwTicksStart );
+    WpdStatCounters& counters = pStats->ops[op];
 
-                hr = pEnumPortableDeviceObjectIDs->Next(
-                    MY_FETCH_COUNT
-                    , pszObjectIdArray
-                    , &nFetched
-                    );
-                if ( FAILED(hr) )
-                {
-                    LOGE( L"! Failed. pEnumPortableDeviceObjectIDs Next, hr=0x%08x\n", hr );
-                    result = false;
-                }
-                else
-                {
-                    s_dwCountContent += nFetched;
-                    for ( DWORD dwIndex = 0; dwIndex < nFetched; ++dwIndex )
-                    {
-                        result = wpdEnumContent_RecursiveEnumerate( pszObjectIdArray[dwIndex], pPortableDeviceContent );
-                        if ( false == result )
-                        {
-                            break;
-                        }
-                    }
+    DWORD dwBucket = 0;
+    for ( ULONGLONG qw = qwMicroseconds; 1 < qw && dwBucket < WPD_STAT_BUCKET_MAX - 1; qw >>= 1 )
+    {
+        dwBucket += 1;
+    }
 
-                    //FreePortableDevicePnPIDs( pszObjectIdArray, MY_FETCH_COUNT );
-                    if ( NULL != pszObjectIdArray )
-                    {
-                        for ( size_t index = 0; index < MY_FETCH_COUNT; ++index )
-                        {
-                            if ( NULL != pszObjectIdArray[index] )
-                            {
-                                ::CoTaskMemFree( pszObjectIdArray[index] );
-                                pszObjectIdArray[index] = NULL;
-                            }
-                        }
-                    }
-                }
-            }
-        }
+    ::InterlockedIncrement( &counters.nCountCall );
+    ::InterlockedIncrement( &counters.nBucket[dwBucket] );
+    wpdStats_Add64( &counters.qwMicroseconds, (LONGLONG)qwMicroseconds );
+    if ( 0 < dwCountObject )
+    {
+        ::InterlockedExchangeAdd( &counters.nCountObject, (LONG)dwCountObject );
+    }
 
-        //FreePortableDevicePnPIDs( pszObjectIdArray, MY_FETCH_COUNT );
-        if ( NULL != pszObjectIdArray )
+    if ( FAILED(hr) )
+    {
+        ::InterlockedIncrement( &counters.nCountFailure );
+        ::EnterCriticalSection( &pStats->cs );
+        DWORD index = 0;
+        for ( ; index < WPD_STAT_HRESULT_MAX; ++index )
         {
-            for ( size_t index = 0; index < MY_FETCH_COUNT; ++index )
+            if ( 0 == counters.nCountFailureByHr[index] || hr == counters.hrFailure[index] )
             {
-                if ( NULL != pszObjectIdArray[index] )
-                {
-                    ::CoTaskMemFree( pszObjectIdArray[index] );
-                    pszObjectIdArray[index] = NULL;
-                }
+                counters.hrFailure[index] = hr;
+                counters.nCountFailureByHr[index] += 1;
+                break;
             }
         }
-        if ( NULL != pszObjectIdArray )
+        if ( WPD_STAT_HRESULT_MAX == index )
         {
-            delete [] pszObjectIdArray;
-            pszObjectIdArray = NULL;
+            counters.nCountFailureOtherHr += 1;
         }
+        ::LeaveCriticalSection( &pStats->cs );
     }
-
-    if ( NULL != pEnumPortableDeviceObjectIDs )
-    {
-        const DWORD dwCount = pEnumPortableDeviceObjectIDs->Release();
-        LOGV( L"IEnumPortableDeviceObjectIDs::Release, count=%u\n", dwCount );
-        pEnumPortableDeviceObjectIDs = NULL;
-    }
-
-    return result;
 }
 
 void
-dispDeviceInfo(
-    IPortableDeviceManager* pPortableDeviceManager
-    , LPCWSTR pszPnPDeviceID
+wpdStats_AddBytes(
+    WpdDeviceStats* pStats
+    , const WpdStatOp op
+    , const ULONGLONG qwBytes
 )
 {
-    if ( NULL == pPortableDeviceManager )
-    {
-        return;
-    }
-    if ( NULL == pszPnPDeviceID )
+    if ( NULL == pStats || 0 == qwBytes )
     {
         return;
     }
+    wpdStats_Add64( &pStats->ops[op].qwBytes, (LONGLONG)qwBytes );
+}
 
+// upper bound of the bucket holding the given fraction of calls
+ULONGLONG
+wpdStats_Percentile(
+    const WpdStatCounters& counters
+    , const double dFraction
+)
+{
+    const LONG nTarget = (LONG)(counters.nCountCall * dFraction + 0.5);
+    LONG nSeen = 0;
+    for ( DWORD index = 0; index < WPD_STAT_BUCKET_MAX; ++index )
     {
-        DWORD dwSize = 0;
+        nSeen += counters.nBucket[index];
+        if ( nTarget <= nSeen && 0 < nSeen )
         {
-            const HRESULT hr = pPortableDeviceManager->GetDeviceFriendlyName(
-                pszPnPDeviceID
-                , NULL
-                , &dwSize
-                );
-            if ( FAILED(hr) )
-            {
-                LOGE( L"! Failed. IPortableDeviceManager::GetDeviceFriendlyName get count, hr=0x%08x\n", hr );
-            }
+            return 1ULL << (index + 1);
         }
+    }
+    return 1ULL << WPD_STAT_BUCKET_MAX;
+}
 
-        LPWSTR pDispBuff = NULL;
-        pDispBuff = new WCHAR[dwSize+1];
-        if ( NULL != pDispBuff )
-        {
-            pDispBuff[0] = L'\0';
-
-            {
-                const HRESULT hr = pPortableDeviceManager->GetDeviceFriendlyName(
-                    pszPnPDeviceID
-                    , pDispBuff
-                    , &dwSize
-                    );
-                if ( FAILED(hr) )
-                {
-                    LOGE( L"! Failed. IPortableDeviceManager::GetDeviceFriendlyName get name and count, hr=0x%08x\n", hr );
-                }
-                else
-                {
-                    LOGI( L"    FriendlyName: %s\n", pDispBuff );
-                }
-            }
-        }
+// what one wpdStats_Begin/wpdStats_End pair costs on this machine, in microseconds
+double
+wpdStats_Calibrate(
+    void
+)
+{
+    WpdDeviceStats stats;
+    ::InitializeCriticalSection( &stats.cs );
+    ::memset( stats.ops, 0, sizeof(stats.ops) );
 
-        if ( NULL != pDispBuff )
-        {
-            delete [] pDispBuff;
-            pDispBuff = NULL;
-        }
+    const DWORD dwCount = 100000;
+    const ULONGLONG qwTicksStart = wpdTicksNow();
+    for ( DWORD index = 0; index < dwCount; ++index )
+    {
+        const ULONGLONG qwTicksCall = wpdStats_Begin( &stats );
+        wpdStats_End( &stats, WPD_STAT_OP_NEXT, qwTicksCall, S_OK, 1 );
     }
+    const double dMicroseconds = wpdTicksToMicroseconds( wpdTicksNow() - qwTicksStart );
+
+    ::DeleteCriticalSection( &stats.cs );
+    return dMicroseconds / dwCount;
+}
 
+void
+wpdStats_Report(
+    void
+)
+{
+    for ( size_t indexDevice = 0; indexDevice < s_stats.devices.size(); ++indexDevice )
     {
-        DWORD dwSize = 0;
+        const WpdDeviceStats* pStats = s_stats.devices[indexDevice];
+        LOGI( L"Stats      : %s\n", pStats->pnpDeviceId.c_str() );
+        for ( DWORD op = 0; op < WPD_STAT_OP_MAX; ++op )
         {
-            const HRESULT hr = pPortableDeviceManager->GetDeviceManufacturer(
-                pszPnPDeviceID
-                , NULL
-                , &dwSize
+            const WpdStatCounters& counters = pStats->ops[op];
+            if ( 0 == counters.nCountCall )
+            {
+                continue;
+            }
+            LOGI( L"    %-12s calls=%ld, failed=%ld, objects=%ld, bytes=%I64u, total=%.1fms, avg=%.1fus, p50<%I64uus, p99<%I64uus\n"
+                , s_statOpNames[op]
+                , counters.nCountCall
+                , counters.nCountFailure
+                , counters.nCountObject
+                , counters.qwBytes
+                , counters.qwMicroseconds / 1000.0
+                , (double)counters.qwMicroseconds / counters.nCountCall
+                , wpdStats_Percentile( counters, 0.50 )
+                , wpdStats_Percentile( counters, 0.99 )
                 );
-            if ( FAILED(hr) )
+            for ( DWORD index = 0; index < WPD_STAT_HRESULT_MAX && 0 < counters.nCountFailureByHr[index]; ++index )
             {
-                LOGE( L"! Failed. IPortableDeviceManager::GetDeviceManufacturer get count, hr=0x%08x\n", hr );
+                LOGI( L"        hr=0x%08x x%ld\n", counters.hrFailure[index], counters.nCountFailureByHr[index] );
             }
-        }
-
-        LPWSTR pDispBuff = NULL;
-        pDispBuff = new WCHAR[dwSize+1];
-        if ( NULL != pDispBuff )
-        {
-            pDispBuff[0] = L'\0';
-
+            if ( 0 < counters.nCountFailureOtherHr )
             {
-                const HRESULT hr = pPortableDeviceManager->GetDeviceManufacturer(
-                    pszPnPDeviceID
-                    , pDispBuff
-                    , &dwSize
-                    );
-                if ( FAILED(hr) )
-                {
-                    LOGE( L"! Failed. IPortableDeviceManager::GetDeviceManufacturer get name and count, hr=0x%08x\n", hr );
-                }
-                else
+                LOGI( L"        hr=other x%ld\n", counters.nCountFailureOtherHr );
+            }
+            if ( s_optVerbose )
+            {
+                for ( DWORD index = 0; index < WPD_STAT_BUCKET_MAX; ++index )
                 {
-                    LOGI( L"    Manufacturer: %s\n", pDispBuff );
+                    if ( 0 < counters.nBucket[index] )
+                    {
+                        LOGV( L"        [%I64u, %I64u)us: %ld\n", 1ULL << index, 1ULL << (index + 1), counters.nBucket[index] );
+                    }
                 }
             }
         }
-
-        if ( NULL != pDispBuff )
-        {
-            delete [] pDispBuff;
-            pDispBuff = NULL;
-        }
     }
+}
 
+// PnP ids are ASCII but full of backslashes
+void
+wpdStats_PrintJsonString(
+    FILE* fp
+    , LPCWSTR pszText
+)
+{
+    ::fputc( '"', fp );
+    for ( LPCWSTR p = pszText; L'\0' != *p; ++p )
     {
-        DWORD dwSize = 0;
+        if ( L'"' == *p || L'\\' == *p )
         {
-            const HRESULT hr = pPortableDeviceManager->GetDeviceDescription(
-                pszPnPDeviceID
-                , NULL
-                , &dwSize
-                );
-            if ( FAILED(hr) )
-            {
-                LOGE( L"! Failed. IPortableDeviceManager::GetDeviceDescription get count, hr=0x%08x\n", hr );
-            }
+            ::fputc( '\\', fp );
+            ::fputc( (char)*p, fp );
         }
-
-        LPWSTR pDispBuff = NULL;
-        pDispBuff = new WCHAR[dwSize+1];
-        if ( NULL != pDispBuff )
+        else
+        if ( 0x20 <= *p && *p < 0x7f )
         {
-            pDispBuff[0] = L'\0';
-
-            {
-                const HRESULT hr = pPortableDeviceManager->GetDeviceDescription(
-                    pszPnPDeviceID
-                    , pDispBuff
-                    , &dwSize
-                    );
-                if ( FAILED(hr) )
-                {
-                    LOGE( L"! Failed. IPortableDeviceManager::GetDeviceDescription get name and count, hr=0x%08x\n", hr );
-                }
-                else
-                {
-                    LOGI( L"    Description : %s\n", pDispBuff );
-                }
-            }
+            ::fputc( (char)*p, fp );
         }
-
-        if ( NULL != pDispBuff )
+        else
         {
-            delete [] pDispBuff;
-            pDispBuff = NULL;
+            ::fprintf( fp, "\\u%04x", (unsigned int)*p );
         }
     }
-
+    ::fputc( '"', fp );
 }
 
-void
-enumWPDcore(void)
+bool
+wpdStats_WriteJson(
+    LPCWSTR pszPath
+)
 {
-    IPortableDeviceManager* pPortableDeviceManager = NULL;
+    FILE* fp = NULL;
+    if ( 0 != ::_wfopen_s( &fp, pszPath, L"w" ) || NULL == fp )
     {
-        const HRESULT hr = ::CoCreateInstance(
-            CLSID_PortableDeviceManager
-            , NULL
-            , CLSCTX_INPROC_SERVER
-            , IID_PPV_ARGS(&pPortableDeviceManager)
-            );
-        if ( FAILED(hr) )
-        {
-            LOGE( L"! Failed. CoCreateInstance CLSID_PortableDeviceManager, hr=0x%08x\n", hr );
-        }
+        LOGE( L"! Failed. open stats json %s\n", pszPath );
+        return false;
     }
 
-    DWORD dwCountDeviceId = 0;
-    if ( NULL != pPortableDeviceManager )
+    ::fprintf( fp, "{\"devices\":[" );
+    for ( size_t indexDevice = 0; indexDevice < s_stats.devices.size(); ++indexDevice )
     {
-        for ( size_t retry = 0; retry < 30; ++retry )
+        const WpdDeviceStats* pStats = s_stats.devices[indexDevice];
+        ::fprintf( fp, "%s\n{\"device\":", (0 < indexDevice)?(","):("") );
+        wpdStats_PrintJsonString( fp, pStats->pnpDeviceId.c_str() );
+        ::fprintf( fp, ",\"ops\":{" );
+
+        bool first = true;
+        for ( DWORD op = 0; op < WPD_STAT_OP_MAX; ++op )
         {
+            const WpdStatCounters& counters = pStats->ops[op];
+            if ( 0 == counters.nCountCall )
             {
-                const HRESULT hr = pPortableDeviceManager->GetDevices( NULL, &dwCountDeviceId );
-                if ( FAILED(hr) )
-                {
-                    LOGE( L"! Failed. IPortableDeviceManager::GetDevices get count, hr=0x%08x\n", hr );
-                }
-                else
-                {
-                    LOGI( L"IPortableDeviceManager::GetDevices get count, device count=%u\n", dwCountDeviceId );
-                    if ( 0 < dwCountDeviceId )
-                    {
-                        break;
-                    }
-                }
+                continue;
             }
+            ::fprintf( fp, "%s\n\"%S\":{\"calls\":%ld,\"failed\":%ld,\"objects\":%ld,\"bytes\":%I64u,\"us\":%I64u,\"log2_us\":["
+                , (first)?(""):(",")
+                , s_statOpNames[op]
+                , counters.nCountCall
+                , counters.nCountFailure
+                , counters.nCountObject
+                , counters.qwBytes
+                , counters.qwMicroseconds
+                );
+            first = false;
 
-            ::Sleep( 1 * 1000 );
+            // trailing empty buckets are left out
+            DWORD dwCountBucket = WPD_STAT_BUCKET_MAX;
+            while ( 0 < dwCountBucket && 0 == counters.nBucket[dwCountBucket - 1] )
             {
-                const HRESULT hr = pPortableDeviceManager->RefreshDeviceList();
-                if ( FAILED(hr) )
-                {
-                    LOGE( L"! Failed. IPortableDeviceManager::RefreshDeviceList, hr=0x%08x\n", hr );
-                }
+                dwCountBucket -= 1;
             }
-        }
-    }
-
-    LPWSTR* pDeviceIdArray = NULL;
-    if ( 0 < dwCountDeviceId && NULL != pPortableDeviceManager )
-    {
-        pDeviceIdArray = new PWSTR[dwCountDeviceId];
-        for ( size_t index = 0; index < dwCountDeviceId; ++index )
-        {
-            pDeviceIdArray[index] = NULL;
-        }
-
-        if ( NULL != pDeviceIdArray )
-        {
+            for ( DWORD index = 0; index < dwCountBucket; ++index )
             {
-                const HRESULT hr = pPortableDeviceManager->GetDevices( pDeviceIdArray, &dwCountDeviceId );
-                if ( FAILED(hr) )
-                {
-                    LOGE( L"! Failed. IPortableDeviceManager::GetDevice get id and count, hr=0x%08x\n", hr );
-                }
-                else
-                {
-                    /*
-                    for ( size_t index = 0; index < dwCountDeviceId; ++index )
-                    {
-                        LOGV( L"%3u: %s\n", index, pDeviceIdArray[index] );
-                    }
-                    */
-                }
+                ::fprintf( fp, "%s%ld", (0 < index)?(","):(""), counters.nBucket[index] );
+            }
+            ::fprintf( fp, "],\"hresults\":{" );
+            for ( DWORD index = 0; index < WPD_STAT_HRESULT_MAX && 0 < counters.nCountFailureByHr[index]; ++index )
+            {
+                ::fprintf( fp, "%s\"0x%08x\":%ld", (0 < index)?(","):(""), counters.hrFailure[index], counters.nCountFailureByHr[index] );
+            }
+            if ( 0 < counters.nCountFailureOtherHr )
+            {
+                ::fprintf( fp, "%s\"other\":%ld", (0 < counters.nCountFailureByHr[0])?(","):(""), counters.nCountFailureOtherHr );
             }
+            ::fprintf( fp, "}}" );
         }
+        ::fprintf( fp, "}}" );
     }
+    ::fprintf( fp, "\n]}\n" );
 
-    if ( NULL != pDeviceIdArray && NULL != pPortableDeviceManager )
+    const bool result = (0 == ::ferror( fp ));
+    ::fclose( fp );
+    fp = NULL;
+    if ( false == result )
     {
-        for ( size_t index = 0; index < dwCountDeviceId; ++index )
-        {
-            if ( NULL == pDeviceIdArray[index] )
-            {
-                continue;
-            }
-
-            LOGV( L"%3u: %s\n", index, pDeviceIdArray[index] );
-            dispDeviceInfo( pPortableDeviceManager, pDeviceIdArray[index] );
-        }
+        LOGE( L"! Failed. write stats json %s\n", pszPath );
     }
+    return result;
+}
 
+// --alloc-stats: heap allocations of this process, C++ and COM task memory
+static
+volatile LONG s_nCountHeapAlloc = 0;
+static
+volatile LONG s_nCountCoTaskAlloc = 0;
+// the same of the calling thread alone, so a walker can tell its own allocations from everybody else's
+static
+__declspec(thread) LONG s_nCountHeapAllocThread = 0;
+static
+__declspec(thread) LONG s_nCountCoTaskAllocThread = 0;
 
+void
+wpdAlloc_CountHeap(
+    void
+)
+{
+    if ( s_optAllocStats )
+    {
+        ::InterlockedIncrement( &s_nCountHeapAlloc );
+        s_nCountHeapAllocThread += 1;
+    }
+}
 
-    IPortableDeviceValues* pPortableDeviceValues = NULL;
+void*
+operator new( size_t size )
+{
+    wpdAlloc_CountHeap();
+    void* p = ::malloc( (0 < size)?(size):(1) );
+    if ( NULL == p )
     {
-        const HRESULT hr = ::CoCreateInstance(
-            CLSID_PortableDeviceValues
-            , NULL
-            , CLSCTX_INPROC_SERVER
-            , IID_PPV_ARGS(&pPortableDeviceValues)
-            );
-        if ( FAILED(hr) )
-        {
-            LOGE( L"! Failed. CoCreateInstance CLSID_PortableDeviceValues, hr=0x%08x\n", hr );
-        }
+        throw std::bad_alloc();
     }
+    return p;
+}
 
-    if ( NULL != pPortableDeviceValues )
+void*
+operator new[]( size_t size )
+{
+    return operator new( size );
+}
+
+void*
+operator new( size_t size, const std::nothrow_t& ) throw()
+{
+    wpdAlloc_CountHeap();
+    return ::malloc( (0 < size)?(size):(1) );
+}
+
+void*
+operator new[]( size_t size, const std::nothrow_t& nothrow ) throw()
+{
+    return operator new( size, nothrow );
+}
+
+void
+operator delete( void* p )
+{
+    ::free( p );
+}
+
+void
+operator delete[]( void* p )
+{
+    ::free( p );
+}
+
+void
+operator delete( void* p, const std::nothrow_t& ) throw()
+{
+    ::free( p );
+}
+
+void
+operator delete[]( void* p, const std::nothrow_t& ) throw()
+{
+    ::free( p );
+}
+
+// sized delete came with VS2015 and over-aligned new with C++17. the library's aligned new would not be counted
+#if defined(_MSC_VER) && (1900 <= _MSC_VER)
+void
+operator delete( void* p, size_t ) throw()
+{
+    ::free( p );
+}
+
+void
+operator delete[]( void* p, size_t ) throw()
+{
+    ::free( p );
+}
+#endif
+
+#if defined(__cpp_aligned_new)
+void*
+operator new( size_t size, std::align_val_t alignment )
+{
+    wpdAlloc_CountHeap();
+    void* p = ::_aligned_malloc( (0 < size)?(size):(1), (size_t)alignment );
+    if ( NULL == p )
     {
-        const WCHAR szClientName[] = L"WPD client";
-        const DWORD dwClientVersionMajor = 1;
-        const DWORD dwClientVersionMinor = 0;
-        const DWORD dwClientRevision = 1;
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void*
+operator new[]( size_t size, std::align_val_t alignment )
+{
+    return operator new( size, alignment );
+}
+
+void*
+operator new( size_t size, std::align_val_t alignment, const std::nothrow_t& ) throw()
+{
+    wpdAlloc_CountHeap();
+    return ::_aligned_malloc( (0 < size)?(size):(1), (size_t)alignment );
+}
+
+void*
+operator new[]( size_t size, std::align_val_t alignment, const std::nothrow_t& nothrow ) throw()
+{
+    return operator new( size, alignment, nothrow );
+}
+
+void
+operator delete( void* p, std::align_val_t ) throw()
+{
+    ::_aligned_free( p );
+}
+
+void
+operator delete[]( void* p, std::align_val_t ) throw()
+{
+    ::_aligned_free( p );
+}
+
+void
+operator delete( void* p, size_t, std::align_val_t ) throw()
+{
+    ::_aligned_free( p );
+}
+
+void
+operator delete[]( void* p, size_t, std::align_val_t ) throw()
+{
+    ::_aligned_free( p );
+}
+
+void
+operator delete( void* p, std::align_val_t, const std::nothrow_t& ) throw()
+{
+    ::_aligned_free( p );
+}
+
+void
+operator delete[]( void* p, std::align_val_t, const std::nothrow_t& ) throw()
+{
+    ::_aligned_free( p );
+}
+#endif
+
+// counts CoTaskMemAlloc / CoTaskMemRealloc, the memory the WPD API hands out; blocks are not changed
+class WpdMallocSpy : public IMallocSpy
+{
+public:
+    WpdMallocSpy()
+        : m_cRef(1)
+    {
+    }
+
+    HRESULT STDMETHODCALLTYPE
+    QueryInterface( REFIID riid, void** ppv )
+    {
+        if ( NULL == ppv )
         {
-            const HRESULT hr =
-                pPortableDeviceValues->SetStringValue(
-                    WPD_CLIENT_NAME, szClientName
-                );
-            if ( FAILED(hr) )
-            {
-                LOGE( L"! Failed. IPortableDeviceValues::SetStringValue WPD_CLIENT_NAME, hr=0x%08x\n", hr );
-            }
+            return E_POINTER;
         }
+        *ppv = NULL;
+
+        if ( ::IsEqualIID( riid, IID_IUnknown )
+            || ::IsEqualIID( riid, IID_IMallocSpy ) )
         {
-            const HRESULT hr =
-                pPortableDeviceValues->SetUnsignedIntegerValue(
-                    WPD_CLIENT_MAJOR_VERSION, dwClientVersionMajor
-                );
-            if ( FAILED(hr) )
-            {
-                LOGE( L"! Failed. IPortableDeviceValues::SetUnsignedIntegerValue WPD_CLIENT_MAJOR_VERSION, hr=0x%08x\n", hr );
-            }
+            *ppv = static_cast<IMallocSpy*>(this);
+            this->AddRef();
+            return S_OK;
         }
+
+        return E_NOINTERFACE;
+    }
+
+    ULONG STDMETHODCALLTYPE
+    AddRef( void )
+    {
+        return ::InterlockedIncrement( &m_cRef );
+    }
+
+    ULONG STDMETHODCALLTYPE
+    Release( void )
+    {
+        const LONG cRef = ::InterlockedDecrement( &m_cRef );
+        if ( 0 == cRef )
         {
-            const HRESULT hr =
-                pPortableDeviceValues->SetUnsignedIntegerValue(
-                    WPD_CLIENT_MINOR_VERSION, dwClientVersionMinor
-                );
-            if ( FAILED(hr) )
-            {
-                LOGE( L"! Failed. IPortableDeviceValues::SetUnsignedIntegerValue WPD_CLIENT_MINOR_VERSION, hr=0x%08x\n", hr );
-            }
+            delete this;
         }
+        return cRef;
+    }
+
+    SIZE_T STDMETHODCALLTYPE
+    PreAlloc( SIZE_T cbRequest )
+    {
+        ::InterlockedIncrement( &s_nCountCoTaskAlloc );
+        s_nCountCoTaskAllocThread += 1;
+        return cbRequest;
+    }
+
+    void* STDMETHODCALLTYPE
+    PostAlloc( void* pActual )
+    {
+        return pActual;
+    }
+
+    void* STDMETHODCALLTYPE
+    PreFree( void* pRequest, BOOL /*fSpyed*/ )
+    {
+        return pRequest;
+    }
+
+    void STDMETHODCALLTYPE
+    PostFree( BOOL /*fSpyed*/ )
+    {
+    }
+
+    SIZE_T STDMETHODCALLTYPE
+    PreRealloc( void* pRequest, SIZE_T cbRequest, void** ppNewRequest, BOOL /*fSpyed*/ )
+    {
+        ::InterlockedIncrement( &s_nCountCoTaskAlloc );
+        s_nCountCoTaskAllocThread += 1;
+        *ppNewRequest = pRequest;
+        return cbRequest;
+    }
+
+    void* STDMETHODCALLTYPE
+    PostRealloc( void* pActual, BOOL /*fSpyed*/ )
+    {
+        return pActual;
+    }
+
+    void* STDMETHODCALLTYPE
+    PreGetSize( void* pRequest, BOOL /*fSpyed*/ )
+    {
+        return pRequest;
+    }
+
+    SIZE_T STDMETHODCALLTYPE
+    PostGetSize( SIZE_T cbActual, BOOL /*fSpyed*/ )
+    {
+        return cbActual;
+    }
+
+    void* STDMETHODCALLTYPE
+    PreDidAlloc( void* pRequest, BOOL /*fSpyed*/ )
+    {
+        return pRequest;
+    }
+
+    int STDMETHODCALLTYPE
+    PostDidAlloc( void* /*pRequest*/, BOOL /*fSpyed*/, int fActual )
+    {
+        return fActual;
+    }
+
+    void STDMETHODCALLTYPE
+    PreHeapMinimize( void )
+    {
+    }
+
+    void STDMETHODCALLTYPE
+    PostHeapMinimize( void )
+    {
+    }
+
+private:
+    ~WpdMallocSpy()
+    {
+    }
+
+    LONG    m_cRef;
+};
+
+// buffers a walk keeps reusing: child id arrays and object id strings of the frames.
+// one pool per thread, it lives across recursion levels and devices
+struct WpdScratchPool
+{
+    std::vector<LPWSTR*>    idArrays;
+    std::vector<DWORD>      idArrayCapacities;
+    std::vector<LPWSTR>     strings;
+    std::vector<DWORD>      stringCapacities;
+};
+
+#define WPD_SCRATCH_POOL_MAX    (256)
+
+// smallest pooled buffer of at least dwCapacity, NULL when none is that large
+template <typename T>
+T
+wpdScratchPool_Take(
+    std::vector<T>* pBuffers
+    , std::vector<DWORD>* pCapacities
+    , const DWORD dwCapacity
+    , DWORD* pdwCapacity
+)
+{
+    size_t found = pBuffers->size();
+    for ( size_t index = 0; index < pBuffers->size(); ++index )
+    {
+        if ( dwCapacity <= (*pCapacities)[index]
+            && (pBuffers->size() == found || (*pCapacities)[index] < (*pCapacities)[found]) )
         {
-            const HRESULT hr =
-                pPortableDeviceValues->SetUnsignedIntegerValue(
-                    WPD_CLIENT_REVISION, dwClientRevision
-                );
-            if ( FAILED(hr) )
-            {
-                LOGE( L"! Failed. IPortableDeviceValues::SetUnsignedIntegerValue WPD_CLIENT_REVISION, hr=0x%08x\n", hr );
-            }
+            found = index;
         }
+    }
+    if ( pBuffers->size() == found )
+    {
+        return NULL;
+    }
+
+    T p = (*pBuffers)[found];
+    *pdwCapacity = (*pCapacities)[found];
+    (*pBuffers)[found] = pBuffers->back();
+    (*pCapacities)[found] = pCapacities->back();
+    pBuffers->pop_back();
+    pCapacities->pop_back();
+    return p;
+}
 
+LPWSTR*
+wpdScratchPool_GetIdArray(
+    WpdScratchPool* pPool
+    , const DWORD dwCapacity
+    , DWORD* pdwCapacity
+)
+{
+    if ( NULL != pPool )
+    {
+        LPWSTR* p = wpdScratchPool_Take( &pPool->idArrays, &pPool->idArrayCapacities, dwCapacity, pdwCapacity );
+        if ( NULL != p )
         {
-            const HRESULT hr =
-                pPortableDeviceValues->SetUnsignedIntegerValue(
-                    WPD_CLIENT_SECURITY_QUALITY_OF_SERVICE, SECURITY_IMPERSONATION
-                );
-            if ( FAILED(hr) )
-            {
-                LOGE( L"! Failed. IPortableDeviceValues::SetUnsignedIntegerValue WPD_CLIENT_SECURITY_QUALITY_OF_SERVICE, hr=0x%08x\n", hr );
-            }
+            return p;
         }
+    }
+    *pdwCapacity = dwCapacity;
+    return new LPWSTR[dwCapacity];
+}
+
+void
+wpdScratchPool_PutIdArray(
+    WpdScratchPool* pPool
+    , LPWSTR* p
+    , const DWORD dwCapacity
+)
+{
+    if ( NULL == p )
+    {
+        return;
+    }
+    if ( NULL == pPool || WPD_SCRATCH_POOL_MAX <= pPool->idArrays.size() )
+    {
+        delete [] p;
+        return;
+    }
+    pPool->idArrays.push_back( p );
+    pPool->idArrayCapacities.push_back( dwCapacity );
+}
 
+LPWSTR
+wpdScratchPool_GetString(
+    WpdScratchPool* pPool
+    , const DWORD dwCapacity
+    , DWORD* pdwCapacity
+)
+{
+    if ( NULL != pPool )
+    {
+        LPWSTR p = wpdScratchPool_Take( &pPool->strings, &pPool->stringCapacities, dwCapacity, pdwCapacity );
+        if ( NULL != p )
         {
-            const HRESULT hr =
-                pPortableDeviceValues->SetUnsignedIntegerValue(
-                    WPD_CLIENT_DESIRED_ACCESS, GENERIC_READ
-                );
-            if ( FAILED(hr) )
-            {
-                LOGE( L"! Failed. IPortableDeviceValues::SetUnsignedIntegerValue WPD_CLIENT_DESIRED_ACCESS, hr=0x%08x\n", hr );
-            }
+            return p;
         }
+    }
+    // round up, ids of one device have similar lengths
+    *pdwCapacity = (dwCapacity + 63U) & ~63U;
+    return new WCHAR[*pdwCapacity];
+}
 
-        {
-            const HRESULT hr =
-                pPortableDeviceValues->SetUnsignedIntegerValue(
-                    WPD_CLIENT_SHARE_MODE, FILE_SHARE_READ|FILE_SHARE_WRITE
-                );
-            if ( FAILED(hr) )
-            {
-                LOGE( L"! Failed. IPortableDeviceValues::SetUnsignedIntegerValue WPD_CLIENT_DESIRED_ACCESS, hr=0x%08x\n", hr );
+void
+wpdScratchPool_PutString(
+    WpdScratchPool* pPool
+    , LPWSTR p
+    , const DWORD dwCapacity
+)
+{
+    if ( NULL == p )
+    {
+        return;
+    }
+    if ( NULL == pPool || WPD_SCRATCH_POOL_MAX <= pPool->strings.size() )
+    {
+        delete [] p;
+        return;
+    }
+    pPool->strings.push_back( p );
+    pPool->stringCapacities.push_back( dwCapacity );
+}
+
+void
+wpdScratchPool_Term(
+    WpdScratchPool* pPool
+)
+{
+    for ( size_t index = 0; index < pPool->idArrays.size(); ++index )
+    {
+        delete [] pPool->idArrays[index];
+    }
+    pPool->idArrays.clear();
+    pPool->idArrayCapacities.clear();
+    for ( size_t index = 0; index < pPool->strings.size(); ++index )
+    {
+        delete [] pPool->strings[index];
+    }
+    pPool->strings.clear();
+    pPool->stringCapacities.clear();
+}
+
+#define WPD_HANDLE_NONE         (0xFFFFFFFFU)
+// string handle: chunk index above, wchar offset in the chunk below
+#define WPD_ARENA_CHUNK_BITS    (20)
+#define WPD_ARENA_CHUNK_SIZE    (1U << WPD_ARENA_CHUNK_BITS)
+
+// bump allocated, interned strings addressed by 32-bit handles
+struct WpdStringArena
+{
+    std::vector<wchar_t*>   chunks;
+    UINT32                  dwUsed;         // in the last chunk
+    ULONGLONG               qwCountChar;
+
+    // open addressing: handle per slot, WPD_HANDLE_NONE when empty
+    std::vector<UINT32>     slots;
+    std::vector<UINT32>     slotHash;
+    UINT32                  dwCountString;
+};
+
+UINT32
+wpdArena_Hash( LPCWSTR pszText, const size_t len )
+{
+    // FNV-1a
+    UINT32 dwHash = 2166136261U;
+    for ( size_t index = 0; index < len; ++index )
+    {
+        dwHash ^= (UINT32)pszText[index];
+        dwHash *= 16777619U;
+    }
+    return dwHash;
+}
+
+LPCWSTR
+wpdArena_Get( const WpdStringArena* pArena, const UINT32 dwHandle )
+{
+    if ( WPD_HANDLE_NONE == dwHandle )
+    {
+        return NULL;
+    }
+    return pArena->chunks[dwHandle >> WPD_ARENA_CHUNK_BITS] + (dwHandle & (WPD_ARENA_CHUNK_SIZE - 1));
+}
+
+void
+wpdArena_Term( WpdStringArena* pArena )
+{
+    for ( size_t index = 0; index < pArena->chunks.size(); ++index )
+    {
+        delete [] pArena->chunks[index];
+    }
+    pArena->chunks.clear();
+    pArena->slots.clear();
+    pArena->slotHash.clear();
+    pArena->dwUsed = 0;
+    pArena->qwCountChar = 0;
+    pArena->dwCountString = 0;
+}
+
+void
+wpdArena_Rehash( WpdStringArena* pArena, const size_t countSlot )
+{
+    std::vector<UINT32> slots( countSlot, WPD_HANDLE_NONE );
+    std::vector<UINT32> slotHash( countSlot, 0 );
+    for ( size_t index = 0; index < pArena->slots.size(); ++index )
+    {
+        if ( WPD_HANDLE_NONE == pArena->slots[index] )
+        {
+            continue;
+        }
+        size_t slot = pArena->slotHash[index] & (countSlot - 1);
+        while ( WPD_HANDLE_NONE != slots[slot] )
+        {
+            slot = (slot + 1) & (countSlot - 1);
+        }
+        slots[slot] = pArena->slots[index];
+        slotHash[slot] = pArena->slotHash[index];
+    }
+    pArena->slots.swap( slots );
+    pArena->slotHash.swap( slotHash );
+}
+
+// handle of pszText[0, len); added when insert is set, else WPD_HANDLE_NONE when unknown
+UINT32
+wpdArena_Intern( WpdStringArena* pArena, LPCWSTR pszText, const size_t len, const bool insert )
+{
+    if ( WPD_ARENA_CHUNK_SIZE <= len + 1 )
+    {
+        return WPD_HANDLE_NONE;
+    }
+
+    const UINT32 dwHash = wpdArena_Hash( pszText, len );
+    size_t slot = 0;
+    if ( !pArena->slots.empty() )
+    {
+        const size_t mask = pArena->slots.size() - 1;
+        for ( slot = dwHash & mask; WPD_HANDLE_NONE != pArena->slots[slot]; slot = (slot + 1) & mask )
+        {
+            if ( dwHash != pArena->slotHash[slot] )
+            {
+                continue;
+            }
+            LPCWSTR pszFound = wpdArena_Get( pArena, pArena->slots[slot] );
+            if ( 0 == ::wcsncmp( pszFound, pszText, len ) && L'\0' == pszFound[len] )
+            {
+                return pArena->slots[slot];
+            }
+        }
+    }
+    if ( false == insert )
+    {
+        return WPD_HANDLE_NONE;
+    }
+
+    // keep the load at or below one half
+    if ( pArena->slots.size() <= (size_t)(pArena->dwCountString + 1) * 2 )
+    {
+        wpdArena_Rehash( pArena, (pArena->slots.empty())?(1024):(pArena->slots.size() * 2) );
+        const size_t mask = pArena->slots.size() - 1;
+        for ( slot = dwHash & mask; WPD_HANDLE_NONE != pArena->slots[slot]; slot = (slot + 1) & mask )
+        {
+        }
+    }
+
+    if ( pArena->chunks.empty() || WPD_ARENA_CHUNK_SIZE < pArena->dwUsed + len + 1 )
+    {
+        if ( (1U << (32 - WPD_ARENA_CHUNK_BITS)) - 1 <= pArena->chunks.size() )
+        {
+            return WPD_HANDLE_NONE;
+        }
+        pArena->chunks.push_back( new wchar_t[WPD_ARENA_CHUNK_SIZE] );
+        pArena->dwUsed = 0;
+    }
+    const UINT32 dwHandle = ((UINT32)(pArena->chunks.size() - 1) << WPD_ARENA_CHUNK_BITS) | pArena->dwUsed;
+    wchar_t* p = pArena->chunks.back() + pArena->dwUsed;
+    ::memcpy( p, pszText, len * sizeof(wchar_t) );
+    p[len] = L'\0';
+    pArena->dwUsed += (UINT32)(len + 1);
+    pArena->qwCountChar += len + 1;
+
+    pArena->slots[slot] = dwHandle;
+    pArena->slotHash[slot] = dwHash;
+    pArena->dwCountString += 1;
+    return dwHandle;
+}
+
+// objects as a struct of arrays indexed by 32-bit node handles; children are a sibling list
+struct WpdTreeStore
+{
+    WpdStringArena          strings;
+
+    std::vector<UINT32>     parent;
+    std::vector<UINT32>     firstChild;
+    std::vector<UINT32>     nextSibling;
+    std::vector<UINT32>     objectId;
+    std::vector<UINT32>     name;
+    std::vector<UINT32>     path;           // WPD_HANDLE_NONE until asked for
+    std::vector<ULONGLONG>  size;
+    std::vector<BYTE>       folder;         // folder or storage, by content type
+    std::vector<UINT32>     puid;           // WPD_HANDLE_NONE unless keepPuid
+    bool                    keepPuid;       // --download= keys its journals by it
+
+    // object id string handle -> node, open addressing
+    std::vector<UINT32>     idSlots;
+    std::vector<UINT32>     idSlotNode;
+
+    CRITICAL_SECTION        cs;
+};
+
+UINT32
+wpdTreeStore_HashHandle( UINT32 dwHandle )
+{
+    // murmur3 finalizer
+    dwHandle ^= dwHandle >> 16;
+    dwHandle *= 0x85ebca6bU;
+    dwHandle ^= dwHandle >> 13;
+    dwHandle *= 0xc2b2ae35U;
+    dwHandle ^= dwHandle >> 16;
+    return dwHandle;
+}
+
+void
+wpdTreeStore_Init( WpdTreeStore* pStore )
+{
+    pStore->strings.dwUsed = 0;
+    pStore->strings.qwCountChar = 0;
+    pStore->strings.dwCountString = 0;
+    pStore->keepPuid = false;
+    ::InitializeCriticalSection( &pStore->cs );
+}
+
+void
+wpdTreeStore_Term( WpdTreeStore* pStore )
+{
+    wpdArena_Term( &pStore->strings );
+    ::DeleteCriticalSection( &pStore->cs );
+}
+
+UINT32
+wpdTreeStore_Count( const WpdTreeStore* pStore )
+{
+    return (UINT32)pStore->parent.size();
+}
+
+// node of an object id, WPD_HANDLE_NONE when not in the store
+UINT32
+wpdTreeStore_Find( WpdTreeStore* pStore, LPCWSTR pszObjectId )
+{
+    const UINT32 dwId = wpdArena_Intern( &pStore->strings, pszObjectId, ::wcslen( pszObjectId ), false );
+    if ( WPD_HANDLE_NONE == dwId || pStore->idSlots.empty() )
+    {
+        return WPD_HANDLE_NONE;
+    }
+    const size_t mask = pStore->idSlots.size() - 1;
+    for ( size_t slot = wpdTreeStore_HashHandle( dwId ) & mask; WPD_HANDLE_NONE != pStore->idSlots[slot]; slot = (slot + 1) & mask )
+    {
+        if ( dwId == pStore->idSlots[slot] )
+        {
+            return pStore->idSlotNode[slot];
+        }
+    }
+    return WPD_HANDLE_NONE;
+}
+
+void
+wpdTreeStore_IndexId( WpdTreeStore* pStore, const UINT32 dwId, const UINT32 dwNode )
+{
+    if ( pStore->idSlots.size() <= pStore->parent.size() * 2 )
+    {
+        const size_t countSlot = (pStore->idSlots.empty())?(1024):(pStore->idSlots.size() * 2);
+        std::vector<UINT32> idSlots( countSlot, WPD_HANDLE_NONE );
+        std::vector<UINT32> idSlotNode( countSlot, WPD_HANDLE_NONE );
+        for ( size_t index = 0; index < pStore->idSlots.size(); ++index )
+        {
+            if ( WPD_HANDLE_NONE == pStore->idSlots[index] )
+            {
+                continue;
+            }
+            size_t slot = wpdTreeStore_HashHandle( pStore->idSlots[index] ) & (countSlot - 1);
+            while ( WPD_HANDLE_NONE != idSlots[slot] )
+            {
+                slot = (slot + 1) & (countSlot - 1);
+            }
+            idSlots[slot] = pStore->idSlots[index];
+            idSlotNode[slot] = pStore->idSlotNode[index];
+        }
+        pStore->idSlots.swap( idSlots );
+        pStore->idSlotNode.swap( idSlotNode );
+    }
+
+    const size_t mask = pStore->idSlots.size() - 1;
+    size_t slot = wpdTreeStore_HashHandle( dwId ) & mask;
+    while ( WPD_HANDLE_NONE != pStore->idSlots[slot] )
+    {
+        slot = (slot + 1) & mask;
+    }
+    pStore->idSlots[slot] = dwId;
+    pStore->idSlotNode[slot] = dwNode;
+}
+
+// hang a parentless node below dwParent, unless dwParent is inside its subtree
+void
+wpdTreeStore_Link( WpdTreeStore* pStore, const UINT32 dwParent, const UINT32 dwNode )
+{
+    for ( UINT32 dwCurrent = dwParent; WPD_HANDLE_NONE != dwCurrent; dwCurrent = pStore->parent[dwCurrent] )
+    {
+        if ( dwCurrent == dwNode )
+        {
+            return;
+        }
+    }
+    pStore->parent[dwNode] = dwParent;
+    pStore->nextSibling[dwNode] = pStore->firstChild[dwParent];
+    pStore->firstChild[dwParent] = dwNode;
+}
+
+// add an object below dwParent (WPD_HANDLE_NONE for the root). an object already stored is returned,
+// linked below dwParent first when it has no parent yet: bulk values can store a child before its parent links it
+UINT32
+wpdTreeStore_Add( WpdTreeStore* pStore, const UINT32 dwParent, LPCWSTR pszObjectId )
+{
+    const UINT32 dwFound = wpdTreeStore_Find( pStore, pszObjectId );
+    if ( WPD_HANDLE_NONE != dwFound )
+    {
+        if ( WPD_HANDLE_NONE != dwParent && WPD_HANDLE_NONE == pStore->parent[dwFound] )
+        {
+            wpdTreeStore_Link( pStore, dwParent, dwFound );
+        }
+        return dwFound;
+    }
+
+    const UINT32 dwId = wpdArena_Intern( &pStore->strings, pszObjectId, ::wcslen( pszObjectId ), true );
+    if ( WPD_HANDLE_NONE == dwId || WPD_HANDLE_NONE - 1 <= pStore->parent.size() )
+    {
+        return WPD_HANDLE_NONE;
+    }
+
+    const UINT32 dwNode = (UINT32)pStore->parent.size();
+    pStore->parent.push_back( dwParent );
+    pStore->firstChild.push_back( WPD_HANDLE_NONE );
+    pStore->nextSibling.push_back( WPD_HANDLE_NONE );
+    pStore->objectId.push_back( dwId );
+    pStore->name.push_back( WPD_HANDLE_NONE );
+    pStore->path.push_back( WPD_HANDLE_NONE );
+    pStore->size.push_back( 0 );
+    pStore->folder.push_back( 0 );
+    pStore->puid.push_back( WPD_HANDLE_NONE );
+    if ( WPD_HANDLE_NONE != dwParent )
+    {
+        pStore->nextSibling[dwNode] = pStore->firstChild[dwParent];
+        pStore->firstChild[dwParent] = dwNode;
+    }
+    wpdTreeStore_IndexId( pStore, dwId, dwNode );
+    return dwNode;
+}
+
+// every node reachable from a root, each after its parent; node handles do not keep that order
+void
+wpdTreeStore_Order( const WpdTreeStore* pStore, std::vector<UINT32>* pOrder )
+{
+    pOrder->clear();
+    pOrder->reserve( pStore->parent.size() );
+    for ( UINT32 dwNode = 0; dwNode < (UINT32)pStore->parent.size(); ++dwNode )
+    {
+        if ( WPD_HANDLE_NONE == pStore->parent[dwNode] )
+        {
+            pOrder->push_back( dwNode );
+        }
+    }
+    for ( size_t index = 0; index < pOrder->size(); ++index )
+    {
+        for ( UINT32 dwChild = pStore->firstChild[(*pOrder)[index]]; WPD_HANDLE_NONE != dwChild; dwChild = pStore->nextSibling[dwChild] )
+        {
+            pOrder->push_back( dwChild );
+        }
+    }
+}
+
+// false when the arena cannot take the name; the node keeps its previous one, its object id if none
+bool
+wpdTreeStore_SetName( WpdTreeStore* pStore, const UINT32 dwNode, LPCWSTR pszName )
+{
+    const UINT32 dwName = wpdArena_Intern( &pStore->strings, pszName, ::wcslen( pszName ), true );
+    if ( WPD_HANDLE_NONE == dwName )
+    {
+        LOGE( L"! Failed. name of %s not stored, length=%u\n", wpdArena_Get( &pStore->strings, pStore->objectId[dwNode] ), (DWORD)::wcslen( pszName ) );
+        return false;
+    }
+    pStore->name[dwNode] = dwName;
+    return true;
+}
+
+// "name\\name\\name" below the root, built and interned on first use along with the paths of its parents.
+// NULL when the arena cannot take one of them; nothing below it is cached, so a later call tries again
+LPCWSTR
+wpdTreeStore_Path( WpdTreeStore* pStore, const UINT32 dwNode )
+{
+    if ( WPD_HANDLE_NONE != pStore->path[dwNode] )
+    {
+        return wpdArena_Get( &pStore->strings, pStore->path[dwNode] );
+    }
+
+    std::vector<UINT32> chain;
+    UINT32 dwCurrent = dwNode;
+    while ( WPD_HANDLE_NONE != dwCurrent && WPD_HANDLE_NONE == pStore->path[dwCurrent] )
+    {
+        chain.push_back( dwCurrent );
+        dwCurrent = pStore->parent[dwCurrent];
+    }
+
+    std::wstring path;
+    if ( WPD_HANDLE_NONE != dwCurrent )
+    {
+        path.assign( wpdArena_Get( &pStore->strings, pStore->path[dwCurrent] ) );
+    }
+    while ( !chain.empty() )
+    {
+        const UINT32 dwChain = chain.back();
+        chain.pop_back();
+        if ( WPD_HANDLE_NONE != pStore->parent[dwChain] )
+        {
+            if ( !path.empty() )
+            {
+                path.push_back( L'\\' );
+            }
+            LPCWSTR pszName = wpdArena_Get( &pStore->strings, pStore->name[dwChain] );
+            if ( NULL == pszName )
+            {
+                pszName = wpdArena_Get( &pStore->strings, pStore->objectId[dwChain] );
+            }
+            path.append( pszName );
+        }
+        const UINT32 dwPath = wpdArena_Intern( &pStore->strings, path.c_str(), path.size(), true );
+        if ( WPD_HANDLE_NONE == dwPath )
+        {
+            LOGE( L"! Failed. path of %s not stored, length=%u\n", wpdArena_Get( &pStore->strings, pStore->objectId[dwChain] ), (DWORD)path.size() );
+            return NULL;
+        }
+        pStore->path[dwChain] = dwPath;
+    }
+    return wpdArena_Get( &pStore->strings, pStore->path[dwNode] );
+}
+
+ULONGLONG
+wpdTreeStore_Bytes( const WpdTreeStore* pStore )
+{
+    ULONGLONG qwBytes = (ULONGLONG)pStore->strings.chunks.size() * WPD_ARENA_CHUNK_SIZE * sizeof(wchar_t);
+    qwBytes += (pStore->strings.slots.capacity() + pStore->strings.slotHash.capacity()) * sizeof(UINT32);
+    qwBytes += (pStore->idSlots.capacity() + pStore->idSlotNode.capacity()) * sizeof(UINT32);
+    qwBytes += (pStore->parent.capacity() + pStore->firstChild.capacity() + pStore->nextSibling.capacity()
+        + pStore->objectId.capacity() + pStore->name.capacity() + pStore->path.capacity() + pStore->puid.capacity()) * sizeof(UINT32);
+    qwBytes += pStore->size.capacity() * sizeof(ULONGLONG) + pStore->folder.capacity() * sizeof(BYTE);
+    return qwBytes;
+}
+
+void
+wpdTreeStore_Report( const WpdTreeStore* pStore, const double dMicroseconds )
+{
+    const UINT32 dwCount = wpdTreeStore_Count( pStore );
+    const ULONGLONG qwBytes = wpdTreeStore_Bytes( pStore );
+    LOGI( L"    tree: objects=%u, strings=%u, chars=%I64u, bytes=%I64u, bytes/object=%.1f, %.3f sec\n"
+        , dwCount
+        , pStore->strings.dwCountString
+        , pStore->strings.qwCountChar
+        , qwBytes
+        , (0 < dwCount)?((double)qwBytes / dwCount):(0.0)
+        , dMicroseconds / 1000000.0
+        );
+}
+
+// --tree-bench=N: N synthetic objects, 100 per folder, folder names repeat across branches
+void
+wpdTreeStore_Bench( const DWORD dwCountObject )
+{
+    WpdTreeStore store;
+    wpdTreeStore_Init( &store );
+
+    WCHAR szObjectId[32];
+    WCHAR szName[64];
+    const ULONGLONG qwTicksStart = wpdTicksNow();
+    const UINT32 dwRoot = wpdTreeStore_Add( &store, WPD_HANDLE_NONE, WPD_DEVICE_OBJECT_ID );
+    UINT32 dwFolder = dwRoot;
+    for ( DWORD index = 0; index < dwCountObject; ++index )
+    {
+        ::_snwprintf_s( szObjectId, _countof(szObjectId), _TRUNCATE, L"o%X", index + 1 );
+        if ( 0 == index % 100 )
+        {
+            dwFolder = wpdTreeStore_Add( &store, dwRoot, szObjectId );
+            ::_snwprintf_s( szName, _countof(szName), _TRUNCATE, L"%03uCANON", (index / 100) % 1000 );
+            wpdTreeStore_SetName( &store, dwFolder, szName );
+            continue;
+        }
+        const UINT32 dwNode = wpdTreeStore_Add( &store, dwFolder, szObjectId );
+        ::_snwprintf_s( szName, _countof(szName), _TRUNCATE, L"IMG_%04u.JPG", index % 10000 );
+        wpdTreeStore_SetName( &store, dwNode, szName );
+    }
+    const double dBuild = wpdTicksToMicroseconds( wpdTicksNow() - qwTicksStart );
+    wpdTreeStore_Report( &store, dBuild );
+
+    // paths of every 100th object, interned on the way
+    const ULONGLONG qwTicksPath = wpdTicksNow();
+    DWORD dwCountPath = 0;
+    for ( UINT32 dwNode = 0; dwNode < wpdTreeStore_Count( &store ); dwNode += 100 )
+    {
+        if ( NULL != wpdTreeStore_Path( &store, dwNode ) )
+        {
+            dwCountPath += 1;
+        }
+    }
+    LOGI( L"    tree: paths=%u, %.3f sec, bytes after=%I64u\n"
+        , dwCountPath
+        , wpdTicksToMicroseconds( wpdTicksNow() - qwTicksPath ) / 1000000.0
+        , wpdTreeStore_Bytes( &store )
+        );
+
+    wpdTreeStore_Term( &store );
+}
+
+// --catalog=: read-only image of a scanned tree, mapped and queried where it lies.
+// a header, then sections at 8-byte aligned offsets:
+//   nodes      WpdCatalogNode per object, in no particular order
+//   children   u32 node per child, those of a folder contiguous and in name order
+//   byName     u32 node per object, in name order
+//   names      distinct names in name order, front coded as u16 shared prefix, u16 suffix length
+//              and the suffix; every WPD_CATALOG_BLOCK-th name starts a block and is whole
+//   blocks     u32 offset of each block in names, in u16 units
+//   idIndex    u32 offset of the object id of each node in ids, in WCHARs
+//   ids        nul terminated object ids
+// name order compares case-folded first, so the names with a prefix in any case are one range
+#define WPD_CATALOG_MAGIC       0x54414357U     // "WCAT"
+#define WPD_CATALOG_VERSION     1U
+#define WPD_CATALOG_BLOCK       16U
+#define WPD_CATALOG_NAME_MAX    1024U           // longer names are cut
+#define WPD_CATALOG_FOLDER      1U
+
+struct WpdCatalogHeader
+{
+    UINT32      dwMagic;
+    UINT32      dwVersion;
+    UINT32      dwHeaderSize;
+    UINT32      dwCountNode;
+    UINT32      dwCountChild;
+    UINT32      dwCountName;
+    UINT32      dwRoot;
+    UINT32      dwReserved;
+    ULONGLONG   qwFileSize;
+    ULONGLONG   qwOffsetNodes;
+    ULONGLONG   qwOffsetChildren;
+    ULONGLONG   qwOffsetByName;
+    ULONGLONG   qwOffsetNames;
+    ULONGLONG   qwOffsetBlocks;
+    ULONGLONG   qwOffsetIdIndex;
+    ULONGLONG   qwOffsetIds;
+};
+
+struct WpdCatalogNode
+{
+    ULONGLONG   qwSize;
+    ULONGLONG   qwBytes;        // files of the subtree
+    UINT32      dwParent;       // WPD_HANDLE_NONE above a root
+    UINT32      dwFirstChild;   // into children
+    UINT32      dwCountChild;
+    UINT32      dwCountObject;  // of the subtree, itself included
+    UINT32      dwName;         // rank in names
+    UINT32      dwFlags;
+};
+
+WCHAR
+wpdCatalog_Fold( const WCHAR c )
+{
+    if ( c < 0x80 )
+    {
+        return (L'A' <= c && c <= L'Z')?((WCHAR)(c + (L'a' - L'A'))):(c);
+    }
+    return (WCHAR)::towlower( c );
+}
+
+// case-folded only, what lookups match on
+int
+wpdCatalog_CompareFolded(
+    LPCWSTR pszA
+    , const size_t lenA
+    , LPCWSTR pszB
+    , const size_t lenB
+)
+{
+    const size_t len = (lenA < lenB)?(lenA):(lenB);
+    for ( size_t index = 0; index < len; ++index )
+    {
+        if ( pszA[index] == pszB[index] )
+        {
+            continue;
+        }
+        const WCHAR a = wpdCatalog_Fold( pszA[index] );
+        const WCHAR b = wpdCatalog_Fold( pszB[index] );
+        if ( a != b )
+        {
+            return (a < b)?(-1):(1);
+        }
+    }
+    if ( lenA != lenB )
+    {
+        return (lenA < lenB)?(-1):(1);
+    }
+    return 0;
+}
+
+// case-folded, then ordinal so names equal but for case still have an order
+int
+wpdCatalog_CompareName(
+    LPCWSTR pszA
+    , const size_t lenA
+    , LPCWSTR pszB
+    , const size_t lenB
+)
+{
+    const int compare = wpdCatalog_CompareFolded( pszA, lenA, pszB, lenB );
+    if ( 0 != compare )
+    {
+        return compare;
+    }
+    for ( size_t index = 0; index < lenA; ++index )
+    {
+        if ( pszA[index] != pszB[index] )
+        {
+            return (pszA[index] < pszB[index])?(-1):(1);
+        }
+    }
+    return 0;
+}
+
+struct WpdCatalogNameLess
+{
+    const std::vector<LPCWSTR>*     pNames;
+    const std::vector<UINT16>*      pLengths;
+
+    bool
+    operator()( const UINT32 a, const UINT32 b ) const
+    {
+        const int compare = wpdCatalog_CompareName( (*pNames)[a], (*pLengths)[a], (*pNames)[b], (*pLengths)[b] );
+        return (0 != compare)?(compare < 0):(a < b);
+    }
+};
+
+struct WpdCatalogRankLess
+{
+    const std::vector<UINT32>*      pRanks;
+
+    bool
+    operator()( const UINT32 a, const UINT32 b ) const
+    {
+        return ((*pRanks)[a] != (*pRanks)[b])?((*pRanks)[a] < (*pRanks)[b]):(a < b);
+    }
+};
+
+ULONGLONG
+wpdCatalog_Align( const ULONGLONG qwOffset )
+{
+    return (qwOffset + 7) & ~(ULONGLONG)7;
+}
+
+// zeros up to qwOffset, then the section
+bool
+wpdCatalog_WriteSection(
+    FILE* fp
+    , ULONGLONG* pqwWritten
+    , const ULONGLONG qwOffset
+    , const void* pData
+    , const size_t cbData
+)
+{
+    const BYTE zero[8] = { 0 };
+    const size_t cbPad = (size_t)(qwOffset - *pqwWritten);
+    if ( 0 < cbPad && cbPad != ::fwrite( zero, 1, cbPad, fp ) )
+    {
+        return false;
+    }
+    if ( 0 < cbData && cbData != ::fwrite( pData, 1, cbData, fp ) )
+    {
+        return false;
+    }
+    *pqwWritten = qwOffset + cbData;
+    return true;
+}
+
+// the store as a catalog, written next to pszPath and moved over it
+bool
+wpdCatalog_Write(
+    WpdTreeStore* pStore
+    , LPCWSTR pszPath
+    , ULONGLONG* pqwFileSize
+)
+{
+    *pqwFileSize = 0;
+    const UINT32 dwCount = wpdTreeStore_Count( pStore );
+    if ( 0 == dwCount )
+    {
+        LOGE( L"! Failed. catalog %s, nothing scanned\n", pszPath );
+        return false;
+    }
+
+    std::vector<LPCWSTR> names( dwCount );
+    std::vector<UINT16> lengths( dwCount );
+    UINT32 dwRoot = WPD_HANDLE_NONE;
+    for ( UINT32 dwNode = 0; dwNode < dwCount; ++dwNode )
+    {
+        LPCWSTR pszName = wpdArena_Get( &pStore->strings, pStore->name[dwNode] );
+        if ( NULL == pszName )
+        {
+            pszName = wpdArena_Get( &pStore->strings, pStore->objectId[dwNode] );
+        }
+        const size_t len = ::wcslen( pszName );
+        names[dwNode] = pszName;
+        lengths[dwNode] = (UINT16)((len < WPD_CATALOG_NAME_MAX)?(len):(WPD_CATALOG_NAME_MAX));
+        if ( WPD_HANDLE_NONE == dwRoot && WPD_HANDLE_NONE == pStore->parent[dwNode] )
+        {
+            dwRoot = dwNode;
+        }
+    }
+
+    // distinct names get their rank in name order and are front coded in it
+    std::vector<UINT32> byName( dwCount );
+    for ( UINT32 dwNode = 0; dwNode < dwCount; ++dwNode )
+    {
+        byName[dwNode] = dwNode;
+    }
+    WpdCatalogNameLess nameLess;
+    nameLess.pNames = &names;
+    nameLess.pLengths = &lengths;
+    std::sort( byName.begin(), byName.end(), nameLess );
+
+    std::vector<UINT32> ranks( dwCount );
+    std::vector<UINT16> nameUnits;
+    std::vector<UINT32> blocks;
+    UINT32 dwCountName = 0;
+    LPCWSTR pszPrevious = NULL;
+    size_t lenPrevious = 0;
+    for ( UINT32 index = 0; index < dwCount; ++index )
+    {
+        const UINT32 dwNode = byName[index];
+        LPCWSTR pszName = names[dwNode];
+        const size_t len = lengths[dwNode];
+        if ( NULL == pszPrevious || len != lenPrevious || 0 != ::wcsncmp( pszName, pszPrevious, len ) )
+        {
+            size_t prefix = 0;
+            if ( 0 == dwCountName % WPD_CATALOG_BLOCK )
+            {
+                blocks.push_back( (UINT32)nameUnits.size() );
+            }
+            else
+            {
+                while ( prefix < len && prefix < lenPrevious && pszName[prefix] == pszPrevious[prefix] )
+                {
+                    prefix += 1;
+                }
+            }
+            nameUnits.push_back( (UINT16)prefix );
+            nameUnits.push_back( (UINT16)(len - prefix) );
+            nameUnits.insert( nameUnits.end(), pszName + prefix, pszName + len );
+            dwCountName += 1;
+            pszPrevious = pszName;
+            lenPrevious = len;
+        }
+        ranks[dwNode] = dwCountName - 1;
+    }
+
+    std::vector<WpdCatalogNode> nodes( dwCount );
+    std::vector<UINT32> children;
+    children.reserve( dwCount );
+    WpdCatalogRankLess rankLess;
+    rankLess.pRanks = &ranks;
+    for ( UINT32 dwNode = 0; dwNode < dwCount; ++dwNode )
+    {
+        WpdCatalogNode& node = nodes[dwNode];
+        node.dwParent = pStore->parent[dwNode];
+        node.dwFirstChild = (UINT32)children.size();
+        for ( UINT32 dwChild = pStore->firstChild[dwNode]; WPD_HANDLE_NONE != dwChild; dwChild = pStore->nextSibling[dwChild] )
+        {
+            children.push_back( dwChild );
+        }
+        node.dwCountChild = (UINT32)children.size() - node.dwFirstChild;
+        std::sort( children.begin() + node.dwFirstChild, children.end(), rankLess );
+        node.dwCountObject = 1;
+        node.dwName = ranks[dwNode];
+        node.dwFlags = (0 != pStore->folder[dwNode] || 0 < node.dwCountChild)?(WPD_CATALOG_FOLDER):(0);
+        node.qwSize = pStore->size[dwNode];
+        node.qwBytes = (0 != node.dwFlags)?(0):(node.qwSize);
+    }
+    // one pass from the end of the parent first order sums the subtrees
+    std::vector<UINT32> order;
+    wpdTreeStore_Order( pStore, &order );
+    for ( size_t index = order.size(); 0 < index; --index )
+    {
+        const UINT32 dwNode = order[index - 1];
+        const UINT32 dwParent = nodes[dwNode].dwParent;
+        if ( WPD_HANDLE_NONE != dwParent )
+        {
+            nodes[dwParent].qwBytes += nodes[dwNode].qwBytes;
+            nodes[dwParent].dwCountObject += nodes[dwNode].dwCountObject;
+        }
+    }
+
+    std::vector<UINT32> idIndex( dwCount );
+    std::vector<WCHAR> ids;
+    for ( UINT32 dwNode = 0; dwNode < dwCount; ++dwNode )
+    {
+        LPCWSTR pszObjectId = wpdArena_Get( &pStore->strings, pStore->objectId[dwNode] );
+        idIndex[dwNode] = (UINT32)ids.size();
+        ids.insert( ids.end(), pszObjectId, pszObjectId + ::wcslen( pszObjectId ) + 1 );
+    }
+    if ( 0xFFFFFFFFU < nameUnits.size() || 0xFFFFFFFFU < ids.size() )
+    {
+        LOGE( L"! Failed. catalog %s, names or ids past 4G characters\n", pszPath );
+        return false;
+    }
+
+    WpdCatalogHeader header;
+    ::memset( &header, 0, sizeof(header) );
+    header.dwMagic = WPD_CATALOG_MAGIC;
+    header.dwVersion = WPD_CATALOG_VERSION;
+    header.dwHeaderSize = sizeof(header);
+    header.dwCountNode = dwCount;
+    header.dwCountChild = (UINT32)children.size();
+    header.dwCountName = dwCountName;
+    header.dwRoot = dwRoot;
+    header.qwOffsetNodes = wpdCatalog_Align( sizeof(header) );
+    header.qwOffsetChildren = wpdCatalog_Align( header.qwOffsetNodes + nodes.size() * sizeof(WpdCatalogNode) );
+    header.qwOffsetByName = wpdCatalog_Align( header.qwOffsetChildren + children.size() * sizeof(UINT32) );
+    header.qwOffsetNames = wpdCatalog_Align( header.qwOffsetByName + byName.size() * sizeof(UINT32) );
+    header.qwOffsetBlocks = wpdCatalog_Align( header.qwOffsetNames + nameUnits.size() * sizeof(UINT16) );
+    header.qwOffsetIdIndex = wpdCatalog_Align( header.qwOffsetBlocks + blocks.size() * sizeof(UINT32) );
+    header.qwOffsetIds = wpdCatalog_Align( header.qwOffsetIdIndex + idIndex.size() * sizeof(UINT32) );
+    header.qwFileSize = wpdCatalog_Align( header.qwOffsetIds + ids.size() * sizeof(WCHAR) );
+
+    std::wstring pathTemp( pszPath );
+    pathTemp.append( L".tmp" );
+    FILE* fp = NULL;
+    if ( 0 != ::_wfopen_s( &fp, pathTemp.c_str(), L"wb" ) || NULL == fp )
+    {
+        LOGE( L"! Failed. open catalog %s\n", pathTemp.c_str() );
+        return false;
+    }
+
+    ULONGLONG qwWritten = 0;
+    bool result = wpdCatalog_WriteSection( fp, &qwWritten, 0, &header, sizeof(header) )
+        && wpdCatalog_WriteSection( fp, &qwWritten, header.qwOffsetNodes, &nodes[0], nodes.size() * sizeof(WpdCatalogNode) )
+        && wpdCatalog_WriteSection( fp, &qwWritten, header.qwOffsetChildren, (children.empty())?(NULL):(&children[0]), children.size() * sizeof(UINT32) )
+        && wpdCatalog_WriteSection( fp, &qwWritten, header.qwOffsetByName, &byName[0], byName.size() * sizeof(UINT32) )
+        && wpdCatalog_WriteSection( fp, &qwWritten, header.qwOffsetNames, &nameUnits[0], nameUnits.size() * sizeof(UINT16) )
+        && wpdCatalog_WriteSection( fp, &qwWritten, header.qwOffsetBlocks, &blocks[0], blocks.size() * sizeof(UINT32) )
+        && wpdCatalog_WriteSection( fp, &qwWritten, header.qwOffsetIdIndex, &idIndex[0], idIndex.size() * sizeof(UINT32) )
+        && wpdCatalog_WriteSection( fp, &qwWritten, header.qwOffsetIds, &ids[0], ids.size() * sizeof(WCHAR) )
+        && wpdCatalog_WriteSection( fp, &qwWritten, header.qwFileSize, NULL, 0 );
+    result = (0 == ::fclose( fp )) && result;
+    fp = NULL;
+
+    if ( false == result || FALSE == ::MoveFileExW( pathTemp.c_str(), pszPath, MOVEFILE_REPLACE_EXISTING ) )
+    {
+        LOGE( L"! Failed. write catalog %s\n", pszPath );
+        ::DeleteFileW( pathTemp.c_str() );
+        return false;
+    }
+    *pqwFileSize = header.qwFileSize;
+    return true;
+}
+
+// a mapped catalog; the pointers are into the view
+struct WpdCatalog
+{
+    HANDLE                      hFile;
+    HANDLE                      hMapping;
+    const BYTE*                 pView;
+    const WpdCatalogHeader*     pHeader;
+    const WpdCatalogNode*       pNodes;
+    const UINT32*               pChildren;
+    const UINT32*               pByName;
+    const UINT16*               pNames;
+    size_t                      countNameUnit;
+    const UINT32*               pBlocks;
+    const UINT32*               pIdIndex;
+    LPCWSTR                     pIds;
+    size_t                      cchIds;
+};
+
+void
+wpdCatalog_Close(
+    WpdCatalog* pCatalog
+)
+{
+    if ( NULL != pCatalog->pView )
+    {
+        ::UnmapViewOfFile( pCatalog->pView );
+        pCatalog->pView = NULL;
+    }
+    if ( NULL != pCatalog->hMapping )
+    {
+        ::CloseHandle( pCatalog->hMapping );
+        pCatalog->hMapping = NULL;
+    }
+    if ( INVALID_HANDLE_VALUE != pCatalog->hFile )
+    {
+        ::CloseHandle( pCatalog->hFile );
+        pCatalog->hFile = INVALID_HANDLE_VALUE;
+    }
+}
+
+// maps the file and checks the header against its size; nothing past the header is read,
+// what the sections hold is checked where a query reaches it
+bool
+wpdCatalog_Open(
+    WpdCatalog* pCatalog
+    , LPCWSTR pszPath
+)
+{
+    ::memset( pCatalog, 0, sizeof(*pCatalog) );
+    pCatalog->hFile = ::CreateFileW( pszPath, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_RANDOM_ACCESS, NULL );
+    if ( INVALID_HANDLE_VALUE == pCatalog->hFile )
+    {
+        LOGE( L"! Failed. open catalog %s, error=%u\n", pszPath, ::GetLastError() );
+        return false;
+    }
+    LARGE_INTEGER liSize;
+    liSize.QuadPart = 0;
+    if ( FALSE == ::GetFileSizeEx( pCatalog->hFile, &liSize )
+        || liSize.QuadPart < (LONGLONG)sizeof(WpdCatalogHeader)
+        || (ULONGLONG)(SIZE_T)-1 < (ULONGLONG)liSize.QuadPart )
+    {
+        LOGE( L"! Failed. invalid catalog %s\n", pszPath );
+        wpdCatalog_Close( pCatalog );
+        return false;
+    }
+    pCatalog->hMapping = ::CreateFileMappingW( pCatalog->hFile, NULL, PAGE_READONLY, 0, 0, NULL );
+    if ( NULL != pCatalog->hMapping )
+    {
+        pCatalog->pView = (const BYTE*)::MapViewOfFile( pCatalog->hMapping, FILE_MAP_READ, 0, 0, 0 );
+    }
+    if ( NULL == pCatalog->pView )
+    {
+        LOGE( L"! Failed. map catalog %s, error=%u\n", pszPath, ::GetLastError() );
+        wpdCatalog_Close( pCatalog );
+        return false;
+    }
+
+    const WpdCatalogHeader* pHeader = (const WpdCatalogHeader*)pCatalog->pView;
+    const ULONGLONG qwCountBlock = ((ULONGLONG)pHeader->dwCountName + WPD_CATALOG_BLOCK - 1) / WPD_CATALOG_BLOCK;
+    const ULONGLONG qwOffsets[] =
+    {
+        pHeader->qwOffsetNodes, pHeader->qwOffsetChildren, pHeader->qwOffsetByName, pHeader->qwOffsetNames
+        , pHeader->qwOffsetBlocks, pHeader->qwOffsetIdIndex, pHeader->qwOffsetIds, pHeader->qwFileSize
+    };
+    bool valid = (WPD_CATALOG_MAGIC == pHeader->dwMagic
+        && WPD_CATALOG_VERSION == pHeader->dwVersion
+        && sizeof(WpdCatalogHeader) == pHeader->dwHeaderSize
+        && (ULONGLONG)liSize.QuadPart == pHeader->qwFileSize
+        && pHeader->dwRoot < pHeader->dwCountNode
+        && pHeader->dwCountName <= pHeader->dwCountNode
+        && pHeader->dwCountChild < pHeader->dwCountNode
+        && sizeof(WpdCatalogHeader) <= pHeader->qwOffsetNodes
+        && pHeader->qwOffsetNodes + (ULONGLONG)pHeader->dwCountNode * sizeof(WpdCatalogNode) <= pHeader->qwOffsetChildren
+        && pHeader->qwOffsetChildren + (ULONGLONG)pHeader->dwCountChild * sizeof(UINT32) <= pHeader->qwOffsetByName
+        && pHeader->qwOffsetByName + (ULONGLONG)pHeader->dwCountNode * sizeof(UINT32) <= pHeader->qwOffsetNames
+        && pHeader->qwOffsetNames <= pHeader->qwOffsetBlocks
+        && pHeader->qwOffsetBlocks + qwCountBlock * sizeof(UINT32) <= pHeader->qwOffsetIdIndex
+        && pHeader->qwOffsetIdIndex + (ULONGLONG)pHeader->dwCountNode * sizeof(UINT32) <= pHeader->qwOffsetIds
+        && pHeader->qwOffsetIds < pHeader->qwFileSize);
+    for ( size_t index = 0; valid && index < _countof(qwOffsets); ++index )
+    {
+        valid = (0 == qwOffsets[index] % 8);
+    }
+    // the last character is a nul, so every id offset inside the section ends in one
+    valid = valid && L'\0' == *(LPCWSTR)(pCatalog->pView + pHeader->qwFileSize - sizeof(WCHAR));
+    if ( false == valid )
+    {
+        LOGE( L"! Failed. invalid catalog %s\n", pszPath );
+        wpdCatalog_Close( pCatalog );
+        return false;
+    }
+
+    pCatalog->pHeader = pHeader;
+    pCatalog->pNodes = (const WpdCatalogNode*)(pCatalog->pView + pHeader->qwOffsetNodes);
+    pCatalog->pChildren = (const UINT32*)(pCatalog->pView + pHeader->qwOffsetChildren);
+    pCatalog->pByName = (const UINT32*)(pCatalog->pView + pHeader->qwOffsetByName);
+    pCatalog->pNames = (const UINT16*)(pCatalog->pView + pHeader->qwOffsetNames);
+    pCatalog->countNameUnit = (size_t)((pHeader->qwOffsetBlocks - pHeader->qwOffsetNames) / sizeof(UINT16));
+    pCatalog->pBlocks = (const UINT32*)(pCatalog->pView + pHeader->qwOffsetBlocks);
+    pCatalog->pIdIndex = (const UINT32*)(pCatalog->pView + pHeader->qwOffsetIdIndex);
+    pCatalog->pIds = (LPCWSTR)(pCatalog->pView + pHeader->qwOffsetIds);
+    pCatalog->cchIds = (size_t)((pHeader->qwFileSize - pHeader->qwOffsetIds) / sizeof(WCHAR));
+    return true;
+}
+
+const WpdCatalogNode*
+wpdCatalog_Node(
+    const WpdCatalog* pCatalog
+    , const UINT32 dwNode
+)
+{
+    return (dwNode < pCatalog->pHeader->dwCountNode)?(&pCatalog->pNodes[dwNode]):(NULL);
+}
+
+UINT32
+wpdCatalog_Child(
+    const WpdCatalog* pCatalog
+    , const WpdCatalogNode* pNode
+    , const UINT32 index
+)
+{
+    const ULONGLONG qwChild = (ULONGLONG)pNode->dwFirstChild + index;
+    return (index < pNode->dwCountChild && qwChild < pCatalog->pHeader->dwCountChild)?(pCatalog->pChildren[qwChild]):(WPD_HANDLE_NONE);
+}
+
+LPCWSTR
+wpdCatalog_ObjectId(
+    const WpdCatalog* pCatalog
+    , const UINT32 dwNode
+)
+{
+    if ( pCatalog->pHeader->dwCountNode <= dwNode || pCatalog->cchIds <= pCatalog->pIdIndex[dwNode] )
+    {
+        return L"";
+    }
+    return pCatalog->pIds + pCatalog->pIdIndex[dwNode];
+}
+
+// one decoded name of the table; names are decoded from the start of their block
+struct WpdCatalogCursor
+{
+    UINT32      dwName;
+    size_t      offset;         // of the entry after dwName, in u16 units
+    size_t      len;
+    WCHAR       szName[WPD_CATALOG_NAME_MAX + 1];
+};
+
+// the entry at the offset over the name before it, false on a damaged entry
+bool
+wpdCatalogCursor_Read(
+    const WpdCatalog* pCatalog
+    , WpdCatalogCursor* pCursor
+)
+{
+    const size_t offset = pCursor->offset;
+    if ( pCatalog->countNameUnit < offset + 2 )
+    {
+        return false;
+    }
+    const size_t prefix = pCatalog->pNames[offset];
+    const size_t suffix = pCatalog->pNames[offset + 1];
+    if ( pCursor->len < prefix || WPD_CATALOG_NAME_MAX < prefix + suffix || pCatalog->countNameUnit < offset + 2 + suffix )
+    {
+        return false;
+    }
+    ::memcpy( &pCursor->szName[prefix], &pCatalog->pNames[offset + 2], suffix * sizeof(WCHAR) );
+    pCursor->len = prefix + suffix;
+    pCursor->szName[pCursor->len] = L'\0';
+    pCursor->offset = offset + 2 + suffix;
+    return true;
+}
+
+bool
+wpdCatalogCursor_Seek(
+    const WpdCatalog* pCatalog
+    , WpdCatalogCursor* pCursor
+    , const UINT32 dwName
+)
+{
+    if ( pCatalog->pHeader->dwCountName <= dwName )
+    {
+        return false;
+    }
+    pCursor->dwName = dwName - dwName % WPD_CATALOG_BLOCK;
+    pCursor->offset = pCatalog->pBlocks[dwName / WPD_CATALOG_BLOCK];
+    pCursor->len = 0;
+    if ( false == wpdCatalogCursor_Read( pCatalog, pCursor ) )
+    {
+        return false;
+    }
+    while ( pCursor->dwName < dwName )
+    {
+        if ( false == wpdCatalogCursor_Read( pCatalog, pCursor ) )
+        {
+            return false;
+        }
+        pCursor->dwName += 1;
+    }
+    return true;
+}
+
+// blocks follow each other, so the next name is the next entry even across them
+bool
+wpdCatalogCursor_Next(
+    const WpdCatalog* pCatalog
+    , WpdCatalogCursor* pCursor
+)
+{
+    if ( pCatalog->pHeader->dwCountName <= pCursor->dwName + 1 || false == wpdCatalogCursor_Read( pCatalog, pCursor ) )
+    {
+        return false;
+    }
+    pCursor->dwName += 1;
+    return true;
+}
+
+// child of a folder by name in any case, a binary search of the children in name order
+UINT32
+wpdCatalog_FindChild(
+    const WpdCatalog* pCatalog
+    , const UINT32 dwNode
+    , LPCWSTR pszName
+    , const size_t len
+    , WpdCatalogCursor* pCursor
+)
+{
+    const WpdCatalogNode* pNode = wpdCatalog_Node( pCatalog, dwNode );
+    if ( NULL == pNode )
+    {
+        return WPD_HANDLE_NONE;
+    }
+    UINT32 lo = 0;
+    UINT32 hi = pNode->dwCountChild;
+    while ( lo < hi )
+    {
+        const UINT32 mid = lo + (hi - lo) / 2;
+        const WpdCatalogNode* pChild = wpdCatalog_Node( pCatalog, wpdCatalog_Child( pCatalog, pNode, mid ) );
+        if ( NULL == pChild || false == wpdCatalogCursor_Seek( pCatalog, pCursor, pChild->dwName ) )
+        {
+            return WPD_HANDLE_NONE;
+        }
+        if ( wpdCatalog_CompareFolded( pCursor->szName, pCursor->len, pszName, len ) < 0 )
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    const UINT32 dwChild = wpdCatalog_Child( pCatalog, pNode, lo );
+    const WpdCatalogNode* pChild = wpdCatalog_Node( pCatalog, dwChild );
+    if ( NULL != pChild
+        && wpdCatalogCursor_Seek( pCatalog, pCursor, pChild->dwName )
+        && 0 == wpdCatalog_CompareFolded( pCursor->szName, pCursor->len, pszName, len ) )
+    {
+        return dwChild;
+    }
+    return WPD_HANDLE_NONE;
+}
+
+// "name\\name" below the root, '/' as well
+UINT32
+wpdCatalog_Resolve(
+    const WpdCatalog* pCatalog
+    , LPCWSTR pszPath
+    , WpdCatalogCursor* pCursor
+)
+{
+    UINT32 dwNode = pCatalog->pHeader->dwRoot;
+    LPCWSTR p = pszPath;
+    while ( WPD_HANDLE_NONE != dwNode && L'\0' != *p )
+    {
+        LPCWSTR pszComponent = p;
+        while ( L'\0' != *p && L'\\' != *p && L'/' != *p )
+        {
+            ++p;
+        }
+        const size_t len = (size_t)(p - pszComponent);
+        if ( L'\0' != *p )
+        {
+            ++p;
+        }
+        if ( 0 == len || (1 == len && L'.' == pszComponent[0]) )
+        {
+            continue;
+        }
+        dwNode = wpdCatalog_FindChild( pCatalog, dwNode, pszComponent, len, pCursor );
+    }
+    return dwNode;
+}
+
+// ranks [*pdwFirst, *pdwLast) of the names that start with the prefix in any case
+void
+wpdCatalog_FindPrefix(
+    const WpdCatalog* pCatalog
+    , LPCWSTR pszPrefix
+    , const size_t len
+    , WpdCatalogCursor* pCursor
+    , UINT32* pdwFirst
+    , UINT32* pdwLast
+)
+{
+    const UINT32 dwCountName = pCatalog->pHeader->dwCountName;
+    *pdwFirst = dwCountName;
+    *pdwLast = dwCountName;
+
+    // first block that starts at or after the prefix, the range begins in the block before it
+    UINT32 lo = 0;
+    UINT32 hi = (dwCountName + WPD_CATALOG_BLOCK - 1) / WPD_CATALOG_BLOCK;
+    while ( lo < hi )
+    {
+        const UINT32 mid = lo + (hi - lo) / 2;
+        if ( false == wpdCatalogCursor_Seek( pCatalog, pCursor, mid * WPD_CATALOG_BLOCK ) )
+        {
+            return;
+        }
+        if ( wpdCatalog_CompareFolded( pCursor->szName, pCursor->len, pszPrefix, len ) < 0 )
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    if ( false == wpdCatalogCursor_Seek( pCatalog, pCursor, (0 < lo)?((lo - 1) * WPD_CATALOG_BLOCK):(0) ) )
+    {
+        return;
+    }
+    while ( wpdCatalog_CompareFolded( pCursor->szName, pCursor->len, pszPrefix, len ) < 0 )
+    {
+        if ( false == wpdCatalogCursor_Next( pCatalog, pCursor ) )
+        {
+            return;
+        }
+    }
+    *pdwFirst = pCursor->dwName;
+    while ( len <= pCursor->len && 0 == wpdCatalog_CompareFolded( pCursor->szName, len, pszPrefix, len ) )
+    {
+        if ( false == wpdCatalogCursor_Next( pCatalog, pCursor ) )
+        {
+            return;
+        }
+    }
+    *pdwLast = pCursor->dwName;
+}
+
+// first entry of byName whose name ranks at or after dwName
+UINT32
+wpdCatalog_LowerByName(
+    const WpdCatalog* pCatalog
+    , const UINT32 dwName
+)
+{
+    UINT32 lo = 0;
+    UINT32 hi = pCatalog->pHeader->dwCountNode;
+    while ( lo < hi )
+    {
+        const UINT32 mid = lo + (hi - lo) / 2;
+        const WpdCatalogNode* pNode = wpdCatalog_Node( pCatalog, pCatalog->pByName[mid] );
+        if ( NULL == pNode )
+        {
+            return pCatalog->pHeader->dwCountNode;
+        }
+        if ( pNode->dwName < dwName )
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+// path below the root for printing, the only part of a query that allocates
+void
+wpdCatalog_Path(
+    const WpdCatalog* pCatalog
+    , UINT32 dwNode
+    , WpdCatalogCursor* pCursor
+    , std::wstring* pPath
+)
+{
+    pPath->clear();
+    for ( UINT32 depth = 0; depth < 4096; ++depth )
+    {
+        const WpdCatalogNode* pNode = wpdCatalog_Node( pCatalog, dwNode );
+        if ( NULL == pNode || WPD_HANDLE_NONE == pNode->dwParent || false == wpdCatalogCursor_Seek( pCatalog, pCursor, pNode->dwName ) )
+        {
+            break;
+        }
+        if ( !pPath->empty() )
+        {
+            pPath->insert( 0, 1, L'\\' );
+        }
+        pPath->insert( 0, pCursor->szName, pCursor->len );
+        dwNode = pNode->dwParent;
+    }
+}
+
+// "ls <path>", "stat <path>" or "search <prefix>", as the daemon answers the first two
+bool
+wpdCatalog_Query(
+    const WpdCatalog* pCatalog
+    , LPCWSTR pszRequest
+    , const bool print
+    , DWORD* pdwCount
+)
+{
+    *pdwCount = 0;
+    while ( L' ' == *pszRequest || L'\t' == *pszRequest )
+    {
+        ++pszRequest;
+    }
+    LPCWSTR pszArgument = pszRequest;
+    while ( L'\0' != *pszArgument && L' ' != *pszArgument && L'\t' != *pszArgument )
+    {
+        ++pszArgument;
+    }
+    const size_t lenVerb = (size_t)(pszArgument - pszRequest);
+    while ( L' ' == *pszArgument || L'\t' == *pszArgument )
+    {
+        ++pszArgument;
+    }
+
+    WpdCatalogCursor cursor;
+    if ( 6 == lenVerb && 0 == ::wcsncmp( pszRequest, L"search", 6 ) )
+    {
+        UINT32 dwFirst = 0;
+        UINT32 dwLast = 0;
+        wpdCatalog_FindPrefix( pCatalog, pszArgument, ::wcslen( pszArgument ), &cursor, &dwFirst, &dwLast );
+        std::wstring path;
+        for ( UINT32 index = wpdCatalog_LowerByName( pCatalog, dwFirst ); index < pCatalog->pHeader->dwCountNode; ++index )
+        {
+            const UINT32 dwNode = pCatalog->pByName[index];
+            const WpdCatalogNode* pNode = wpdCatalog_Node( pCatalog, dwNode );
+            if ( NULL == pNode || dwLast <= pNode->dwName )
+            {
+                break;
+            }
+            *pdwCount += 1;
+            if ( print )
+            {
+                wpdCatalog_Path( pCatalog, dwNode, &cursor, &path );
+                LOGI( L"    %s\t%I64u\t%s\n", (0 != (WPD_CATALOG_FOLDER & pNode->dwFlags))?(L"d"):(L"f"), pNode->qwBytes, path.c_str() );
+            }
+        }
+        return true;
+    }
+    if ( false == (2 == lenVerb && 0 == ::wcsncmp( pszRequest, L"ls", 2 )) && false == (4 == lenVerb && 0 == ::wcsncmp( pszRequest, L"stat", 4 )) )
+    {
+        LOGE( L"! Failed. catalog request %s, ls|stat <path> or search <prefix>\n", pszRequest );
+        return false;
+    }
+
+    const UINT32 dwNode = wpdCatalog_Resolve( pCatalog, pszArgument, &cursor );
+    const WpdCatalogNode* pNode = wpdCatalog_Node( pCatalog, dwNode );
+    if ( NULL == pNode )
+    {
+        if ( print )
+        {
+            LOGI( L"    no such path %s\n", pszArgument );
+        }
+        return true;
+    }
+    const bool isFolder = (0 != (WPD_CATALOG_FOLDER & pNode->dwFlags));
+    if ( 2 == lenVerb )
+    {
+        if ( false == isFolder && print )
+        {
+            LOGI( L"    not a folder %s\n", pszArgument );
+        }
+        for ( UINT32 index = 0; isFolder && index < pNode->dwCountChild; ++index )
+        {
+            const WpdCatalogNode* pChild = wpdCatalog_Node( pCatalog, wpdCatalog_Child( pCatalog, pNode, index ) );
+            if ( NULL == pChild || false == wpdCatalogCursor_Seek( pCatalog, &cursor, pChild->dwName ) )
+            {
+                return false;
+            }
+            *pdwCount += 1;
+            if ( print )
+            {
+                LOGI( L"    %s\t%I64u\t%s\n", (0 != (WPD_CATALOG_FOLDER & pChild->dwFlags))?(L"d"):(L"f"), pChild->qwBytes, cursor.szName );
+            }
+        }
+        return true;
+    }
+
+    *pdwCount = 1;
+    if ( print )
+    {
+        const bool named = wpdCatalogCursor_Seek( pCatalog, &cursor, pNode->dwName );
+        LOGI( L"    type\t%s\n    size\t%I64u\n    bytes\t%I64u\n    objects\t%u\n    children\t%u\n    name\t%s\n    id\t%s\n"
+            , (isFolder)?(L"folder"):(L"file")
+            , pNode->qwSize
+            , pNode->qwBytes
+            , pNode->dwCountObject
+            , pNode->dwCountChild
+            , (named)?(cursor.szName):(L"")
+            , wpdCatalog_ObjectId( pCatalog, dwNode )
+            );
+    }
+    return true;
+}
+
+// --catalog-query=<file>;<request>[;<request>...]
+bool
+wpdCatalog_Command(
+    LPCWSTR pszArgument
+)
+{
+    const std::wstring argument( pszArgument );
+    size_t pos = argument.find( L';' );
+    if ( std::wstring::npos == pos )
+    {
+        LOGE( L"! Failed. --catalog-query=<file>;<request>, got %s\n", pszArgument );
+        return false;
+    }
+    const std::wstring path( argument, 0, pos );
+
+    WpdCatalog catalog;
+    const ULONGLONG qwTicksOpen = wpdTicksNow();
+    if ( false == wpdCatalog_Open( &catalog, path.c_str() ) )
+    {
+        return false;
+    }
+    LOGI( L"Catalog    : %s, objects=%u, names=%u, %I64u bytes, opened in %.1fus\n"
+        , path.c_str()
+        , catalog.pHeader->dwCountNode
+        , catalog.pHeader->dwCountName
+        , catalog.pHeader->qwFileSize
+        , wpdTicksToMicroseconds( wpdTicksNow() - qwTicksOpen )
+        );
+
+    bool result = true;
+    while ( std::wstring::npos != pos )
+    {
+        const size_t next = argument.find( L';', pos + 1 );
+        const std::wstring request( argument, pos + 1, (std::wstring::npos == next)?(std::wstring::npos):(next - pos - 1) );
+        pos = next;
+
+        LOGI( L"    > %s\n", request.c_str() );
+        DWORD dwCount = 0;
+        const ULONGLONG qwTicksQuery = wpdTicksNow();
+        const bool resultQuery = wpdCatalog_Query( &catalog, request.c_str(), true, &dwCount );
+        LOGI( L"    catalog: %s, results=%u, %.1fus\n"
+            , (resultQuery)?(L"ok"):(L"failed")
+            , dwCount
+            , wpdTicksToMicroseconds( wpdTicksNow() - qwTicksQuery )
+            );
+        result = result && resultQuery;
+    }
+    wpdCatalog_Close( &catalog );
+    return result;
+}
+
+// latencies in microseconds, sorted here
+void
+wpdCatalog_ReportLatency(
+    LPCWSTR pszKind
+    , std::vector<double>* pLatencies
+    , const DWORD dwCountMismatch
+)
+{
+    if ( pLatencies->empty() )
+    {
+        return;
+    }
+    std::sort( pLatencies->begin(), pLatencies->end() );
+    const size_t last = pLatencies->size() - 1;
+    LOGI( L"    %-6s queries=%u, mismatched=%u, p50=%.1fus, p90=%.1fus, p99=%.1fus, max=%.1fus\n"
+        , pszKind
+        , (DWORD)pLatencies->size()
+        , dwCountMismatch
+        , (*pLatencies)[last * 50 / 100]
+        , (*pLatencies)[last * 90 / 100]
+        , (*pLatencies)[last * 99 / 100]
+        , (*pLatencies)[last]
+        );
+}
+
+// --catalog-bench=<objects>: DCIMnnn folders of 100 camera folders of 99 files, written as a catalog
+// in the temp directory, then opened and queried; the file is left there for --catalog-query=
+void
+wpdCatalog_Bench(
+    const DWORD dwCountObject
+)
+{
+    WCHAR szTemp[MAX_PATH];
+    const DWORD cchTemp = ::GetTempPathW( _countof(szTemp), szTemp );
+    if ( 0 == cchTemp || _countof(szTemp) <= cchTemp )
+    {
+        LOGE( L"! Failed. GetTempPath, error=%u\n", ::GetLastError() );
+        return;
+    }
+    const std::wstring path( std::wstring( szTemp ) + L"wpdcatalog_bench.wpdcat" );
+
+    WpdTreeStore store;
+    wpdTreeStore_Init( &store );
+    WCHAR szObjectId[32];
+    WCHAR szName[64];
+    const ULONGLONG qwTicksBuild = wpdTicksNow();
+    const UINT32 dwRoot = wpdTreeStore_Add( &store, WPD_HANDLE_NONE, WPD_DEVICE_OBJECT_ID );
+    UINT32 dwTop = dwRoot;
+    UINT32 dwFolder = dwRoot;
+    for ( DWORD index = 0; index < dwCountObject; ++index )
+    {
+        ::_snwprintf_s( szObjectId, _countof(szObjectId), _TRUNCATE, L"o%X", index + 1 );
+        if ( 0 == index % 100 )
+        {
+            if ( 0 == index % 10000 )
+            {
+                ::_snwprintf_s( szObjectId, _countof(szObjectId), _TRUNCATE, L"t%X", index / 10000 + 1 );
+                dwTop = wpdTreeStore_Add( &store, dwRoot, szObjectId );
+                ::_snwprintf_s( szName, _countof(szName), _TRUNCATE, L"DCIM%03u", index / 10000 );
+                wpdTreeStore_SetName( &store, dwTop, szName );
+                store.folder[dwTop] = 1;
+                ::_snwprintf_s( szObjectId, _countof(szObjectId), _TRUNCATE, L"o%X", index + 1 );
+            }
+            dwFolder = wpdTreeStore_Add( &store, dwTop, szObjectId );
+            ::_snwprintf_s( szName, _countof(szName), _TRUNCATE, L"%06uCANON", index / 100 );
+            wpdTreeStore_SetName( &store, dwFolder, szName );
+            store.folder[dwFolder] = 1;
+            continue;
+        }
+        const UINT32 dwNode = wpdTreeStore_Add( &store, dwFolder, szObjectId );
+        ::_snwprintf_s( szName, _countof(szName), _TRUNCATE, L"IMG_%08u.JPG", index );
+        wpdTreeStore_SetName( &store, dwNode, szName );
+        store.size[dwNode] = 100000U + (index * 2654435761U) % 5000000U;
+    }
+    const double dSecondsBuild = wpdTicksToMicroseconds( wpdTicksNow() - qwTicksBuild ) / 1000000.0;
+
+    ULONGLONG qwFileSize = 0;
+    const ULONGLONG qwTicksWrite = wpdTicksNow();
+    const bool written = wpdCatalog_Write( &store, path.c_str(), &qwFileSize );
+    const double dSecondsWrite = wpdTicksToMicroseconds( wpdTicksNow() - qwTicksWrite ) / 1000000.0;
+    const UINT32 dwCountNode = wpdTreeStore_Count( &store );
+    const ULONGLONG qwStoreBytes = wpdTreeStore_Bytes( &store );
+    wpdTreeStore_Term( &store );
+    if ( false == written )
+    {
+        return;
+    }
+    LOGI( L"Catalog bench: objects=%u, built in %.3f sec (%I64u bytes in memory), written in %.3f sec\n"
+        , dwCountNode
+        , dSecondsBuild
+        , qwStoreBytes
+        , dSecondsWrite
+        );
+    LOGI( L"    catalog: %s, %I64u bytes, %.1f bytes/object\n", path.c_str(), qwFileSize, (double)qwFileSize / dwCountNode );
+
+    // the first open, then the mean of reopening it
+    WpdCatalog catalog;
+    ULONGLONG qwTicksOpen = wpdTicksNow();
+    if ( false == wpdCatalog_Open( &catalog, path.c_str() ) )
+    {
+        return;
+    }
+    const double dMicrosecondsOpen = wpdTicksToMicroseconds( wpdTicksNow() - qwTicksOpen );
+    wpdCatalog_Close( &catalog );
+    const DWORD dwCountReopen = 100;
+    qwTicksOpen = wpdTicksNow();
+    for ( DWORD index = 0; index < dwCountReopen; ++index )
+    {
+        if ( false == wpdCatalog_Open( &catalog, path.c_str() ) )
+        {
+            return;
+        }
+        wpdCatalog_Close( &catalog );
+    }
+    const double dMicrosecondsReopen = wpdTicksToMicroseconds( wpdTicksNow() - qwTicksOpen ) / dwCountReopen;
+    if ( false == wpdCatalog_Open( &catalog, path.c_str() ) )
+    {
+        return;
+    }
+    LOGI( L"    open: first=%.1fus, mean of %u=%.1fus\n", dMicrosecondsOpen, dwCountReopen, dMicrosecondsReopen );
+
+    // random files and folders, the first query of a page faults it in from the cache
+    const DWORD dwCountFolder = (dwCountObject + 99) / 100;
+    std::vector<double> latencyStat;
+    std::vector<double> latencyList;
+    std::vector<double> latencySearch;
+    DWORD dwMismatchStat = 0;
+    DWORD dwMismatchList = 0;
+    DWORD dwMismatchSearch = 0;
+    DWORD x = 0x12345678U;
+    WCHAR szRequest[128];
+    for ( DWORD query = 0; query < 10000 && 1 < dwCountObject; ++query )
+    {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        DWORD index = x % dwCountObject;
+        if ( 0 == index % 100 )
+        {
+            index = (index + 1 < dwCountObject)?(index + 1):(index - 1);
+        }
+        ::_snwprintf_s( szRequest, _countof(szRequest), _TRUNCATE, L"stat DCIM%03u\\%06uCANON\\img_%08u.jpg", index / 10000, index / 100, index );
+        DWORD dwCount = 0;
+        ULONGLONG qwTicksQuery = wpdTicksNow();
+        wpdCatalog_Query( &catalog, szRequest, false, &dwCount );
+        latencyStat.push_back( wpdTicksToMicroseconds( wpdTicksNow() - qwTicksQuery ) );
+        dwMismatchStat += (1 == dwCount)?(0):(1);
+
+        if ( 0 != query % 10 )
+        {
+            continue;
+        }
+        const DWORD dwFolderQuery = x % dwCountFolder;
+        const DWORD dwExpected = (dwFolderQuery + 1 < dwCountFolder)?(99):(dwCountObject - dwFolderQuery * 100 - 1);
+        ::_snwprintf_s( szRequest, _countof(szRequest), _TRUNCATE, L"ls DCIM%03u/%06uCANON", dwFolderQuery / 100, dwFolderQuery );
+        qwTicksQuery = wpdTicksNow();
+        wpdCatalog_Query( &catalog, szRequest, false, &dwCount );
+        latencyList.push_back( wpdTicksToMicroseconds( wpdTicksNow() - qwTicksQuery ) );
+        dwMismatchList += (dwExpected == dwCount)?(0):(1);
+
+        // the 99 files of the folder share the first six digits
+        ::_snwprintf_s( szRequest, _countof(szRequest), _TRUNCATE, L"search IMG_%06u", dwFolderQuery );
+        qwTicksQuery = wpdTicksNow();
+        wpdCatalog_Query( &catalog, szRequest, false, &dwCount );
+        latencySearch.push_back( wpdTicksToMicroseconds( wpdTicksNow() - qwTicksQuery ) );
+        dwMismatchSearch += (dwExpected == dwCount)?(0):(1);
+    }
+    wpdCatalog_ReportLatency( L"stat", &latencyStat, dwMismatchStat );
+    wpdCatalog_ReportLatency( L"ls", &latencyList, dwMismatchList );
+    wpdCatalog_ReportLatency( L"search", &latencySearch, dwMismatchSearch );
+    wpdCatalog_Close( &catalog );
+}
+
+// --catalog=<directory>: a catalog per device, named after its PnP id
+void
+wpdCatalog_Save(
+    WpdTreeStore* pStore
+    , LPCWSTR pszPnPDeviceID
+    , const size_t index
+)
+{
+    std::wstring path( s_optCatalog );
+    if ( !path.empty() && L'\\' != path[path.size()-1] && L'/' != path[path.size()-1] )
+    {
+        path.push_back( L'\\' );
+    }
+    for ( LPCWSTR p = pszPnPDeviceID; L'\0' != *p; ++p )
+    {
+        const WCHAR c = *p;
+        const bool safe = (L'0' <= c && c <= L'9') || (L'A' <= c && c <= L'Z') || (L'a' <= c && c <= L'z') || L'-' == c;
+        path.push_back( (safe)?(c):(L'_') );
+    }
+    path.append( L".wpdcat" );
+
+    ULONGLONG qwFileSize = 0;
+    const ULONGLONG qwTicksStart = wpdTicksNow();
+    if ( wpdCatalog_Write( pStore, path.c_str(), &qwFileSize ) )
+    {
+        LOGI( L"%3u: Catalog %s, objects=%u, %I64u bytes, %.3f sec\n"
+            , index
+            , path.c_str()
+            , wpdTreeStore_Count( pStore )
+            , qwFileSize
+            , wpdTicksToMicroseconds( wpdTicksNow() - qwTicksStart ) / 1000000.0
+            );
+    }
+}
+
+// per device scan result, owned by the scan pool
+struct WpdDeviceScan
+{
+    LPCWSTR     pszPnPDeviceID;
+    size_t      index;
+    bool        result;
+    DWORD       dwCountContent;
+    DWORD       dwCountObjectValues;    // objects whose properties reached the walk, the root included
+    DWORD       dwCountFilterFolder;    // --exclude-folders= pruned
+    DWORD       dwCountFilterFile;      // --only= filtered
+    DWORD       dwCountFilterEnumSaved;
+    LONG        nCountHeapAlloc;        // --alloc-stats: during the walk, process wide
+    LONG        nCountCoTaskAlloc;
+    DWORD       dwCountEnumerate;
+    DWORD       dwCountWalk;            // walks one second apart, --simulate walks once
+    WpdTreeStore*   pTreeStore;     // --tree
+    WpdScratchPool* pScratchPool;   // of the scanning thread
+};
+
+struct WpdScanCache;
+struct WpdWatchTree;
+
+struct WpdEnumContext
+{
+    WpdDeviceScan*                  pScan;
+    DWORD                           dwCountContent;
+
+    // incremental scan cache, NULL without --cache=
+    WpdScanCache*                   pCache;
+    // object tree kept up to date by events, NULL without --watch
+    WpdWatchTree*                   pWatchTree;
+    // compact tree of the scan, NULL without --tree
+    WpdTreeStore*                   pTreeStore;
+    // buffers of the walking thread, NULL allocates every time
+    WpdScratchPool*                 pScratchPool;
+    LONG                            nCountHeapAllocStart;
+    LONG                            nCountCoTaskAllocStart;
+    // --alloc-stats: made by the walking threads themselves, and the most opening one object took
+    LONG                            nCountHeapAllocWalk;
+    LONG                            nCountCoTaskAllocWalk;
+    LONG                            nCountHeapAllocObjectMax;
+    LONG                            nCountCoTaskAllocObjectMax;
+    // --stats counters of the device, NULL without
+    WpdDeviceStats*                 pStats;
+    // object which owns the children currently being fetched
+    LPCWSTR                         pszParentObjectId;
+
+    IPortableDeviceContent*         pPortableDeviceContent;
+    IPortableDeviceProperties*      pPortableDeviceProperties;
+    IPortableDevicePropertiesBulk*  pPortableDevicePropertiesBulk;
+
+    // NULL means every property (legacy behaviour)
+    IPortableDeviceKeyCollection*   pKeysFile;
+    IPortableDeviceKeyCollection*   pKeysFolder;
+    IPortableDeviceKeyCollection*   pKeysFileOnly;
+
+    // --only= / --exclude-folders=: first pass with pKeysFolder decides, pruned objects are not walked
+    bool                            useFilter;
+    std::set<std::wstring>*         pFilterPruned;
+    DWORD   dwCountFilterFolder;
+    DWORD   dwCountFilterFile;
+    DWORD   dwCountFilterEnumSaved;
+    DWORD   dwCountFilterFetchSaved;
+
+    // first pass values of files waiting for their second bulk pass, only with --output=
+    std::map<std::wstring, IPortableDeviceValues*>* pOutputPending;
+
+    // --bulk: children a bulk request returned no values for, fetched one by one when walked
+    std::set<std::wstring>*         pBulkMissing;
+    DWORD   dwCountBulkRequest;
+    DWORD   dwCountBulkObject;
+    DWORD   dwCountBulkFallback;
+    DWORD   dwCountGetValues;
+    DWORD   dwCountSampleGetValues;
+    // objects whose properties reached the walk, once each however they were fetched
+    DWORD   dwCountObjectValues;
+
+    DWORD       dwCountValuesFetched;
+    ULONGLONG   qwBytesFetched;
+    DWORD       dwCountContentTypeStat;
+    WpdContentTypeStat  contentTypeStat[WPD_CONTENT_TYPE_STAT_MAX];
+
+    // Next() observations: per call latency = fixed + per id * fetched
+    DWORD       dwFetchStart;
+    DWORD       dwCountNext;
+    ULONGLONG   qwTicksNext;
+    DWORD       dwCountFetchSample;
+    double      dFetchSumN;
+    double      dFetchSumT;
+    double      dFetchSumNN;
+    double      dFetchSumNT;
+    DWORD       dwFetchHistogram[WPD_FETCH_HISTOGRAM_MAX];
+};
+
+// --alloc-stats: the allocation counts of the calling thread at some point of the walk
+struct WpdAllocMark
+{
+    LONG    nCountHeap;
+    LONG    nCountCoTask;
+};
+
+void
+wpdAllocMark_Start(
+    WpdAllocMark* pMark
+)
+{
+    pMark->nCountHeap = s_nCountHeapAllocThread;
+    pMark->nCountCoTask = s_nCountCoTaskAllocThread;
+}
+
+// what this thread allocated since the mark goes to the walk; object when that was opening one object
+void
+wpdAllocMark_Charge(
+    const WpdAllocMark* pMark
+    , WpdEnumContext* pContext
+    , const bool object
+)
+{
+    if ( false == s_optAllocStats )
+    {
+        return;
+    }
+    const LONG nCountHeap = s_nCountHeapAllocThread - pMark->nCountHeap;
+    const LONG nCountCoTask = s_nCountCoTaskAllocThread - pMark->nCountCoTask;
+    pContext->nCountHeapAllocWalk += nCountHeap;
+    pContext->nCountCoTaskAllocWalk += nCountCoTask;
+    if ( object )
+    {
+        if ( pContext->nCountHeapAllocObjectMax < nCountHeap )
+        {
+            pContext->nCountHeapAllocObjectMax = nCountHeap;
+        }
+        if ( pContext->nCountCoTaskAllocObjectMax < nCountCoTask )
+        {
+            pContext->nCountCoTaskAllocObjectMax = nCountCoTask;
+        }
+    }
+}
+
+DWORD
+wpdPropVariantSize( const PROPVARIANT& pv )
+{
+    switch ( pv.vt )
+    {
+    case VT_LPWSTR:
+        return (NULL != pv.pwszVal)?((DWORD)((::wcslen(pv.pwszVal)+1)*sizeof(WCHAR))):(0);
+    case VT_LPSTR:
+        return (NULL != pv.pszVal)?((DWORD)(::strlen(pv.pszVal)+1)):(0);
+    case VT_CLSID:
+        return sizeof(GUID);
+    case VT_UI8:
+    case VT_I8:
+    case VT_R8:
+    case VT_DATE:
+    case VT_FILETIME:
+        return 8;
+    case VT_BLOB:
+        return pv.blob.cbSize;
+    case VT_BOOL:
+        return 2;
+    case VT_EMPTY:
+        return 0;
+    default:
+        return 4;
+    }
+}
+
+// estimated wire size of a property set: key plus payload for each value
+DWORD
+wpdValuesPayloadSize( IPortableDeviceValues* pAttributes, DWORD* pdwCountValues )
+{
+    DWORD dwBytes = 0;
+    DWORD dwCount = 0;
+    if ( NULL != pAttributes )
+    {
+        const HRESULT hr = pAttributes->GetCount( &dwCount );
+        if ( FAILED(hr) )
+        {
+            dwCount = 0;
+        }
+        for ( DWORD dwIndex = 0; dwIndex < dwCount; ++dwIndex )
+        {
+            PROPVARIANT pv;
+            ::PropVariantInit( &pv );
+            if ( SUCCEEDED(pAttributes->GetAt( dwIndex, NULL, &pv )) )
+            {
+                dwBytes += (DWORD)sizeof(PROPERTYKEY) + wpdPropVariantSize( pv );
+            }
+            ::PropVariantClear( &pv );
+        }
+    }
+    if ( NULL != pdwCountValues )
+    {
+        *pdwCountValues = dwCount;
+    }
+    return dwBytes;
+}
+
+bool
+wpdIsFolderContentType( const GUID& guid )
+{
+    return ( ::IsEqualGUID( guid, WPD_CONTENT_TYPE_FOLDER )
+        || ::IsEqualGUID( guid, WPD_CONTENT_TYPE_FUNCTIONAL_OBJECT ) );
+}
+
+struct WpdContentTypeName
+{
+    LPCWSTR     pszName;
+    const GUID* pGuid;
+};
+
+static
+const WpdContentTypeName s_contentTypeNames[] =
+{
+    { L"image",     &WPD_CONTENT_TYPE_IMAGE     },
+    { L"video",     &WPD_CONTENT_TYPE_VIDEO     },
+    { L"audio",     &WPD_CONTENT_TYPE_AUDIO     },
+    { L"document",  &WPD_CONTENT_TYPE_DOCUMENT  },
+    { L"playlist",  &WPD_CONTENT_TYPE_PLAYLIST  },
+};
+
+// true when guid is one of the comma separated --only= type names
+bool
+wpdFilter_MatchContentType(
+    LPCWSTR pszTypes
+    , const GUID& guid
+)
+{
+    for ( size_t index = 0; index < sizeof(s_contentTypeNames)/sizeof(s_contentTypeNames[0]); ++index )
+    {
+        const WpdContentTypeName& entry = s_contentTypeNames[index];
+        if ( false == ::IsEqualGUID( guid, *entry.pGuid ) )
+        {
+            continue;
+        }
+
+        const size_t len = ::wcslen( entry.pszName );
+        LPCWSTR p = pszTypes;
+        while ( NULL != p && L'\0' != *p )
+        {
+            LPCWSTR pEnd = ::wcschr( p, L',' );
+            const size_t lenToken = (NULL != pEnd)?((size_t)(pEnd - p)):(::wcslen(p));
+            if ( len == lenToken && 0 == ::_wcsnicmp( p, entry.pszName, len ) )
+            {
+                return true;
+            }
+            p = (NULL != pEnd)?(pEnd + 1):(NULL);
+        }
+        return false;
+    }
+    return false;
+}
+
+// case insensitive '*' and '?' match of pszName against [pszPattern, pszPatternEnd)
+bool
+wpdFilter_MatchGlob(
+    LPCWSTR pszPattern
+    , LPCWSTR pszPatternEnd
+    , LPCWSTR pszName
+)
+{
+    LPCWSTR pStar = NULL;
+    LPCWSTR pStarName = NULL;
+    while ( L'\0' != *pszName )
+    {
+        if ( pszPattern < pszPatternEnd && L'*' == *pszPattern )
+        {
+            pStar = pszPattern;
+            pszPattern += 1;
+            pStarName = pszName;
+        }
+        else
+        if ( pszPattern < pszPatternEnd
+            && (L'?' == *pszPattern || ::towlower( *pszPattern ) == ::towlower( *pszName )) )
+        {
+            pszPattern += 1;
+            pszName += 1;
+        }
+        else
+        if ( NULL != pStar )
+        {
+            // let the last '*' take one more character
+            pszPattern = pStar + 1;
+            pStarName += 1;
+            pszName = pStarName;
+        }
+        else
+        {
+            return false;
+        }
+    }
+    while ( pszPattern < pszPatternEnd && L'*' == *pszPattern )
+    {
+        pszPattern += 1;
+    }
+    return pszPattern == pszPatternEnd;
+}
+
+// true when pszName matches one of the ';' separated --exclude-folders= globs
+bool
+wpdFilter_MatchFolder(
+    LPCWSTR pszGlobs
+    , LPCWSTR pszName
+)
+{
+    LPCWSTR p = pszGlobs;
+    while ( NULL != p && L'\0' != *p )
+    {
+        LPCWSTR pEnd = ::wcschr( p, L';' );
+        if ( NULL == pEnd )
+        {
+            pEnd = p + ::wcslen( p );
+        }
+        if ( p < pEnd && wpdFilter_MatchGlob( p, pEnd, pszName ) )
+        {
+            return true;
+        }
+        p = (L'\0' != *pEnd)?(pEnd + 1):(NULL);
+    }
+    return false;
+}
+
+// decide on the values of the first pass; returns false for an object that is not shown.
+// *pPruned is set when nothing more of the object (its file keys, its children) is wanted
+bool
+wpdFilter_Accept(
+    WpdEnumContext* pContext
+    , IPortableDeviceValues* pAttributes
+    , bool* pIsFolder
+    , bool* pPruned
+)
+{
+    *pIsFolder = false;
+    *pPruned = false;
+
+    GUID guid;
+    const bool hasContentType = SUCCEEDED(pAttributes->GetGuidValue( WPD_OBJECT_CONTENT_TYPE, &guid ));
+    *pIsFolder = hasContentType && wpdIsFolderContentType( guid );
+
+    if ( *pIsFolder )
+    {
+        if ( NULL == s_optExcludeFolders )
+        {
+            return true;
+        }
+
+        bool excluded = false;
+        LPWSTR pszName = NULL;
+        if ( SUCCEEDED(pAttributes->GetStringValue( WPD_OBJECT_NAME, &pszName )) && NULL != pszName )
+        {
+            excluded = wpdFilter_MatchFolder( s_optExcludeFolders, pszName );
+        }
+        if ( NULL != pszName )
+        {
+            ::CoTaskMemFree( pszName );
+            pszName = NULL;
+        }
+        if ( excluded )
+        {
+            pContext->dwCountFilterFolder += 1;
+            *pPruned = true;
+            return false;
+        }
+        return true;
+    }
+
+    if ( NULL != s_optOnly && (false == hasContentType || false == wpdFilter_MatchContentType( s_optOnly, guid )) )
+    {
+        pContext->dwCountFilterFile += 1;
+        pContext->dwCountFilterFetchSaved += 1;
+        *pPruned = true;
+        return false;
+    }
+    return true;
+}
+
+// remember an object pruned during a bulk pass, so the walker skips it
+void
+wpdFilter_Prune(
+    WpdEnumContext* pContext
+    , IPortableDeviceValues* pAttributes
+)
+{
+    LPWSTR pszObjectId = NULL;
+    if ( SUCCEEDED(pAttributes->GetStringValue( WPD_OBJECT_ID, &pszObjectId )) && NULL != pszObjectId )
+    {
+        pContext->pFilterPruned->insert( pszObjectId );
+    }
+    if ( NULL != pszObjectId )
+    {
+        ::CoTaskMemFree( pszObjectId );
+        pszObjectId = NULL;
+    }
+}
+
+// one object as written by the output sinks; strings may be NULL
+struct WpdOutputRecord
+{
+    LPCWSTR     pszObjectId;
+    LPCWSTR     pszParentId;
+    LPCWSTR     pszName;
+    GUID        guidContentType;
+    bool        hasContentType;
+    ULONGLONG   qwSize;
+    bool        hasSize;
+    double      dModified;
+    bool        hasModified;
+    double      dCreated;
+    bool        hasCreated;
+};
+
+#define WPD_OUTPUT_BUFFER_SIZE  (1024U * 1024U)
+
+// buffered UTF-8 record stream, written one record per object while walking
+class WpdOutputSink
+{
+public:
+    explicit WpdOutputSink( HANDLE hFile, const bool ownFile )
+        : m_hFile(hFile)
+        , m_ownFile(ownFile)
+        , m_failed(false)
+        , m_qwCountRecord(0)
+        , m_qwCountBytes(0)
+    {
+        ::InitializeCriticalSection( &m_cs );
+        m_buffer.reserve( WPD_OUTPUT_BUFFER_SIZE );
+    }
+
+    virtual ~WpdOutputSink()
+    {
+        this->flush();
+        if ( m_ownFile && INVALID_HANDLE_VALUE != m_hFile )
+        {
+            ::CloseHandle( m_hFile );
+        }
+        m_hFile = INVALID_HANDLE_VALUE;
+        ::DeleteCriticalSection( &m_cs );
+    }
+
+    void
+    write( const WpdOutputRecord& record )
+    {
+        ::EnterCriticalSection( &m_cs );
+        this->encode( record );
+        m_qwCountRecord += 1;
+        if ( WPD_OUTPUT_BUFFER_SIZE <= m_buffer.size() )
+        {
+            this->flushLocked();
+        }
+        ::LeaveCriticalSection( &m_cs );
+    }
+
+    bool
+    flush( void )
+    {
+        ::EnterCriticalSection( &m_cs );
+        const bool result = this->flushLocked();
+        ::LeaveCriticalSection( &m_cs );
+        return result;
+    }
+
+    ULONGLONG
+    getCountRecord( void ) const
+    {
+        return m_qwCountRecord;
+    }
+
+    ULONGLONG
+    getCountBytes( void ) const
+    {
+        return m_qwCountBytes + m_buffer.size();
+    }
+
+protected:
+    virtual void encode( const WpdOutputRecord& record ) = 0;
+
+    void
+    appendBytes( const void* p, const size_t size )
+    {
+        const char* pBytes = reinterpret_cast<const char*>(p);
+        m_buffer.insert( m_buffer.end(), pBytes, pBytes + size );
+    }
+
+    // UTF-8 of pszText[0, len), converted straight into the buffer
+    void
+    appendUtf8( LPCWSTR pszText, const size_t len )
+    {
+        if ( 0 == len )
+        {
+            return;
+        }
+        const size_t offset = m_buffer.size();
+        m_buffer.resize( offset + len * 3 );
+        const int written = ::WideCharToMultiByte( CP_UTF8, 0, pszText, (int)len, &m_buffer[offset], (int)(len * 3), NULL, NULL );
+        m_buffer.resize( offset + ((0 < written)?((size_t)written):(0)) );
+    }
+
+private:
+    bool
+    flushLocked( void )
+    {
+        if ( m_buffer.empty() )
+        {
+            return true;
+        }
+        if ( false == m_failed )
+        {
+            DWORD dwWritten = 0;
+            if ( FALSE == ::WriteFile( m_hFile, &m_buffer[0], (DWORD)m_buffer.size(), &dwWritten, NULL )
+                || dwWritten != (DWORD)m_buffer.size() )
+            {
+                LOGE( L"! Failed. output WriteFile, err=%u\n", ::GetLastError() );
+                m_failed = true;
+            }
+        }
+        m_qwCountBytes += m_buffer.size();
+        m_buffer.clear();
+        return false == m_failed;
+    }
+
+    HANDLE              m_hFile;
+    bool                m_ownFile;
+    bool                m_failed;
+    CRITICAL_SECTION    m_cs;
+    std::vector<char>   m_buffer;
+    ULONGLONG           m_qwCountRecord;
+    ULONGLONG           m_qwCountBytes;
+};
+
+// short name of a content type, NULL when it has none
+LPCWSTR
+wpdContentTypeName( const GUID& guid )
+{
+    if ( ::IsEqualGUID( guid, WPD_CONTENT_TYPE_FOLDER ) )
+    {
+        return L"folder";
+    }
+    if ( ::IsEqualGUID( guid, WPD_CONTENT_TYPE_FUNCTIONAL_OBJECT ) )
+    {
+        return L"functional";
+    }
+    for ( size_t index = 0; index < sizeof(s_contentTypeNames)/sizeof(s_contentTypeNames[0]); ++index )
+    {
+        if ( ::IsEqualGUID( guid, *s_contentTypeNames[index].pGuid ) )
+        {
+            return s_contentTypeNames[index].pszName;
+        }
+    }
+    return NULL;
+}
+
+// one JSON object per line
+class WpdOutputNdjson : public WpdOutputSink
+{
+public:
+    explicit WpdOutputNdjson( HANDLE hFile, const bool ownFile )
+        : WpdOutputSink( hFile, ownFile )
+    {
+    }
+
+protected:
+    void
+    encode( const WpdOutputRecord& record )
+    {
+        this->appendBytes( "{\"id\":", 6 );
+        this->appendString( record.pszObjectId );
+        this->appendBytes( ",\"parent\":", 10 );
+        this->appendString( record.pszParentId );
+        this->appendBytes( ",\"name\":", 8 );
+        this->appendString( record.pszName );
+        if ( record.hasContentType )
+        {
+            this->appendBytes( ",\"type\":", 8 );
+            LPCWSTR pszType = wpdContentTypeName( record.guidContentType );
+            WCHAR szGuid[40];
+            if ( NULL == pszType )
+            {
+                szGuid[0] = L'\0';
+                ::StringFromGUID2( record.guidContentType, szGuid, sizeof(szGuid)/sizeof(szGuid[0]) );
+                pszType = szGuid;
+            }
+            this->appendString( pszType );
+        }
+
+        char szNumber[64];
+        if ( record.hasSize )
+        {
+            const int len = ::_snprintf_s( szNumber, sizeof(szNumber), _TRUNCATE, ",\"size\":%I64u", record.qwSize );
+            this->appendBytes( szNumber, (0 < len)?((size_t)len):(0) );
+        }
+        if ( record.hasModified )
+        {
+            this->appendDate( ",\"modified\":", record.dModified );
+        }
+        if ( record.hasCreated )
+        {
+            this->appendDate( ",\"created\":", record.dCreated );
+        }
+        this->appendBytes( "}\n", 2 );
+    }
+
+private:
+    void
+    appendString( LPCWSTR pszText )
+    {
+        if ( NULL == pszText )
+        {
+            this->appendBytes( "null", 4 );
+            return;
+        }
+
+        this->appendBytes( "\"", 1 );
+        LPCWSTR pRun = pszText;
+        LPCWSTR p = pszText;
+        for ( ; L'\0' != *p; ++p )
+        {
+            const WCHAR c = *p;
+            if ( L'"' != c && L'\\' != c && 0x20 <= c )
+            {
+                continue;
+            }
+
+            this->appendUtf8( pRun, (size_t)(p - pRun) );
+            pRun = p + 1;
+            if ( L'"' == c || L'\\' == c )
+            {
+                const char escaped[2] = { '\\', (char)c };
+                this->appendBytes( escaped, 2 );
+            }
+            else
+            {
+                char szEscaped[8];
+                ::_snprintf_s( szEscaped, sizeof(szEscaped), _TRUNCATE, "\\u%04x", (unsigned int)c );
+                this->appendBytes( szEscaped, 6 );
+            }
+        }
+        this->appendUtf8( pRun, (size_t)(p - pRun) );
+        this->appendBytes( "\"", 1 );
+    }
+
+    // ISO 8601 in the device's time, it has no time zone
+    void
+    appendDate( const char* pszKey, const double dDate )
+    {
+        SYSTEMTIME st;
+        if ( FALSE == ::VariantTimeToSystemTime( dDate, &st ) )
+        {
+            return;
+        }
+        char szDate[64];
+        const int len = ::_snprintf_s( szDate, sizeof(szDate), _TRUNCATE, "%s\"%04u-%02u-%02uT%02u:%02u:%02u\""
+            , pszKey
+            , st.wYear, st.wMonth, st.wDay
+            , st.wHour, st.wMinute, st.wSecond
+            );
+        this->appendBytes( szDate, (0 < len)?((size_t)len):(0) );
+    }
+};
+
+// "WPDR" version 1, then per record:
+//   u32 length of the rest, u32 flags (1 type, 2 size, 4 modified, 8 created),
+//   GUID type, u64 size, f64 modified, f64 created,
+//   then id, parent and name, each as u32 byte length and UTF-8 bytes
+class WpdOutputBinary : public WpdOutputSink
+{
+public:
+    explicit WpdOutputBinary( HANDLE hFile, const bool ownFile )
+        : WpdOutputSink( hFile, ownFile )
+    {
+        const UINT32 dwVersion = 1;
+        this->appendBytes( "WPDR", 4 );
+        this->appendBytes( &dwVersion, sizeof(dwVersion) );
+    }
+
+protected:
+    void
+    encode( const WpdOutputRecord& record )
+    {
+        const UINT32 dwFlags =
+            ((record.hasContentType)?(1U):(0U))
+            | ((record.hasSize)?(2U):(0U))
+            | ((record.hasModified)?(4U):(0U))
+            | ((record.hasCreated)?(8U):(0U));
+
+        // strings are converted first, the length goes in front of them
+        UINT32 dwLength = sizeof(UINT32) + sizeof(GUID) + sizeof(ULONGLONG) + sizeof(double) * 2;
+        const size_t lenId = this->measure( record.pszObjectId, 0 );
+        const size_t lenParent = this->measure( record.pszParentId, 1 );
+        const size_t lenName = this->measure( record.pszName, 2 );
+        dwLength += (UINT32)(sizeof(UINT32) * 3 + lenId + lenParent + lenName);
+
+        this->appendBytes( &dwLength, sizeof(dwLength) );
+        this->appendBytes( &dwFlags, sizeof(dwFlags) );
+        this->appendBytes( &record.guidContentType, sizeof(record.guidContentType) );
+        this->appendBytes( &record.qwSize, sizeof(record.qwSize) );
+        this->appendBytes( &record.dModified, sizeof(record.dModified) );
+        this->appendBytes( &record.dCreated, sizeof(record.dCreated) );
+        for ( size_t index = 0; index < 3; ++index )
+        {
+            const UINT32 dwBytes = (UINT32)m_scratchLength[index];
+            this->appendBytes( &dwBytes, sizeof(dwBytes) );
+            if ( 0 < dwBytes )
+            {
+                this->appendBytes( &m_scratch[m_scratchOffset[index]], dwBytes );
+            }
+        }
+        m_scratch.clear();
+    }
+
+private:
+    // UTF-8 of one string into the scratch area, its length is needed before the bytes
+    size_t
+    measure( LPCWSTR pszText, const size_t index )
+    {
+        m_scratchOffset[index] = m_scratch.size();
+        m_scratchLength[index] = 0;
+        if ( NULL == pszText || L'\0' == pszText[0] )
+        {
+            return 0;
+        }
+        const size_t len = ::wcslen( pszText );
+        const size_t offset = m_scratch.size();
+        m_scratch.resize( offset + len * 3 );
+        const int written = ::WideCharToMultiByte( CP_UTF8, 0, pszText, (int)len, &m_scratch[offset], (int)(len * 3), NULL, NULL );
+        m_scratchLength[index] = (0 < written)?((size_t)written):(0);
+        m_scratch.resize( offset + m_scratchLength[index] );
+        return m_scratchLength[index];
+    }
+
+    std::vector<char>   m_scratch;
+    size_t              m_scratchOffset[3];
+    size_t              m_scratchLength[3];
+};
+
+// --output= file ("-" for stdout, the log then goes to stderr) in --format=ndjson|binary
+WpdOutputSink*
+wpdOutput_Create(
+    LPCWSTR pszPath
+    , LPCWSTR pszFormat
+)
+{
+    HANDLE hFile = INVALID_HANDLE_VALUE;
+    bool ownFile = false;
+    if ( 0 == ::wcscmp( pszPath, L"-" ) )
+    {
+        hFile = ::GetStdHandle( STD_OUTPUT_HANDLE );
+    }
+    else
+    {
+        hFile = ::CreateFileW( pszPath, GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_FLAG_SEQUENTIAL_SCAN, NULL );
+        ownFile = true;
+    }
+    if ( INVALID_HANDLE_VALUE == hFile || NULL == hFile )
+    {
+        LOGE( L"! Failed. open output %s, err=%u\n", pszPath, ::GetLastError() );
+        return NULL;
+    }
+
+    if ( 0 == ::_wcsicmp( pszFormat, L"binary" ) )
+    {
+        return new WpdOutputBinary( hFile, ownFile );
+    }
+    return new WpdOutputNdjson( hFile, ownFile );
+}
+
+static
+WpdOutputSink* s_pOutputSink = NULL;
+
+// string property from pMore, else from pAttributes; CoTaskMemFree the result
+LPWSTR
+wpdOutput_GetString(
+    IPortableDeviceValues* pAttributes
+    , IPortableDeviceValues* pMore
+    , REFPROPERTYKEY key
+)
+{
+    LPWSTR pValue = NULL;
+    if ( NULL != pMore && SUCCEEDED(pMore->GetStringValue( key, &pValue )) && NULL != pValue )
+    {
+        return pValue;
+    }
+    if ( NULL != pValue )
+    {
+        ::CoTaskMemFree( pValue );
+        pValue = NULL;
+    }
+    if ( NULL != pAttributes && SUCCEEDED(pAttributes->GetStringValue( key, &pValue )) && NULL != pValue )
+    {
+        return pValue;
+    }
+    if ( NULL != pValue )
+    {
+        ::CoTaskMemFree( pValue );
+        pValue = NULL;
+    }
+    return NULL;
+}
+
+bool
+wpdOutput_GetDate(
+    IPortableDeviceValues* pAttributes
+    , IPortableDeviceValues* pMore
+    , REFPROPERTYKEY key
+    , double* pDate
+)
+{
+    IPortableDeviceValues* sources[2] = { pMore, pAttributes };
+    for ( size_t index = 0; index < 2; ++index )
+    {
+        if ( NULL == sources[index] )
+        {
+            continue;
+        }
+        PROPVARIANT pv;
+        ::PropVariantInit( &pv );
+        const bool found = SUCCEEDED(sources[index]->GetValue( key, &pv )) && VT_DATE == pv.vt;
+        if ( found )
+        {
+            *pDate = pv.date;
+        }
+        ::PropVariantClear( &pv );
+        if ( found )
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+// write the record of one object; pMore holds the second pass values of a file, if any
+void
+wpdOutput_Emit(
+    WpdEnumContext* pContext
+    , LPCWSTR pszObjectId
+    , IPortableDeviceValues* pAttributes
+    , IPortableDeviceValues* pMore
+)
+{
+    if ( NULL == s_pOutputSink || NULL == pAttributes )
+    {
+        return;
+    }
+
+    WpdOutputRecord record;
+    ::memset( &record, 0, sizeof(record) );
+
+    LPWSTR pszObjectIdValue = NULL;
+    if ( NULL == pszObjectId )
+    {
+        pszObjectIdValue = wpdOutput_GetString( pAttributes, pMore, WPD_OBJECT_ID );
+        pszObjectId = pszObjectIdValue;
+    }
+    LPWSTR pszParentId = wpdOutput_GetString( pAttributes, pMore, WPD_OBJECT_PARENT_ID );
+    LPWSTR pszName = wpdOutput_GetString( pAttributes, pMore, WPD_OBJECT_NAME );
+
+    record.pszObjectId = pszObjectId;
+    record.pszParentId = (NULL != pszParentId)?(pszParentId):(pContext->pszParentObjectId);
+    if ( NULL != pszObjectId && 0 == ::wcscmp( pszObjectId, WPD_DEVICE_OBJECT_ID ) )
+    {
+        record.pszParentId = NULL;
+    }
+    record.pszName = pszName;
+    record.hasContentType = SUCCEEDED(pAttributes->GetGuidValue( WPD_OBJECT_CONTENT_TYPE, &record.guidContentType ));
+    if ( false == record.hasContentType && NULL != pMore )
+    {
+        record.hasContentType = SUCCEEDED(pMore->GetGuidValue( WPD_OBJECT_CONTENT_TYPE, &record.guidContentType ));
+    }
+    record.hasSize = (NULL != pMore && SUCCEEDED(pMore->GetUnsignedLargeIntegerValue( WPD_OBJECT_SIZE, &record.qwSize )))
+        || SUCCEEDED(pAttributes->GetUnsignedLargeIntegerValue( WPD_OBJECT_SIZE, &record.qwSize ));
+    record.hasModified = wpdOutput_GetDate( pAttributes, pMore, WPD_OBJECT_DATE_MODIFIED, &record.dModified );
+    record.hasCreated = wpdOutput_GetDate( pAttributes, pMore, WPD_OBJECT_DATE_CREATED, &record.dCreated );
+
+    s_pOutputSink->write( record );
+
+    if ( NULL != pszName )
+    {
+        ::CoTaskMemFree( pszName );
+        pszName = NULL;
+    }
+    if ( NULL != pszParentId )
+    {
+        ::CoTaskMemFree( pszParentId );
+        pszParentId = NULL;
+    }
+    if ( NULL != pszObjectIdValue )
+    {
+        ::CoTaskMemFree( pszObjectIdValue );
+        pszObjectIdValue = NULL;
+    }
+}
+
+// first bulk pass of a file: keep its values until the second pass completes the record
+void
+wpdOutput_Defer(
+    WpdEnumContext* pContext
+    , IPortableDeviceValues* pAttributes
+)
+{
+    LPWSTR pszObjectId = NULL;
+    if ( SUCCEEDED(pAttributes->GetStringValue( WPD_OBJECT_ID, &pszObjectId )) && NULL != pszObjectId )
+    {
+        IPortableDeviceValues*& pPending = (*pContext->pOutputPending)[pszObjectId];
+        if ( NULL != pPending )
+        {
+            pPending->Release();
+        }
+        pPending = pAttributes;
+        pPending->AddRef();
+    }
+    if ( NULL != pszObjectId )
+    {
+        ::CoTaskMemFree( pszObjectId );
+        pszObjectId = NULL;
+    }
+}
+
+// second bulk pass of a file: write it with its first pass values
+void
+wpdOutput_Complete(
+    WpdEnumContext* pContext
+    , IPortableDeviceValues* pAttributes
+)
+{
+    LPWSTR pszObjectId = NULL;
+    if ( SUCCEEDED(pAttributes->GetStringValue( WPD_OBJECT_ID, &pszObjectId )) && NULL != pszObjectId )
+    {
+        std::map<std::wstring, IPortableDeviceValues*>::iterator it = pContext->pOutputPending->find( pszObjectId );
+        if ( pContext->pOutputPending->end() != it )
+        {
+            wpdOutput_Emit( pContext, pszObjectId, it->second, pAttributes );
+            it->second->Release();
+            pContext->pOutputPending->erase( it );
+        }
+        else
+        {
+            wpdOutput_Emit( pContext, pszObjectId, pAttributes, NULL );
+        }
+    }
+    if ( NULL != pszObjectId )
+    {
+        ::CoTaskMemFree( pszObjectId );
+        pszObjectId = NULL;
+    }
+}
+
+// files whose second pass did not come back are written with what the first pass had
+void
+wpdOutput_FlushPending(
+    WpdEnumContext* pContext
+)
+{
+    if ( NULL == pContext->pOutputPending )
+    {
+        return;
+    }
+    for ( std::map<std::wstring, IPortableDeviceValues*>::iterator it = pContext->pOutputPending->begin(); it != pContext->pOutputPending->end(); ++it )
+    {
+        wpdOutput_Emit( pContext, it->first.c_str(), it->second, NULL );
+        it->second->Release();
+    }
+    pContext->pOutputPending->clear();
+}
+
+// --output-bench=N: N synthetic records through the sink, nothing from a device
+void
+wpdOutput_Bench(
+    const DWORD dwCountRecord
+)
+{
+    WCHAR szObjectId[32];
+    WCHAR szParentId[32];
+    WCHAR szName[64];
+
+    WpdOutputRecord record;
+    ::memset( &record, 0, sizeof(record) );
+    record.pszObjectId = szObjectId;
+    record.pszParentId = szParentId;
+    record.pszName = szName;
+    record.guidContentType = WPD_CONTENT_TYPE_IMAGE;
+    record.hasContentType = true;
+    record.hasSize = true;
+    record.dModified = 45000.5;
+    record.hasModified = true;
+
+    const ULONGLONG qwTicksStart = wpdTicksNow();
+    for ( DWORD index = 0; index < dwCountRecord; ++index )
+    {
+        ::_snwprintf_s( szObjectId, _countof(szObjectId), _TRUNCATE, L"o%X", index + 1 );
+        ::_snwprintf_s( szParentId, _countof(szParentId), _TRUNCATE, L"o%X", (index / 100) + 1 );
+        ::_snwprintf_s( szName, _countof(szName), _TRUNCATE, L"IMG_%06u.JPG", index );
+        record.qwSize = 1000000ULL + index;
+        s_pOutputSink->write( record );
+    }
+    s_pOutputSink->flush();
+    const double dSeconds = wpdTicksToMicroseconds( wpdTicksNow() - qwTicksStart ) / 1000000.0;
+
+    LOGI( L"Output bench: records=%u, bytes=%I64u, %.3f sec, %.0f records/sec, %.1f MB/sec\n"
+        , dwCountRecord
+        , s_pOutputSink->getCountBytes()
+        , dSeconds
+        , (0.0 < dSeconds)?(dwCountRecord / dSeconds):(0.0)
+        , (0.0 < dSeconds)?(s_pOutputSink->getCountBytes() / dSeconds / (1024.0 * 1024.0)):(0.0)
+        );
+}
+
+// account fetched values; returns true when the object is a folder
+bool
+wpdEnumContent_AccountValues(
+    IPortableDeviceValues* pAttributes
+    , WpdEnumContext* pContext
+    , const bool countObject
+)
+{
+    if ( NULL == pAttributes || NULL == pContext )
+    {
+        return false;
+    }
+
+    DWORD dwCountValues = 0;
+    pContext->qwBytesFetched += wpdValuesPayloadSize( pAttributes, &dwCountValues );
+    pContext->dwCountValuesFetched += dwCountValues;
+
+    GUID guid;
+    if ( FAILED(pAttributes->GetGuidValue( WPD_OBJECT_CONTENT_TYPE, &guid )) )
+    {
+        return false;
+    }
+
+    if ( countObject && NULL != pContext->pKeysFile )
+    {
+        WpdContentTypeStat* pStat = NULL;
+        for ( DWORD index = 0; index < pContext->dwCountContentTypeStat; ++index )
+        {
+            if ( ::IsEqualGUID( guid, pContext->contentTypeStat[index].guidContentType ) )
+            {
+                pStat = &pContext->contentTypeStat[index];
+                break;
+            }
+        }
+        if ( NULL == pStat && pContext->dwCountContentTypeStat < WPD_CONTENT_TYPE_STAT_MAX )
+        {
+            pStat = &pContext->contentTypeStat[pContext->dwCountContentTypeStat];
+            pContext->dwCountContentTypeStat += 1;
+            pStat->guidContentType = guid;
+            pAttributes->GetStringValue( WPD_OBJECT_ID, &pStat->pszSampleObjectId );
+        }
+        if ( NULL != pStat )
+        {
+            pStat->dwCountObject += 1;
+        }
+    }
+
+    return wpdIsFolderContentType( guid );
+}
+
+// one full GetValues per content type seen, to estimate the bytes a restricted key set saved
+void
+wpdEnumContent_SampleContentTypes(
+    WpdEnumContext* pContext
+)
+{
+    if ( NULL == pContext || NULL == pContext->pPortableDeviceProperties )
+    {
+        return;
+    }
+
+    for ( DWORD index = 0; index < pContext->dwCountContentTypeStat; ++index )
+    {
+        WpdContentTypeStat* pStat = &pContext->contentTypeStat[index];
+        if ( pStat->sampled || NULL == pStat->pszSampleObjectId )
+        {
+            continue;
+        }
+        pStat->sampled = true;
+
+        IPortableDeviceValues* pAttributes = NULL;
+        const ULONGLONG qwTicksCall = wpdStats_Begin( pContext->pStats );
+        const HRESULT hr = pContext->pPortableDeviceProperties->GetValues(
+            pStat->pszSampleObjectId
+            , NULL
+            , &pAttributes
+            );
+        wpdStats_End( pContext->pStats, WPD_STAT_OP_GET_VALUES, qwTicksCall, hr, 1 );
+        pContext->dwCountSampleGetValues += 1;
+        if ( SUCCEEDED(hr) )
+        {
+            pStat->dwBytesFull = wpdValuesPayloadSize( pAttributes, NULL );
+        }
+
+        if ( NULL != pAttributes )
+        {
+            pAttributes->Release();
+            pAttributes = NULL;
+        }
+    }
+}
+
+// --cache=<dir>: the scan of a device is saved under its serial number. a folder whose date and child count
+// match the last scan is not walked, its subtree comes from the cache and only shows in the counts, so
+// --cache= is refused next to the options that consume the walked objects.
+// 100k objects with 1% of the files changed: --simulate=tree --sim-depth=4 --sim-fanout=10 --sim-files=8
+// --sim-runs=2 --sim-change=10 --cache=<dir>, the second run against the first
+
+// one object of a scan, as stored in the cache file
+struct WpdCacheRecord
+{
+    std::wstring    parent;         // persistent unique id of the parent
+    std::wstring    name;
+    ULONGLONG       qwSize;
+    double          dModified;
+    DWORD           dwCountChild;
+    bool            isFolder;
+};
+
+// keyed by WPD_OBJECT_PERSISTENT_UNIQUE_ID, iterated in id order
+typedef std::map<std::wstring, WpdCacheRecord>      WpdCacheTable;
+
+struct WpdScanCache
+{
+    bool            loaded;
+    std::wstring    serial;
+    std::wstring    path;
+
+    WpdCacheTable                               previous;
+    std::multimap<std::wstring, std::wstring>   previousChildren;
+
+    WpdCacheTable                               current;
+    // object ids are only valid in this session
+    std::map<std::wstring, std::wstring>        objectIdToPuid;
+
+    DWORD   dwCountSkipFolder;
+    DWORD   dwCountSkipObject;
+};
+
+#define WPD_SCAN_CACHE_MAGIC    L"wpdcache"
+#define WPD_SCAN_CACHE_VERSION  (1)
+
+// tab separated file: escape tab, newline and backslash
+void
+wpdScanCache_Escape( const std::wstring& src, std::wstring* pDst )
+{
+    pDst->clear();
+    for ( size_t index = 0; index < src.size(); ++index )
+    {
+        const WCHAR c = src[index];
+        if ( L'\t' == c )
+        {
+            pDst->append( L"\\t" );
+        }
+        else
+        if ( L'\n' == c )
+        {
+            pDst->append( L"\\n" );
+        }
+        else
+        if ( L'\r' == c )
+        {
+            pDst->append( L"\\r" );
+        }
+        else
+        if ( L'\\' == c )
+        {
+            pDst->append( L"\\\\" );
+        }
+        else
+        {
+            pDst->push_back( c );
+        }
+    }
+}
+
+void
+wpdScanCache_Unescape( LPCWSTR pszBegin, LPCWSTR pszEnd, std::wstring* pDst )
+{
+    pDst->clear();
+    for ( LPCWSTR p = pszBegin; p < pszEnd; ++p )
+    {
+        if ( L'\\' == *p && p + 1 < pszEnd )
+        {
+            ++p;
+            if ( L't' == *p )
+            {
+                pDst->push_back( L'\t' );
+            }
+            else
+            if ( L'n' == *p )
+            {
+                pDst->push_back( L'\n' );
+            }
+            else
+            if ( L'r' == *p )
+            {
+                pDst->push_back( L'\r' );
+            }
+            else
+            {
+                pDst->push_back( *p );
+            }
+        }
+        else
+        {
+            pDst->push_back( *p );
+        }
+    }
+}
+
+// fgetws() into a buffer that grows until the line break or the end of the file is in it, so a long
+// name cannot split a line into two records
+bool
+wpdFile_ReadLine(
+    FILE* fp
+    , std::vector<WCHAR>* pLine
+)
+{
+    if ( pLine->size() < 2 )
+    {
+        pLine->resize( 256 );
+    }
+    size_t length = 0;
+    (*pLine)[0] = L'\0';
+    while ( NULL != ::fgetws( &(*pLine)[length], (int)(pLine->size() - length), fp ) )
+    {
+        length += ::wcslen( &(*pLine)[length] );
+        if ( 0 == length || L'\n' == (*pLine)[length - 1] || length + 1 < pLine->size() )
+        {
+            return true;
+        }
+        pLine->resize( pLine->size() * 2 );
+    }
+    return 0 < length;
+}
+
+// one line of the cache file: puid \t parent \t name \t size \t modified \t children \t folder
+bool
+wpdScanCache_ParseRecord(
+    LPCWSTR pszLine
+    , std::wstring* pPuid
+    , WpdCacheRecord* pRecord
+)
+{
+    LPCWSTR field[7];
+    LPCWSTR fieldEnd[7];
+    LPCWSTR p = pszLine;
+    DWORD dwCountField = 0;
+    while ( dwCountField < 7 )
+    {
+        field[dwCountField] = p;
+        while ( L'\0' != *p && L'\t' != *p && L'\n' != *p && L'\r' != *p )
+        {
+            ++p;
+        }
+        fieldEnd[dwCountField] = p;
+        dwCountField += 1;
+        if ( L'\t' != *p )
+        {
+            break;
+        }
+        ++p;
+    }
+    if ( 7 != dwCountField )
+    {
+        return false;
+    }
+
+    wpdScanCache_Unescape( field[0], fieldEnd[0], pPuid );
+    wpdScanCache_Unescape( field[1], fieldEnd[1], &pRecord->parent );
+    wpdScanCache_Unescape( field[2], fieldEnd[2], &pRecord->name );
+    pRecord->qwSize = ::_wcstoui64( field[3], NULL, 10 );
+    pRecord->dModified = ::wcstod( field[4], NULL );
+    pRecord->dwCountChild = ::wcstoul( field[5], NULL, 10 );
+    pRecord->isFolder = (L'1' == *field[6]);
+    return true;
+}
+
+void
+wpdScanCache_WriteRecord(
+    FILE* fp
+    , const std::wstring& puid
+    , const WpdCacheRecord& record
+    , std::wstring* pScratch
+)
+{
+    wpdScanCache_Escape( puid, pScratch );
+    ::fwprintf( fp, L"%s\t", pScratch->c_str() );
+    wpdScanCache_Escape( record.parent, pScratch );
+    ::fwprintf( fp, L"%s\t", pScratch->c_str() );
+    wpdScanCache_Escape( record.name, pScratch );
+    ::fwprintf( fp, L"%s\t%I64u\t%.9f\t%u\t%u\n"
+        , pScratch->c_str()
+        , record.qwSize
+        , record.dModified
+        , record.dwCountChild
+        , (record.isFolder)?(1U):(0U)
+        );
+}
+
+bool
+wpdScanCache_Load(
+    WpdScanCache* pCache
+)
+{
+    FILE* fp = NULL;
+    if ( 0 != ::_wfopen_s( &fp, pCache->path.c_str(), L"r, ccs=UTF-8" ) || NULL == fp )
+    {
+        LOGI( L"    cache: no previous scan for %s\n", pCache->serial.c_str() );
+        return false;
+    }
+
+    bool result = false;
+    std::vector<WCHAR> line( 256 );
+    DWORD dwVersion = 0;
+    if ( wpdFile_ReadLine( fp, &line )
+        && 0 == ::wcsncmp( &line[0], WPD_SCAN_CACHE_MAGIC L" ", ::wcslen(WPD_SCAN_CACHE_MAGIC L" ") )
+        && 1 == ::swscanf( &line[::wcslen(WPD_SCAN_CACHE_MAGIC L" ")], L"%u", &dwVersion )
+        && WPD_SCAN_CACHE_VERSION == dwVersion
+        && wpdFile_ReadLine( fp, &line ) )
+    {
+        result = true;
+        std::wstring puid;
+        WpdCacheRecord record;
+        while ( wpdFile_ReadLine( fp, &line ) )
+        {
+            if ( false == wpdScanCache_ParseRecord( &line[0], &puid, &record ) )
+            {
+                continue;
+            }
+            pCache->previous[puid] = record;
+            pCache->previousChildren.insert( std::make_pair( record.parent, puid ) );
+        }
+    }
+    ::fclose( fp );
+    fp = NULL;
+
+    if ( false == result )
+    {
+        LOGE( L"! Failed. invalid cache %s\n", pCache->path.c_str() );
+        pCache->previous.clear();
+        pCache->previousChildren.clear();
+        return false;
+    }
+
+    LOGI( L"    cache: %u objects from previous scan\n", (DWORD)pCache->previous.size() );
+    return true;
+}
+
+bool
+wpdScanCache_Save(
+    WpdScanCache* pCache
+)
+{
+    std::wstring pathTemp( pCache->path );
+    pathTemp.append( L".tmp" );
+
+    FILE* fp = NULL;
+    if ( 0 != ::_wfopen_s( &fp, pathTemp.c_str(), L"w, ccs=UTF-8" ) || NULL == fp )
+    {
+        LOGE( L"! Failed. open cache %s\n", pathTemp.c_str() );
+        return false;
+    }
+
+    ::fwprintf( fp, L"%s %u\n", WPD_SCAN_CACHE_MAGIC, WPD_SCAN_CACHE_VERSION );
+    ::fwprintf( fp, L"%s\n", pCache->serial.c_str() );
+
+    std::wstring scratch;
+    for ( WpdCacheTable::const_iterator it = pCache->current.begin(); it != pCache->current.end(); ++it )
+    {
+        wpdScanCache_WriteRecord( fp, it->first, it->second, &scratch );
+    }
+
+    const bool result = (0 == ::ferror( fp ));
+    ::fclose( fp );
+    fp = NULL;
+
+    if ( false == result || FALSE == ::MoveFileExW( pathTemp.c_str(), pCache->path.c_str(), MOVEFILE_REPLACE_EXISTING ) )
+    {
+        LOGE( L"! Failed. write cache %s\n", pCache->path.c_str() );
+        return false;
+    }
+
+    return true;
+}
+
+// device object values carry the serial number the cache file is named after
+void
+wpdScanCache_Open(
+    WpdScanCache* pCache
+    , IPortableDeviceValues* pAttributes
+)
+{
+    pCache->loaded = true;
+
+    LPWSTR pszSerial = NULL;
+    const HRESULT hr = pAttributes->GetStringValue( WPD_DEVICE_SERIAL_NUMBER, &pszSerial );
+    if ( FAILED(hr) || NULL == pszSerial || L'\0' == pszSerial[0] )
+    {
+        LOGI( L"    cache: device has no serial number, cache disabled\n" );
+        if ( NULL != pszSerial )
+        {
+            ::CoTaskMemFree( pszSerial );
+        }
+        return;
+    }
+    pCache->serial.assign( pszSerial );
+    ::CoTaskMemFree( pszSerial );
+    pszSerial = NULL;
+
+    std::wstring fileName;
+    for ( size_t index = 0; index < pCache->serial.size(); ++index )
+    {
+        const WCHAR c = pCache->serial[index];
+        const bool safe = (L'0' <= c && c <= L'9') || (L'A' <= c && c <= L'Z') || (L'a' <= c && c <= L'z') || L'-' == c;
+        fileName.push_back( (safe)?(c):(L'_') );
+    }
+    pCache->path.assign( s_optCacheDir );
+    if ( !pCache->path.empty() && L'\\' != pCache->path[pCache->path.size()-1] && L'/' != pCache->path[pCache->path.size()-1] )
+    {
+        pCache->path.push_back( L'\\' );
+    }
+    pCache->path.append( fileName );
+    pCache->path.append( L".wpdcache" );
+
+    wpdScanCache_Load( pCache );
+}
+
+void
+wpdScanCache_OnValues(
+    WpdEnumContext* pContext
+    , LPCWSTR pszObjectId
+    , IPortableDeviceValues* pAttributes
+)
+{
+    WpdScanCache* pCache = pContext->pCache;
+    if ( NULL == pCache || NULL == pAttributes )
+    {
+        return;
+    }
+
+    LPWSTR pszObjectIdValue = NULL;
+    if ( NULL == pszObjectId )
+    {
+        if ( FAILED(pAttributes->GetStringValue( WPD_OBJECT_ID, &pszObjectIdValue )) )
+        {
+            return;
+        }
+        pszObjectId = pszObjectIdValue;
+    }
+
+    if ( false == pCache->loaded && 0 == ::wcscmp( pszObjectId, WPD_DEVICE_OBJECT_ID ) )
+    {
+        wpdScanCache_Open( pCache, pAttributes );
+    }
+
+    if ( !pCache->serial.empty() )
+    {
+        // the second bulk pass of a file only carries the file keys: merge into the known record
+        std::map<std::wstring, std::wstring>::const_iterator itPuid = pCache->objectIdToPuid.find( pszObjectId );
+        WpdCacheRecord* pRecord = NULL;
+        if ( pCache->objectIdToPuid.end() != itPuid )
+        {
+            pRecord = &pCache->current[itPuid->second];
+        }
+        else
+        {
+            std::wstring puid( pszObjectId );
+            LPWSTR pszPuid = NULL;
+            if ( SUCCEEDED(pAttributes->GetStringValue( WPD_OBJECT_PERSISTENT_UNIQUE_ID, &pszPuid )) && NULL != pszPuid )
+            {
+                puid.assign( pszPuid );
+            }
+            if ( NULL != pszPuid )
+            {
+                ::CoTaskMemFree( pszPuid );
+                pszPuid = NULL;
+            }
+            pCache->objectIdToPuid[pszObjectId] = puid;
+
+            pRecord = &pCache->current[puid];
+            pRecord->qwSize = 0;
+            pRecord->dModified = 0.0;
+            pRecord->dwCountChild = 0;
+            pRecord->isFolder = false;
+            if ( NULL != pContext->pszParentObjectId )
+            {
+                std::map<std::wstring, std::wstring>::const_iterator itParent = pCache->objectIdToPuid.find( pContext->pszParentObjectId );
+                if ( pCache->objectIdToPuid.end() != itParent )
+                {
+                    pRecord->parent = itParent->second;
+                }
+            }
+        }
+
+        {
+            LPWSTR pValue = NULL;
+            if ( SUCCEEDED(pAttributes->GetStringValue( WPD_OBJECT_NAME, &pValue )) && NULL != pValue )
+            {
+                pRecord->name.assign( pValue );
+            }
+            if ( NULL != pValue )
+            {
+                ::CoTaskMemFree( pValue );
+                pValue = NULL;
+            }
+        }
+        {
+            ULONGLONG qwValue = 0;
+            if ( SUCCEEDED(pAttributes->GetUnsignedLargeIntegerValue( WPD_OBJECT_SIZE, &qwValue )) )
+            {
+                pRecord->qwSize = qwValue;
+            }
+        }
+        {
+            PROPVARIANT pv;
+            ::PropVariantInit( &pv );
+            if ( SUCCEEDED(pAttributes->GetValue( WPD_OBJECT_DATE_MODIFIED, &pv )) && VT_DATE == pv.vt )
+            {
+                pRecord->dModified = pv.date;
+            }
+            ::PropVariantClear( &pv );
+        }
+        {
+            GUID guid;
+            if ( SUCCEEDED(pAttributes->GetGuidValue( WPD_OBJECT_CONTENT_TYPE, &guid )) )
+            {
+                pRecord->isFolder = wpdIsFolderContentType( guid );
+            }
+        }
+    }
+
+    if ( NULL != pszObjectIdValue )
+    {
+        ::CoTaskMemFree( pszObjectIdValue );
+        pszObjectIdValue = NULL;
+    }
+}
+
+WpdCacheRecord*
+wpdScanCache_Find(
+    WpdScanCache* pCache
+    , LPCWSTR pszObjectId
+    , std::wstring* pPuid
+)
+{
+    std::map<std::wstring, std::wstring>::const_iterator itPuid = pCache->objectIdToPuid.find( pszObjectId );
+    if ( pCache->objectIdToPuid.end() == itPuid )
+    {
+        return NULL;
+    }
+    WpdCacheTable::iterator it = pCache->current.find( itPuid->second );
+    if ( pCache->current.end() == it )
+    {
+        return NULL;
+    }
+    if ( NULL != pPuid )
+    {
+        pPuid->assign( itPuid->second );
+    }
+    return &it->second;
+}
+
+// take the previous records below puid as they are; returns the count of objects reused
+DWORD
+wpdScanCache_ReuseSubtree(
+    WpdScanCache* pCache
+    , const std::wstring& puid
+)
+{
+    DWORD dwCount = 0;
+    std::vector<std::wstring> pending;
+    pending.push_back( puid );
+    while ( !pending.empty() )
+    {
+        const std::wstring parent( pending.back() );
+        pending.pop_back();
+
+        typedef std::multimap<std::wstring, std::wstring>::const_iterator ChildIterator;
+        const std::pair<ChildIterator, ChildIterator> range = pCache->previousChildren.equal_range( parent );
+        for ( ChildIterator it = range.first; it != range.second; ++it )
+        {
+            WpdCacheTable::const_iterator itRecord = pCache->previous.find( it->second );
+            if ( pCache->previous.end() == itRecord )
+            {
+                continue;
+            }
+            pCache->current[it->second] = itRecord->second;
+            dwCount += 1;
+            if ( itRecord->second.isFolder )
+            {
+                pending.push_back( it->second );
+            }
+        }
+    }
+    return dwCount;
+}
+
+// report added, removed and changed objects against the previous scan
+void
+wpdScanCache_Report(
+    WpdScanCache* pCache
+)
+{
+    DWORD dwCountAdded = 0;
+    DWORD dwCountRemoved = 0;
+    DWORD dwCountChanged = 0;
+
+    WpdCacheTable::const_iterator itPrevious = pCache->previous.begin();
+    WpdCacheTable::const_iterator itCurrent = pCache->current.begin();
+    while ( pCache->previous.end() != itPrevious || pCache->current.end() != itCurrent )
+    {
+        int compare = 0;
+        if ( pCache->previous.end() == itPrevious )
+        {
+            compare = 1;
+        }
+        else
+        if ( pCache->current.end() == itCurrent )
+        {
+            compare = -1;
+        }
+        else
+        {
+            compare = itPrevious->first.compare( itCurrent->first );
+        }
+
+        if ( compare < 0 )
+        {
+            LOGI( L"    - %s %s\n", itPrevious->first.c_str(), itPrevious->second.name.c_str() );
+            dwCountRemoved += 1;
+            ++itPrevious;
+        }
+        else
+        if ( 0 < compare )
+        {
+            LOGI( L"    + %s %s\n", itCurrent->first.c_str(), itCurrent->second.name.c_str() );
+            dwCountAdded += 1;
+            ++itCurrent;
+        }
+        else
+        {
+            const WpdCacheRecord& a = itPrevious->second;
+            const WpdCacheRecord& b = itCurrent->second;
+            const double dDiff = a.dModified - b.dModified;
+            if ( a.name != b.name || a.parent != b.parent || a.qwSize != b.qwSize
+                || 1e-7 < dDiff || dDiff < -1e-7 )
+            {
+                LOGI( L"    ~ %s %s\n", itCurrent->first.c_str(), b.name.c_str() );
+                dwCountChanged += 1;
+            }
+            ++itPrevious;
+            ++itCurrent;
+        }
+    }
+
+    LOGI( L"    cache: objects=%u, added=%u, removed=%u, changed=%u, skipped folders=%u, reused objects=%u\n"
+        , (DWORD)pCache->current.size()
+        , dwCountAdded
+        , dwCountRemoved
+        , dwCountChanged
+        , pCache->dwCountSkipFolder
+        , pCache->dwCountSkipObject
+        );
+}
+
+// --diff=<before>;<after>: two saved scans of a device compared in one pass. cache files are written in
+// id order, so both are read a line at a time and merged; memory does not grow with the scans
+struct WpdCacheReader
+{
+    FILE*               fp;
+    std::wstring        path;
+    std::vector<WCHAR>  line;
+    std::wstring        puid;
+    WpdCacheRecord      record;
+    std::wstring        puidLast;
+    bool                valid;      // puid and record hold the next object
+    bool                failed;
+    DWORD               dwCountRecord;
+};
+
+void
+wpdCacheReader_Next(
+    WpdCacheReader* pReader
+)
+{
+    pReader->valid = false;
+    while ( false == pReader->failed && wpdFile_ReadLine( pReader->fp, &pReader->line ) )
+    {
+        pReader->puidLast.swap( pReader->puid );
+        if ( false == wpdScanCache_ParseRecord( &pReader->line[0], &pReader->puid, &pReader->record ) )
+        {
+            pReader->puid.swap( pReader->puidLast );
+            continue;
+        }
+        if ( 0 < pReader->dwCountRecord && pReader->puid.compare( pReader->puidLast ) <= 0 )
+        {
+            LOGE( L"! Failed. %s is not in id order at %s\n", pReader->path.c_str(), pReader->puid.c_str() );
+            pReader->failed = true;
+            break;
+        }
+        pReader->dwCountRecord += 1;
+        pReader->valid = true;
+        break;
+    }
+    if ( false == pReader->valid && false == pReader->failed && 0 != ::ferror( pReader->fp ) )
+    {
+        LOGE( L"! Failed. read %s\n", pReader->path.c_str() );
+        pReader->failed = true;
+    }
+}
+
+bool
+wpdCacheReader_Open(
+    WpdCacheReader* pReader
+    , LPCWSTR pszPath
+    , std::wstring* pSerial
+)
+{
+    pReader->fp = NULL;
+    pReader->path.assign( pszPath );
+    pReader->line.resize( 256 );
+    pReader->valid = false;
+    pReader->failed = false;
+    pReader->dwCountRecord = 0;
+
+    if ( 0 != ::_wfopen_s( &pReader->fp, pszPath, L"r, ccs=UTF-8" ) || NULL == pReader->fp )
+    {
+        LOGE( L"! Failed. open %s\n", pszPath );
+        pReader->fp = NULL;
+        return false;
+    }
+
+    DWORD dwVersion = 0;
+    if ( false == wpdFile_ReadLine( pReader->fp, &pReader->line )
+        || 0 != ::wcsncmp( &pReader->line[0], WPD_SCAN_CACHE_MAGIC L" ", ::wcslen(WPD_SCAN_CACHE_MAGIC L" ") )
+        || 1 != ::swscanf( &pReader->line[::wcslen(WPD_SCAN_CACHE_MAGIC L" ")], L"%u", &dwVersion )
+        || WPD_SCAN_CACHE_VERSION != dwVersion
+        || false == wpdFile_ReadLine( pReader->fp, &pReader->line ) )
+    {
+        LOGE( L"! Failed. invalid cache %s\n", pszPath );
+        ::fclose( pReader->fp );
+        pReader->fp = NULL;
+        return false;
+    }
+    pSerial->assign( &pReader->line[0] );
+    while ( !pSerial->empty() && (L'\n' == (*pSerial)[pSerial->size() - 1] || L'\r' == (*pSerial)[pSerial->size() - 1]) )
+    {
+        pSerial->erase( pSerial->size() - 1 );
+    }
+
+    wpdCacheReader_Next( pReader );
+    return false == pReader->failed;
+}
+
+void
+wpdCacheReader_Close(
+    WpdCacheReader* pReader
+)
+{
+    if ( NULL != pReader->fp )
+    {
+        ::fclose( pReader->fp );
+        pReader->fp = NULL;
+    }
+}
+
+struct WpdDiffCounts
+{
+    DWORD   dwCountAdded;
+    DWORD   dwCountRemoved;
+    DWORD   dwCountMoved;
+    DWORD   dwCountRenamed;
+    DWORD   dwCountModified;
+    DWORD   dwCountUnchanged;
+};
+
+// an object can be moved, renamed and modified at once and is counted for each.
+// folders are not modified by what happens to their children, those are reported themselves
+bool
+wpdDiff_Run(
+    LPCWSTR pszBefore
+    , LPCWSTR pszAfter
+    , const bool print
+    , WpdDiffCounts* pCounts
+)
+{
+    ::memset( pCounts, 0, sizeof(*pCounts) );
+
+    WpdCacheReader before;
+    WpdCacheReader after;
+    std::wstring serialBefore;
+    std::wstring serialAfter;
+    const bool opened = wpdCacheReader_Open( &before, pszBefore, &serialBefore );
+    if ( false == opened || false == wpdCacheReader_Open( &after, pszAfter, &serialAfter ) )
+    {
+        wpdCacheReader_Close( &before );
+        return false;
+    }
+    if ( serialBefore != serialAfter )
+    {
+        LOGI( L"    diff: scans of different devices, %s and %s\n", serialBefore.c_str(), serialAfter.c_str() );
+    }
+
+    while ( before.valid || after.valid )
+    {
+        const int compare = (false == before.valid)?(1):((false == after.valid)?(-1):(before.puid.compare( after.puid )));
+        if ( compare < 0 )
+        {
+            if ( print )
+            {
+                LOGI( L"    - %s %s\n", before.puid.c_str(), before.record.name.c_str() );
+            }
+            pCounts->dwCountRemoved += 1;
+            wpdCacheReader_Next( &before );
+            continue;
+        }
+        if ( 0 < compare )
+        {
+            if ( print )
+            {
+                LOGI( L"    + %s %s\n", after.puid.c_str(), after.record.name.c_str() );
+            }
+            pCounts->dwCountAdded += 1;
+            wpdCacheReader_Next( &after );
+            continue;
+        }
+
+        const WpdCacheRecord& a = before.record;
+        const WpdCacheRecord& b = after.record;
+        bool changed = false;
+        if ( a.parent != b.parent )
+        {
+            if ( print )
+            {
+                LOGI( L"    > %s %s, %s -> %s\n", after.puid.c_str(), b.name.c_str(), a.parent.c_str(), b.parent.c_str() );
+            }
+            pCounts->dwCountMoved += 1;
+            changed = true;
+        }
+        if ( a.name != b.name )
+        {
+            if ( print )
+            {
+                LOGI( L"    r %s %s -> %s\n", after.puid.c_str(), a.name.c_str(), b.name.c_str() );
+            }
+            pCounts->dwCountRenamed += 1;
+            changed = true;
+        }
+        const double dDiff = a.dModified - b.dModified;
+        if ( false == b.isFolder && (a.qwSize != b.qwSize || 1e-7 < dDiff || dDiff < -1e-7) )
+        {
+            if ( print )
+            {
+                LOGI( L"    ~ %s %s, %I64u -> %I64u bytes\n", after.puid.c_str(), b.name.c_str(), a.qwSize, b.qwSize );
+            }
+            pCounts->dwCountModified += 1;
+            changed = true;
+        }
+        if ( false == changed )
+        {
+            pCounts->dwCountUnchanged += 1;
+        }
+        wpdCacheReader_Next( &before );
+        wpdCacheReader_Next( &after );
+    }
+
+    const bool result = (false == before.failed && false == after.failed);
+    wpdCacheReader_Close( &before );
+    wpdCacheReader_Close( &after );
+    return result;
+}
+
+// --diff= takes both files separated by ';'
+bool
+wpdDiff_Command(
+    LPCWSTR pszFiles
+)
+{
+    const std::wstring files( pszFiles );
+    const size_t pos = files.find( L';' );
+    if ( std::wstring::npos == pos )
+    {
+        LOGE( L"! Failed. --diff=<before>;<after>, got %s\n", pszFiles );
+        return false;
+    }
+    const std::wstring pathBefore( files, 0, pos );
+    const std::wstring pathAfter( files, pos + 1, std::wstring::npos );
+
+    LOGI( L"Diff       : %s -> %s\n", pathBefore.c_str(), pathAfter.c_str() );
+    WpdDiffCounts counts;
+    const ULONGLONG qwTicksStart = wpdTicksNow();
+    const bool result = wpdDiff_Run( pathBefore.c_str(), pathAfter.c_str(), true, &counts );
+    LOGI( L"    diff: %s, added=%u, removed=%u, moved=%u, renamed=%u, modified=%u, unchanged=%u, %.3f sec\n"
+        , (result)?(L"ok"):(L"failed")
+        , counts.dwCountAdded
+        , counts.dwCountRemoved
+        , counts.dwCountMoved
+        , counts.dwCountRenamed
+        , counts.dwCountModified
+        , counts.dwCountUnchanged
+        , wpdTicksToMicroseconds( wpdTicksNow() - qwTicksStart ) / 1000000.0
+        );
+    return result;
+}
+
+// --diff-bench=<objects>: two synthetic scans in the temp directory, 1% of the objects changed, then diffed
+void
+wpdDiff_Bench(
+    const DWORD dwCountObject
+)
+{
+    WCHAR szTemp[MAX_PATH];
+    const DWORD cchTemp = ::GetTempPathW( _countof(szTemp), szTemp );
+    if ( 0 == cchTemp || _countof(szTemp) <= cchTemp )
+    {
+        LOGE( L"! Failed. GetTempPath, error=%u\n", ::GetLastError() );
+        return;
+    }
+    const std::wstring pathBefore( std::wstring( szTemp ) + L"wpddiff_before.wpdcache" );
+    const std::wstring pathAfter( std::wstring( szTemp ) + L"wpddiff_after.wpdcache" );
+
+    FILE* fpBefore = NULL;
+    FILE* fpAfter = NULL;
+    if ( 0 != ::_wfopen_s( &fpBefore, pathBefore.c_str(), L"w, ccs=UTF-8" ) || NULL == fpBefore
+        || 0 != ::_wfopen_s( &fpAfter, pathAfter.c_str(), L"w, ccs=UTF-8" ) || NULL == fpAfter )
+    {
+        LOGE( L"! Failed. open %s\n", (NULL == fpBefore)?(pathBefore.c_str()):(pathAfter.c_str()) );
+        if ( NULL != fpBefore )
+        {
+            ::fclose( fpBefore );
+        }
+        return;
+    }
+    ::fwprintf( fpBefore, L"%s %u\n%s\n", WPD_SCAN_CACHE_MAGIC, WPD_SCAN_CACHE_VERSION, L"BENCH" );
+    ::fwprintf( fpAfter, L"%s %u\n%s\n", WPD_SCAN_CACHE_MAGIC, WPD_SCAN_CACHE_VERSION, L"BENCH" );
+
+    // ids sort as they are generated; added objects take the odd ids between the others
+    const ULONGLONG qwTicksStart = wpdTicksNow();
+    WpdDiffCounts expected;
+    ::memset( &expected, 0, sizeof(expected) );
+    DWORD x = 0x12345678U;
+    WCHAR szPuid[64];
+    WCHAR szParent[64];
+    WCHAR szName[64];
+    std::wstring puid;
+    std::wstring scratch;
+    WpdCacheRecord record;
+    for ( DWORD index = 0; index < dwCountObject; ++index )
+    {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        const DWORD dwDice = x % 10000U;
+        const DWORD dwRandom = x / 10000U;
+
+        ::_snwprintf_s( szPuid, _countof(szPuid), _TRUNCATE, L"{%08X-0000-4000-8000-000000000000}", index * 2 );
+        ::_snwprintf_s( szParent, _countof(szParent), _TRUNCATE, L"{%08X-0000-4000-8000-000000000000}", (index / 100) * 100 * 2 );
+        puid.assign( szPuid );
+        record.isFolder = (0 == index % 100);
+        record.parent.assign( (record.isFolder)?(L"DEVICE"):(szParent) );
+        if ( record.isFolder )
+        {
+            ::_snwprintf_s( szName, _countof(szName), _TRUNCATE, L"%03uCANON", (index / 100) % 1000 );
+        }
+        else
+        {
+            ::_snwprintf_s( szName, _countof(szName), _TRUNCATE, L"IMG_%06u.JPG", index );
+        }
+        record.name.assign( szName );
+        record.qwSize = (record.isFolder)?(0):(100000U + dwRandom % 5000000U);
+        record.dModified = 42005.0 + (index % 1825U) + (dwRandom % 86400U) / 86400.0;
+        record.dwCountChild = (record.isFolder)?(99):(0);
+        wpdScanCache_WriteRecord( fpBefore, puid, record, &scratch );
+
+        // 0.25% each removed, moved, renamed and modified, 0.25% added after
+        if ( dwDice < 25 )
+        {
+            expected.dwCountRemoved += 1;
+        }
+        else
+        {
+            if ( dwDice < 50 && false == record.isFolder && 100 < dwCountObject )
+            {
+                ::_snwprintf_s( szParent, _countof(szParent), _TRUNCATE, L"{%08X-0000-4000-8000-000000000000}", ((dwRandom % dwCountObject) / 100) * 100 * 2 );
+                expected.dwCountMoved += (record.parent != szParent)?(1):(0);
+                record.parent.assign( szParent );
+            }
+            else
+            if ( dwDice < 75 )
+            {
+                record.name.append( L"~edited" );
+                expected.dwCountRenamed += 1;
+            }
+            else
+            if ( dwDice < 100 && false == record.isFolder )
+            {
+                record.qwSize += 1 + dwRandom % 1000U;
+                record.dModified += 1.0;
+                expected.dwCountModified += 1;
+            }
+            wpdScanCache_WriteRecord( fpAfter, puid, record, &scratch );
+        }
+
+        if ( dwRandom % 10000U < 25 )
+        {
+            ::_snwprintf_s( szPuid, _countof(szPuid), _TRUNCATE, L"{%08X-0000-4000-8000-000000000000}", index * 2 + 1 );
+            puid.assign( szPuid );
+            record.name.assign( L"IMG_added.JPG" );
+            record.isFolder = false;
+            record.dwCountChild = 0;
+            wpdScanCache_WriteRecord( fpAfter, puid, record, &scratch );
+            expected.dwCountAdded += 1;
+        }
+    }
+    const bool written = (0 == ::ferror( fpBefore ) && 0 == ::ferror( fpAfter ));
+    ::fclose( fpBefore );
+    fpBefore = NULL;
+    ::fclose( fpAfter );
+    fpAfter = NULL;
+    const double dSecondsWrite = wpdTicksToMicroseconds( wpdTicksNow() - qwTicksStart ) / 1000000.0;
+
+    if ( written )
+    {
+        WpdDiffCounts counts;
+        const ULONGLONG qwTicksDiff = wpdTicksNow();
+        const bool result = wpdDiff_Run( pathBefore.c_str(), pathAfter.c_str(), false, &counts );
+        const double dSeconds = wpdTicksToMicroseconds( wpdTicksNow() - qwTicksDiff ) / 1000000.0;
+        const bool match = (expected.dwCountAdded == counts.dwCountAdded
+            && expected.dwCountRemoved == counts.dwCountRemoved
+            && expected.dwCountMoved == counts.dwCountMoved
+            && expected.dwCountRenamed == counts.dwCountRenamed
+            && expected.dwCountModified == counts.dwCountModified);
+
+        ULONGLONG qwPeakWorkingSet = 0;
+        PROCESS_MEMORY_COUNTERS memoryCounters;
+        ::memset( &memoryCounters, 0, sizeof(memoryCounters) );
+        memoryCounters.cb = sizeof(memoryCounters);
+        if ( ::GetProcessMemoryInfo( ::GetCurrentProcess(), &memoryCounters, sizeof(memoryCounters) ) )
+        {
+            qwPeakWorkingSet = memoryCounters.PeakWorkingSetSize;
+        }
+
+        LOGI( L"Diff bench : objects=%u, written in %.3f sec\n", dwCountObject, dSecondsWrite );
+        LOGI( L"    diff: %s, added=%u, removed=%u, moved=%u, renamed=%u, modified=%u, unchanged=%u, expected %s\n"
+            , (result)?(L"ok"):(L"failed")
+            , counts.dwCountAdded
+            , counts.dwCountRemoved
+            , counts.dwCountMoved
+            , counts.dwCountRenamed
+            , counts.dwCountModified
+            , counts.dwCountUnchanged
+            , (match)?(L"matched"):(L"NOT matched")
+            );
+        LOGI( L"    diff: %.3f sec, %.0f objects/sec, peak working set=%I64u\n"
+            , dSeconds
+            , (0.0 < dSeconds)?((double)(dwCountObject * 2U) / dSeconds):(0.0)
+            , qwPeakWorkingSet
+            );
+    }
+    else
+    {
+        LOGE( L"! Failed. write %s\n", pathBefore.c_str() );
+    }
+
+    ::DeleteFileW( pathBefore.c_str() );
+    ::DeleteFileW( pathAfter.c_str() );
+}
+
+// parent and children of one object seen by the watch mode
+struct WpdWatchNode
+{
+    std::wstring            parent;
+    std::set<std::wstring>  children;
+};
+
+struct WpdWatchTree
+{
+    std::map<std::wstring, WpdWatchNode>    nodes;
+
+    DWORD   dwCountEvent;
+    DWORD   dwCountRescan;
+    DWORD   dwCountAdded;
+    DWORD   dwCountRemoved;
+    DWORD   dwCountUpdated;
+};
+
+void
+wpdWatchTree_Insert(
+    WpdWatchTree* pTree
+    , LPCWSTR pszParentObjectId
+    , LPCWSTR pszObjectId
+)
+{
+    if ( NULL == pTree || NULL == pszObjectId )
+    {
+        return;
+    }
+
+    WpdWatchNode& node = pTree->nodes[pszObjectId];
+    if ( NULL != pszParentObjectId )
+    {
+        node.parent.assign( pszParentObjectId );
+        pTree->nodes[pszParentObjectId].children.insert( pszObjectId );
+    }
+}
+
+// drop an object and everything below it; returns the count of objects dropped
+DWORD
+wpdWatchTree_Erase(
+    WpdWatchTree* pTree
+    , const std::wstring& objectId
+)
+{
+    std::map<std::wstring, WpdWatchNode>::iterator it = pTree->nodes.find( objectId );
+    if ( pTree->nodes.end() == it )
+    {
+        return 0;
+    }
+
+    std::map<std::wstring, WpdWatchNode>::iterator itParent = pTree->nodes.find( it->second.parent );
+    if ( pTree->nodes.end() != itParent )
+    {
+        itParent->second.children.erase( objectId );
+    }
+
+    DWORD dwCount = 0;
+    std::vector<std::wstring> pending;
+    pending.push_back( objectId );
+    while ( !pending.empty() )
+    {
+        const std::wstring id( pending.back() );
+        pending.pop_back();
+
+        std::map<std::wstring, WpdWatchNode>::iterator itNode = pTree->nodes.find( id );
+        if ( pTree->nodes.end() == itNode )
+        {
+            continue;
+        }
+        pending.insert( pending.end(), itNode->second.children.begin(), itNode->second.children.end() );
+        pTree->nodes.erase( itNode );
+        dwCount += 1;
+    }
+    return dwCount;
+}
+
+void
+wpdTreeStore_OnChild(
+    WpdTreeStore* pStore
+    , LPCWSTR pszParentObjectId
+    , LPCWSTR pszObjectId
+)
+{
+    if ( NULL == pStore )
+    {
+        return;
+    }
+
+    // parallel walkers share the store of the device
+    ::EnterCriticalSection( &pStore->cs );
+    UINT32 dwParent = wpdTreeStore_Find( pStore, pszParentObjectId );
+    if ( WPD_HANDLE_NONE == dwParent )
+    {
+        dwParent = wpdTreeStore_Add( pStore, WPD_HANDLE_NONE, pszParentObjectId );
+    }
+    wpdTreeStore_Add( pStore, dwParent, pszObjectId );
+    ::LeaveCriticalSection( &pStore->cs );
+}
+
+void
+wpdTreeStore_OnValues(
+    WpdEnumContext* pContext
+    , LPCWSTR pszObjectId
+    , IPortableDeviceValues* pAttributes
+)
+{
+    WpdTreeStore* pStore = pContext->pTreeStore;
+    if ( NULL == pStore || NULL == pAttributes )
+    {
+        return;
+    }
+
+    LPWSTR pszObjectIdValue = NULL;
+    if ( NULL == pszObjectId )
+    {
+        if ( FAILED(pAttributes->GetStringValue( WPD_OBJECT_ID, &pszObjectIdValue )) )
+        {
+            return;
+        }
+        pszObjectId = pszObjectIdValue;
+    }
+
+    LPWSTR pszName = NULL;
+    if ( FAILED(pAttributes->GetStringValue( WPD_OBJECT_NAME, &pszName )) )
+    {
+        pszName = NULL;
+    }
+    ULONGLONG qwSize = 0;
+    const bool hasSize = SUCCEEDED(pAttributes->GetUnsignedLargeIntegerValue( WPD_OBJECT_SIZE, &qwSize ));
+    GUID guidContentType;
+    ::memset( &guidContentType, 0, sizeof(guidContentType) );
+    const bool hasContentType = SUCCEEDED(pAttributes->GetGuidValue( WPD_OBJECT_CONTENT_TYPE, &guidContentType ));
+    LPWSTR pszPuid = NULL;
+    if ( false == pStore->keepPuid || FAILED(pAttributes->GetStringValue( WPD_OBJECT_PERSISTENT_UNIQUE_ID, &pszPuid )) )
+    {
+        pszPuid = NULL;
+    }
+
+    if ( NULL != pszName || hasSize || hasContentType || NULL != pszPuid )
+    {
+        ::EnterCriticalSection( &pStore->cs );
+        UINT32 dwNode = wpdTreeStore_Find( pStore, pszObjectId );
+        if ( WPD_HANDLE_NONE == dwNode )
+        {
+            dwNode = wpdTreeStore_Add( pStore, WPD_HANDLE_NONE, pszObjectId );
+        }
+        if ( WPD_HANDLE_NONE != dwNode )
+        {
+            if ( NULL != pszName )
+            {
+                wpdTreeStore_SetName( pStore, dwNode, pszName );
+            }
+            if ( hasSize )
+            {
+                pStore->size[dwNode] = qwSize;
+            }
+            if ( hasContentType )
+            {
+                pStore->folder[dwNode] = (wpdIsFolderContentType( guidContentType ))?(1):(0);
+            }
+            if ( NULL != pszPuid )
+            {
+                pStore->puid[dwNode] = wpdArena_Intern( &pStore->strings, pszPuid, ::wcslen( pszPuid ), true );
+            }
+        }
+        ::LeaveCriticalSection( &pStore->cs );
+    }
+    if ( NULL != pszPuid )
+    {
+        ::CoTaskMemFree( pszPuid );
+        pszPuid = NULL;
+    }
+    if ( NULL != pszName )
+    {
+        ::CoTaskMemFree( pszName );
+        pszName = NULL;
+    }
+    if ( NULL != pszObjectIdValue )
+    {
+        ::CoTaskMemFree( pszObjectIdValue );
+        pszObjectIdValue = NULL;
+    }
+}
+
+// one object of a bulk result. pPending holds the ids still waiting for values;
+// an object not in it was not asked for or was answered already and is ignored
+bool
+wpdEnumContent_BulkOnValues(
+    IPortableDeviceValues* pAttributes
+    , WpdEnumContext* pContext
+    , const bool countObject
+    , IPortableDevicePropVariantCollection* pFileObjectIdArray
+    , std::set<std::wstring>* pPending
+)
+{
+    LPWSTR pszObjectId = NULL;
+    if ( FAILED(pAttributes->GetStringValue( WPD_OBJECT_ID, &pszObjectId )) || NULL == pszObjectId )
+    {
+        LOGE( L"! Failed. bulk result without WPD_OBJECT_ID\n" );
+        return false;
+    }
+    if ( NULL != pPending && 0 == pPending->erase( pszObjectId ) )
+    {
+        LOGV( L"bulk result for %s ignored, not pending\n", pszObjectId );
+        ::CoTaskMemFree( pszObjectId );
+        pszObjectId = NULL;
+        return false;
+    }
+
+    bool accepted = true;
+    bool pruned = false;
+    if ( countObject && pContext->useFilter )
+    {
+        bool isFolderFilter = false;
+        accepted = wpdFilter_Accept( pContext, pAttributes, &isFolderFilter, &pruned );
+        if ( pruned )
+        {
+            wpdFilter_Prune( pContext, pAttributes );
+        }
+    }
+    if ( accepted )
+    {
+        dispDeviceValues( pAttributes );
+    }
+    if ( countObject )
+    {
+        pContext->dwCountObjectValues += 1;
+    }
+
+    const bool isFolder = wpdEnumContent_AccountValues( pAttributes, pContext, countObject );
+    wpdScanCache_OnValues( pContext, NULL, pAttributes );
+    wpdTreeStore_OnValues( pContext, NULL, pAttributes );
+    if ( NULL != pContext->pOutputPending && accepted )
+    {
+        if ( false == countObject )
+        {
+            wpdOutput_Complete( pContext, pAttributes );
+        }
+        else
+        if ( false == isFolder && NULL != pFileObjectIdArray )
+        {
+            wpdOutput_Defer( pContext, pAttributes );
+        }
+        else
+        {
+            wpdOutput_Emit( pContext, NULL, pAttributes, NULL );
+        }
+    }
+    if ( false == isFolder && false == pruned && NULL != pFileObjectIdArray )
+    {
+        // second pass fetches the file only keys
+        PROPVARIANT pv;
+        ::PropVariantInit( &pv );
+        pv.vt = VT_LPWSTR;
+        pv.pwszVal = pszObjectId;
+        pFileObjectIdArray->Add( &pv );
+    }
+
+    ::CoTaskMemFree( pszObjectId );
+    pszObjectId = NULL;
+    return true;
+}
+
+class WpdPropertiesBulkCallback : public IPortableDevicePropertiesBulkCallback
+{
+public:
+    WpdPropertiesBulkCallback(
+        WpdEnumContext* pContext
+        , const bool countObject
+        , IPortableDevicePropVariantCollection* pFileObjectIdArray
+        , std::set<std::wstring>* pPending
+    )
+        : m_cRef(1)
+        , m_hEventEnd(NULL)
+        , m_hrStatus(S_OK)
+        , m_dwCountValues(0)
+        , m_pContext(pContext)
+        , m_countObject(countObject)
+        , m_pFileObjectIdArray(pFileObjectIdArray)
+        , m_pPending(pPending)
+    {
+        m_hEventEnd = ::CreateEventW( NULL, FALSE, FALSE, NULL );
+    }
+
+    HRESULT STDMETHODCALLTYPE
+    QueryInterface( REFIID riid, void** ppv )
+    {
+        if ( NULL == ppv )
+        {
+            return E_POINTER;
+        }
+        *ppv = NULL;
+
+        if ( ::IsEqualIID( riid, IID_IUnknown )
+            || ::IsEqualIID( riid, IID_IPortableDevicePropertiesBulkCallback ) )
+        {
+            *ppv = static_cast<IPortableDevicePropertiesBulkCallback*>(this);
+            this->AddRef();
+            return S_OK;
+        }
+
+        return E_NOINTERFACE;
+    }
+
+    ULONG STDMETHODCALLTYPE
+    AddRef( void )
+    {
+        return ::InterlockedIncrement( &m_cRef );
+    }
+
+    ULONG STDMETHODCALLTYPE
+    Release( void )
+    {
+        const LONG cRef = ::InterlockedDecrement( &m_cRef );
+        if ( 0 == cRef )
+        {
+            delete this;
+        }
+        return cRef;
+    }
+
+    HRESULT STDMETHODCALLTYPE
+    OnStart( REFGUID /*Context*/ )
+    {
+        return S_OK;
+    }
+
+    HRESULT STDMETHODCALLTYPE
+    OnProgress( REFGUID /*Context*/, IPortableDeviceValuesCollection* pResults )
+    {
+        if ( NULL == pResults )
+        {
+            return S_OK;
+        }
+
+        DWORD dwCount = 0;
+        {
+            const HRESULT hr = pResults->GetCount( &dwCount );
+            if ( FAILED(hr) )
+            {
+                LOGE( L"! Failed. IPortableDeviceValuesCollection GetCount, hr=0x%08x\n", hr );
+                return S_OK;
+            }
+        }
+
+        for ( DWORD dwIndex = 0; dwIndex < dwCount; ++dwIndex )
+        {
+            IPortableDeviceValues* pAttributes = NULL;
+            const HRESULT hr = pResults->GetAt( dwIndex, &pAttributes );
+            if ( FAILED(hr) )
+            {
+                LOGE( L"! Failed. IPortableDeviceValuesCollection GetAt, hr=0x%08x\n", hr );
+                continue;
+            }
+
+            if ( wpdEnumContent_BulkOnValues( pAttributes, m_pContext, m_countObject, m_pFileObjectIdArray, m_pPending ) )
+            {
+                m_dwCountValues += 1;
+            }
+
+            if ( NULL != pAttributes )
+            {
+                pAttributes->Release();
+                pAttributes = NULL;
+            }
+        }
+
+        return S_OK;
+    }
+
+    HRESULT STDMETHODCALLTYPE
+    OnEnd( REFGUID /*Context*/, HRESULT hrStatus )
+    {
+        m_hrStatus = hrStatus;
+        if ( NULL != m_hEventEnd )
+        {
+            ::SetEvent( m_hEventEnd );
+        }
+        return S_OK;
+    }
+
+    HRESULT
+    waitEnd( void )
+    {
+        if ( NULL == m_hEventEnd )
+        {
+            return E_FAIL;
+        }
+        ::WaitForSingleObject( m_hEventEnd, INFINITE );
+        return m_hrStatus;
+    }
+
+    DWORD
+    getCountValues( void ) const
+    {
+        return m_dwCountValues;
+    }
+
+private:
+    ~WpdPropertiesBulkCallback()
+    {
+        if ( NULL != m_hEventEnd )
+        {
+            ::CloseHandle( m_hEventEnd );
+            m_hEventEnd = NULL;
+        }
+    }
+
+    LONG    m_cRef;
+    HANDLE  m_hEventEnd;
+    HRESULT m_hrStatus;
+    DWORD   m_dwCountValues;
+
+    WpdEnumContext*                         m_pContext;
+    bool                                    m_countObject;
+    IPortableDevicePropVariantCollection*   m_pFileObjectIdArray;
+    std::set<std::wstring>*                 m_pPending;
+};
+
+IPortableDeviceKeyCollection*
+wpdCreatePropertyKeys(
+    LPCWSTR pszProps
+    , const bool forFolder
+)
+{
+    IPortableDeviceKeyCollection* pKeys = NULL;
+    {
+        const HRESULT hr = ::CoCreateInstance(
+            CLSID_PortableDeviceKeyCollection
+            , NULL
+            , CLSCTX_INPROC_SERVER
+            , IID_PPV_ARGS(&pKeys)
+            );
+        if ( FAILED(hr) )
+        {
+            LOGE( L"! Failed. CoCreateInstance CLSID_PortableDeviceKeyCollection, hr=0x%08x\n", hr );
+            return NULL;
+        }
+    }
+
+    if ( 0 == ::_wcsicmp( pszProps, L"minimal" ) )
+    {
+        pszProps = s_szPropsMinimal;
+    }
+
+    for ( size_t index = 0; index < sizeof(s_propertyKeyNames)/sizeof(s_propertyKeyNames[0]); ++index )
+    {
+        const WpdPropertyKeyName& entry = s_propertyKeyNames[index];
+        if ( forFolder && false == entry.forFolder )
+        {
+            continue;
+        }
+
+        const size_t len = ::wcslen( entry.pszName );
+        bool selected = false;
+        for ( LPCWSTR p = pszProps; L'\0' != *p; )
+        {
+            LPCWSTR pEnd = ::wcschr( p, L',' );
+            const size_t lenToken = (NULL != pEnd)?((size_t)(pEnd - p)):(::wcslen(p));
+            if ( lenToken == len && 0 == ::_wcsnicmp( p, entry.pszName, len ) )
+            {
+                selected = true;
+                break;
+            }
+            p += lenToken;
+            if ( L',' == *p )
+            {
+                ++p;
+            }
+        }
+
+        // folders always need the content type to be told apart from files
+        if ( forFolder && &WPD_OBJECT_CONTENT_TYPE == entry.pKey )
+        {
+            selected = true;
+        }
+
+        if ( selected )
+        {
+            const HRESULT hr = pKeys->Add( *entry.pKey );
+            if ( FAILED(hr) )
+            {
+                LOGE( L"! Failed. IPortableDeviceKeyCollection Add %s, hr=0x%08x\n", entry.pszName, hr );
+            }
+        }
+    }
+
+    return pKeys;
+}
+
+// keys of pKeysFile which are not in pKeysFolder
+IPortableDeviceKeyCollection*
+wpdCreatePropertyKeysDifference(
+    IPortableDeviceKeyCollection* pKeysFile
+    , IPortableDeviceKeyCollection* pKeysFolder
+)
+{
+    if ( NULL == pKeysFile || NULL == pKeysFolder )
+    {
+        return NULL;
+    }
+
+    IPortableDeviceKeyCollection* pKeys = NULL;
+    {
+        const HRESULT hr = ::CoCreateInstance(
+            CLSID_PortableDeviceKeyCollection
+            , NULL
+            , CLSCTX_INPROC_SERVER
+            , IID_PPV_ARGS(&pKeys)
+            );
+        if ( FAILED(hr) )
+        {
+            LOGE( L"! Failed. CoCreateInstance CLSID_PortableDeviceKeyCollection, hr=0x%08x\n", hr );
+            return NULL;
+        }
+    }
+
+    DWORD dwCountFile = 0;
+    DWORD dwCountFolder = 0;
+    pKeysFile->GetCount( &dwCountFile );
+    pKeysFolder->GetCount( &dwCountFolder );
+    for ( DWORD i = 0; i < dwCountFile; ++i )
+    {
+        PROPERTYKEY keyFile;
+        if ( FAILED(pKeysFile->GetAt( i, &keyFile )) )
+        {
+            continue;
+        }
+
+        bool found = false;
+        for ( DWORD j = 0; j < dwCountFolder; ++j )
+        {
+            PROPERTYKEY keyFolder;
+            if ( SUCCEEDED(pKeysFolder->GetAt( j, &keyFolder ))
+                && IsEqualPropertyKey( keyFile, keyFolder ) )
+            {
+                found = true;
+                break;
+            }
+        }
+        if ( false == found )
+        {
+            pKeys->Add( keyFile );
+        }
+    }
+
+    DWORD dwCount = 0;
+    pKeys->GetCount( &dwCount );
+    if ( 0 == dwCount )
+    {
+        pKeys->Release();
+        pKeys = NULL;
+    }
+
+    return pKeys;
+}
+
+bool
+wpdEnumContent_GetValues(
+    LPCWSTR pszObjectId
+    , IPortableDeviceKeyCollection* pKeys
+    , WpdEnumContext* pContext
+)
+{
+    if ( NULL == pContext || NULL == pContext->pPortableDeviceProperties )
+    {
+        return false;
+    }
+
+    IPortableDeviceValues* pAttributes = NULL;
+    {
+        const ULONGLONG qwTicksCall = wpdStats_Begin( pContext->pStats );
+        const HRESULT hr = pContext->pPortableDeviceProperties->GetValues(
+            pszObjectId
+            , pKeys
+            , &pAttributes
+            );
+        wpdStats_End( pContext->pStats, WPD_STAT_OP_GET_VALUES, qwTicksCall, hr, 1 );
+        pContext->dwCountGetValues += 1;
+        if ( FAILED(hr) )
+        {
+            LOGE( L"! Failed. pPortableDeviceProperties GetValues, hr=0x%08x\n", hr );
+            return false;
+        }
+    }
+
+    dispDeviceValues( pAttributes );
+    pContext->dwCountObjectValues += 1;
+    const ULONGLONG qwBytesFetched = pContext->qwBytesFetched;
+    wpdEnumContent_AccountValues( pAttributes, pContext, (NULL != pKeys) );
+    wpdStats_AddBytes( pContext->pStats, WPD_STAT_OP_GET_VALUES, pContext->qwBytesFetched - qwBytesFetched );
+    wpdScanCache_OnValues( pContext, pszObjectId, pAttributes );
+    wpdTreeStore_OnValues( pContext, pszObjectId, pAttributes );
+    wpdOutput_Emit( pContext, pszObjectId, pAttributes, NULL );
+
+    if ( NULL != pAttributes )
+    {
+        const DWORD dwCount = pAttributes->Release();
+        LOGV( L"pAttributes::Release, count=%u\n", dwCount );
+        pAttributes = NULL;
+    }
+
+    return true;
+}
+
+// first pass with the folder keys for the filter, the rest only for the files it accepts
+bool
+wpdEnumContent_GetValuesFiltered(
+    LPCWSTR pszObjectId
+    , WpdEnumContext* pContext
+    , bool* pPruned
+)
+{
+    *pPruned = false;
+
+    IPortableDeviceValues* pAttributes = NULL;
+    {
+        const ULONGLONG qwTicksCall = wpdStats_Begin( pContext->pStats );
+        const HRESULT hr = pContext->pPortableDeviceProperties->GetValues(
+            pszObjectId
+            , pContext->pKeysFolder
+            , &pAttributes
+            );
+        wpdStats_End( pContext->pStats, WPD_STAT_OP_GET_VALUES, qwTicksCall, hr, 1 );
+        pContext->dwCountGetValues += 1;
+        if ( FAILED(hr) )
+        {
+            LOGE( L"! Failed. pPortableDeviceProperties GetValues, hr=0x%08x\n", hr );
+            return false;
+        }
+    }
+
+    bool isFolder = false;
+    const bool accepted = wpdFilter_Accept( pContext, pAttributes, &isFolder, pPruned );
+    if ( accepted )
+    {
+        dispDeviceValues( pAttributes );
+    }
+    pContext->dwCountObjectValues += 1;
+    const ULONGLONG qwBytesFetched = pContext->qwBytesFetched;
+    wpdEnumContent_AccountValues( pAttributes, pContext, true );
+    wpdStats_AddBytes( pContext->pStats, WPD_STAT_OP_GET_VALUES, pContext->qwBytesFetched - qwBytesFetched );
+    wpdScanCache_OnValues( pContext, pszObjectId, pAttributes );
+    wpdTreeStore_OnValues( pContext, pszObjectId, pAttributes );
+
+    bool result = true;
+    if ( accepted && isFolder )
+    {
+        wpdOutput_Emit( pContext, pszObjectId, pAttributes, NULL );
+    }
+    else
+    if ( accepted )
+    {
+        IPortableDeviceValues* pAttributesFile = NULL;
+        {
+            const ULONGLONG qwTicksCall = wpdStats_Begin( pContext->pStats );
+            const HRESULT hr = pContext->pPortableDeviceProperties->GetValues(
+                pszObjectId
+                , pContext->pKeysFileOnly
+                , &pAttributesFile
+                );
+            wpdStats_End( pContext->pStats, WPD_STAT_OP_GET_VALUES, qwTicksCall, hr, 0 );
+            pContext->dwCountGetValues += 1;
+            if ( FAILED(hr) )
+            {
+                LOGE( L"! Failed. pPortableDeviceProperties GetValues, hr=0x%08x\n", hr );
+                pAttributesFile = NULL;
+                result = false;
+            }
+        }
+
+        if ( NULL != pAttributesFile )
+        {
+            dispDeviceValues( pAttributesFile );
+            const ULONGLONG qwBytesFetchedFile = pContext->qwBytesFetched;
+            wpdEnumContent_AccountValues( pAttributesFile, pContext, false );
+            wpdStats_AddBytes( pContext->pStats, WPD_STAT_OP_GET_VALUES, pContext->qwBytesFetched - qwBytesFetchedFile );
+            wpdScanCache_OnValues( pContext, pszObjectId, pAttributesFile );
+            wpdTreeStore_OnValues( pContext, pszObjectId, pAttributesFile );
+            wpdOutput_Emit( pContext, pszObjectId, pAttributes, pAttributesFile );
+
+            const DWORD dwCount = pAttributesFile->Release();
+            LOGV( L"pAttributes::Release, count=%u\n", dwCount );
+            pAttributesFile = NULL;
+        }
+    }
+
+    if ( NULL != pAttributes )
+    {
+        const DWORD dwCount = pAttributes->Release();
+        LOGV( L"pAttributes::Release, count=%u\n", dwCount );
+        pAttributes = NULL;
+    }
+
+    return result;
+}
+
+// queue one bulk request for pBatch and wait until it completes; the ids answered leave pPending
+bool
+wpdEnumContent_BulkQueue(
+    IPortableDevicePropVariantCollection* pBatch
+    , const DWORD dwCount
+    , IPortableDeviceKeyCollection* pKeys
+    , const bool countObject
+    , IPortableDevicePropVariantCollection* pFileObjectIdArray
+    , std::set<std::wstring>* pPending
+    , WpdEnumContext* pContext
+)
+{
+    bool result = true;
+
+    WpdPropertiesBulkCallback* pCallback = new WpdPropertiesBulkCallback( pContext, countObject, pFileObjectIdArray, pPending );
+
+    const ULONGLONG qwTicksCall = wpdStats_Begin( pContext->pStats );
+    const ULONGLONG qwBytesFetched = pContext->qwBytesFetched;
+    HRESULT hrStats = S_OK;
+
+    GUID guidContext;
+    bool queued = false;
+    if ( NULL != pCallback )
+    {
+        const HRESULT hr = pContext->pPortableDevicePropertiesBulk->QueueGetValuesByObjectList(
+            pBatch
+            , pKeys
+            , pCallback
+            , &guidContext
+            );
+        if ( FAILED(hr) )
+        {
+            LOGE( L"! Failed. IPortableDevicePropertiesBulk QueueGetValuesByObjectList, hr=0x%08x\n", hr );
+            hrStats = hr;
+            result = false;
+        }
+        else
+        {
+            queued = true;
+        }
+    }
+
+    if ( queued )
+    {
+        HRESULT hr = pContext->pPortableDevicePropertiesBulk->Start( guidContext );
+        if ( FAILED(hr) )
+        {
+            LOGE( L"! Failed. IPortableDevicePropertiesBulk Start, hr=0x%08x\n", hr );
+            hrStats = hr;
+            result = false;
+        }
+        else
+        {
+            hr = pCallback->waitEnd();
+            if ( FAILED(hr) )
+            {
+                LOGE( L"! Failed. IPortableDevicePropertiesBulk OnEnd, hr=0x%08x\n", hr );
+                hrStats = hr;
+                result = false;
+            }
+            else
+            if ( pCallback->getCountValues() < dwCount )
+            {
+                // the objects without a result stay in pPending
+                LOGV( L"bulk request returned %u of %u objects\n", pCallback->getCountValues(), dwCount );
+                result = false;
+            }
+        }
+
+        pContext->dwCountBulkRequest += 1;
+    }
+
+    wpdStats_End( pContext->pStats, WPD_STAT_OP_BULK, qwTicksCall, hrStats, (countObject)?(dwCount):(0) );
+    wpdStats_AddBytes( pContext->pStats, WPD_STAT_OP_BULK, pContext->qwBytesFetched - qwBytesFetched );
+
+    if ( NULL != pCallback )
+    {
+        pCallback->Release();
+        pCallback = NULL;
+    }
+
+    return result;
+}
+
+// file only keys of one file whose second bulk pass came back without it
+bool
+wpdEnumContent_BulkRefetch(
+    LPCWSTR pszObjectId
+    , std::set<std::wstring>* pPending
+    , WpdEnumContext* pContext
+)
+{
+    IPortableDeviceValues* pAttributes = NULL;
+    {
+        const ULONGLONG qwTicksCall = wpdStats_Begin( pContext->pStats );
+        const HRESULT hr = pContext->pPortableDeviceProperties->GetValues(
+            pszObjectId
+            , pContext->pKeysFileOnly
+            , &pAttributes
+            );
+        wpdStats_End( pContext->pStats, WPD_STAT_OP_GET_VALUES, qwTicksCall, hr, 0 );
+        pContext->dwCountGetValues += 1;
+        if ( FAILED(hr) )
+        {
+            LOGE( L"! Failed. pPortableDeviceProperties GetValues, hr=0x%08x\n", hr );
+            return false;
+        }
+    }
+
+    // the file only keys may not hold the id the pending set is keyed on
+    pAttributes->SetStringValue( WPD_OBJECT_ID, pszObjectId );
+
+    const ULONGLONG qwBytesFetched = pContext->qwBytesFetched;
+    const bool result = wpdEnumContent_BulkOnValues( pAttributes, pContext, false, NULL, pPending );
+    wpdStats_AddBytes( pContext->pStats, WPD_STAT_OP_GET_VALUES, pContext->qwBytesFetched - qwBytesFetched );
+
+    if ( NULL != pAttributes )
+    {
+        const DWORD dwCount = pAttributes->Release();
+        LOGV( L"pAttributes::Release, count=%u\n", dwCount );
+        pAttributes = NULL;
+    }
+
+    return result;
+}
+
+// fetch properties of pszObjectIdArray[0, dwCount) in bulk requests.
+// objects the first pass returns nothing for go to pBulkMissing for the walk to fetch on their own;
+// files the second pass misses get their file only keys here, so nothing is fetched twice
+bool
+wpdEnumContent_BulkGetValues(
+    LPWSTR* pszObjectIdArray
+    , const DWORD dwCount
+    , WpdEnumContext* pContext
+)
+{
+    if ( NULL == pszObjectIdArray || NULL == pContext || NULL == pContext->pPortableDevicePropertiesBulk )
+    {
+        return false;
+    }
+
+    std::set<std::wstring> pending;
+    for ( DWORD dwIndex = 0; dwIndex < dwCount; ++dwIndex )
+    {
+        pending.insert( pszObjectIdArray[dwIndex] );
+    }
+
+    IPortableDevicePropVariantCollection* pBatch = NULL;
+    bool result = true;
+    {
+        const HRESULT hr = ::CoCreateInstance(
+            CLSID_PortableDevicePropVariantCollection
+            , NULL
+            , CLSCTX_INPROC_SERVER
+            , IID_PPV_ARGS(&pBatch)
+            );
+        if ( FAILED(hr) )
+        {
+            LOGE( L"! Failed. CoCreateInstance CLSID_PortableDevicePropVariantCollection, hr=0x%08x\n", hr );
+            pBatch = NULL;
+            result = false;
+        }
+    }
+
+    for ( DWORD dwIndex = 0; false != result && dwIndex < dwCount; ++dwIndex )
+    {
+        PROPVARIANT pv;
+        ::PropVariantInit( &pv );
+        pv.vt = VT_LPWSTR;
+        pv.pwszVal = pszObjectIdArray[dwIndex];
+        const HRESULT hr = pBatch->Add( &pv );
+        if ( FAILED(hr) )
+        {
+            LOGE( L"! Failed. IPortableDevicePropVariantCollection Add, hr=0x%08x\n", hr );
+            result = false;
+        }
+    }
+
+    // with a key profile or a filter, folders only get the folder keys; the rest is fetched for files only
+    IPortableDevicePropVariantCollection* pFileObjectIdArray = NULL;
+    if ( false != result && (NULL != pContext->pKeysFileOnly || pContext->useFilter) )
+    {
+        const HRESULT hr = ::CoCreateInstance(
+            CLSID_PortableDevicePropVariantCollection
+            , NULL
+            , CLSCTX_INPROC_SERVER
+            , IID_PPV_ARGS(&pFileObjectIdArray)
+            );
+        if ( FAILED(hr) )
+        {
+            LOGE( L"! Failed. CoCreateInstance CLSID_PortableDevicePropVariantCollection, hr=0x%08x\n", hr );
+            pFileObjectIdArray = NULL;
+        }
+    }
+
+    if ( false != result )
+    {
+        IPortableDeviceKeyCollection* pKeys = (NULL != pFileObjectIdArray)?(pContext->pKeysFolder):(pContext->pKeysFile);
+        result = wpdEnumContent_BulkQueue( pBatch, dwCount, pKeys, true, pFileObjectIdArray, &pending, pContext );
+    }
+
+    // the first pass is over: whatever it did not answer is the walk's to fetch
+    const DWORD dwCountMissing = (DWORD)pending.size();
+    for ( std::set<std::wstring>::const_iterator it = pending.begin(); it != pending.end(); ++it )
+    {
+        pContext->pBulkMissing->insert( *it );
+    }
+    pContext->dwCountBulkFallback += dwCountMissing;
+
+    DWORD dwCountFile = 0;
+    if ( NULL != pFileObjectIdArray )
+    {
+        pFileObjectIdArray->GetCount( &dwCountFile );
+    }
+    if ( 0 < dwCountFile )
+    {
+        pending.clear();
+        for ( DWORD dwIndex = 0; dwIndex < dwCountFile; ++dwIndex )
+        {
+            PROPVARIANT pv;
+            ::PropVariantInit( &pv );
+            if ( SUCCEEDED(pFileObjectIdArray->GetAt( dwIndex, &pv )) && VT_LPWSTR == pv.vt && NULL != pv.pwszVal )
+            {
+                pending.insert( pv.pwszVal );
+            }
+            ::PropVariantClear( &pv );
+        }
+
+        if ( false == wpdEnumContent_BulkQueue( pFileObjectIdArray, dwCountFile, pContext->pKeysFileOnly, false, NULL, &pending, pContext ) )
+        {
+            result = false;
+        }
+
+        // the files already have their first pass values, only the file only keys are missing
+        pContext->dwCountBulkFallback += (DWORD)pending.size();
+        while ( !pending.empty() )
+        {
+            const std::wstring objectId( *pending.begin() );
+            if ( false == wpdEnumContent_BulkRefetch( objectId.c_str(), &pending, pContext ) )
+            {
+                pending.erase( objectId );
+            }
+        }
+    }
+    wpdOutput_FlushPending( pContext );
+
+    pContext->dwCountBulkObject += dwCount - dwCountMissing;
+
+    if ( NULL != pFileObjectIdArray )
+    {
+        pFileObjectIdArray->Release();
+        pFileObjectIdArray = NULL;
+    }
+
+    if ( NULL != pBatch )
+    {
+        pBatch->Release();
+        pBatch = NULL;
+    }
+
+    return result;
+}
+
+// one object being walked: its enumerator and the children fetched from it but not handed out yet
+struct WpdWalkFrame
+{
+    WpdScratchPool*                 pPool;
+    LPWSTR                          pszObjectId;
+    DWORD                           dwCapacityObjectId;
+    IEnumPortableDeviceObjectIDs*   pEnumPortableDeviceObjectIDs;
+
+    LPWSTR*                         pszChildArray;
+    DWORD                           dwCapacityChild;
+    DWORD                           dwCountChild;
+    DWORD                           dwIndexChild;
+    bool                            endOfEnum;
+
+    // children [dwIndexChild, dwBulkEnd) went through a bulk request, see pBulkMissing
+    DWORD                           dwBulkEnd;
+
+    // enumerator position: count of children handed out
+    DWORD                           dwNext;
+
+    // Next() batch size for this object, adaptive with --fetch-count=auto
+    DWORD                           dwFetchCount;
+    DWORD                           dwCountFetched;
+
+    // buffer every child at once, not one batch
+    bool                            fetchAll;
+};
+
+void
+wpdWalkFrame_FreeChildren(
+    WpdWalkFrame* pFrame
+)
+{
+    //FreePortableDevicePnPIDs( pFrame->pszChildArray, pFrame->dwCountChild );
+    if ( NULL != pFrame->pszChildArray )
+    {
+        for ( DWORD index = 0; index < pFrame->dwCountChild; ++index )
+        {
+            if ( NULL != pFrame->pszChildArray[index] )
+            {
+                ::CoTaskMemFree( pFrame->pszChildArray[index] );
+                pFrame->pszChildArray[index] = NULL;
+            }
+        }
+    }
+    pFrame->dwCountChild = 0;
+    pFrame->dwIndexChild = 0;
+    pFrame->dwBulkEnd = 0;
+}
+
+void
+wpdWalkFrame_Close(
+    WpdWalkFrame* pFrame
+)
+{
+    if ( NULL == pFrame )
+    {
+        return;
+    }
+
+    wpdWalkFrame_FreeChildren( pFrame );
+    wpdScratchPool_PutIdArray( pFrame->pPool, pFrame->pszChildArray, pFrame->dwCapacityChild );
+    pFrame->pszChildArray = NULL;
+    pFrame->dwCapacityChild = 0;
+
+    if ( NULL != pFrame->pEnumPortableDeviceObjectIDs )
+    {
+        const DWORD dwCount = pFrame->pEnumPortableDeviceObjectIDs->Release();
+        LOGV( L"IEnumPortableDeviceObjectIDs::Release, count=%u\n", dwCount );
+        pFrame->pEnumPortableDeviceObjectIDs = NULL;
+    }
+
+    wpdScratchPool_PutString( pFrame->pPool, pFrame->pszObjectId, pFrame->dwCapacityObjectId );
+    pFrame->pszObjectId = NULL;
+    pFrame->dwCapacityObjectId = 0;
+}
+
+bool
+wpdWalkFrame_Reserve(
+    WpdWalkFrame* pFrame
+    , const DWORD dwCapacity
+)
+{
+    if ( dwCapacity <= pFrame->dwCapacityChild )
+    {
+        return true;
+    }
+
+    DWORD dwCapacityNew = pFrame->dwCapacityChild * 2;
+    if ( dwCapacityNew < dwCapacity )
+    {
+        dwCapacityNew = dwCapacity;
+    }
+
+    LPWSTR* pszChildArray = wpdScratchPool_GetIdArray( pFrame->pPool, dwCapacityNew, &dwCapacityNew );
+    if ( NULL == pszChildArray )
+    {
+        return false;
+    }
+    for ( DWORD index = 0; index < dwCapacityNew; ++index )
+    {
+        pszChildArray[index] = (index < pFrame->dwCountChild)?(pFrame->pszChildArray[index]):(NULL);
+    }
+    wpdScratchPool_PutIdArray( pFrame->pPool, pFrame->pszChildArray, pFrame->dwCapacityChild );
+    pFrame->pszChildArray = pszChildArray;
+    pFrame->dwCapacityChild = dwCapacityNew;
+    return true;
+}
+
+// fetch the properties of the object (when needed) and start enumerating its children at dwSkip
+bool
+wpdWalkFrame_Open(
+    WpdWalkFrame* pFrame
+    , LPCWSTR pszObjectId
+    , const bool needProperties
+    , const DWORD dwSkip
+    , WpdEnumContext* pContext
+)
+{
+    ::memset( pFrame, 0, sizeof(*pFrame) );
+
+    if ( NULL == pszObjectId )
+    {
+        LOGV( L"wpdWalkFrame_Open: pszObjectId is NULL" );
+        return false;
+    }
+    if ( NULL == pContext || NULL == pContext->pPortableDeviceContent )
+    {
+        LOGV( L"wpdWalkFrame_Open: pPortableDeviceContent is NULL" );
+        return false;
+    }
+    IPortableDeviceContent* pPortableDeviceContent = pContext->pPortableDeviceContent;
+
+    pFrame->pPool = pContext->pScratchPool;
+    {
+        const DWORD dwLength = (DWORD)::wcslen( pszObjectId ) + 1;
+        pFrame->pszObjectId = wpdScratchPool_GetString( pFrame->pPool, dwLength, &pFrame->dwCapacityObjectId );
+        ::memcpy( pFrame->pszObjectId, pszObjectId, dwLength * sizeof(WCHAR) );
+    }
+
+    LOGV( L"enum content: %s\n", pszObjectId );
+    if ( needProperties )
+    {
+        // the device object is fetched in full, everything below uses the key profile
+        if ( 0 == ::wcscmp( pszObjectId, WPD_DEVICE_OBJECT_ID ) )
+        {
+            if ( false == wpdEnumContent_GetValues( pszObjectId, NULL, pContext ) )
+            {
+                return false;
+            }
+        }
+        else
+        if ( pContext->useFilter )
+        {
+            bool pruned = false;
+            if ( false == wpdEnumContent_GetValuesFiltered( pszObjectId, pContext, &pruned ) )
+            {
+                return false;
+            }
+            if ( pruned )
+            {
+                // nothing below it is wanted: no enumerator
+                pContext->dwCountFilterEnumSaved += 1;
+                pFrame->endOfEnum = true;
+                return true;
+            }
+        }
+        else
+        if ( false == wpdEnumContent_GetValues( pszObjectId, pContext->pKeysFile, pContext ) )
+        {
+            return false;
+        }
+    }
+
+    {
+        const DWORD dwFlags = 0;
+        IPortableDeviceValues* pFilter = NULL;
+
+        const ULONGLONG qwTicksCall = wpdStats_Begin( pContext->pStats );
+        const HRESULT hr = pPortableDeviceContent->EnumObjects(
+            dwFlags
+            , pszObjectId
+            , pFilter
+            , &pFrame->pEnumPortableDeviceObjectIDs
+            );
+        wpdStats_End( pContext->pStats, WPD_STAT_OP_ENUM_OBJECTS, qwTicksCall, hr, 0 );
+        if ( FAILED(hr) )
+        {
+            LOGE( L"! Failed. pPortableDeviceContent EnumObjects, hr=0x%08x\n", hr );
+            pFrame->pEnumPortableDeviceObjectIDs = NULL;
+            return false;
+        }
+    }
+
+    if ( 0 < dwSkip )
+    {
+        const HRESULT hr = pFrame->pEnumPortableDeviceObjectIDs->Skip( dwSkip );
+        if ( S_OK != hr )
+        {
+            // driver without Skip: fetch and drop
+            LOGV( L"IEnumPortableDeviceObjectIDs Skip, hr=0x%08x. skip by Next\n", hr );
+            DWORD dwSkipped = 0;
+            HRESULT hrNext = pFrame->pEnumPortableDeviceObjectIDs->Reset();
+            while ( SUCCEEDED(hrNext) && dwSkipped < dwSkip )
+            {
+                LPWSTR pszSkip = NULL;
+                DWORD nFetched = 0;
+                hrNext = pFrame->pEnumPortableDeviceObjectIDs->Next( 1, &pszSkip, &nFetched );
+                if ( NULL != pszSkip )
+                {
+                    ::CoTaskMemFree( pszSkip );
+                    pszSkip = NULL;
+                }
+                if ( S_OK != hrNext || 0 == nFetched )
+                {
+                    break;
+                }
+                dwSkipped += 1;
+            }
+            if ( dwSkipped < dwSkip )
+            {
+                LOGE( L"! Failed. skip to enumerator position %u, reached %u\n", dwSkip, dwSkipped );
+                return false;
+            }
+        }
+    }
+    pFrame->dwNext = dwSkip;
+    pFrame->dwFetchCount = (s_optAdaptiveFetch)?(pContext->dwFetchStart):(s_optCountOfFetch);
+
+    return true;
+}
+
+DWORD
+wpdFetchAdaptive_Bucket( DWORD dwCount )
+{
+    DWORD dwBucket = 0;
+    while ( 1 < dwCount && dwBucket + 1 < WPD_FETCH_HISTOGRAM_MAX )
+    {
+        dwCount >>= 1;
+        dwBucket += 1;
+    }
+    return dwBucket;
+}
+
+// largest batch worth asking for, estimated by least squares over (fetched, latency) of this device's Next() calls.
+// a batch of n costs fixed + n * perId, perId * (1 + fixed / (n * perId)) per id. at n = 4 * fixed / perId the
+// fixed part is a fifth of the call and an id costs 1.25 perId; twice that batch would save a tenth per id, but
+// a Next() holds the session twice as long before the walk sees an id, so the batch stops there
+#define WPD_FETCH_LIMIT_FACTOR  (4.0)
+DWORD
+wpdFetchAdaptive_Limit(
+    const WpdEnumContext* pContext
+    , double* pdFixed
+    , double* pdPerId
+)
+{
+    DWORD dwLimit = s_optCountOfFetchMax;
+    double dFixed = 0.0;
+    double dPerId = 0.0;
+
+    const double n = (double)pContext->dwCountFetchSample;
+    const double denominator = n * pContext->dFetchSumNN - pContext->dFetchSumN * pContext->dFetchSumN;
+    if ( 4 <= pContext->dwCountFetchSample && 0.0 < denominator )
+    {
+        dPerId = (n * pContext->dFetchSumNT - pContext->dFetchSumN * pContext->dFetchSumT) / denominator;
+        dFixed = (pContext->dFetchSumT - dPerId * pContext->dFetchSumN) / n;
+        if ( 0.0 < dPerId && 0.0 < dFixed )
+        {
+            const double dOptimal = WPD_FETCH_LIMIT_FACTOR * dFixed / dPerId;
+            if ( dOptimal < (double)dwLimit )
+            {
+                dwLimit = (1.0 < dOptimal)?((DWORD)dOptimal):(1U);
+            }
+        }
+    }
+
+    if ( NULL != pdFixed )
+    {
+        *pdFixed = dFixed;
+    }
+    if ( NULL != pdPerId )
+    {
+        *pdPerId = dPerId;
+    }
+    return dwLimit;
+}
+
+// grow the batch while a folder keeps filling it, learn the device start size from finished folders
+void
+wpdFetchAdaptive_Observe(
+    WpdWalkFrame* pFrame
+    , WpdEnumContext* pContext
+    , const DWORD dwRequested
+    , const DWORD dwFetched
+    , const ULONGLONG qwTicks
+)
+{
+    pContext->dwCountNext += 1;
+    pContext->qwTicksNext += qwTicks;
+    pContext->dwFetchHistogram[wpdFetchAdaptive_Bucket( dwRequested )] += 1;
+    pFrame->dwCountFetched += dwFetched;
+
+    if ( false == s_optAdaptiveFetch )
+    {
+        return;
+    }
+
+    if ( 0 < dwFetched )
+    {
+        const double n = (double)dwFetched;
+        const double t = wpdTicksToMicroseconds( qwTicks );
+        pContext->dwCountFetchSample += 1;
+        pContext->dFetchSumN += n;
+        pContext->dFetchSumT += t;
+        pContext->dFetchSumNN += n * n;
+        pContext->dFetchSumNT += n * t;
+    }
+
+    const DWORD dwLimit = wpdFetchAdaptive_Limit( pContext, NULL, NULL );
+    if ( dwFetched == dwRequested )
+    {
+        const DWORD dwGrow = dwRequested * 2;
+        pFrame->dwFetchCount = (dwGrow < dwLimit)?(dwGrow):(dwLimit);
+    }
+    else
+    {
+        // folder finished: move the start size toward the size of folders seen on this device
+        DWORD dwSize = pFrame->dwCountFetched;
+        if ( dwSize < 1 )
+        {
+            dwSize = 1;
+        }
+        if ( dwLimit < dwSize )
+        {
+            dwSize = dwLimit;
+        }
+        pContext->dwFetchStart = (pContext->dwFetchStart * 3 + dwSize + 3) / 4;
+        if ( pContext->dwFetchStart < 1 )
+        {
+            pContext->dwFetchStart = 1;
+        }
+    }
+    if ( pFrame->dwFetchCount < 1 )
+    {
+        pFrame->dwFetchCount = 1;
+    }
+}
+
+// refill the children buffer. bulk mode queues every remaining child of the object
+bool
+wpdWalkFrame_Fill(
+    WpdWalkFrame* pFrame
+    , WpdEnumContext* pContext
+)
+{
+    wpdWalkFrame_FreeChildren( pFrame );
+    if ( NULL == pFrame->pEnumPortableDeviceObjectIDs )
+    {
+        // pruned by the filter
+        pFrame->endOfEnum = true;
+        return true;
+    }
+
+    const bool fetchAll = (NULL != pContext->pPortableDevicePropertiesBulk) || pFrame->fetchAll;
+
+    HRESULT hr = S_OK;
+    while ( S_OK == hr ) // not SUCCEEDED(hr)
+    {
+        const DWORD MY_FETCH_COUNT = pFrame->dwFetchCount;
+        if ( false == wpdWalkFrame_Reserve( pFrame, pFrame->dwCountChild + MY_FETCH_COUNT ) )
+        {
+            LOGE( L"! Failed. allocate object id array\n" );
+            return false;
+        }
+
+        DWORD nFetched = 0;
+        const ULONGLONG qwTicksStart = wpdTicksNow();
+        hr = pFrame->pEnumPortableDeviceObjectIDs->Next(
+            MY_FETCH_COUNT
+            , &pFrame->pszChildArray[pFrame->dwCountChild]
+            , &nFetched
+            );
+        wpdStats_End( pContext->pStats, WPD_STAT_OP_NEXT, qwTicksStart, hr, nFetched );
+        if ( FAILED(hr) )
+        {
+            LOGE( L"! Failed. pEnumPortableDeviceObjectIDs Next, hr=0x%08x\n", hr );
+            return false;
+        }
+        wpdFetchAdaptive_Observe( pFrame, pContext, MY_FETCH_COUNT, nFetched, wpdTicksNow() - qwTicksStart );
+
+        pFrame->dwCountChild += nFetched;
+        if ( 0 == nFetched )
+        {
+            hr = S_FALSE;
+        }
+        if ( false == fetchAll )
+        {
+            break;
+        }
+    }
+
+    if ( S_OK != hr )
+    {
+        pFrame->endOfEnum = true;
+    }
+
+    return true;
+}
+
+// hand out the next child; *ppszChildObjectId is NULL at the end of the enumeration.
+// the returned id stays valid until the next call
+bool
+wpdWalkFrame_NextChild(
+    WpdWalkFrame* pFrame
+    , WpdEnumContext* pContext
+    , LPCWSTR* ppszChildObjectId
+    , bool* pNeedProperties
+)
+{
+    *ppszChildObjectId = NULL;
+    *pNeedProperties = true;
+
+    for ( ;; )
+    {
+        if ( pFrame->dwCountChild <= pFrame->dwIndexChild )
+        {
+            if ( pFrame->endOfEnum )
+            {
+                return true;
+            }
+            if ( false == wpdWalkFrame_Fill( pFrame, pContext ) )
+            {
+                return false;
+            }
+            if ( 0 == pFrame->dwCountChild )
+            {
+                return true;
+            }
+        }
+
+        pContext->pszParentObjectId = pFrame->pszObjectId;
+        if ( NULL != pContext->pPortableDevicePropertiesBulk && pFrame->dwBulkEnd <= pFrame->dwIndexChild )
+        {
+            const DWORD dwBatch = (0 < s_optBulkBatch)?(s_optBulkBatch):(1U);
+            const DWORD dwRemain = pFrame->dwCountChild - pFrame->dwIndexChild;
+            const DWORD dwCount = (dwBatch < dwRemain)?(dwBatch):(dwRemain);
+            wpdEnumContent_BulkGetValues( &pFrame->pszChildArray[pFrame->dwIndexChild], dwCount, pContext );
+            pFrame->dwBulkEnd = pFrame->dwIndexChild + dwCount;
+        }
+
+        LPCWSTR pszChildObjectId = pFrame->pszChildArray[pFrame->dwIndexChild];
+        if ( NULL != pContext->pPortableDevicePropertiesBulk )
+        {
+            // only what the bulk request left out is fetched per object
+            *pNeedProperties = (0 < pContext->pBulkMissing->erase( pszChildObjectId ));
+        }
+        pFrame->dwIndexChild += 1;
+        pFrame->dwNext += 1;
+        pContext->dwCountContent += 1;
+
+        // the bulk pass stored its values already, link it like one opened per object
+        wpdTreeStore_OnChild( pContext->pTreeStore, pFrame->pszObjectId, pszChildObjectId );
+
+        // pruned by the filter during a bulk pass: never opened, whether or not it still needs properties
+        if ( NULL != pContext->pFilterPruned && 0 < pContext->pFilterPruned->erase( pszChildObjectId ) )
+        {
+            pContext->dwCountFilterEnumSaved += 1;
+            continue;
+        }
+
+        *ppszChildObjectId = pszChildObjectId;
+        wpdWatchTree_Insert( pContext->pWatchTree, pFrame->pszObjectId, pszChildObjectId );
+        return true;
+    }
+}
+
+// give a child back, used when it could not be opened so a checkpoint retries it
+void
+wpdWalkFrame_UndoChild(
+    WpdWalkFrame* pFrame
+    , WpdEnumContext* pContext
+)
+{
+    if ( 0 < pFrame->dwIndexChild )
+    {
+        pFrame->dwIndexChild -= 1;
+        pFrame->dwNext -= 1;
+        pContext->dwCountContent -= 1;
+    }
+}
+
+// called for each child of an enumerated object
+typedef bool (*WpdEnumChildProc)( LPCWSTR pszObjectId, const bool needProperties, void* pParam );
+
+// fetch the properties of one object (when needed), enumerate its children and hand each of them to pfnChild
+bool
+wpdEnumContent_EnumerateObject(
+    LPCWSTR pszObjectId
+    , WpdEnumContext* pContext
+    , const bool needProperties
+    , WpdEnumChildProc pfnChild
+    , void* pParam
+)
+{
+    WpdAllocMark mark;
+    wpdAllocMark_Start( &mark );
+    WpdWalkFrame frame;
+    bool result = wpdWalkFrame_Open( &frame, pszObjectId, needProperties, 0, pContext );
+    wpdAllocMark_Charge( &mark, pContext, true );
+    wpdAllocMark_Start( &mark );
+    while ( false != result )
+    {
+        LPCWSTR pszChildObjectId = NULL;
+        bool needChildProperties = true;
+        result = wpdWalkFrame_NextChild( &frame, pContext, &pszChildObjectId, &needChildProperties );
+        if ( false == result || NULL == pszChildObjectId )
+        {
+            break;
+        }
+
+        result = pfnChild( pszChildObjectId, needChildProperties, pParam );
+    }
+    wpdWalkFrame_Close( &frame );
+    wpdAllocMark_Charge( &mark, pContext, false );
+
+    return result;
+}
+
+// a folder whose modified date and child count match the previous scan is not descended into
+bool
+wpdScanCache_SkipFolder(
+    WpdWalkFrame* pFrame
+    , WpdEnumContext* pContext
+    , bool* pSkip
+)
+{
+    *pSkip = false;
+
+    WpdScanCache* pCache = pContext->pCache;
+    if ( NULL == pCache || pCache->previous.empty() )
+    {
+        return true;
+    }
+
+    std::wstring puid;
+    WpdCacheRecord* pRecord = wpdScanCache_Find( pCache, pFrame->pszObjectId, &puid );
+    if ( NULL == pRecord || false == pRecord->isFolder )
+    {
+        return true;
+    }
+    WpdCacheTable::const_iterator itPrevious = pCache->previous.find( puid );
+    if ( pCache->previous.end() == itPrevious || false == itPrevious->second.isFolder )
+    {
+        return true;
+    }
+    const double dDiff = itPrevious->second.dModified - pRecord->dModified;
+    if ( 1e-7 < dDiff || dDiff < -1e-7 )
+    {
+        return true;
+    }
+
+    // child ids only, no properties
+    pFrame->fetchAll = true;
+    if ( false == wpdWalkFrame_Fill( pFrame, pContext ) )
+    {
+        return false;
+    }
+    pRecord->dwCountChild = pFrame->dwCountChild;
+    if ( pFrame->dwCountChild != itPrevious->second.dwCountChild )
+    {
+        return true;
+    }
+
+    const DWORD dwCountReused = wpdScanCache_ReuseSubtree( pCache, puid );
+    pCache->dwCountSkipFolder += 1;
+    pCache->dwCountSkipObject += dwCountReused;
+    pContext->dwCountContent += dwCountReused;
+    *pSkip = true;
+    return true;
+}
+
+// a folder frame is done: remember its child count for the next scan
+void
+wpdScanCache_OnFolderDone(
+    WpdWalkFrame* pFrame
+    , WpdEnumContext* pContext
+)
+{
+    if ( NULL == pContext->pCache )
+    {
+        return;
+    }
+    WpdCacheRecord* pRecord = wpdScanCache_Find( pContext->pCache, pFrame->pszObjectId, NULL );
+    if ( NULL != pRecord )
+    {
+        pRecord->dwCountChild = pFrame->dwNext;
+    }
+}
+
+struct WpdWalkCheckpointFrame
+{
+    DWORD           dwNext;
+    std::wstring    objectId;
+};
+
+// serializable walk frontier: the object ids on the stack and their enumerator positions
+struct WpdWalkCheckpoint
+{
+    std::wstring                            pnpDeviceId;
+    DWORD                                   dwCountContent;
+    std::vector<WpdWalkCheckpointFrame>     frames;
+};
+
+#define WPD_WALK_CHECKPOINT_MAGIC   L"wpdwalk"
+#define WPD_WALK_CHECKPOINT_VERSION (1)
+
+void
+wpdWalkCheckpoint_Path(
+    WpdEnumContext* pContext
+    , std::wstring* pPath
+)
+{
+    pPath->assign( s_optResumeFile );
+    if ( NULL != pContext->pScan && 0 < pContext->pScan->index )
+    {
+        WCHAR szSuffix[32];
+        ::_snwprintf_s( szSuffix, sizeof(szSuffix)/sizeof(szSuffix[0]), _TRUNCATE, L".%u", (DWORD)pContext->pScan->index );
+        pPath->append( szSuffix );
+    }
+}
+
+bool
+wpdWalkCheckpoint_Save(
+    const std::vector<WpdWalkFrame>& stack
+    , WpdEnumContext* pContext
+)
+{
+    std::wstring path;
+    wpdWalkCheckpoint_Path( pContext, &path );
+    std::wstring pathTemp( path );
+    pathTemp.append( L".tmp" );
+
+    FILE* fp = NULL;
+    if ( 0 != ::_wfopen_s( &fp, pathTemp.c_str(), L"w, ccs=UTF-8" ) || NULL == fp )
+    {
+        LOGE( L"! Failed. open checkpoint %s\n", pathTemp.c_str() );
+        return false;
+    }
+
+    const LPCWSTR pszPnPDeviceID = (NULL != pContext->pScan && NULL != pContext->pScan->pszPnPDeviceID)?(pContext->pScan->pszPnPDeviceID):(L"");
+    ::fwprintf( fp, L"%s %u\n", WPD_WALK_CHECKPOINT_MAGIC, WPD_WALK_CHECKPOINT_VERSION );
+    ::fwprintf( fp, L"%s\n", pszPnPDeviceID );
+    ::fwprintf( fp, L"%u %u\n", pContext->dwCountContent, (DWORD)stack.size() );
+    for ( size_t index = 0; index < stack.size(); ++index )
+    {
+        ::fwprintf( fp, L"%u %s\n", stack[index].dwNext, stack[index].pszObjectId );
+    }
+
+    const bool result = (0 == ::ferror( fp ));
+    ::fclose( fp );
+    fp = NULL;
+
+    if ( false == result || FALSE == ::MoveFileExW( pathTemp.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING ) )
+    {
+        LOGE( L"! Failed. write checkpoint %s\n", path.c_str() );
+        return false;
+    }
+
+    LOGV( L"checkpoint: count=%u, depth=%u\n", pContext->dwCountContent, (DWORD)stack.size() );
+    return true;
+}
+
+// a decimal DWORD at *pp and then the separator, L'\0' for the end of the line; *pp moves past both
+bool
+wpdWalkCheckpoint_ParseNumber(
+    LPCWSTR* pp
+    , const WCHAR separator
+    , DWORD* pValue
+)
+{
+    LPCWSTR p = *pp;
+    if ( L'0' > *p || L'9' < *p )
+    {
+        return false;
+    }
+    ULONGLONG qwValue = 0;
+    for ( ; L'0' <= *p && L'9' >= *p; ++p )
+    {
+        qwValue = qwValue * 10 + (ULONGLONG)(*p - L'0');
+        if ( 0xFFFFFFFFULL < qwValue )
+        {
+            return false;
+        }
+    }
+    if ( L'\0' == separator )
+    {
+        p += ::wcsspn( p, L"\r\n" );
+    }
+    if ( separator != *p )
+    {
+        return false;
+    }
+    *pValue = (DWORD)qwValue;
+    *pp = (L'\0' == separator)?(p):(p + 1);
+    return true;
+}
+
+bool
+wpdWalkCheckpoint_Load(
+    WpdEnumContext* pContext
+    , WpdWalkCheckpoint* pCheckpoint
+)
+{
+    std::wstring path;
+    wpdWalkCheckpoint_Path( pContext, &path );
+
+    FILE* fp = NULL;
+    if ( 0 != ::_wfopen_s( &fp, path.c_str(), L"r, ccs=UTF-8" ) || NULL == fp )
+    {
+        return false;
+    }
+
+    // every line has to be what wpdWalkCheckpoint_Save writes, and nothing may follow the last frame
+    std::vector<WCHAR> line;
+    DWORD dwVersion = 0;
+    DWORD dwCountFrame = 0;
+    bool result = wpdFile_ReadLine( fp, &line )
+        && 0 == ::wcsncmp( &line[0], WPD_WALK_CHECKPOINT_MAGIC L" ", ::wcslen(WPD_WALK_CHECKPOINT_MAGIC L" ") );
+    if ( result )
+    {
+        LPCWSTR p = &line[::wcslen(WPD_WALK_CHECKPOINT_MAGIC L" ")];
+        result = wpdWalkCheckpoint_ParseNumber( &p, L'\0', &dwVersion ) && WPD_WALK_CHECKPOINT_VERSION == dwVersion;
+    }
+    if ( result )
+    {
+        result = wpdFile_ReadLine( fp, &line );
+        pCheckpoint->pnpDeviceId.assign( &line[0], ::wcscspn( &line[0], L"\r\n" ) );
+    }
+    if ( result )
+    {
+        result = wpdFile_ReadLine( fp, &line );
+        LPCWSTR p = &line[0];
+        result = result
+            && wpdWalkCheckpoint_ParseNumber( &p, L' ', &pCheckpoint->dwCountContent )
+            && wpdWalkCheckpoint_ParseNumber( &p, L'\0', &dwCountFrame )
+            && 0 < dwCountFrame;
+    }
+    for ( DWORD index = 0; result && index < dwCountFrame; ++index )
+    {
+        WpdWalkCheckpointFrame frame;
+        result = wpdFile_ReadLine( fp, &line );
+        LPCWSTR p = &line[0];
+        if ( result && wpdWalkCheckpoint_ParseNumber( &p, L' ', &frame.dwNext ) )
+        {
+            frame.objectId.assign( p, ::wcscspn( p, L"\r\n" ) );
+        }
+        // the stack starts at the device object
+        result = result
+            && !frame.objectId.empty()
+            && (0 < index || 0 == ::wcscmp( frame.objectId.c_str(), WPD_DEVICE_OBJECT_ID ));
+        if ( result )
+        {
+            pCheckpoint->frames.push_back( frame );
+        }
+    }
+    if ( result && wpdFile_ReadLine( fp, &line ) )
+    {
+        result = false;
+    }
+    ::fclose( fp );
+    fp = NULL;
+
+    if ( false == result )
+    {
+        LOGE( L"! Failed. invalid checkpoint %s\n", path.c_str() );
+        pCheckpoint->frames.clear();
+        return false;
+    }
+
+    const LPCWSTR pszPnPDeviceID = (NULL != pContext->pScan && NULL != pContext->pScan->pszPnPDeviceID)?(pContext->pScan->pszPnPDeviceID):(L"");
+    if ( 0 != ::wcscmp( pCheckpoint->pnpDeviceId.c_str(), pszPnPDeviceID ) )
+    {
+        LOGI( L"    checkpoint %s is for another device, ignored\n", path.c_str() );
+        return false;
+    }
+
+    return true;
+}
+
+void
+wpdWalkCheckpoint_Remove(
+    WpdEnumContext* pContext
+)
+{
+    std::wstring path;
+    wpdWalkCheckpoint_Path( pContext, &path );
+    ::DeleteFileW( path.c_str() );
+}
+
+// depth first walk on an explicit stack of frames, no native recursion.
+// with --resume=<file> the frontier is checkpointed periodically and restored from the file
+bool
+wpdEnumContent_IterativeEnumerate(
+    WpdEnumContext* pContext
+)
+{
+    const bool useCheckpoint = (NULL != s_optResumeFile);
+    std::vector<WpdWalkFrame> stack;
+
+    bool result = true;
+    if ( useCheckpoint )
+    {
+        WpdWalkCheckpoint checkpoint;
+        if ( wpdWalkCheckpoint_Load( pContext, &checkpoint ) )
+        {
+            for ( size_t index = 0; index < checkpoint.frames.size(); ++index )
+            {
+                // properties of the objects on the stack were fetched before the checkpoint
+                WpdWalkFrame frame;
+                result = wpdWalkFrame_Open( &frame, checkpoint.frames[index].objectId.c_str(), false, checkpoint.frames[index].dwNext, pContext );
+                if ( false == result )
+                {
+                    wpdWalkFrame_Close( &frame );
+                    break;
+                }
+                stack.push_back( frame );
+            }
+
+            if ( false != result )
+            {
+                pContext->dwCountContent = checkpoint.dwCountContent;
+                LOGI( L"    resume: count=%u, depth=%u\n", pContext->dwCountContent, (DWORD)stack.size() );
+            }
+            else
+            {
+                LOGI( L"    resume failed, walk from the device object\n" );
+                while ( !stack.empty() )
+                {
+                    wpdWalkFrame_Close( &stack.back() );
+                    stack.pop_back();
+                }
+                pContext->dwCountContent = 0;
+                result = true;
+            }
+        }
+    }
+
+    if ( stack.empty() )
+    {
+        WpdWalkFrame frame;
+        result = wpdWalkFrame_Open( &frame, WPD_DEVICE_OBJECT_ID, true, 0, pContext );
+        if ( false == result )
+        {
+            wpdWalkFrame_Close( &frame );
+            return false;
+        }
+        stack.push_back( frame );
+    }
+
+    DWORD dwCountCheckpoint = pContext->dwCountContent;
+    WpdAllocMark mark;
+    while ( !stack.empty() )
+    {
+        LPCWSTR pszChildObjectId = NULL;
+        bool needChildProperties = true;
+        wpdAllocMark_Start( &mark );
+        result = wpdWalkFrame_NextChild( &stack.back(), pContext, &pszChildObjectId, &needChildProperties );
+        wpdAllocMark_Charge( &mark, pContext, false );
+        if ( false == result )
+        {
+            break;
+        }
+        if ( NULL == pszChildObjectId )
+        {
+            wpdScanCache_OnFolderDone( &stack.back(), pContext );
+            wpdWalkFrame_Close( &stack.back() );
+            stack.pop_back();
+            continue;
+        }
+
+        WpdWalkFrame frame;
+        wpdAllocMark_Start( &mark );
+        result = wpdWalkFrame_Open( &frame, pszChildObjectId, needChildProperties, 0, pContext );
+        wpdAllocMark_Charge( &mark, pContext, true );
+        if ( false == result )
+        {
+            wpdWalkFrame_Close( &frame );
+            wpdWalkFrame_UndoChild( &stack.back(), pContext );
+            break;
+        }
+
+        bool skip = false;
+        result = wpdScanCache_SkipFolder( &frame, pContext, &skip );
+        if ( false == result || skip )
+        {
+            wpdWalkFrame_Close( &frame );
+            if ( false == result )
+            {
+                break;
+            }
+            continue;
+        }
+        stack.push_back( frame );
+
+        if ( useCheckpoint && s_optCheckpointInterval <= pContext->dwCountContent - dwCountCheckpoint )
+        {
+            wpdWalkCheckpoint_Save( stack, pContext );
+            dwCountCheckpoint = pContext->dwCountContent;
+        }
+    }
+
+    if ( useCheckpoint )
+    {
+        if ( false != result )
+        {
+            wpdWalkCheckpoint_Remove( pContext );
+        }
+        else
+        {
+            wpdWalkCheckpoint_Save( stack, pContext );
+        }
+    }
+
+    while ( !stack.empty() )
+    {
+        wpdWalkFrame_Close( &stack.back() );
+        stack.pop_back();
+    }
+
+    return result;
+}
+
+bool
+wpdEnumContext_Init(
+    WpdEnumContext* pContext
+    , IPortableDeviceContent* pPortableDeviceContent
+    , IPortableDeviceProperties* pPortableDeviceProperties
+    , WpdDeviceScan* pScan
+)
+{
+    if ( NULL == pContext || NULL == pPortableDeviceContent )
+    {
+        return false;
+    }
+
+    ::memset( pContext, 0, sizeof(*pContext) );
+    pContext->pScan = pScan;
+    pContext->pTreeStore = (NULL != pScan)?(pScan->pTreeStore):(NULL);
+    pContext->pScratchPool = (NULL != pScan)?(pScan->pScratchPool):(NULL);
+    pContext->nCountHeapAllocStart = s_nCountHeapAlloc;
+    pContext->nCountCoTaskAllocStart = s_nCountCoTaskAlloc;
+    pContext->pStats = wpdStats_Device( (NULL != pScan)?(pScan->pszPnPDeviceID):(NULL) );
+    pContext->pPortableDeviceContent = pPortableDeviceContent;
+    pContext->dwFetchStart = s_optCountOfFetch;
+
+    if ( NULL != pPortableDeviceProperties )
+    {
+        // cached by the session
+        pPortableDeviceProperties->AddRef();
+        pContext->pPortableDeviceProperties = pPortableDeviceProperties;
+    }
+    else
+    {
+        const ULONGLONG qwTicksCall = wpdStats_Begin( pContext->pStats );
+        const HRESULT hr = pPortableDeviceContent->Properties( &pContext->pPortableDeviceProperties );
+        wpdStats_End( pContext->pStats, WPD_STAT_OP_PROPERTIES, qwTicksCall, hr, 0 );
+        if ( FAILED(hr) )
+        {
+            LOGE( L"! Failed. pPortableDeviceContent Properties, hr=0x%08x\n", hr );
+            pContext->pPortableDeviceProperties = NULL;
+            return false;
+        }
+    }
+
+    if ( NULL != s_pOutputSink )
+    {
+        pContext->pOutputPending = new std::map<std::wstring, IPortableDeviceValues*>();
+    }
+
+    pContext->useFilter = (NULL != s_optOnly || NULL != s_optExcludeFolders);
+    if ( pContext->useFilter )
+    {
+        pContext->pFilterPruned = new std::set<std::wstring>();
+    }
+
+    if ( NULL != s_optProps && 0 != ::_wcsicmp( s_optProps, L"all" ) )
+    {
+        // the cache, the filter and the download journal need the minimal profile on top of what was asked for
+        std::wstring props( s_optProps );
+        if ( NULL != s_optCacheDir || pContext->useFilter || NULL != s_optDownload )
+        {
+            props.append( L"," );
+            props.append( s_szPropsMinimal );
+        }
+        pContext->pKeysFile = wpdCreatePropertyKeys( props.c_str(), false );
+        pContext->pKeysFolder = wpdCreatePropertyKeys( props.c_str(), true );
+        pContext->pKeysFileOnly = wpdCreatePropertyKeysDifference( pContext->pKeysFile, pContext->pKeysFolder );
+    }
+    else
+    if ( pContext->useFilter )
+    {
+        // the filter decides on the minimal keys, accepted files then get everything
+        pContext->pKeysFolder = wpdCreatePropertyKeys( L"minimal", true );
+    }
+
+    if ( s_optUseBulk && NULL != pContext->pPortableDeviceProperties )
+    {
+        const HRESULT hr = pContext->pPortableDeviceProperties->QueryInterface(
+            IID_PPV_ARGS(&pContext->pPortableDevicePropertiesBulk)
+            );
+        if ( FAILED(hr) )
+        {
+            LOGI( L"    IPortableDevicePropertiesBulk not supported, hr=0x%08x. fallback per object\n", hr );
+            pContext->pPortableDevicePropertiesBulk = NULL;
+        }
+        else
+        {
+            pContext->pBulkMissing = new std::set<std::wstring>();
+        }
+    }
+
+    return true;
+}
+
+// add the counters of pSrc to pDst; sample object ids move to pDst
+void
+wpdEnumContext_Merge(
+    WpdEnumContext* pDst
+    , WpdEnumContext* pSrc
+)
+{
+    if ( NULL == pDst || NULL == pSrc || pDst == pSrc )
+    {
+        return;
+    }
+
+    pDst->dwCountContent += pSrc->dwCountContent;
+    pDst->nCountHeapAllocWalk += pSrc->nCountHeapAllocWalk;
+    pDst->nCountCoTaskAllocWalk += pSrc->nCountCoTaskAllocWalk;
+    pDst->nCountHeapAllocObjectMax = (pDst->nCountHeapAllocObjectMax < pSrc->nCountHeapAllocObjectMax)?(pSrc->nCountHeapAllocObjectMax):(pDst->nCountHeapAllocObjectMax);
+    pDst->nCountCoTaskAllocObjectMax = (pDst->nCountCoTaskAllocObjectMax < pSrc->nCountCoTaskAllocObjectMax)?(pSrc->nCountCoTaskAllocObjectMax):(pDst->nCountCoTaskAllocObjectMax);
+    pDst->dwCountBulkRequest += pSrc->dwCountBulkRequest;
+    pDst->dwCountBulkObject += pSrc->dwCountBulkObject;
+    pDst->dwCountBulkFallback += pSrc->dwCountBulkFallback;
+    pDst->dwCountGetValues += pSrc->dwCountGetValues;
+    pDst->dwCountSampleGetValues += pSrc->dwCountSampleGetValues;
+    pDst->dwCountObjectValues += pSrc->dwCountObjectValues;
+    pDst->dwCountValuesFetched += pSrc->dwCountValuesFetched;
+    pDst->qwBytesFetched += pSrc->qwBytesFetched;
+    pDst->dwCountFilterFolder += pSrc->dwCountFilterFolder;
+    pDst->dwCountFilterFile += pSrc->dwCountFilterFile;
+    pDst->dwCountFilterEnumSaved += pSrc->dwCountFilterEnumSaved;
+    pDst->dwCountFilterFetchSaved += pSrc->dwCountFilterFetchSaved;
+
+    pDst->dwCountNext += pSrc->dwCountNext;
+    pDst->qwTicksNext += pSrc->qwTicksNext;
+    pDst->dwCountFetchSample += pSrc->dwCountFetchSample;
+    pDst->dFetchSumN += pSrc->dFetchSumN;
+    pDst->dFetchSumT += pSrc->dFetchSumT;
+    pDst->dFetchSumNN += pSrc->dFetchSumNN;
+    pDst->dFetchSumNT += pSrc->dFetchSumNT;
+    for ( DWORD index = 0; index < WPD_FETCH_HISTOGRAM_MAX; ++index )
+    {
+        pDst->dwFetchHistogram[index] += pSrc->dwFetchHistogram[index];
+    }
+
+    for ( DWORD index = 0; index < pSrc->dwCountContentTypeStat; ++index )
+    {
+        WpdContentTypeStat& src = pSrc->contentTypeStat[index];
+        WpdContentTypeStat* pStat = NULL;
+        for ( DWORD indexDst = 0; indexDst < pDst->dwCountContentTypeStat; ++indexDst )
+        {
+            if ( ::IsEqualGUID( src.guidContentType, pDst->contentTypeStat[indexDst].guidContentType ) )
+            {
+                pStat = &pDst->contentTypeStat[indexDst];
+                break;
+            }
+        }
+        if ( NULL == pStat && pDst->dwCountContentTypeStat < WPD_CONTENT_TYPE_STAT_MAX )
+        {
+            pStat = &pDst->contentTypeStat[pDst->dwCountContentTypeStat];
+            pDst->dwCountContentTypeStat += 1;
+            pStat->guidContentType = src.guidContentType;
+            pStat->pszSampleObjectId = src.pszSampleObjectId;
+            src.pszSampleObjectId = NULL;
+        }
+        if ( NULL != pStat )
+        {
+            pStat->dwCountObject += src.dwCountObject;
+        }
+    }
+}
+
+// GetValues calls a walk without --bulk would have made, one per object, less the Start of every bulk pass
+// (a file only second pass is a request of its own) and the objects refetched one by one after them
+DWORD
+wpdEnumContext_BulkCallsSaved(
+    const WpdEnumContext* pContext
+)
+{
+    const DWORD dwCountCall = pContext->dwCountBulkRequest + pContext->dwCountBulkFallback;
+    return (dwCountCall < pContext->dwCountBulkObject)?(pContext->dwCountBulkObject - dwCountCall):(0);
+}
+
+void
+wpdEnumContext_Report(
+    WpdEnumContext* pContext
+)
+{
+    if ( NULL == pContext )
+    {
+        return;
+    }
+
+    if ( s_optAdaptiveFetch )
+    {
+        double dFixed = 0.0;
+        double dPerId = 0.0;
+        const DWORD dwLimit = wpdFetchAdaptive_Limit( pContext, &dFixed, &dPerId );
+        LOGI( L"    Fetch adaptive: start=%u, limit=%u, Next calls=%u, avg=%.1fus, fixed=%.1fus, per id=%.2fus\n"
+            , pContext->dwFetchStart
+            , dwLimit
+            , pContext->dwCountNext
+            , (0 < pContext->dwCountNext)?(wpdTicksToMicroseconds( pContext->qwTicksNext ) / pContext->dwCountNext):(0.0)
+            , dFixed
+            , dPerId
+            );
+
+        WCHAR szHistogram[512];
+        szHistogram[0] = L'\0';
+        size_t len = 0;
+        for ( DWORD index = 0; index < WPD_FETCH_HISTOGRAM_MAX; ++index )
+        {
+            if ( 0 == pContext->dwFetchHistogram[index] )
+            {
+                continue;
+            }
+            const int ret = ::_snwprintf_s(
+                &szHistogram[len], sizeof(szHistogram)/sizeof(szHistogram[0]) - len, _TRUNCATE
+                , L" %u:%u", (1U << index), pContext->dwFetchHistogram[index]
+                );
+            if ( ret < 0 )
+            {
+                break;
+            }
+            len += ret;
+        }
+        LOGI( L"    Fetch sizes (size:calls):%s\n", szHistogram );
+    }
+
+    if ( s_optUseBulk )
+    {
+        LOGI( L"    Bulk requests=%u, objects=%u, fallback=%u, GetValues=%u\n"
+            , pContext->dwCountBulkRequest
+            , pContext->dwCountBulkObject
+            , pContext->dwCountBulkFallback
+            , pContext->dwCountGetValues
+            );
+    }
+
+    if ( s_optAllocStats )
+    {
+        const LONG nCountHeap = s_nCountHeapAlloc - pContext->nCountHeapAllocStart;
+        const LONG nCountCoTask = s_nCountCoTaskAlloc - pContext->nCountCoTaskAllocStart;
+        const double dCount = (0 < pContext->dwCountContent)?((double)pContext->dwCountContent):(1.0);
+        LOGI( L"    Alloc heap=%ld (%.2f/object), CoTaskMem=%ld (%.2f/object), process wide\n"
+            , nCountHeap
+            , nCountHeap / dCount
+            , nCountCoTask
+            , nCountCoTask / dCount
+            );
+        LOGI( L"    Alloc heap=%ld (%.2f/object, %ld at most), CoTaskMem=%ld (%.2f/object, %ld at most), walking threads\n"
+            , pContext->nCountHeapAllocWalk
+            , pContext->nCountHeapAllocWalk / dCount
+            , pContext->nCountHeapAllocObjectMax
+            , pContext->nCountCoTaskAllocWalk
+            , pContext->nCountCoTaskAllocWalk / dCount
+            , pContext->nCountCoTaskAllocObjectMax
+            );
+    }
+
+    if ( pContext->useFilter )
+    {
+        LOGI( L"    Filter folders pruned=%u, files filtered=%u, EnumObjects saved=%u, file fetches saved=%u\n"
+            , pContext->dwCountFilterFolder
+            , pContext->dwCountFilterFile
+            , pContext->dwCountFilterEnumSaved
+            , pContext->dwCountFilterFetchSaved
+            );
+    }
+
+    if ( NULL != pContext->pKeysFile )
+    {
+        wpdEnumContent_SampleContentTypes( pContext );
+
+        ULONGLONG qwBytesFull = 0;
+        for ( DWORD index = 0; index < pContext->dwCountContentTypeStat; ++index )
+        {
+            const WpdContentTypeStat& stat = pContext->contentTypeStat[index];
+            qwBytesFull += (ULONGLONG)stat.dwBytesFull * stat.dwCountObject;
+        }
+        const ULONGLONG qwBytesSaved = (pContext->qwBytesFetched < qwBytesFull)?(qwBytesFull - pContext->qwBytesFetched):(0);
+        const DWORD dwCallsSaved = wpdEnumContext_BulkCallsSaved( pContext );
+        LOGI( L"    Props values=%u, bytes=%I64u, bytes saved=%I64u, calls saved=%u (sample calls=%u)\n"
+            , pContext->dwCountValuesFetched
+            , pContext->qwBytesFetched
+            , qwBytesSaved
+            , (dwCallsSaved > pContext->dwCountSampleGetValues)?(dwCallsSaved - pContext->dwCountSampleGetValues):(0)
+            , pContext->dwCountSampleGetValues
+            );
+    }
+    else
+    if ( s_optUseBulk )
+    {
+        LOGI( L"    Props values=%u, bytes=%I64u, calls saved=%u\n"
+            , pContext->dwCountValuesFetched
+            , pContext->qwBytesFetched
+            , wpdEnumContext_BulkCallsSaved( pContext )
+            );
+    }
+}
+
+void
+wpdEnumContext_Term(
+    WpdEnumContext* pContext
+)
+{
+    if ( NULL == pContext )
+    {
+        return;
+    }
+
+    for ( DWORD index = 0; index < pContext->dwCountContentTypeStat; ++index )
+    {
+        if ( NULL != pContext->contentTypeStat[index].pszSampleObjectId )
+        {
+            ::CoTaskMemFree( pContext->contentTypeStat[index].pszSampleObjectId );
+            pContext->contentTypeStat[index].pszSampleObjectId = NULL;
+        }
+    }
+
+    if ( NULL != pContext->pFilterPruned )
+    {
+        delete pContext->pFilterPruned;
+        pContext->pFilterPruned = NULL;
+    }
+    if ( NULL != pContext->pOutputPending )
+    {
+        wpdOutput_FlushPending( pContext );
+        delete pContext->pOutputPending;
+        pContext->pOutputPending = NULL;
+    }
+
+    if ( NULL != pContext->pKeysFileOnly )
+    {
+        pContext->pKeysFileOnly->Release();
+        pContext->pKeysFileOnly = NULL;
+    }
+    if ( NULL != pContext->pKeysFolder )
+    {
+        pContext->pKeysFolder->Release();
+        pContext->pKeysFolder = NULL;
+    }
+    if ( NULL != pContext->pKeysFile )
+    {
+        pContext->pKeysFile->Release();
+        pContext->pKeysFile = NULL;
+    }
+
+    if ( NULL != pContext->pBulkMissing )
+    {
+        delete pContext->pBulkMissing;
+        pContext->pBulkMissing = NULL;
+    }
+    if ( NULL != pContext->pPortableDevicePropertiesBulk )
+    {
+        pContext->pPortableDevicePropertiesBulk->Release();
+        pContext->pPortableDevicePropertiesBulk = NULL;
+    }
+
+    if ( NULL != pContext->pPortableDeviceProperties )
+    {
+        const DWORD dwCount = pContext->pPortableDeviceProperties->Release();
+        LOGV( L"pPortableDeviceProperties::Release, count=%u\n", dwCount );
+        pContext->pPortableDeviceProperties = NULL;
+    }
+}
+
+IPortableDeviceValues*
+wpdCreateClientInformation(void)
+{
+    IPortableDeviceValues* pPortableDeviceValues = NULL;
+    {
+        const HRESULT hr = ::CoCreateInstance(
+            CLSID_PortableDeviceValues
+            , NULL
+            , CLSCTX_INPROC_SERVER
+            , IID_PPV_ARGS(&pPortableDeviceValues)
+            );
+        if ( FAILED(hr) )
+        {
+            LOGE( L"! Failed. CoCreateInstance CLSID_PortableDeviceValues, hr=0x%08x\n", hr );
+        }
+    }
+
+    if ( NULL != pPortableDeviceValues )
+    {
+        const WCHAR szClientName[] = L"WPD client";
+        const DWORD dwClientVersionMajor = 1;
+        const DWORD dwClientVersionMinor = 0;
+        const DWORD dwClientRevision = 1;
+        {
+            const HRESULT hr =
+                pPortableDeviceValues->SetStringValue(
+                    WPD_CLIENT_NAME, szClientName
+                );
+            if ( FAILED(hr) )
+            {
+                LOGE( L"! Failed. IPortableDeviceValues::SetStringValue WPD_CLIENT_NAME, hr=0x%08x\n", hr );
+            }
+        }
+        {
+            const HRESULT hr =
+                pPortableDeviceValues->SetUnsignedIntegerValue(
+                    WPD_CLIENT_MAJOR_VERSION, dwClientVersionMajor
+                );
+            if ( FAILED(hr) )
+            {
+                LOGE( L"! Failed. IPortableDeviceValues::SetUnsignedIntegerValue WPD_CLIENT_MAJOR_VERSION, hr=0x%08x\n", hr );
+            }
+        }
+        {
+            const HRESULT hr =
+                pPortableDeviceValues->SetUnsignedIntegerValue(
+                    WPD_CLIENT_MINOR_VERSION, dwClientVersionMinor
+                );
+            if ( FAILED(hr) )
+            {
+                LOGE( L"! Failed. IPortableDeviceValues::SetUnsignedIntegerValue WPD_CLIENT_MINOR_VERSION, hr=0x%08x\n", hr );
+            }
+        }
+        {
+            const HRESULT hr =
+                pPortableDeviceValues->SetUnsignedIntegerValue(
+                    WPD_CLIENT_REVISION, dwClientRevision
+                );
+            if ( FAILED(hr) )
+            {
+                LOGE( L"! Failed. IPortableDeviceValues::SetUnsignedIntegerValue WPD_CLIENT_REVISION, hr=0x%08x\n", hr );
+            }
+        }
+
+        {
+            const HRESULT hr =
+                pPortableDeviceValues->SetUnsignedIntegerValue(
+                    WPD_CLIENT_SECURITY_QUALITY_OF_SERVICE, SECURITY_IMPERSONATION
+                );
+            if ( FAILED(hr) )
+            {
+                LOGE( L"! Failed. IPortableDeviceValues::SetUnsignedIntegerValue WPD_CLIENT_SECURITY_QUALITY_OF_SERVICE, hr=0x%08x\n", hr );
+            }
+        }
+
+        {
+            const HRESULT hr =
+                pPortableDeviceValues->SetUnsignedIntegerValue(
+                    WPD_CLIENT_DESIRED_ACCESS, GENERIC_READ
+                );
+            if ( FAILED(hr) )
+            {
+                LOGE( L"! Failed. IPortableDeviceValues::SetUnsignedIntegerValue WPD_CLIENT_DESIRED_ACCESS, hr=0x%08x\n", hr );
+            }
+        }
+
+        {
+            const HRESULT hr =
+                pPortableDeviceValues->SetUnsignedIntegerValue(
+                    WPD_CLIENT_SHARE_MODE, FILE_SHARE_READ|FILE_SHARE_WRITE
+                );
+            if ( FAILED(hr) )
+            {
+                LOGE( L"! Failed. IPortableDeviceValues::SetUnsignedIntegerValue WPD_CLIENT_DESIRED_ACCESS, hr=0x%08x\n", hr );
+            }
+        }
+
+    }
+
+    return pPortableDeviceValues;
+}
+
+IPortableDevice*
+wpdOpenPortableDevice(
+    LPCWSTR pszPnPDeviceID
+)
+{
+    if ( NULL == pszPnPDeviceID )
+    {
+        return NULL;
+    }
+
+    IPortableDeviceValues* pPortableDeviceValues = wpdCreateClientInformation();
+
+    bool readyPortableDevice = false;
+    IPortableDevice* pPortableDevice = NULL;
+    {
+        const IID& rclsid = (s_optUsePortableDeviceFTM)?(myCLSID_PortableDeviceFTM):(CLSID_PortableDevice);
+        const HRESULT hr = ::CoCreateInstance(
+            rclsid
+            , NULL
+            , CLSCTX_INPROC_SERVER
+            , IID_PPV_ARGS(&pPortableDevice)
+            );
+        if ( FAILED(hr) )
+        {
+            LOGE( L"! Failed. CoCreateInstance CLSID_PortableDevice, hr=0x%08x\n", hr );
+        }
+    }
+
+    if ( NULL != pPortableDevice )
+    {
+        WpdDeviceStats* pStats = wpdStats_Device( pszPnPDeviceID );
+        const ULONGLONG qwTicksCall = wpdStats_Begin( pStats );
+        const HRESULT hr = pPortableDevice->Open( pszPnPDeviceID, pPortableDeviceValues );
+        wpdStats_End( pStats, WPD_STAT_OP_OPEN, qwTicksCall, hr, 0 );
+        if ( FAILED(hr) )
+        {
+            LOGE( L"! Failed. IPortableDevice::Open, hr=0x%08x\n", hr );
+        }
+        else
+        {
+            readyPortableDevice = true;
+        }
+    }
+
+    if ( NULL != pPortableDevice && false == readyPortableDevice )
+    {
+        const DWORD dwCount = pPortableDevice->Release();
+        LOGV( L"IPortableDevice::Release, count=%u\n", dwCount );
+        pPortableDevice = NULL;
+    }
+
+    if ( NULL != pPortableDeviceValues )
+    {
+        const DWORD dwCount = pPortableDeviceValues->Release();
+        LOGV( L"IPortableDeviceValues::Release, count=%u\n", dwCount );
+        pPortableDeviceValues = NULL;
+    }
+
+    return pPortableDevice;
+}
+
+// opened devices kept across scans. enumWPDcore runs again and again, Open() is by far its most expensive call
+struct WpdSession
+{
+    std::wstring                pnpDeviceId;
+    IPortableDevice*            pPortableDevice;
+    IPortableDeviceContent*     pPortableDeviceContent;
+    IPortableDeviceProperties*  pPortableDeviceProperties;
+    bool                        inUse;
+};
+
+typedef IPortableDevice* (*WpdOpenDeviceProc)( LPCWSTR pszPnPDeviceID );
+
+struct WpdSessionPool
+{
+    CRITICAL_SECTION                cs;
+    std::vector<WpdSession*>        sessions;
+    IPortableDeviceManager*         pPortableDeviceManager;
+    // one cheap round trip proves a pooled session still talks to its device
+    IPortableDeviceKeyCollection*   pKeysHealth;
+    WpdOpenDeviceProc               pfnOpen;
+
+    volatile LONG       nCountOpen;
+    volatile LONG       nCountOpenFailed;
+    volatile LONG       nCountReuse;
+    volatile LONG       nCountReopen;
+    volatile LONGLONG   qwMicrosecondsOpen;
+    volatile LONGLONG   qwMicrosecondsHealth;
+};
+
+static
+WpdSessionPool s_sessionPool;
+
+void
+wpdSessionPool_Start(
+    void
+)
+{
+    ::InitializeCriticalSection( &s_sessionPool.cs );
+    s_sessionPool.pPortableDeviceManager = NULL;
+    s_sessionPool.pKeysHealth = wpdCreatePropertyKeys( L"name", true );
+    s_sessionPool.pfnOpen = wpdOpenPortableDevice;
+    s_sessionPool.nCountOpen = 0;
+    s_sessionPool.nCountOpenFailed = 0;
+    s_sessionPool.nCountReuse = 0;
+    s_sessionPool.nCountReopen = 0;
+    s_sessionPool.qwMicrosecondsOpen = 0;
+    s_sessionPool.qwMicrosecondsHealth = 0;
+}
+
+void
+wpdSession_Close(
+    WpdSession* pSession
+)
+{
+    if ( NULL == pSession )
+    {
+        return;
+    }
+
+    if ( NULL != pSession->pPortableDeviceProperties )
+    {
+        pSession->pPortableDeviceProperties->Release();
+        pSession->pPortableDeviceProperties = NULL;
+    }
+    if ( NULL != pSession->pPortableDeviceContent )
+    {
+        const DWORD dwCount = pSession->pPortableDeviceContent->Release();
+        LOGV( L"IPortableDeviceContent::Release, count=%u\n", dwCount );
+        pSession->pPortableDeviceContent = NULL;
+    }
+    if ( NULL != pSession->pPortableDevice )
+    {
+        const DWORD dwCount = pSession->pPortableDevice->Release();
+        LOGV( L"IPortableDevice::Release, count=%u\n", dwCount );
+        pSession->pPortableDevice = NULL;
+    }
+
+    delete pSession;
+}
+
+// open the device and cache the interfaces every scan asks for
+WpdSession*
+wpdSession_Open(
+    LPCWSTR pszPnPDeviceID
+)
+{
+    const ULONGLONG qwTicksStart = wpdTicksNow();
+
+    WpdSession* pSession = new WpdSession();
+    pSession->pnpDeviceId.assign( pszPnPDeviceID );
+    pSession->pPortableDevice = s_sessionPool.pfnOpen( pszPnPDeviceID );
+    pSession->pPortableDeviceContent = NULL;
+    pSession->pPortableDeviceProperties = NULL;
+    pSession->inUse = true;
+
+    WpdDeviceStats* pStats = wpdStats_Device( pszPnPDeviceID );
+    if ( NULL != pSession->pPortableDevice )
+    {
+        const ULONGLONG qwTicksCall = wpdStats_Begin( pStats );
+        const HRESULT hr = pSession->pPortableDevice->Content( &pSession->pPortableDeviceContent );
+        wpdStats_End( pStats, WPD_STAT_OP_CONTENT, qwTicksCall, hr, 0 );
+        if ( FAILED(hr) )
+        {
+            LOGE( L"! Failed. IPortableDevice::Content, hr=0x%08x\n", hr );
+            pSession->pPortableDeviceContent = NULL;
+        }
+    }
+    if ( NULL != pSession->pPortableDeviceContent )
+    {
+        const ULONGLONG qwTicksCall = wpdStats_Begin( pStats );
+        const HRESULT hr = pSession->pPortableDeviceContent->Properties( &pSession->pPortableDeviceProperties );
+        wpdStats_End( pStats, WPD_STAT_OP_PROPERTIES, qwTicksCall, hr, 0 );
+        if ( FAILED(hr) )
+        {
+            LOGE( L"! Failed. pPortableDeviceContent Properties, hr=0x%08x\n", hr );
+            pSession->pPortableDeviceProperties = NULL;
+        }
+    }
+
+    if ( NULL == pSession->pPortableDeviceProperties )
+    {
+        wpdSession_Close( pSession );
+        ::InterlockedIncrement( &s_sessionPool.nCountOpenFailed );
+        return NULL;
+    }
+
+    ::InterlockedIncrement( &s_sessionPool.nCountOpen );
+    wpdStats_Add64( &s_sessionPool.qwMicrosecondsOpen, (LONGLONG)wpdTicksToMicroseconds( wpdTicksNow() - qwTicksStart ) );
+    return pSession;
+}
+
+bool
+wpdSession_Check(
+    WpdSession* pSession
+)
+{
+    const ULONGLONG qwTicksStart = wpdTicksNow();
+
+    IPortableDeviceValues* pValues = NULL;
+    const HRESULT hr = pSession->pPortableDeviceProperties->GetValues( WPD_DEVICE_OBJECT_ID, s_sessionPool.pKeysHealth, &pValues );
+    if ( NULL != pValues )
+    {
+        pValues->Release();
+        pValues = NULL;
+    }
+
+    wpdStats_Add64( &s_sessionPool.qwMicrosecondsHealth, (LONGLONG)wpdTicksToMicroseconds( wpdTicksNow() - qwTicksStart ) );
+    if ( FAILED(hr) )
+    {
+        LOGI( L"    session of %s is stale, hr=0x%08x. reopen\n", pSession->pnpDeviceId.c_str(), hr );
+        return false;
+    }
+    return true;
+}
+
+// an idle healthy session of the device, or a newly opened one. NULL when the device cannot be opened
+WpdSession*
+wpdSessionPool_Acquire(
+    LPCWSTR pszPnPDeviceID
+)
+{
+    if ( NULL == pszPnPDeviceID )
+    {
+        return NULL;
+    }
+
+    WpdSession* pSession = NULL;
+    ::EnterCriticalSection( &s_sessionPool.cs );
+    for ( size_t index = 0; index < s_sessionPool.sessions.size(); ++index )
+    {
+        WpdSession* pCandidate = s_sessionPool.sessions[index];
+        if ( false == pCandidate->inUse && pCandidate->pnpDeviceId == pszPnPDeviceID )
+        {
+            pCandidate->inUse = true;
+            pSession = pCandidate;
+            break;
+        }
+    }
+    ::LeaveCriticalSection( &s_sessionPool.cs );
+
+    if ( NULL != pSession )
+    {
+        if ( wpdSession_Check( pSession ) )
+        {
+            ::InterlockedIncrement( &s_sessionPool.nCountReuse );
+            return pSession;
+        }
+
+        // marked in use above, so nobody else could have taken it out; it is closed either way
+        ::EnterCriticalSection( &s_sessionPool.cs );
+        const std::vector<WpdSession*>::iterator it = std::find( s_sessionPool.sessions.begin(), s_sessionPool.sessions.end(), pSession );
+        if ( s_sessionPool.sessions.end() != it )
+        {
+            s_sessionPool.sessions.erase( it );
+        }
+        else
+        {
+            LOGE( L"! Failed. session of %s not in the pool\n", pszPnPDeviceID );
+        }
+        ::LeaveCriticalSection( &s_sessionPool.cs );
+        wpdSession_Close( pSession );
+        pSession = NULL;
+        ::InterlockedIncrement( &s_sessionPool.nCountReopen );
+    }
+
+    pSession = wpdSession_Open( pszPnPDeviceID );
+    if ( NULL != pSession )
+    {
+        ::EnterCriticalSection( &s_sessionPool.cs );
+        s_sessionPool.sessions.push_back( pSession );
+        ::LeaveCriticalSection( &s_sessionPool.cs );
+    }
+    return pSession;
+}
+
+// a session whose scan failed is closed, the next acquire opens the device again
+void
+wpdSessionPool_Release(
+    WpdSession* pSession
+    , const bool healthy
+)
+{
+    if ( NULL == pSession )
+    {
+        return;
+    }
+
+    // a session the pool does not hold was released before, or never came from it; it is left alone
+    const bool keep = healthy && false == s_optNoSessionPool;
+    ::EnterCriticalSection( &s_sessionPool.cs );
+    const std::vector<WpdSession*>::iterator it = std::find( s_sessionPool.sessions.begin(), s_sessionPool.sessions.end(), pSession );
+    const bool pooled = (s_sessionPool.sessions.end() != it);
+    if ( pooled && keep )
+    {
+        pSession->inUse = false;
+    }
+    else
+    if ( pooled )
+    {
+        s_sessionPool.sessions.erase( it );
+    }
+    ::LeaveCriticalSection( &s_sessionPool.cs );
+
+    if ( false == pooled )
+    {
+        LOGE( L"! Failed. released a session not in the pool\n" );
+        return;
+    }
+
+    if ( false == keep )
+    {
+        wpdSession_Close( pSession );
+    }
+}
+
+// close the idle sessions of one device, or of every device with NULL
+void
+wpdSessionPool_Close(
+    LPCWSTR pszPnPDeviceID
+)
+{
+    std::vector<WpdSession*> closing;
+    ::EnterCriticalSection( &s_sessionPool.cs );
+    for ( size_t index = 0; index < s_sessionPool.sessions.size(); )
+    {
+        WpdSession* pSession = s_sessionPool.sessions[index];
+        if ( false == pSession->inUse && (NULL == pszPnPDeviceID || pSession->pnpDeviceId == pszPnPDeviceID) )
+        {
+            closing.push_back( pSession );
+            s_sessionPool.sessions.erase( s_sessionPool.sessions.begin() + index );
+            continue;
+        }
+        index += 1;
+    }
+    ::LeaveCriticalSection( &s_sessionPool.cs );
+
+    for ( size_t index = 0; index < closing.size(); ++index )
+    {
+        wpdSession_Close( closing[index] );
+    }
+}
+
+// the manager is kept too, AddRef'ed for the caller
+IPortableDeviceManager*
+wpdSessionPool_Manager(
+    void
+)
+{
+    ::EnterCriticalSection( &s_sessionPool.cs );
+    if ( NULL == s_sessionPool.pPortableDeviceManager )
+    {
+        const HRESULT hr = ::CoCreateInstance(
+            CLSID_PortableDeviceManager
+            , NULL
+            , CLSCTX_INPROC_SERVER
+            , IID_PPV_ARGS(&s_sessionPool.pPortableDeviceManager)
+            );
+        if ( FAILED(hr) )
+        {
+            LOGE( L"! Failed. CoCreateInstance CLSID_PortableDeviceManager, hr=0x%08x\n", hr );
+            s_sessionPool.pPortableDeviceManager = NULL;
+        }
+    }
+    IPortableDeviceManager* pPortableDeviceManager = s_sessionPool.pPortableDeviceManager;
+    if ( NULL != pPortableDeviceManager )
+    {
+        pPortableDeviceManager->AddRef();
+    }
+    if ( s_optNoSessionPool )
+    {
+        s_sessionPool.pPortableDeviceManager = NULL;
+        if ( NULL != pPortableDeviceManager )
+        {
+            pPortableDeviceManager->Release();
+        }
+    }
+    ::LeaveCriticalSection( &s_sessionPool.cs );
+
+    return pPortableDeviceManager;
+}
+
+void
+wpdSessionPool_Report(
+    void
+)
+{
+    const double dOpen = (0 < s_sessionPool.nCountOpen)?((double)s_sessionPool.qwMicrosecondsOpen / s_sessionPool.nCountOpen):(0.0);
+    const double dSaved = dOpen * s_sessionPool.nCountReuse - (double)s_sessionPool.qwMicrosecondsHealth;
+    LOGI( L"Sessions   : opened=%ld, reused=%ld, reopened=%ld, open failed=%ld, open avg=%.1fms, health checks=%.1fms, saved=%.1fms\n"
+        , s_sessionPool.nCountOpen
+        , s_sessionPool.nCountReuse
+        , s_sessionPool.nCountReopen
+        , s_sessionPool.nCountOpenFailed
+        , dOpen / 1000.0
+        , s_sessionPool.qwMicrosecondsHealth / 1000.0
+        , dSaved / 1000.0
+        );
+}
+
+void
+wpdSessionPool_Stop(
+    void
+)
+{
+    wpdSessionPool_Close( NULL );
+    if ( NULL != s_sessionPool.pPortableDeviceManager )
+    {
+        const DWORD dwCount = s_sessionPool.pPortableDeviceManager->Release();
+        LOGV( L"IPortableDeviceManager::Release, count=%u\n", dwCount );
+        s_sessionPool.pPortableDeviceManager = NULL;
+    }
+    if ( NULL != s_sessionPool.pKeysHealth )
+    {
+        s_sessionPool.pKeysHealth->Release();
+        s_sessionPool.pKeysHealth = NULL;
+    }
+    ::DeleteCriticalSection( &s_sessionPool.cs );
+}
+
+struct WpdWalkTask
+{
+    LPWSTR  pszObjectId;
+    LPWSTR  pszParentObjectId;  // NULL for the device object
+    bool    needProperties;
+};
+
+struct WpdWalkDeque
+{
+    CRITICAL_SECTION            cs;
+    std::deque<WpdWalkTask>     tasks;
+};
+
+struct WpdParallelWalk
+{
+    WpdDeviceScan*  pScan;
+    DWORD           dwCountWorker;
+    WpdWalkDeque*   pDequeArray;
+    volatile LONG   nPendingTask;
+    volatile LONG   nFailed;
+    volatile LONG   nCountSteal;
+};
+
+struct WpdWalkWorker
+{
+    WpdParallelWalk*        pWalk;
+    DWORD                   dwIndex;
+    IPortableDeviceContent* pPortableDeviceContent;
+    WpdSession*             pSession;       // NULL for walker 0, it uses the scan's session
+    WpdEnumContext          context;
+    bool                    readyContext;
+    DWORD                   dwCountTask;
+    WpdScratchPool          scratchPool;    // of the walker thread
+};
+
+void
+wpdParallelWalk_Push(
+    WpdWalkWorker* pWorker
+    , LPCWSTR pszObjectId
+    , LPCWSTR pszParentObjectId
+    , const bool needProperties
+)
+{
+    WpdWalkTask task;
+    task.pszObjectId = ::_wcsdup( pszObjectId );
+    task.pszParentObjectId = (NULL != pszParentObjectId)?(::_wcsdup( pszParentObjectId )):(NULL);
+    task.needProperties = needProperties;
+
+    ::InterlockedIncrement( &pWorker->pWalk->nPendingTask );
+
+    WpdWalkDeque& deque = pWorker->pWalk->pDequeArray[pWorker->dwIndex];
+    ::EnterCriticalSection( &deque.cs );
+    deque.tasks.push_back( task );
+    ::LeaveCriticalSection( &deque.cs );
+}
+
+// owner takes the newest task (depth first), thieves take the oldest (largest subtrees)
+bool
+wpdParallelWalk_Pop(
+    WpdWalkWorker* pWorker
+    , WpdWalkTask* pTask
+)
+{
+    WpdParallelWalk* pWalk = pWorker->pWalk;
+    {
+        WpdWalkDeque& deque = pWalk->pDequeArray[pWorker->dwIndex];
+        ::EnterCriticalSection( &deque.cs );
+        const bool found = !deque.tasks.empty();
+        if ( found )
+        {
+            *pTask = deque.tasks.back();
+            deque.tasks.pop_back();
+        }
+        ::LeaveCriticalSection( &deque.cs );
+        if ( found )
+        {
+            return true;
+        }
+    }
+
+    for ( DWORD offset = 1; offset < pWalk->dwCountWorker; ++offset )
+    {
+        WpdWalkDeque& deque = pWalk->pDequeArray[(pWorker->dwIndex + offset) % pWalk->dwCountWorker];
+        ::EnterCriticalSection( &deque.cs );
+        const bool found = !deque.tasks.empty();
+        if ( found )
+        {
+            *pTask = deque.tasks.front();
+            deque.tasks.pop_front();
+        }
+        ::LeaveCriticalSection( &deque.cs );
+        if ( found )
+        {
+            ::InterlockedIncrement( &pWalk->nCountSteal );
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool
+wpdParallelWalk_Child(
+    LPCWSTR pszObjectId
+    , const bool needProperties
+    , void* pParam
+)
+{
+    WpdWalkWorker* pWorker = reinterpret_cast<WpdWalkWorker*>(pParam);
+    wpdParallelWalk_Push( pWorker, pszObjectId, pWorker->context.pszParentObjectId, needProperties );
+    return true;
+}
+
+void
+wpdParallelWalk_Run(
+    WpdWalkWorker* pWorker
+)
+{
+    WpdParallelWalk* pWalk = pWorker->pWalk;
+
+    DWORD dwIdle = 0;
+    for ( ;; )
+    {
+        WpdWalkTask task;
+        if ( wpdParallelWalk_Pop( pWorker, &task ) )
+        {
+            dwIdle = 0;
+            if ( 0 == pWalk->nFailed )
+            {
+                // the task may come from another worker: its parent is not on this context
+                pWorker->context.pszParentObjectId = task.pszParentObjectId;
+                const bool result = wpdEnumContent_EnumerateObject(
+                    task.pszObjectId
+                    , &pWorker->context
+                    , task.needProperties
+                    , wpdParallelWalk_Child
+                    , pWorker
+                    );
+                if ( false == result )
+                {
+                    ::InterlockedExchange( &pWalk->nFailed, 1 );
+                }
+                pWorker->dwCountTask += 1;
+            }
+            ::free( task.pszObjectId );
+            ::free( task.pszParentObjectId );
+            pWorker->context.pszParentObjectId = NULL;
+
+            // children were pushed before this decrement, so zero means the walk is done
+            ::InterlockedDecrement( &pWalk->nPendingTask );
+            continue;
+        }
+
+        if ( 0 == pWalk->nPendingTask )
+        {
+            break;
+        }
+
+        dwIdle += 1;
+        if ( dwIdle < 16 )
+        {
+            ::SwitchToThread();
+        }
+        else
+        {
+            ::Sleep( 1 );
+        }
+    }
+}
+
+unsigned __stdcall
+wpdParallelWalk_Worker( void* pParam )
+{
+    WpdWalkWorker* pWorker = reinterpret_cast<WpdWalkWorker*>(pParam);
+    if ( NULL == pWorker )
+    {
+        return 1;
+    }
+
+    bool needCoUninitialize = false;
+    {
+        const DWORD dwCoInit = COINIT_MULTITHREADED | COINIT_DISABLE_OLE1DDE;
+        const HRESULT hr = ::CoInitializeEx( NULL, dwCoInit );
+        if ( FAILED(hr) )
+        {
+            LOGE( L"! Failed. walker CoInitializeEx, hr=0x%08x\n", hr );
+            return 1;
+        }
+        needCoUninitialize = true;
+    }
+
+    // own session on the same device, released by the owner after merging the context
+    pWorker->pSession = wpdSessionPool_Acquire( pWorker->pWalk->pScan->pszPnPDeviceID );
+    if ( NULL != pWorker->pSession )
+    {
+        pWorker->pPortableDeviceContent = pWorker->pSession->pPortableDeviceContent;
+        pWorker->readyContext = wpdEnumContext_Init(
+            &pWorker->context
+            , pWorker->pPortableDeviceContent
+            , pWorker->pSession->pPortableDeviceProperties
+            , pWorker->pWalk->pScan
+            );
+        if ( pWorker->readyContext )
+        {
+            pWorker->context.pScratchPool = &pWorker->scratchPool;
+            wpdParallelWalk_Run( pWorker );
+        }
+    }
+
+    if ( needCoUninitialize )
+    {
+        ::CoUninitialize();
+    }
+
+    return 0;
+}
+
+// split the walk of one device into folder tasks on work stealing deques, one session per walker
+bool
+wpdEnumContent_Parallel(
+    IPortableDeviceContent* pPortableDeviceContent
+    , IPortableDeviceProperties* pPortableDeviceProperties
+    , WpdDeviceScan* pScan
+)
+{
+    const DWORD dwCountWorker = s_optCountOfWalkers;
+
+    WpdParallelWalk walk;
+    walk.pScan = pScan;
+    walk.dwCountWorker = dwCountWorker;
+    walk.pDequeArray = new WpdWalkDeque[dwCountWorker];
+    walk.nPendingTask = 0;
+    walk.nFailed = 0;
+    walk.nCountSteal = 0;
+    for ( DWORD index = 0; index < dwCountWorker; ++index )
+    {
+        ::InitializeCriticalSection( &walk.pDequeArray[index].cs );
+    }
+
+    WpdWalkWorker* pWorkerArray = new WpdWalkWorker[dwCountWorker];
+    for ( DWORD index = 0; index < dwCountWorker; ++index )
+    {
+        WpdWalkWorker& worker = pWorkerArray[index];
+        worker.pWalk = &walk;
+        worker.dwIndex = index;
+        worker.pPortableDeviceContent = NULL;
+        worker.pSession = NULL;
+        worker.readyContext = false;
+        worker.dwCountTask = 0;
+    }
+
+    // walker 0 runs on this thread with the already opened session
+    WpdWalkWorker& owner = pWorkerArray[0];
+    owner.pPortableDeviceContent = pPortableDeviceContent;
+    owner.readyContext = wpdEnumContext_Init( &owner.context, pPortableDeviceContent, pPortableDeviceProperties, pScan );
+    if ( false == owner.readyContext )
+    {
+        walk.nFailed = 1;
+    }
+    else
+    {
+        wpdParallelWalk_Push( &owner, WPD_DEVICE_OBJECT_ID, NULL, true );
+    }
+
+    HANDLE* phWorkerArray = new HANDLE[dwCountWorker];
+    phWorkerArray[0] = NULL;
+    for ( DWORD index = 1; index < dwCountWorker; ++index )
+    {
+        phWorkerArray[index] = NULL;
+        if ( owner.readyContext )
+        {
+            phWorkerArray[index] = reinterpret_cast<HANDLE>(
+                ::_beginthreadex( NULL, 0, wpdParallelWalk_Worker, &pWorkerArray[index], 0, NULL )
+                );
+            if ( NULL == phWorkerArray[index] )
+            {
+                LOGE( L"! Failed. _beginthreadex walker %u\n", index );
+            }
+        }
+    }
+
+    if ( owner.readyContext )
+    {
+        wpdParallelWalk_Run( &owner );
+    }
+
+    for ( DWORD index = 1; index < dwCountWorker; ++index )
+    {
+        if ( NULL != phWorkerArray[index] )
+        {
+            ::WaitForSingleObject( phWorkerArray[index], INFINITE );
+            ::CloseHandle( phWorkerArray[index] );
+            phWorkerArray[index] = NULL;
+        }
+    }
+    delete [] phWorkerArray;
+    phWorkerArray = NULL;
+
+    const bool result = owner.readyContext && (0 == walk.nFailed);
+
+    for ( DWORD index = 1; index < dwCountWorker; ++index )
+    {
+        WpdWalkWorker& worker = pWorkerArray[index];
+        LOGV( L"walker %u: tasks=%u\n", index, worker.dwCountTask );
+        if ( worker.readyContext )
+        {
+            wpdEnumContext_Merge( &owner.context, &worker.context );
+            wpdEnumContext_Term( &worker.context );
+        }
+        worker.pPortableDeviceContent = NULL;
+        wpdSessionPool_Release( worker.pSession, worker.readyContext && 0 == walk.nFailed );
+        worker.pSession = NULL;
+    }
+
+    if ( owner.readyContext )
+    {
+        if ( NULL != pScan )
+        {
+            pScan->dwCountContent = owner.context.dwCountContent;
+            pScan->dwCountObjectValues = owner.context.dwCountObjectValues;
+            pScan->dwCountFilterFolder = owner.context.dwCountFilterFolder;
+            pScan->dwCountFilterFile = owner.context.dwCountFilterFile;
+            pScan->dwCountFilterEnumSaved = owner.context.dwCountFilterEnumSaved;
+            pScan->nCountHeapAlloc = s_nCountHeapAlloc - owner.context.nCountHeapAllocStart;
+            pScan->nCountCoTaskAlloc = s_nCountCoTaskAlloc - owner.context.nCountCoTaskAllocStart;
+        }
+        LOGI( L"    Walkers=%u, steals=%u\n", dwCountWorker, walk.nCountSteal );
+        wpdEnumContext_Report( &owner.context );
+        wpdEnumContext_Term( &owner.context );
+    }
+
+    for ( DWORD index = 1; index < dwCountWorker; ++index )
+    {
+        wpdScratchPool_Term( &pWorkerArray[index].scratchPool );
+    }
+    delete [] pWorkerArray;
+    pWorkerArray = NULL;
+
+    // tasks left over after a failure
+    for ( DWORD index = 0; index < dwCountWorker; ++index )
+    {
+        WpdWalkDeque& deque = walk.pDequeArray[index];
+        while ( !deque.tasks.empty() )
+        {
+            ::free( deque.tasks.back().pszObjectId );
+            ::free( deque.tasks.back().pszParentObjectId );
+            deque.tasks.pop_back();
+        }
+        ::DeleteCriticalSection( &deque.cs );
+    }
+    delete [] walk.pDequeArray;
+    walk.pDequeArray = NULL;
+
+    return result;
+}
+
+bool
+wpdEnumContent(
+    IPortableDeviceContent* pPortableDeviceContent
+    , IPortableDeviceProperties* pPortableDeviceProperties
+    , WpdDeviceScan* pScan
+)
+{
+    if ( NULL == pPortableDeviceContent )
+    {
+        return false;
+    }
+
+    // the parallel walker has no single frontier to checkpoint and no ordered parent chain for the cache
+    if ( 1 < s_optCountOfWalkers && NULL != pScan && NULL == s_optResumeFile && NULL == s_optCacheDir )
+    {
+        return wpdEnumContent_Parallel( pPortableDeviceContent, pPortableDeviceProperties, pScan );
+    }
+
+    WpdEnumContext context;
+    if ( false == wpdEnumContext_Init( &context, pPortableDeviceContent, pPortableDeviceProperties, pScan ) )
+    {
+        return false;
+    }
+
+    WpdScanCache* pCache = NULL;
+    if ( NULL != s_optCacheDir )
+    {
+        pCache = new WpdScanCache();
+        pCache->loaded = false;
+        pCache->dwCountSkipFolder = 0;
+        pCache->dwCountSkipObject = 0;
+        context.pCache = pCache;
+    }
+
+    const bool result = wpdEnumContent_IterativeEnumerate( &context );
+
+    if ( NULL != pCache )
+    {
+        if ( false != result && !pCache->serial.empty() )
+        {
+            wpdScanCache_Report( pCache );
+            wpdScanCache_Save( pCache );
+        }
+        context.pCache = NULL;
+        delete pCache;
+        pCache = NULL;
+    }
+    if ( NULL != pScan )
+    {
+        pScan->dwCountContent = context.dwCountContent;
+        pScan->dwCountObjectValues = context.dwCountObjectValues;
+        pScan->dwCountFilterFolder = context.dwCountFilterFolder;
+        pScan->dwCountFilterFile = context.dwCountFilterFile;
+        pScan->dwCountFilterEnumSaved = context.dwCountFilterEnumSaved;
+        pScan->nCountHeapAlloc = s_nCountHeapAlloc - context.nCountHeapAllocStart;
+        pScan->nCountCoTaskAlloc = s_nCountCoTaskAlloc - context.nCountCoTaskAllocStart;
+    }
+
+    wpdEnumContext_Report( &context );
+    wpdEnumContext_Term( &context );
+
+    return result;
+}
+
+// what dispDeviceInfo shows of a device
+struct WpdDeviceInfo
+{
+    std::wstring    friendlyName;
+    std::wstring    manufacturer;
+    std::wstring    description;
+};
+
+// device info per PnP id, dropped when the device arrives again or is gone from the device list
+struct WpdDeviceInfoCache
+{
+    CRITICAL_SECTION                        cs;
+    std::map<std::wstring, WpdDeviceInfo>   entries;    // lower case PnP id
+    volatile LONG   nCountHit;
+    volatile LONG   nCountMiss;
+    volatile LONG   nCountInvalidate;
+    volatile LONG   nCountManagerCall;
+};
+
+static
+WpdDeviceInfoCache s_deviceInfoCache;
+
+// first guess for the string buffer, most names fit
+#define WPD_DEVICE_INFO_BUFFER_MIN  (64U)
+
+typedef HRESULT (STDMETHODCALLTYPE IPortableDeviceManager::*WpdDeviceInfoProc)( LPCWSTR, WCHAR*, DWORD* );
+
+void
+wpdDeviceInfoCache_Start(
+    void
+)
+{
+    ::InitializeCriticalSection( &s_deviceInfoCache.cs );
+    s_deviceInfoCache.nCountHit = 0;
+    s_deviceInfoCache.nCountMiss = 0;
+    s_deviceInfoCache.nCountInvalidate = 0;
+    s_deviceInfoCache.nCountManagerCall = 0;
+}
+
+void
+wpdDeviceInfoCache_Stop(
+    void
+)
+{
+    s_deviceInfoCache.entries.clear();
+    ::DeleteCriticalSection( &s_deviceInfoCache.cs );
+}
+
+// the manager and the device notifications do not agree on the case of the id
+void
+wpdDeviceInfoCache_Key(
+    LPCWSTR pszPnPDeviceID
+    , std::wstring* pKey
+)
+{
+    pKey->assign( pszPnPDeviceID );
+    for ( size_t index = 0; index < pKey->size(); ++index )
+    {
+        (*pKey)[index] = (WCHAR)::towlower( (*pKey)[index] );
+    }
+}
+
+void
+wpdDeviceInfoCache_Invalidate(
+    LPCWSTR pszPnPDeviceID
+)
+{
+    std::wstring key;
+    wpdDeviceInfoCache_Key( pszPnPDeviceID, &key );
+
+    ::EnterCriticalSection( &s_deviceInfoCache.cs );
+    if ( 0 < s_deviceInfoCache.entries.erase( key ) )
+    {
+        s_deviceInfoCache.nCountInvalidate += 1;
+    }
+    ::LeaveCriticalSection( &s_deviceInfoCache.cs );
+}
+
+// drop the devices which are no longer listed
+void
+wpdDeviceInfoCache_Retain(
+    LPWSTR* pDeviceIdArray
+    , const DWORD dwCountDeviceId
+)
+{
+    std::set<std::wstring> present;
+    for ( DWORD index = 0; index < dwCountDeviceId; ++index )
+    {
+        if ( NULL != pDeviceIdArray[index] )
+        {
+            std::wstring key;
+            wpdDeviceInfoCache_Key( pDeviceIdArray[index], &key );
+            present.insert( key );
+        }
+    }
+
+    ::EnterCriticalSection( &s_deviceInfoCache.cs );
+    std::map<std::wstring, WpdDeviceInfo>::iterator it = s_deviceInfoCache.entries.begin();
+    while ( it != s_deviceInfoCache.entries.end() )
+    {
+        if ( present.end() == present.find( it->first ) )
+        {
+            s_deviceInfoCache.entries.erase( it++ );
+            s_deviceInfoCache.nCountInvalidate += 1;
+        }
+        else
+        {
+            ++it;
+        }
+    }
+    ::LeaveCriticalSection( &s_deviceInfoCache.cs );
+}
+
+// one call with the pooled buffer, a second one only when it was too small
+bool
+wpdDeviceInfo_FetchString(
+    IPortableDeviceManager* pPortableDeviceManager
+    , WpdDeviceInfoProc pfnGet
+    , const WpdStatOp op
+    , LPCWSTR pszPnPDeviceID
+    , std::vector<WCHAR>* pScratch
+    , std::wstring* pValue
+)
+{
+    if ( pScratch->size() < WPD_DEVICE_INFO_BUFFER_MIN )
+    {
+        pScratch->resize( WPD_DEVICE_INFO_BUFFER_MIN );
+    }
+
+    WpdDeviceStats* pStats = wpdStats_Device( pszPnPDeviceID );
+    for ( DWORD attempt = 0; attempt < 2; ++attempt )
+    {
+        DWORD dwSize = (DWORD)pScratch->size();
+        (*pScratch)[0] = L'\0';
+
+        const ULONGLONG qwTicksCall = wpdStats_Begin( pStats );
+        const HRESULT hr = (pPortableDeviceManager->*pfnGet)( pszPnPDeviceID, &(*pScratch)[0], &dwSize );
+        wpdStats_End( pStats, op, qwTicksCall, hr, 0 );
+        ::InterlockedIncrement( &s_deviceInfoCache.nCountManagerCall );
+
+        if ( SUCCEEDED(hr) )
+        {
+            pValue->assign( &(*pScratch)[0] );
+            return true;
+        }
+        if ( HRESULT_FROM_WIN32(ERROR_INSUFFICIENT_BUFFER) != hr || dwSize <= pScratch->size() )
+        {
+            LOGE( L"! Failed. IPortableDeviceManager::GetDevice%s, hr=0x%08x\n", s_statOpNames[op], hr );
+            return false;
+        }
+
+        // dwSize is the length it needs, terminator included
+        pScratch->resize( dwSize );
+    }
+
+    return false;
+}
+
+bool
+wpdDeviceInfoCache_Get(
+    IPortableDeviceManager* pPortableDeviceManager
+    , LPCWSTR pszPnPDeviceID
+    , std::vector<WCHAR>* pScratch
+    , WpdDeviceInfo* pInfo
+)
+{
+    std::wstring key;
+    wpdDeviceInfoCache_Key( pszPnPDeviceID, &key );
+
+    bool found = false;
+    ::EnterCriticalSection( &s_deviceInfoCache.cs );
+    {
+        std::map<std::wstring, WpdDeviceInfo>::const_iterator it = s_deviceInfoCache.entries.find( key );
+        if ( s_deviceInfoCache.entries.end() != it )
+        {
+            *pInfo = it->second;
+            found = true;
+        }
+    }
+    ::LeaveCriticalSection( &s_deviceInfoCache.cs );
+
+    if ( found )
+    {
+        ::InterlockedIncrement( &s_deviceInfoCache.nCountHit );
+        return true;
+    }
+    ::InterlockedIncrement( &s_deviceInfoCache.nCountMiss );
+
+    const bool result =
+        wpdDeviceInfo_FetchString( pPortableDeviceManager, &IPortableDeviceManager::GetDeviceFriendlyName, WPD_STAT_OP_FRIENDLY_NAME, pszPnPDeviceID, pScratch, &pInfo->friendlyName )
+        && wpdDeviceInfo_FetchString( pPortableDeviceManager, &IPortableDeviceManager::GetDeviceManufacturer, WPD_STAT_OP_MANUFACTURER, pszPnPDeviceID, pScratch, &pInfo->manufacturer )
+        && wpdDeviceInfo_FetchString( pPortableDeviceManager, &IPortableDeviceManager::GetDeviceDescription, WPD_STAT_OP_DESCRIPTION, pszPnPDeviceID, pScratch, &pInfo->description );
+    if ( result )
+    {
+        ::EnterCriticalSection( &s_deviceInfoCache.cs );
+        s_deviceInfoCache.entries[key] = *pInfo;
+        ::LeaveCriticalSection( &s_deviceInfoCache.cs );
+    }
+
+    return result;
+}
+
+void
+wpdDeviceInfoCache_Report(
+    void
+)
+{
+    const LONG nCountLookup = s_deviceInfoCache.nCountHit + s_deviceInfoCache.nCountMiss;
+    LOGI( L"DeviceInfo : hits=%ld, misses=%ld, hit rate=%.1f%%, invalidated=%ld, manager calls=%ld\n"
+        , s_deviceInfoCache.nCountHit
+        , s_deviceInfoCache.nCountMiss
+        , (0 < nCountLookup)?(s_deviceInfoCache.nCountHit * 100.0 / nCountLookup):(0.0)
+        , s_deviceInfoCache.nCountInvalidate
+        , s_deviceInfoCache.nCountManagerCall
+        );
+}
+
+void
+dispDeviceInfo(
+    IPortableDeviceManager* pPortableDeviceManager
+    , LPCWSTR pszPnPDeviceID
+    , std::vector<WCHAR>* pScratch
+)
+{
+    if ( NULL == pPortableDeviceManager )
+    {
+        return;
+    }
+    if ( NULL == pszPnPDeviceID )
+    {
+        return;
+    }
+    if ( NULL == pScratch )
+    {
+        return;
+    }
+
+    WpdDeviceInfo info;
+    if ( wpdDeviceInfoCache_Get( pPortableDeviceManager, pszPnPDeviceID, pScratch, &info ) )
+    {
+        LOGI( L"    FriendlyName: %s\n", info.friendlyName.c_str() );
+        LOGI( L"    Manufacturer: %s\n", info.manufacturer.c_str() );
+        LOGI( L"    Description : %s\n", info.description.c_str() );
+    }
+}
+
+// --resolve=path[;path]: object id of "storage\folder\name", walking only the folders on the path.
+// a folder lists its children once; names are fetched one child at a time until the component turns up,
+// so later lookups in the same folder cost nothing or start where the last one stopped
+struct WpdResolveFolder
+{
+    std::vector<std::wstring>               childIds;
+    bool                                    listed;
+    size_t                                  nextName;   // childIds before this one have their name in names
+    std::map<std::wstring, std::wstring>    names;      // lower case name -> object id
+    std::deque<std::wstring>                retryIds;   // before nextName, their name failed to come back
+};
+
+struct WpdResolver
+{
+    IPortableDeviceContent*                     pPortableDeviceContent;
+    IPortableDeviceProperties*                  pPortableDeviceProperties;
+    IPortableDeviceKeyCollection*               pKeysName;
+    WpdDeviceStats*                             pStats;
+    std::map<std::wstring, WpdResolveFolder>    folders;    // by folder object id
+    DWORD                                       dwCountEnumObjects;
+    DWORD                                       dwCountNext;
+    DWORD                                       dwCountGetValues;
+};
+
+void
+wpdResolver_Key(
+    LPCWSTR pszName
+    , const size_t len
+    , std::wstring* pKey
+)
+{
+    pKey->assign( pszName, len );
+    for ( size_t index = 0; index < pKey->size(); ++index )
+    {
+        (*pKey)[index] = (WCHAR)::towlower( (*pKey)[index] );
+    }
+}
+
+bool
+wpdResolver_Init(
+    WpdResolver* pResolver
+    , IPortableDeviceContent* pPortableDeviceContent
+    , IPortableDeviceProperties* pPortableDeviceProperties
+    , LPCWSTR pszPnPDeviceID
+)
+{
+    pResolver->pPortableDeviceContent = NULL;
+    pResolver->pPortableDeviceProperties = NULL;
+    pResolver->pStats = wpdStats_Device( pszPnPDeviceID );
+    pResolver->dwCountEnumObjects = 0;
+    pResolver->dwCountNext = 0;
+    pResolver->dwCountGetValues = 0;
+
+    // the name is all a lookup needs
+    pResolver->pKeysName = wpdCreatePropertyKeys( L"name", false );
+    if ( NULL == pResolver->pKeysName || NULL == pPortableDeviceContent || NULL == pPortableDeviceProperties )
+    {
+        return false;
+    }
+
+    pPortableDeviceContent->AddRef();
+    pResolver->pPortableDeviceContent = pPortableDeviceContent;
+    pPortableDeviceProperties->AddRef();
+    pResolver->pPortableDeviceProperties = pPortableDeviceProperties;
+    return true;
+}
+
+void
+wpdResolver_Term(
+    WpdResolver* pResolver
+)
+{
+    if ( NULL != pResolver->pKeysName )
+    {
+        pResolver->pKeysName->Release();
+        pResolver->pKeysName = NULL;
+    }
+    if ( NULL != pResolver->pPortableDeviceProperties )
+    {
+        pResolver->pPortableDeviceProperties->Release();
+        pResolver->pPortableDeviceProperties = NULL;
+    }
+    if ( NULL != pResolver->pPortableDeviceContent )
+    {
+        pResolver->pPortableDeviceContent->Release();
+        pResolver->pPortableDeviceContent = NULL;
+    }
+    pResolver->folders.clear();
+}
+
+DWORD
+wpdResolver_CountCall(
+    const WpdResolver* pResolver
+)
+{
+    return pResolver->dwCountEnumObjects + pResolver->dwCountNext + pResolver->dwCountGetValues;
+}
+
+// child object ids of the folder, no properties
+bool
+wpdResolver_List(
+    WpdResolver* pResolver
+    , LPCWSTR pszFolderObjectId
+    , WpdResolveFolder* pFolder
+)
+{
+    IEnumPortableDeviceObjectIDs* pEnumObjectIDs = NULL;
+    {
+        const ULONGLONG qwTicksCall = wpdStats_Begin( pResolver->pStats );
+        const HRESULT hr = pResolver->pPortableDeviceContent->EnumObjects( 0, pszFolderObjectId, NULL, &pEnumObjectIDs );
+        wpdStats_End( pResolver->pStats, WPD_STAT_OP_ENUM_OBJECTS, qwTicksCall, hr, 0 );
+        pResolver->dwCountEnumObjects += 1;
+        if ( FAILED(hr) )
+        {
+            LOGE( L"! Failed. IPortableDeviceContent::EnumObjects %s, hr=0x%08x\n", pszFolderObjectId, hr );
+            return false;
+        }
+    }
+
+    // listed aside and swapped in only once complete, so a failed list leaves nothing for the next one to add to
+    const DWORD dwCountFetch = (0 < s_optCountOfFetch)?(s_optCountOfFetch):(1U);
+    std::vector<LPWSTR> objectIds( dwCountFetch, NULL );
+    std::vector<std::wstring> childIds;
+    bool result = true;
+    for ( ;; )
+    {
+        DWORD dwFetched = 0;
+        const ULONGLONG qwTicksCall = wpdStats_Begin( pResolver->pStats );
+        const HRESULT hr = pEnumObjectIDs->Next( dwCountFetch, &objectIds[0], &dwFetched );
+        wpdStats_End( pResolver->pStats, WPD_STAT_OP_NEXT, qwTicksCall, hr, dwFetched );
+        pResolver->dwCountNext += 1;
+        if ( FAILED(hr) )
+        {
+            LOGE( L"! Failed. IEnumPortableDeviceObjectIDs::Next %s, hr=0x%08x\n", pszFolderObjectId, hr );
+            result = false;
+            break;
+        }
+
+        for ( DWORD index = 0; index < dwFetched; ++index )
+        {
+            if ( NULL != objectIds[index] )
+            {
+                childIds.push_back( objectIds[index] );
+                ::CoTaskMemFree( objectIds[index] );
+                objectIds[index] = NULL;
+            }
+        }
+        if ( S_FALSE == hr || 0 == dwFetched )
+        {
+            break;
+        }
+    }
+
+    pEnumObjectIDs->Release();
+    pEnumObjectIDs = NULL;
+
+    if ( result )
+    {
+        pFolder->childIds.swap( childIds );
+    }
+    pFolder->listed = result;
+    pFolder->nextName = 0;
+    return result;
+}
+
+// name of one child into the folder's table; a child whose GetValues failed is kept for the next lookup
+bool
+wpdResolver_FetchName(
+    WpdResolver* pResolver
+    , WpdResolveFolder* pFolder
+    , const std::wstring& childObjectId
+    , std::wstring* pKeyChild
+)
+{
+    pKeyChild->clear();
+
+    IPortableDeviceValues* pValues = NULL;
+    {
+        const ULONGLONG qwTicksCall = wpdStats_Begin( pResolver->pStats );
+        const HRESULT hr = pResolver->pPortableDeviceProperties->GetValues( childObjectId.c_str(), pResolver->pKeysName, &pValues );
+        wpdStats_End( pResolver->pStats, WPD_STAT_OP_GET_VALUES, qwTicksCall, hr, 1 );
+        pResolver->dwCountGetValues += 1;
+        if ( FAILED(hr) )
+        {
+            LOGE( L"! Failed. IPortableDeviceProperties::GetValues %s, hr=0x%08x\n", childObjectId.c_str(), hr );
+            pFolder->retryIds.push_back( childObjectId );
+            return false;
+        }
+    }
+
+    LPWSTR pszName = NULL;
+    if ( SUCCEEDED(pValues->GetStringValue( WPD_OBJECT_NAME, &pszName )) && NULL != pszName )
+    {
+        wpdResolver_Key( pszName, ::wcslen( pszName ), pKeyChild );
+        // the first of two children with one name wins
+        pFolder->names.insert( std::make_pair( *pKeyChild, childObjectId ) );
+        ::CoTaskMemFree( pszName );
+        pszName = NULL;
+    }
+    pValues->Release();
+    pValues = NULL;
+    return true;
+}
+
+// object id of the child named like the component, fetching names only as far as needed
+bool
+wpdResolver_Child(
+    WpdResolver* pResolver
+    , const std::wstring& folderObjectId
+    , LPCWSTR pszComponent
+    , const size_t len
+    , std::wstring* pChildObjectId
+)
+{
+    std::map<std::wstring, WpdResolveFolder>::iterator it = pResolver->folders.find( folderObjectId );
+    if ( pResolver->folders.end() == it )
+    {
+        WpdResolveFolder folder;
+        folder.listed = false;
+        folder.nextName = 0;
+        it = pResolver->folders.insert( std::make_pair( folderObjectId, folder ) ).first;
+    }
+    WpdResolveFolder& folder = it->second;
+    if ( false == folder.listed )
+    {
+        if ( false == wpdResolver_List( pResolver, folderObjectId.c_str(), &folder ) )
+        {
+            return false;
+        }
+    }
+
+    std::wstring key;
+    wpdResolver_Key( pszComponent, len, &key );
+    {
+        std::map<std::wstring, std::wstring>::const_iterator itName = folder.names.find( key );
+        if ( folder.names.end() != itName )
+        {
+            pChildObjectId->assign( itName->second );
+            return true;
+        }
+    }
+
+    // children that failed before get one more try each, a failure goes to the back again
+    std::wstring keyChild;
+    for ( size_t countRetry = folder.retryIds.size(); 0 < countRetry; --countRetry )
+    {
+        const std::wstring childObjectId( folder.retryIds.front() );
+        folder.retryIds.pop_front();
+        if ( wpdResolver_FetchName( pResolver, &folder, childObjectId, &keyChild ) && keyChild == key )
+        {
+            pChildObjectId->assign( folder.names[key] );
+            return true;
+        }
+    }
+
+    while ( folder.nextName < folder.childIds.size() )
+    {
+        const std::wstring& childObjectId = folder.childIds[folder.nextName];
+        folder.nextName += 1;
+        if ( wpdResolver_FetchName( pResolver, &folder, childObjectId, &keyChild ) && keyChild == key )
+        {
+            pChildObjectId->assign( folder.names[key] );
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// names separated by '\' or '/', starting below WPD_DEVICE_OBJECT_ID
+bool
+wpdResolver_Resolve(
+    WpdResolver* pResolver
+    , const std::wstring& path
+    , std::wstring* pObjectId
+)
+{
+    std::wstring objectId( WPD_DEVICE_OBJECT_ID );
+    size_t pos = 0;
+    while ( pos < path.size() )
+    {
+        size_t end = path.find_first_of( L"\\/", pos );
+        if ( std::wstring::npos == end )
+        {
+            end = path.size();
+        }
+        const size_t len = end - pos;
+        LPCWSTR pszComponent = path.c_str() + pos;
+        pos = end + 1;
+        if ( 0 == len )
+        {
+            continue;
+        }
+
+        std::wstring childObjectId;
+        if ( false == wpdResolver_Child( pResolver, objectId, pszComponent, len, &childObjectId ) )
+        {
+            return false;
+        }
+        objectId.swap( childObjectId );
+    }
+
+    pObjectId->swap( objectId );
+    return true;
+}
+
+// every --resolve= path twice: cold, then warm from the folder indexes
+bool
+wpdResolve_Run(
+    IPortableDeviceContent* pPortableDeviceContent
+    , IPortableDeviceProperties* pPortableDeviceProperties
+    , LPCWSTR pszPnPDeviceID
+)
+{
+    WpdResolver resolver;
+    if ( false == wpdResolver_Init( &resolver, pPortableDeviceContent, pPortableDeviceProperties, pszPnPDeviceID ) )
+    {
+        wpdResolver_Term( &resolver );
+        return false;
+    }
+
+    bool resultAll = true;
+    const std::wstring paths( s_optResolve );
+    size_t pos = 0;
+    while ( pos < paths.size() )
+    {
+        size_t end = paths.find( L';', pos );
+        if ( std::wstring::npos == end )
+        {
+            end = paths.size();
+        }
+        const std::wstring path( paths, pos, end - pos );
+        pos = end + 1;
+
+        for ( DWORD pass = 0; pass < 2; ++pass )
+        {
+            const DWORD dwCountCallStart = wpdResolver_CountCall( &resolver );
+            const ULONGLONG qwTicksStart = wpdTicksNow();
+            std::wstring objectId;
+            const bool found = wpdResolver_Resolve( &resolver, path, &objectId );
+            LOGI( L"    resolve %s %s: %s, calls=%u, %.3f ms\n"
+                , (0 == pass)?(L"cold"):(L"warm")
+                , path.c_str()
+                , (found)?(objectId.c_str()):(L"not found")
+                , wpdResolver_CountCall( &resolver ) - dwCountCallStart
+                , wpdTicksToMicroseconds( wpdTicksNow() - qwTicksStart ) / 1000.0
+                );
+            resultAll = resultAll && found;
+        }
+    }
+
+    DWORD dwCountName = 0;
+    for ( std::map<std::wstring, WpdResolveFolder>::const_iterator it = resolver.folders.begin(); it != resolver.folders.end(); ++it )
+    {
+        dwCountName += (DWORD)it->second.names.size();
+    }
+    LOGI( L"    resolve: folders=%u, names=%u, EnumObjects=%u, Next=%u, GetValues=%u\n"
+        , (DWORD)resolver.folders.size()
+        , dwCountName
+        , resolver.dwCountEnumObjects
+        , resolver.dwCountNext
+        , resolver.dwCountGetValues
+        );
+
+    wpdResolver_Term( &resolver );
+    return resultAll;
+}
+
+// --download=<dir>: every file of the scan is copied from WPD_RESOURCE_DEFAULT below <dir>, keeping the folder names.
+// --download-jobs= workers keep that many files in flight, each on a session of its own. a worker reads
+// into one buffer while the other one is still being written, with the target preallocated so the
+// overlapped writes do not extend the file.
+// while a file is copied, "<file>.wpdjournal" lists its chunks written so far with their CRC-32. an
+// interrupted copy resumes after the chunks that still match, from the next run or the next attempt.
+// the journal is keyed on WPD_OBJECT_PERSISTENT_UNIQUE_ID and stays behind with an end marker holding
+// the CRC-32 of the whole file: a later run skips the file only on that marker
+#define WPD_DOWNLOAD_BUFFER_MIN (64U * 1024U)
+
+#define WPD_DOWNLOAD_JOURNAL_SUFFIX     L".wpdjournal"
+#define WPD_DOWNLOAD_JOURNAL_MAGIC      L"wpdjournal"
+#define WPD_DOWNLOAD_JOURNAL_VERSION    2
+#define WPD_DOWNLOAD_JOURNAL_END        L"end"
+
+struct WpdDownloadJob
+{
+    std::wstring    objectId;
+    std::wstring    puid;       // the journal's key, the object id when the device has none
+    std::wstring    path;       // below the download directory
+    ULONGLONG       qwSize;
+
+    bool            done;
+    bool            hasCrc;
+    UINT32          dwCrc;      // CRC-32 of the whole file, as written or as an earlier run journaled it
+};
+
+struct WpdDownload
+{
+    LPCWSTR                     pszPnPDeviceID;
+    WpdDeviceStats*             pStats;
+    std::wstring                directory;
+    std::vector<WpdDownloadJob> jobs;
+    volatile LONG               nNextJob;
+
+    // directories already created, shared by the workers
+    CRITICAL_SECTION            cs;
+    std::set<std::wstring>      directories;
+};
+
+struct WpdDownloadWorker
+{
+    WpdDownload*        pDownload;
+    WpdSession*         pSession;       // borrowed from the scan when not NULL
+    std::vector<BYTE>   buffers[2];
+    HANDLE              hEvents[2];
+    DWORD               dwOptimalBufferSize;
+    DWORD               dwCountFile;
+    DWORD               dwCountFailed;
+    DWORD               dwCountSkipped;
+    DWORD               dwCountResume;
+    ULONGLONG           qwBytes;        // read from the device
+    ULONGLONG           qwBytesResumed; // found verified on disk
+    std::vector<double> latencies;      // milliseconds per file
+};
+
+struct WpdDownloadChunk
+{
+    ULONGLONG   qwOffset;
+    DWORD       cb;
+    UINT32      dwCrc;
+};
+
+// CRC-32 (IEEE 802.3, reflected), continued over calls the way zlib's crc32() is: start from 0
+static
+UINT32 s_crc32Table[256];
+
+void
+wpdCrc32_Init( void )
+{
+    for ( UINT32 index = 0; index < 256; ++index )
+    {
+        UINT32 c = index;
+        for ( DWORD bit = 0; bit < 8; ++bit )
+        {
+            c = (0 != (c & 1))?(0xEDB88320U ^ (c >> 1)):(c >> 1);
+        }
+        s_crc32Table[index] = c;
+    }
+}
+
+UINT32
+wpdCrc32(
+    const UINT32 dwCrc
+    , const BYTE* pData
+    , const size_t cb
+)
+{
+    UINT32 c = ~dwCrc;
+    for ( size_t index = 0; index < cb; ++index )
+    {
+        c = s_crc32Table[(c ^ pData[index]) & 0xFFU] ^ (c >> 8);
+    }
+    return ~c;
+}
+
+// --download= without the trailing separator
+void
+wpdDownload_Directory(
+    std::wstring* pDirectory
+)
+{
+    pDirectory->assign( (NULL != s_optDownload)?(s_optDownload):(L".") );
+    while ( !pDirectory->empty() && (L'\\' == (*pDirectory)[pDirectory->size() - 1] || L'/' == (*pDirectory)[pDirectory->size() - 1]) )
+    {
+        pDirectory->erase( pDirectory->size() - 1 );
+    }
+}
+
+// object names may carry what a Windows file name may not
+void
+wpdDownload_FileName(
+    LPCWSTR pszName
+    , std::wstring* pFileName
+)
+{
+    pFileName->assign( (NULL != pszName)?(pszName):(L"") );
+    for ( size_t index = 0; index < pFileName->size(); ++index )
+    {
+        const WCHAR c = (*pFileName)[index];
+        if ( c < L' ' || NULL != ::wcschr( L"<>:\"/\\|?*", c ) )
+        {
+            (*pFileName)[index] = L'_';
+        }
+    }
+    while ( !pFileName->empty() && (L'.' == (*pFileName)[pFileName->size() - 1] || L' ' == (*pFileName)[pFileName->size() - 1]) )
+    {
+        (*pFileName)[pFileName->size() - 1] = L'_';
+    }
+    if ( pFileName->empty() )
+    {
+        pFileName->assign( L"_" );
+    }
+}
+
+// files of the store with their path below the device object; names repeated in a folder get "~n"
+void
+wpdDownload_Jobs(
+    WpdTreeStore* pStore
+    , std::vector<WpdDownloadJob>* pJobs
+)
+{
+    std::set<std::wstring> paths;
+    std::vector<UINT32> chain;
+    std::wstring fileName;
+    for ( UINT32 dwNode = 0; dwNode < wpdTreeStore_Count( pStore ); ++dwNode )
+    {
+        if ( 0 != pStore->folder[dwNode] || WPD_HANDLE_NONE != pStore->firstChild[dwNode] || WPD_HANDLE_NONE == pStore->parent[dwNode] )
+        {
+            continue;
+        }
+
+        chain.clear();
+        for ( UINT32 dwCurrent = dwNode; WPD_HANDLE_NONE != pStore->parent[dwCurrent]; dwCurrent = pStore->parent[dwCurrent] )
+        {
+            chain.push_back( dwCurrent );
+        }
+
+        WpdDownloadJob job;
+        job.objectId.assign( wpdArena_Get( &pStore->strings, pStore->objectId[dwNode] ) );
+        job.puid.assign( (WPD_HANDLE_NONE != pStore->puid[dwNode])?(wpdArena_Get( &pStore->strings, pStore->puid[dwNode] )):(job.objectId.c_str()) );
+        job.qwSize = pStore->size[dwNode];
+        job.done = false;
+        job.hasCrc = false;
+        job.dwCrc = 0;
+        while ( !chain.empty() )
+        {
+            const UINT32 dwChain = chain.back();
+            chain.pop_back();
+            LPCWSTR pszName = wpdArena_Get( &pStore->strings, pStore->name[dwChain] );
+            wpdDownload_FileName( (NULL != pszName)?(pszName):(wpdArena_Get( &pStore->strings, pStore->objectId[dwChain] )), &fileName );
+            if ( !job.path.empty() )
+            {
+                job.path.push_back( L'\\' );
+            }
+            job.path.append( fileName );
+        }
+
+        std::wstring key( job.path );
+        for ( size_t index = 0; index < key.size(); ++index )
+        {
+            key[index] = (WCHAR)::towlower( key[index] );
+        }
+        if ( paths.end() != paths.find( key ) )
+        {
+            const size_t posName = job.path.rfind( L'\\' ) + 1;
+            size_t posExtension = job.path.rfind( L'.' );
+            if ( std::wstring::npos == posExtension || posExtension <= posName )
+            {
+                posExtension = job.path.size();
+            }
+            for ( DWORD suffix = 1; ; ++suffix )
+            {
+                WCHAR szSuffix[16];
+                ::_snwprintf_s( szSuffix, _countof(szSuffix), _TRUNCATE, L"~%u", suffix );
+                std::wstring path( job.path );
+                path.insert( posExtension, szSuffix );
+                key.assign( path );
+                for ( size_t index = 0; index < key.size(); ++index )
+                {
+                    key[index] = (WCHAR)::towlower( key[index] );
+                }
+                if ( paths.end() == paths.find( key ) )
+                {
+                    job.path.swap( path );
+                    break;
+                }
+            }
+        }
+        paths.insert( key );
+        pJobs->push_back( job );
+    }
+}
+
+// every directory on the way to path, the last component being the file
+void
+wpdDownload_MakeDirectories(
+    WpdDownload* pDownload
+    , const std::wstring& path
+)
+{
+    const size_t posFile = path.rfind( L'\\' );
+    if ( std::wstring::npos == posFile )
+    {
+        return;
+    }
+    const std::wstring directory( path, 0, posFile );
+
+    ::EnterCriticalSection( &pDownload->cs );
+    if ( pDownload->directories.end() == pDownload->directories.find( directory ) )
+    {
+        // failures show up when the file is created
+        for ( size_t pos = directory.find( L'\\' ); ; pos = directory.find( L'\\', pos + 1 ) )
+        {
+            const std::wstring prefix( directory, 0, pos );
+            if ( !prefix.empty() && L':' != prefix[prefix.size() - 1] && L'\\' != prefix[prefix.size() - 1] )
+            {
+                ::CreateDirectoryW( prefix.c_str(), NULL );
+            }
+            if ( std::wstring::npos == pos )
+            {
+                break;
+            }
+        }
+        pDownload->directories.insert( directory );
+    }
+    ::LeaveCriticalSection( &pDownload->cs );
+}
+
+bool
+wpdDownload_WaitWrite(
+    HANDLE hFile
+    , OVERLAPPED* pOverlapped
+)
+{
+    DWORD cbWritten = 0;
+    if ( FALSE == ::GetOverlappedResult( hFile, pOverlapped, &cbWritten, TRUE ) )
+    {
+        LOGE( L"! Failed. GetOverlappedResult write, error=%u\n", ::GetLastError() );
+        return false;
+    }
+    return true;
+}
+
+bool
+wpdDownload_ReadAt(
+    HANDLE hFile
+    , HANDLE hEvent
+    , const ULONGLONG qwOffset
+    , BYTE* pBuffer
+    , const DWORD cb
+)
+{
+    OVERLAPPED overlapped;
+    ::memset( &overlapped, 0, sizeof(overlapped) );
+    overlapped.Offset = (DWORD)qwOffset;
+    overlapped.OffsetHigh = (DWORD)(qwOffset >> 32);
+    overlapped.hEvent = hEvent;
+
+    DWORD cbRead = 0;
+    if ( FALSE == ::ReadFile( hFile, pBuffer, cb, NULL, &overlapped )
+        && ERROR_IO_PENDING != ::GetLastError() )
+    {
+        return false;
+    }
+    return FALSE != ::GetOverlappedResult( hFile, &overlapped, &cbRead, TRUE ) && cb == cbRead;
+}
+
+// chunks of the journal in file order, false when there is none for this object.
+// *pDone is set when the journal ends with the marker of a finished file, its size and CRC-32 in *pEnd
+bool
+wpdDownloadJournal_Load(
+    const std::wstring& pathJournal
+    , const WpdDownloadJob& job
+    , std::vector<WpdDownloadChunk>* pChunks
+    , bool* pDone
+    , WpdDownloadChunk* pEnd
+)
+{
+    pChunks->clear();
+    *pDone = false;
+
+    FILE* fp = NULL;
+    if ( 0 != ::_wfopen_s( &fp, pathJournal.c_str(), L"r, ccs=UTF-8" ) || NULL == fp )
+    {
+        return false;
+    }
+
+    bool result = false;
+    std::vector<WCHAR> line;
+    DWORD dwVersion = 0;
+    if ( wpdFile_ReadLine( fp, &line )
+        && 0 == ::wcsncmp( &line[0], WPD_DOWNLOAD_JOURNAL_MAGIC L" ", ::wcslen(WPD_DOWNLOAD_JOURNAL_MAGIC L" ") )
+        && 1 == ::swscanf( &line[::wcslen(WPD_DOWNLOAD_JOURNAL_MAGIC L" ")], L"%u", &dwVersion )
+        && WPD_DOWNLOAD_JOURNAL_VERSION == dwVersion
+        && wpdFile_ReadLine( fp, &line ) )
+    {
+        // persistent unique id \t size, a journal of another object starts over
+        LPCWSTR p = ::wcschr( &line[0], L'\t' );
+        if ( NULL != p )
+        {
+            std::wstring puid;
+            wpdScanCache_Unescape( &line[0], p, &puid );
+            result = (puid == job.puid && ::_wcstoui64( p + 1, NULL, 10 ) == job.qwSize);
+        }
+
+        // offset \t bytes \t crc, a line cut short by a crash ends the list.
+        // "end" \t size \t crc of the whole file once it was finished
+        while ( result && wpdFile_ReadLine( fp, &line ) )
+        {
+            if ( 0 == ::wcsncmp( &line[0], WPD_DOWNLOAD_JOURNAL_END L"\t", ::wcslen(WPD_DOWNLOAD_JOURNAL_END L"\t") ) )
+            {
+                pEnd->cb = 0;
+                *pDone = (2 == ::swscanf( &line[::wcslen(WPD_DOWNLOAD_JOURNAL_END L"\t")], L"%I64u\t%x", &pEnd->qwOffset, &pEnd->dwCrc )
+                    && NULL != ::wcschr( &line[0], L'\n' ));
+                break;
+            }
+            WpdDownloadChunk chunk;
+            if ( 3 != ::swscanf( &line[0], L"%I64u\t%u\t%x", &chunk.qwOffset, &chunk.cb, &chunk.dwCrc )
+                || NULL == ::wcschr( &line[0], L'\n' ) )
+            {
+                break;
+            }
+            pChunks->push_back( chunk );
+        }
+    }
+    ::fclose( fp );
+    fp = NULL;
+
+    if ( false == result )
+    {
+        pChunks->clear();
+        *pDone = false;
+    }
+    return result;
+}
+
+// rewrites the journal with the chunks kept, then leaves it open for appending
+FILE*
+wpdDownloadJournal_Open(
+    const std::wstring& pathJournal
+    , const WpdDownloadJob& job
+    , const std::vector<WpdDownloadChunk>& chunks
+)
+{
+    std::wstring pathTemp( pathJournal );
+    pathTemp.append( L".tmp" );
+
+    FILE* fp = NULL;
+    if ( 0 != ::_wfopen_s( &fp, pathTemp.c_str(), L"w, ccs=UTF-8" ) || NULL == fp )
+    {
+        LOGE( L"! Failed. open journal %s\n", pathTemp.c_str() );
+        return NULL;
+    }
+
+    std::wstring puid;
+    wpdScanCache_Escape( job.puid, &puid );
+    ::fwprintf( fp, L"%s %u\n", WPD_DOWNLOAD_JOURNAL_MAGIC, WPD_DOWNLOAD_JOURNAL_VERSION );
+    ::fwprintf( fp, L"%s\t%I64u\n", puid.c_str(), job.qwSize );
+    for ( size_t index = 0; index < chunks.size(); ++index )
+    {
+        ::fwprintf( fp, L"%I64u\t%u\t%08x\n", chunks[index].qwOffset, chunks[index].cb, chunks[index].dwCrc );
+    }
+
+    const bool result = (0 == ::ferror( fp ));
+    ::fclose( fp );
+    fp = NULL;
+
+    if ( false == result || FALSE == ::MoveFileExW( pathTemp.c_str(), pathJournal.c_str(), MOVEFILE_REPLACE_EXISTING ) )
+    {
+        LOGE( L"! Failed. write journal %s\n", pathJournal.c_str() );
+        ::DeleteFileW( pathTemp.c_str() );
+        return NULL;
+    }
+
+    if ( 0 != ::_wfopen_s( &fp, pathJournal.c_str(), L"a, ccs=UTF-8" ) || NULL == fp )
+    {
+        LOGE( L"! Failed. open journal %s\n", pathJournal.c_str() );
+        return NULL;
+    }
+    return fp;
+}
+
+// a chunk goes into the journal only once its write has completed
+bool
+wpdDownloadJournal_Append(
+    FILE* fp
+    , const WpdDownloadChunk& chunk
+)
+{
+    ::fwprintf( fp, L"%I64u\t%u\t%08x\n", chunk.qwOffset, chunk.cb, chunk.dwCrc );
+    return 0 == ::fflush( fp ) && 0 == ::ferror( fp );
+}
+
+// the last line, written once the whole file is: only this marks a file as finished
+bool
+wpdDownloadJournal_End(
+    FILE* fp
+    , const ULONGLONG qwSize
+    , const UINT32 dwCrc
+)
+{
+    ::fwprintf( fp, L"%s\t%I64u\t%08x\n", WPD_DOWNLOAD_JOURNAL_END, qwSize, dwCrc );
+    return 0 == ::fflush( fp ) && 0 == ::ferror( fp );
+}
+
+// the journal is trusted only as far as the file still matches it, writes the crash lost included.
+// *pChunks keeps the chunks verified, *pqwOffset and *pCrc end up after the last of them
+void
+wpdDownload_Verify(
+    WpdDownloadWorker* pWorker
+    , HANDLE hFile
+    , std::vector<WpdDownloadChunk>* pChunks
+    , ULONGLONG* pqwOffset
+    , UINT32* pCrc
+)
+{
+    std::vector<BYTE>& buffer = pWorker->buffers[0];
+    size_t countVerified = 0;
+    for ( ; countVerified < pChunks->size(); ++countVerified )
+    {
+        const WpdDownloadChunk& chunk = (*pChunks)[countVerified];
+        if ( chunk.qwOffset != *pqwOffset || 0 == chunk.cb )
+        {
+            break;
+        }
+
+        UINT32 dwCrcChunk = 0;
+        UINT32 dwCrcFile = *pCrc;
+        bool match = true;
+        for ( DWORD cbDone = 0; match && cbDone < chunk.cb; )
+        {
+            const DWORD cb = (chunk.cb - cbDone < (DWORD)buffer.size())?(chunk.cb - cbDone):((DWORD)buffer.size());
+            match = wpdDownload_ReadAt( hFile, pWorker->hEvents[0], chunk.qwOffset + cbDone, &buffer[0], cb );
+            if ( match )
+            {
+                dwCrcChunk = wpdCrc32( dwCrcChunk, &buffer[0], cb );
+                dwCrcFile = wpdCrc32( dwCrcFile, &buffer[0], cb );
+                cbDone += cb;
+            }
+        }
+        if ( false == match || dwCrcChunk != chunk.dwCrc )
+        {
+            break;
+        }
+
+        *pqwOffset += chunk.cb;
+        *pCrc = dwCrcFile;
+    }
+
+    if ( countVerified < pChunks->size() )
+    {
+        LOGV( L"    download: journal verified up to %I64u, %u chunks dropped\n", *pqwOffset, (DWORD)(pChunks->size() - countVerified) );
+        pChunks->resize( countVerified );
+    }
+}
+
+// streams without Seek() are skipped forward by reading
+bool
+wpdDownload_Seek(
+    WpdDownloadWorker* pWorker
+    , IStream* pStream
+    , const ULONGLONG qwOffset
+    , const DWORD cbChunk
+)
+{
+    LARGE_INTEGER liMove;
+    liMove.QuadPart = (LONGLONG)qwOffset;
+    ULARGE_INTEGER uliPosition;
+    uliPosition.QuadPart = 0;
+    const HRESULT hr = pStream->Seek( liMove, STREAM_SEEK_SET, &uliPosition );
+    if ( SUCCEEDED(hr) && qwOffset == uliPosition.QuadPart )
+    {
+        return true;
+    }
+    LOGV( L"    download: no seek, hr=0x%08x. reading %I64u bytes to resume\n", hr, qwOffset );
+
+    WpdDownload* pDownload = pWorker->pDownload;
+    for ( ULONGLONG qwSkipped = 0; qwSkipped < qwOffset; )
+    {
+        const ULONG cb = (qwOffset - qwSkipped < (ULONGLONG)cbChunk)?((ULONG)(qwOffset - qwSkipped)):(cbChunk);
+        ULONG cbRead = 0;
+        const ULONGLONG qwTicksCall = wpdStats_Begin( pDownload->pStats );
+        const HRESULT hrRead = pStream->Read( &pWorker->buffers[1][0], cb, &cbRead );
+        wpdStats_End( pDownload->pStats, WPD_STAT_OP_READ, qwTicksCall, hrRead, 0 );
+        wpdStats_AddBytes( pDownload->pStats, WPD_STAT_OP_READ, cbRead );
+        if ( FAILED(hrRead) || 0 == cbRead )
+        {
+            LOGE( L"! Failed. IStream::Read skipping to %I64u, hr=0x%08x\n", qwOffset, hrRead );
+            return false;
+        }
+        qwSkipped += cbRead;
+    }
+    return true;
+}
+
+// one try at a file. *pqwOffset is how much of it is on disk and journaled afterwards,
+// *pRetry tells a device that went away from a failure another try will not fix
+bool
+wpdDownload_Attempt(
+    WpdDownloadWorker* pWorker
+    , IPortableDeviceResources* pResources
+    , WpdDownloadJob* pJob
+    , ULONGLONG* pqwOffset
+    , bool* pRetry
+)
+{
+    WpdDownload* pDownload = pWorker->pDownload;
+    *pqwOffset = 0;
+    *pRetry = false;
+
+    const std::wstring path( pDownload->directory + L"\\" + pJob->path );
+    const std::wstring pathJournal( path + WPD_DOWNLOAD_JOURNAL_SUFFIX );
+    wpdDownload_MakeDirectories( pDownload, path );
+    HANDLE hFile = ::CreateFileW( path.c_str(), GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_ALWAYS, FILE_FLAG_OVERLAPPED | FILE_FLAG_SEQUENTIAL_SCAN, NULL );
+    const bool existed = (INVALID_HANDLE_VALUE != hFile && ERROR_ALREADY_EXISTS == ::GetLastError());
+    if ( INVALID_HANDLE_VALUE == hFile )
+    {
+        LOGE( L"! Failed. CreateFile %s, error=%u\n", path.c_str(), ::GetLastError() );
+        return false;
+    }
+
+    // the size of a file says nothing, a try preallocates it: only the journal's end marker means finished
+    std::vector<WpdDownloadChunk> chunks;
+    bool done = false;
+    WpdDownloadChunk end;
+    wpdDownloadJournal_Load( pathJournal, *pJob, &chunks, &done, &end );
+    if ( existed && done )
+    {
+        LARGE_INTEGER liSize;
+        if ( FALSE != ::GetFileSizeEx( hFile, &liSize ) && end.qwOffset == (ULONGLONG)liSize.QuadPart )
+        {
+            ::CloseHandle( hFile );
+            hFile = NULL;
+            pJob->done = true;
+            pJob->hasCrc = true;
+            pJob->dwCrc = end.dwCrc;
+            pWorker->dwCountSkipped += 1;
+            *pqwOffset = end.qwOffset;
+            LOGV( L"    download: %s, already there, crc32=%08x\n", pJob->path.c_str(), end.dwCrc );
+            return true;
+        }
+        chunks.clear();
+    }
+
+    IStream* pStream = NULL;
+    DWORD dwOptimalBufferSize = 0;
+    {
+        const ULONGLONG qwTicksCall = wpdStats_Begin( pDownload->pStats );
+        const HRESULT hr = pResources->GetStream( pJob->objectId.c_str(), WPD_RESOURCE_DEFAULT, STGM_READ, &dwOptimalBufferSize, &pStream );
+        wpdStats_End( pDownload->pStats, WPD_STAT_OP_GET_STREAM, qwTicksCall, hr, 1 );
+        if ( FAILED(hr) )
+        {
+            LOGE( L"! Failed. IPortableDeviceResources::GetStream %s, hr=0x%08x\n", pJob->objectId.c_str(), hr );
+            ::CloseHandle( hFile );
+            hFile = NULL;
+            *pRetry = true;
+            return false;
+        }
+    }
+
+    // large reads in whole multiples of what the device prefers
+    DWORD cbChunk = s_optDownloadBuffer * 1024U;
+    if ( cbChunk < WPD_DOWNLOAD_BUFFER_MIN )
+    {
+        cbChunk = WPD_DOWNLOAD_BUFFER_MIN;
+    }
+    if ( 0 < dwOptimalBufferSize )
+    {
+        pWorker->dwOptimalBufferSize = dwOptimalBufferSize;
+        cbChunk = ((cbChunk + dwOptimalBufferSize - 1) / dwOptimalBufferSize) * dwOptimalBufferSize;
+    }
+    for ( DWORD index = 0; index < 2; ++index )
+    {
+        if ( pWorker->buffers[index].size() < cbChunk )
+        {
+            pWorker->buffers[index].resize( cbChunk );
+        }
+    }
+
+    // the CRC of the file so far comes from what is on disk, the rest from the bytes as they arrive
+    ULONGLONG qwOffset = 0;
+    UINT32 dwCrc = 0;
+    wpdDownload_Verify( pWorker, hFile, &chunks, &qwOffset, &dwCrc );
+    const ULONGLONG qwOffsetResume = qwOffset;
+
+    bool result = true;
+    FILE* fpJournal = wpdDownloadJournal_Open( pathJournal, *pJob, chunks );
+    if ( NULL == fpJournal )
+    {
+        result = false;
+    }
+    if ( result && 0 < qwOffsetResume )
+    {
+        result = wpdDownload_Seek( pWorker, pStream, qwOffsetResume, cbChunk );
+        *pRetry = (false == result);
+    }
+
+    // writes inside the file size can complete asynchronously, writes extending it cannot
+    if ( result && 0 < pJob->qwSize )
+    {
+        LARGE_INTEGER liSize;
+        liSize.QuadPart = (LONGLONG)pJob->qwSize;
+        if ( FALSE == ::SetFilePointerEx( hFile, liSize, NULL, FILE_BEGIN ) || FALSE == ::SetEndOfFile( hFile ) )
+        {
+            LOGV( L"    download: no preallocation for %s, error=%u\n", path.c_str(), ::GetLastError() );
+        }
+    }
+
+    OVERLAPPED overlapped[2];
+    WpdDownloadChunk written[2];
+    bool pending[2] = { false, false };
+    DWORD current = 0;
+    for ( ; result; )
+    {
+        // the buffer is free again once its last write is done
+        if ( pending[current] )
+        {
+            pending[current] = false;
+            if ( false == wpdDownload_WaitWrite( hFile, &overlapped[current] )
+                || false == wpdDownloadJournal_Append( fpJournal, written[current] ) )
+            {
+                result = false;
+                break;
+            }
+        }
+
+        ULONG cbRead = 0;
+        const ULONGLONG qwTicksCall = wpdStats_Begin( pDownload->pStats );
+        const HRESULT hr = pStream->Read( &pWorker->buffers[current][0], cbChunk, &cbRead );
+        wpdStats_End( pDownload->pStats, WPD_STAT_OP_READ, qwTicksCall, hr, 0 );
+        wpdStats_AddBytes( pDownload->pStats, WPD_STAT_OP_READ, cbRead );
+        if ( FAILED(hr) )
+        {
+            LOGE( L"! Failed. IStream::Read %s at %I64u, hr=0x%08x\n", pJob->objectId.c_str(), qwOffset, hr );
+            result = false;
+            *pRetry = true;
+            break;
+        }
+        if ( 0 == cbRead )
+        {
+            break;
+        }
+
+        written[current].qwOffset = qwOffset;
+        written[current].cb = cbRead;
+        written[current].dwCrc = wpdCrc32( 0, &pWorker->buffers[current][0], cbRead );
+        dwCrc = wpdCrc32( dwCrc, &pWorker->buffers[current][0], cbRead );
+
+        ::memset( &overlapped[current], 0, sizeof(overlapped[current]) );
+        overlapped[current].Offset = (DWORD)qwOffset;
+        overlapped[current].OffsetHigh = (DWORD)(qwOffset >> 32);
+        overlapped[current].hEvent = pWorker->hEvents[current];
+        if ( FALSE == ::WriteFile( hFile, &pWorker->buffers[current][0], cbRead, NULL, &overlapped[current] )
+            && ERROR_IO_PENDING != ::GetLastError() )
+        {
+            LOGE( L"! Failed. WriteFile %s at %I64u, error=%u\n", path.c_str(), qwOffset, ::GetLastError() );
+            result = false;
+            break;
+        }
+        pending[current] = true;
+        qwOffset += cbRead;
+        current ^= 1;
+
+        // no round trip just to hear about the end
+        if ( 0 < pJob->qwSize && pJob->qwSize <= qwOffset )
+        {
+            break;
+        }
+    }
+
+    // oldest write first, so the journal stays in file order; what made it to disk is kept for the next try
+    for ( DWORD count = 0; count < 2; ++count, current ^= 1 )
+    {
+        if ( pending[current] )
+        {
+            pending[current] = false;
+            if ( wpdDownload_WaitWrite( hFile, &overlapped[current] )
+                && NULL != fpJournal
+                && wpdDownloadJournal_Append( fpJournal, written[current] ) )
+            {
+                continue;
+            }
+            result = false;
+            *pRetry = false;
+        }
+    }
+
+    // the size from the scan was a guess when the stream said otherwise
+    if ( result && qwOffset != pJob->qwSize )
+    {
+        LOGV( L"    download: %s has %I64u bytes, %I64u expected\n", pJob->path.c_str(), qwOffset, pJob->qwSize );
+        LARGE_INTEGER liSize;
+        liSize.QuadPart = (LONGLONG)qwOffset;
+        if ( FALSE == ::SetFilePointerEx( hFile, liSize, NULL, FILE_BEGIN ) || FALSE == ::SetEndOfFile( hFile ) )
+        {
+            LOGE( L"! Failed. SetEndOfFile %s, error=%u\n", path.c_str(), ::GetLastError() );
+            result = false;
+        }
+    }
+    if ( result && false == wpdDownloadJournal_End( fpJournal, qwOffset, dwCrc ) )
+    {
+        LOGE( L"! Failed. write journal %s\n", pathJournal.c_str() );
+        result = false;
+    }
+
+    ::CloseHandle( hFile );
+    hFile = NULL;
+    pStream->Release();
+    pStream = NULL;
+    if ( NULL != fpJournal )
+    {
+        ::fclose( fpJournal );
+        fpJournal = NULL;
+    }
+
+    pWorker->qwBytes += qwOffset - qwOffsetResume;
+    pWorker->qwBytesResumed += qwOffsetResume;
+    if ( false == result )
+    {
+        *pqwOffset = qwOffset;
+        return false;
+    }
+
+    pJob->done = true;
+    pJob->hasCrc = true;
+    pJob->dwCrc = dwCrc;
+    *pqwOffset = qwOffset;
+    LOGV( L"    download: %s, %I64u bytes, crc32=%08x%s\n", pJob->path.c_str(), qwOffset, dwCrc, (0 < qwOffsetResume)?(L", resumed"):(L"") );
+    return true;
+}
+
+// attempts that get no further than the one before count against --download-retries=
+bool
+wpdDownload_File(
+    WpdDownloadWorker* pWorker
+    , IPortableDeviceResources* pResources
+    , WpdDownloadJob* pJob
+)
+{
+    const ULONGLONG qwTicksStart = wpdTicksNow();
+    ULONGLONG qwOffsetLast = 0;
+    DWORD dwCountStall = 0;
+    for ( ;; )
+    {
+        ULONGLONG qwOffset = 0;
+        bool retry = false;
+        if ( wpdDownload_Attempt( pWorker, pResources, pJob, &qwOffset, &retry ) )
+        {
+            pWorker->latencies.push_back( wpdTicksToMicroseconds( wpdTicksNow() - qwTicksStart ) / 1000.0 );
+            return true;
+        }
+        if ( false == retry )
+        {
+            return false;
+        }
+
+        dwCountStall = (qwOffsetLast < qwOffset)?(0):(dwCountStall + 1);
+        qwOffsetLast = qwOffset;
+        if ( s_optDownloadRetries < dwCountStall )
+        {
+            LOGE( L"! Failed. download %s, no progress after %u retries\n", pJob->path.c_str(), s_optDownloadRetries );
+            return false;
+        }
+        pWorker->dwCountResume += 1;
+        LOGI( L"    download: %s interrupted, resuming at %I64u\n", pJob->path.c_str(), qwOffset );
+    }
+}
+
+unsigned __stdcall
+wpdDownload_Worker( void* pParam )
+{
+    WpdDownloadWorker* pWorker = reinterpret_cast<WpdDownloadWorker*>(pParam);
+    if ( NULL == pWorker )
+    {
+        return 1;
+    }
+    WpdDownload* pDownload = pWorker->pDownload;
+
+    bool needCoUninitialize = false;
+    {
+        const DWORD dwCoInit = COINIT_MULTITHREADED | COINIT_DISABLE_OLE1DDE;
+        const HRESULT hr = ::CoInitializeEx( NULL, dwCoInit );
+        if ( FAILED(hr) )
+        {
+            LOGE( L"! Failed. download CoInitializeEx, hr=0x%08x\n", hr );
+            return 1;
+        }
+        needCoUninitialize = true;
+    }
+
+    WpdSession* pSession = pWorker->pSession;
+    if ( NULL == pSession )
+    {
+        pSession = wpdSessionPool_Acquire( pDownload->pszPnPDeviceID );
+    }
+
+    IPortableDeviceResources* pResources = NULL;
+    if ( NULL != pSession )
+    {
+        const HRESULT hr = pSession->pPortableDeviceContent->Transfer( &pResources );
+        if ( FAILED(hr) )
+        {
+            LOGE( L"! Failed. IPortableDeviceContent::Transfer, hr=0x%08x\n", hr );
+            pResources = NULL;
+        }
+    }
+
+    for ( DWORD index = 0; index < 2 && NULL != pResources; ++index )
+    {
+        pWorker->hEvents[index] = ::CreateEventW( NULL, TRUE, FALSE, NULL );
+        if ( NULL == pWorker->hEvents[index] )
+        {
+            LOGE( L"! Failed. CreateEvent download, error=%u\n", ::GetLastError() );
+            pResources->Release();
+            pResources = NULL;
+        }
+    }
+
+    // a worker without a session leaves its share to the others
+    for ( ; NULL != pResources; )
+    {
+        const LONG nIndex = ::InterlockedIncrement( &pDownload->nNextJob ) - 1;
+        if ( (LONG)pDownload->jobs.size() <= nIndex )
+        {
+            break;
+        }
+        pWorker->dwCountFile += 1;
+        if ( false == wpdDownload_File( pWorker, pResources, &pDownload->jobs[nIndex] ) )
+        {
+            pWorker->dwCountFailed += 1;
+        }
+    }
+
+    for ( DWORD index = 0; index < 2; ++index )
+    {
+        if ( NULL != pWorker->hEvents[index] )
+        {
+            ::CloseHandle( pWorker->hEvents[index] );
+            pWorker->hEvents[index] = NULL;
+        }
+    }
+    if ( NULL != pResources )
+    {
+        pResources->Release();
+        pResources = NULL;
+    }
+    if ( NULL != pSession && pSession != pWorker->pSession )
+    {
+        wpdSessionPool_Release( pSession, true );
+    }
+    pSession = NULL;
+
+    if ( needCoUninitialize )
+    {
+        ::CoUninitialize();
+    }
+
+    return 0;
+}
+
+// scan the device into a tree, then copy its files; pSession is the one the scan holds.
+// pJobs, when not NULL, gets the files as they ended for a caller that checks the copies
+bool
+wpdDownload_Device(
+    WpdSession* pSession
+    , WpdDeviceScan* pScan
+    , std::vector<WpdDownloadJob>* pJobs
+)
+{
+    WpdTreeStore store;
+    wpdTreeStore_Init( &store );
+    store.keepPuid = true;
+    pScan->pTreeStore = &store;
+    pScan->result = wpdEnumContent( pSession->pPortableDeviceContent, pSession->pPortableDeviceProperties, pScan );
+    pScan->pTreeStore = NULL;
+
+    WpdDownload download;
+    download.pszPnPDeviceID = pScan->pszPnPDeviceID;
+    download.pStats = wpdStats_Device( pScan->pszPnPDeviceID );
+    wpdDownload_Directory( &download.directory );
+    download.nNextJob = 0;
+    if ( pScan->result )
+    {
+        wpdDownload_Jobs( &store, &download.jobs );
+    }
+    wpdTreeStore_Term( &store );
+    if ( false == pScan->result )
+    {
+        return false;
+    }
+    ::InitializeCriticalSection( &download.cs );
+    wpdCrc32_Init();
+
+    ULONGLONG qwBytesExpected = 0;
+    for ( size_t index = 0; index < download.jobs.size(); ++index )
+    {
+        qwBytesExpected += download.jobs[index].qwSize;
+    }
+    LOGI( L"%3u: Download %u files, %I64u bytes to %s\n", pScan->index, (DWORD)download.jobs.size(), qwBytesExpected, download.directory.c_str() );
+
+    DWORD dwCountWorker = s_optDownloadJobs;
+    if ( download.jobs.size() < dwCountWorker )
+    {
+        dwCountWorker = (DWORD)download.jobs.size();
+    }
+    if ( 0 == dwCountWorker )
+    {
+        dwCountWorker = 1;
+    }
+
+    std::vector<WpdDownloadWorker> workers( dwCountWorker );
+    for ( DWORD index = 0; index < dwCountWorker; ++index )
+    {
+        WpdDownloadWorker& worker = workers[index];
+        worker.pDownload = &download;
+        worker.pSession = (0 == index)?(pSession):(NULL);
+        worker.hEvents[0] = NULL;
+        worker.hEvents[1] = NULL;
+        worker.dwOptimalBufferSize = 0;
+        worker.dwCountFile = 0;
+        worker.dwCountFailed = 0;
+        worker.dwCountSkipped = 0;
+        worker.dwCountResume = 0;
+        worker.qwBytes = 0;
+        worker.qwBytesResumed = 0;
+    }
+
+    const ULONGLONG qwTicksStart = wpdTicksNow();
+    if ( 1 == dwCountWorker )
+    {
+        wpdDownload_Worker( &workers[0] );
+    }
+    else
+    {
+        std::vector<HANDLE> threads( dwCountWorker, (HANDLE)NULL );
+        for ( DWORD index = 0; index < dwCountWorker; ++index )
+        {
+            threads[index] = reinterpret_cast<HANDLE>(
+                ::_beginthreadex( NULL, 0, wpdDownload_Worker, &workers[index], 0, NULL )
+                );
+            if ( NULL == threads[index] )
+            {
+                LOGE( L"! Failed. _beginthreadex download worker %u\n", index );
+            }
+        }
+        for ( DWORD index = 0; index < dwCountWorker; ++index )
+        {
+            if ( NULL != threads[index] )
+            {
+                ::WaitForSingleObject( threads[index], INFINITE );
+                ::CloseHandle( threads[index] );
+                threads[index] = NULL;
+            }
+        }
+    }
+    const double dSeconds = wpdTicksToMicroseconds( wpdTicksNow() - qwTicksStart ) / 1000000.0;
+
+    std::vector<double> latencies;
+    ULONGLONG qwBytes = 0;
+    ULONGLONG qwBytesResumed = 0;
+    DWORD dwCountFile = 0;
+    DWORD dwCountFailed = 0;
+    DWORD dwCountSkipped = 0;
+    DWORD dwCountResume = 0;
+    DWORD dwOptimalBufferSize = 0;
+    for ( DWORD index = 0; index < dwCountWorker; ++index )
+    {
+        const WpdDownloadWorker& worker = workers[index];
+        latencies.insert( latencies.end(), worker.latencies.begin(), worker.latencies.end() );
+        qwBytes += worker.qwBytes;
+        qwBytesResumed += worker.qwBytesResumed;
+        dwCountFile += worker.dwCountFile;
+        dwCountFailed += worker.dwCountFailed;
+        dwCountSkipped += worker.dwCountSkipped;
+        dwCountResume += worker.dwCountResume;
+        if ( 0 < worker.dwOptimalBufferSize )
+        {
+            dwOptimalBufferSize = worker.dwOptimalBufferSize;
+        }
+    }
+    // files no worker got to
+    dwCountFailed += (DWORD)download.jobs.size() - dwCountFile;
+    std::sort( latencies.begin(), latencies.end() );
+
+    LOGI( L"%3u: Download %s, files=%u, failed=%u, %I64u bytes in %.3f sec, %.2f MB/s, workers=%u, optimal buffer=%u\n"
+        , pScan->index
+        , (0 == dwCountFailed)?(L"ok"):(L"failed")
+        , (DWORD)latencies.size()
+        , dwCountFailed
+        , qwBytes
+        , dSeconds
+        , (0.0 < dSeconds)?((double)qwBytes / (1024.0 * 1024.0) / dSeconds):(0.0)
+        , dwCountWorker
+        , dwOptimalBufferSize
+        );
+    LOGI( L"    resumed %u times, %I64u bytes verified on disk, %u files already there\n", dwCountResume, qwBytesResumed, dwCountSkipped );
+    if ( !latencies.empty() )
+    {
+        const size_t last = latencies.size() - 1;
+        LOGI( L"    file latency p50=%.1fms, p90=%.1fms, p99=%.1fms, max=%.1fms\n"
+            , latencies[last * 50 / 100]
+            , latencies[last * 90 / 100]
+            , latencies[last * 99 / 100]
+            , latencies[last]
+            );
+    }
+
+    ::DeleteCriticalSection( &download.cs );
+    if ( NULL != pJobs )
+    {
+        pJobs->swap( download.jobs );
+    }
+    return 0 == dwCountFailed;
+}
+
+// 64-bit content hash after XXH3's design: 8 lanes of 64 bits take 64-byte stripes, each lane adding the
+// 32x32 product of its data xor secret, the other lane of its pair adding the data itself; a block of 16
+// stripes ends with a scramble. the lanes map onto SSE2 and AVX2 registers and every kernel gives
+// the value of the scalar one. the values are not XXH3's, the secret and the tail handling differ
+#define WPD_HASH_STRIPE         64U
+#define WPD_HASH_SECRET_SIZE    192U
+#define WPD_HASH_STRIPES_BLOCK  ((WPD_HASH_SECRET_SIZE - WPD_HASH_STRIPE) / 8U)
+#define WPD_HASH_BLOCK          (WPD_HASH_STRIPE * WPD_HASH_STRIPES_BLOCK)
+
+#define WPD_HASH_PRIME32_1  0x9E3779B1U
+#define WPD_HASH_PRIME32_2  0x85EBCA77U
+#define WPD_HASH_PRIME32_3  0xC2B2AE3DU
+#define WPD_HASH_PRIME64_1  0x9E3779B185EBCA87ULL
+#define WPD_HASH_PRIME64_2  0xC2B2AE3D27D4EB4FULL
+#define WPD_HASH_PRIME64_3  0x165667B19E3779F9ULL
+#define WPD_HASH_PRIME64_4  0x85EBCA77C2B2AE63ULL
+#define WPD_HASH_PRIME64_5  0x27D4EB2F165667C5ULL
+
+// countStripe stripes of pData into the 8 lanes, the secret moving on by 8 bytes per stripe
+typedef void (*WpdHashAccumulateProc)( UINT64* pAcc, const BYTE* pData, const BYTE* pSecret, size_t countStripe );
+
+struct WpdHashKernel
+{
+    LPCWSTR                 pszName;
+    WpdHashAccumulateProc   pfnAccumulate;
+};
+
+struct WpdHashState
+{
+    UINT64                  acc[8];
+    BYTE                    buffer[WPD_HASH_BLOCK];
+    size_t                  cbBuffer;
+    ULONGLONG               qwLength;
+    WpdHashAccumulateProc   pfnAccumulate;
+};
+
+static
+BYTE s_hashSecret[WPD_HASH_SECRET_SIZE];
+// usable on this processor, the fastest last
+static
+std::vector<WpdHashKernel> s_hashKernels;
+
+UINT64
+wpdHash_Read64( const BYTE* p )
+{
+    UINT64 value;
+    ::memcpy( &value, p, sizeof(value) );
+    return value;
+}
+
+void
+wpdHash_AccumulateScalar(
+    UINT64* pAcc
+    , const BYTE* pData
+    , const BYTE* pSecret
+    , size_t countStripe
+)
+{
+    for ( ; 0 < countStripe; --countStripe, pData += WPD_HASH_STRIPE, pSecret += 8 )
+    {
+        for ( DWORD lane = 0; lane < 8; ++lane )
+        {
+            const UINT64 data = wpdHash_Read64( pData + lane * 8 );
+            const UINT64 key = data ^ wpdHash_Read64( pSecret + lane * 8 );
+            pAcc[lane ^ 1] += data;
+            pAcc[lane] += (key & 0xFFFFFFFFU) * (key >> 32);
+        }
+    }
+}
+
+#if defined(WPD_HASH_SSE2)
+void
+wpdHash_AccumulateSse2(
+    UINT64* pAcc
+    , const BYTE* pData
+    , const BYTE* pSecret
+    , size_t countStripe
+)
+{
+    __m128i acc[4];
+    for ( DWORD index = 0; index < 4; ++index )
+    {
+        acc[index] = _mm_loadu_si128( reinterpret_cast<const __m128i*>(pAcc) + index );
+    }
+    for ( ; 0 < countStripe; --countStripe, pData += WPD_HASH_STRIPE, pSecret += 8 )
+    {
+        for ( DWORD index = 0; index < 4; ++index )
+        {
+            const __m128i data = _mm_loadu_si128( reinterpret_cast<const __m128i*>(pData) + index );
+            const __m128i key = _mm_xor_si128( data, _mm_loadu_si128( reinterpret_cast<const __m128i*>(pSecret) + index ) );
+            const __m128i product = _mm_mul_epu32( key, _mm_shuffle_epi32( key, _MM_SHUFFLE(0, 3, 0, 1) ) );
+            const __m128i swapped = _mm_shuffle_epi32( data, _MM_SHUFFLE(1, 0, 3, 2) );
+            acc[index] = _mm_add_epi64( acc[index], _mm_add_epi64( product, swapped ) );
+        }
+    }
+    for ( DWORD index = 0; index < 4; ++index )
+    {
+        _mm_storeu_si128( reinterpret_cast<__m128i*>(pAcc) + index, acc[index] );
+    }
+}
+#endif
+
+#if defined(WPD_HASH_AVX2)
+void
+wpdHash_AccumulateAvx2(
+    UINT64* pAcc
+    , const BYTE* pData
+    , const BYTE* pSecret
+    , size_t countStripe
+)
+{
+    __m256i acc[2];
+    for ( DWORD index = 0; index < 2; ++index )
+    {
+        acc[index] = _mm256_loadu_si256( reinterpret_cast<const __m256i*>(pAcc) + index );
+    }
+    for ( ; 0 < countStripe; --countStripe, pData += WPD_HASH_STRIPE, pSecret += 8 )
+    {
+        for ( DWORD index = 0; index < 2; ++index )
+        {
+            const __m256i data = _mm256_loadu_si256( reinterpret_cast<const __m256i*>(pData) + index );
+            const __m256i key = _mm256_xor_si256( data, _mm256_loadu_si256( reinterpret_cast<const __m256i*>(pSecret) + index ) );
+            const __m256i product = _mm256_mul_epu32( key, _mm256_shuffle_epi32( key, _MM_SHUFFLE(0, 3, 0, 1) ) );
+            const __m256i swapped = _mm256_shuffle_epi32( data, _MM_SHUFFLE(1, 0, 3, 2) );
+            acc[index] = _mm256_add_epi64( acc[index], _mm256_add_epi64( product, swapped ) );
+        }
+    }
+    for ( DWORD index = 0; index < 2; ++index )
+    {
+        _mm256_storeu_si256( reinterpret_cast<__m256i*>(pAcc) + index, acc[index] );
+    }
+    // the rest of the program is built without VEX, leave no dirty upper halves behind
+    _mm256_zeroupper();
+}
+#endif
+
+#if defined(WPD_HASH_AVX2)
+bool
+wpdHash_HasAvx2( void )
+{
+    int info[4] = { 0, 0, 0, 0 };
+    ::__cpuid( info, 0 );
+    if ( info[0] < 7 )
+    {
+        return false;
+    }
+    // the OS has to save the YMM registers too
+    ::__cpuid( info, 1 );
+    if ( 0 == (info[2] & (1 << 27)) || 0 == (info[2] & (1 << 28)) || 6 != (::_xgetbv( 0 ) & 6) )
+    {
+        return false;
+    }
+    ::__cpuidex( info, 7, 0 );
+    return 0 != (info[1] & (1 << 5));
+}
+#endif
+
+void
+wpdHash_Init( void )
+{
+    if ( !s_hashKernels.empty() )
+    {
+        return;
+    }
+
+    // splitmix64, the same secret everywhere
+    UINT64 x = WPD_HASH_PRIME64_1;
+    for ( DWORD offset = 0; offset < WPD_HASH_SECRET_SIZE; offset += 8 )
+    {
+        x += 0x9E3779B97F4A7C15ULL;
+        UINT64 z = x;
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        z ^= z >> 31;
+        ::memcpy( &s_hashSecret[offset], &z, sizeof(z) );
+    }
+
+    WpdHashKernel kernel;
+    kernel.pszName = L"scalar";
+    kernel.pfnAccumulate = wpdHash_AccumulateScalar;
+    s_hashKernels.push_back( kernel );
+#if defined(WPD_HASH_SSE2)
+    {
+        int info[4] = { 0, 0, 0, 0 };
+        ::__cpuid( info, 1 );
+        if ( 0 != (info[3] & (1 << 26)) )
+        {
+            kernel.pszName = L"sse2";
+            kernel.pfnAccumulate = wpdHash_AccumulateSse2;
+            s_hashKernels.push_back( kernel );
+        }
+    }
+#endif
+#if defined(WPD_HASH_AVX2)
+    if ( wpdHash_HasAvx2() )
+    {
+        kernel.pszName = L"avx2";
+        kernel.pfnAccumulate = wpdHash_AccumulateAvx2;
+        s_hashKernels.push_back( kernel );
+    }
+#endif
+}
+
+// pKernel NULL takes the fastest one
+void
+wpdHash_Begin(
+    WpdHashState* pState
+    , const WpdHashKernel* pKernel
+)
+{
+    pState->acc[0] = WPD_HASH_PRIME32_3;
+    pState->acc[1] = WPD_HASH_PRIME64_1;
+    pState->acc[2] = WPD_HASH_PRIME64_2;
+    pState->acc[3] = WPD_HASH_PRIME64_3;
+    pState->acc[4] = WPD_HASH_PRIME64_4;
+    pState->acc[5] = WPD_HASH_PRIME32_2;
+    pState->acc[6] = WPD_HASH_PRIME64_5;
+    pState->acc[7] = WPD_HASH_PRIME32_1;
+    pState->cbBuffer = 0;
+    pState->qwLength = 0;
+    pState->pfnAccumulate = (NULL != pKernel)?(pKernel->pfnAccumulate):(s_hashKernels.back().pfnAccumulate);
+}
+
+void
+wpdHash_Scramble(
+    UINT64* pAcc
+)
+{
+    const BYTE* pSecret = &s_hashSecret[WPD_HASH_SECRET_SIZE - WPD_HASH_STRIPE];
+    for ( DWORD lane = 0; lane < 8; ++lane )
+    {
+        UINT64 acc = pAcc[lane];
+        acc ^= acc >> 47;
+        acc ^= wpdHash_Read64( pSecret + lane * 8 );
+        pAcc[lane] = acc * WPD_HASH_PRIME32_1;
+    }
+}
+
+void
+wpdHash_Block(
+    WpdHashState* pState
+    , const BYTE* pData
+)
+{
+    pState->pfnAccumulate( pState->acc, pData, s_hashSecret, WPD_HASH_STRIPES_BLOCK );
+    wpdHash_Scramble( pState->acc );
+}
+
+// the value depends on the bytes only, not on how they were split up
+void
+wpdHash_Update(
+    WpdHashState* pState
+    , const BYTE* pData
+    , size_t cb
+)
+{
+    pState->qwLength += cb;
+    if ( 0 < pState->cbBuffer )
+    {
+        const size_t cbCopy = (WPD_HASH_BLOCK - pState->cbBuffer < cb)?(WPD_HASH_BLOCK - pState->cbBuffer):(cb);
+        ::memcpy( &pState->buffer[pState->cbBuffer], pData, cbCopy );
+        pState->cbBuffer += cbCopy;
+        pData += cbCopy;
+        cb -= cbCopy;
+        if ( pState->cbBuffer < WPD_HASH_BLOCK )
+        {
+            return;
+        }
+        wpdHash_Block( pState, pState->buffer );
+        pState->cbBuffer = 0;
+    }
+    for ( ; WPD_HASH_BLOCK <= cb; pData += WPD_HASH_BLOCK, cb -= WPD_HASH_BLOCK )
+    {
+        wpdHash_Block( pState, pData );
+    }
+    if ( 0 < cb )
+    {
+        ::memcpy( pState->buffer, pData, cb );
+        pState->cbBuffer = cb;
+    }
+}
+
+// the high and the low half of the 128-bit product folded together
+UINT64
+wpdHash_Mul128Fold64(
+    const UINT64 a
+    , const UINT64 b
+)
+{
+    const UINT64 aLo = a & 0xFFFFFFFFU;
+    const UINT64 aHi = a >> 32;
+    const UINT64 bLo = b & 0xFFFFFFFFU;
+    const UINT64 bHi = b >> 32;
+    const UINT64 lolo = aLo * bLo;
+    const UINT64 hilo = aHi * bLo;
+    const UINT64 lohi = aLo * bHi;
+    const UINT64 hihi = aHi * bHi;
+    const UINT64 cross = (lolo >> 32) + (hilo & 0xFFFFFFFFU) + lohi;
+    const UINT64 hi = hihi + (hilo >> 32) + (cross >> 32);
+    const UINT64 lo = (cross << 32) | (lolo & 0xFFFFFFFFU);
+    return hi ^ lo;
+}
+
+UINT64
+wpdHash_End(
+    WpdHashState* pState
+)
+{
+    // what is left of the last block: whole stripes, then the rest padded with zeros, its length is in the result
+    const size_t countStripe = pState->cbBuffer / WPD_HASH_STRIPE;
+    pState->pfnAccumulate( pState->acc, pState->buffer, s_hashSecret, countStripe );
+    const size_t cbRest = pState->cbBuffer % WPD_HASH_STRIPE;
+    if ( 0 < cbRest )
+    {
+        BYTE stripe[WPD_HASH_STRIPE];
+        ::memset( stripe, 0, sizeof(stripe) );
+        ::memcpy( stripe, &pState->buffer[countStripe * WPD_HASH_STRIPE], cbRest );
+        pState->pfnAccumulate( pState->acc, stripe, &s_hashSecret[WPD_HASH_SECRET_SIZE - WPD_HASH_STRIPE - 7], 1 );
+    }
+
+    UINT64 h = pState->qwLength * WPD_HASH_PRIME64_1;
+    for ( DWORD index = 0; index < 4; ++index )
+    {
+        h += wpdHash_Mul128Fold64(
+            pState->acc[index * 2] ^ wpdHash_Read64( &s_hashSecret[11 + index * 16] )
+            , pState->acc[index * 2 + 1] ^ wpdHash_Read64( &s_hashSecret[19 + index * 16] )
+            );
+    }
+    h ^= h >> 37;
+    h *= 0x165667919E3779F9ULL;
+    h ^= h >> 32;
+    return h;
+}
+
+UINT64
+wpdHash(
+    const BYTE* pData
+    , const size_t cb
+)
+{
+    WpdHashState state;
+    wpdHash_Begin( &state, NULL );
+    wpdHash_Update( &state, pData, cb );
+    return wpdHash_End( &state );
+}
+
+// --hash-bench=<MiB>: every kernel over the same bytes, checked against the scalar one first
+void
+wpdHash_Bench(
+    const DWORD dwMegabytes
+)
+{
+    wpdHash_Init();
+
+    std::vector<BYTE> buffer( (size_t)dwMegabytes * 1024U * 1024U + WPD_HASH_STRIPE );
+    DWORD x = 0x12345678U;
+    for ( size_t index = 0; index < buffer.size(); ++index )
+    {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        buffer[index] = (BYTE)x;
+    }
+
+    // odd lengths, odd alignments and odd splits must not change the value
+    DWORD dwCountMismatch = 0;
+    for ( size_t cb = 0; cb < 4096 && cb + 3 <= buffer.size(); cb += (cb < 256)?(1):(61) )
+    {
+        for ( size_t align = 0; align < 3; ++align )
+        {
+            const UINT64 qwExpected = wpdHash( &buffer[align], cb );
+            for ( size_t kernel = 0; kernel < s_hashKernels.size(); ++kernel )
+            {
+                WpdHashState state;
+                wpdHash_Begin( &state, &s_hashKernels[kernel] );
+                const size_t cbStep = 1 + (cb % 97) + kernel * 13;
+                for ( size_t position = 0; position < cb; position += cbStep )
+                {
+                    wpdHash_Update( &state, &buffer[align + position], (cb - position < cbStep)?(cb - position):(cbStep) );
+                }
+                if ( qwExpected != wpdHash_End( &state ) )
+                {
+                    dwCountMismatch += 1;
+                }
+            }
+        }
+    }
+    LOGI( L"Hash bench : %u MiB, kernels=%u, mismatches=%u\n", dwMegabytes, (DWORD)s_hashKernels.size(), dwCountMismatch );
+#if (defined(_M_IX86) || defined(_M_X64)) && !defined(WPD_HASH_AVX2)
+    LOGI( L"    avx2 not built, it needs VS2012 or later\n" );
+#endif
+
+    const size_t cbData = buffer.size() - WPD_HASH_STRIPE;
+    const size_t cbCached = (cbData < 128U * 1024U)?(cbData):(128U * 1024U);
+    for ( size_t kernel = 0; kernel < s_hashKernels.size(); ++kernel )
+    {
+        WpdHashState state;
+        UINT64 qwHash = 0;
+        const ULONGLONG qwTicksStart = wpdTicksNow();
+        for ( DWORD repeat = 0; repeat < 4; ++repeat )
+        {
+            wpdHash_Begin( &state, &s_hashKernels[kernel] );
+            wpdHash_Update( &state, &buffer[0], cbData );
+            qwHash = wpdHash_End( &state );
+        }
+        const double dSeconds = wpdTicksToMicroseconds( wpdTicksNow() - qwTicksStart ) / 1000000.0;
+
+        // the same 128 KiB again and again, the kernel rather than the memory
+        const DWORD dwCountCached = (DWORD)((4U * cbData) / ((0 < cbCached)?(cbCached):(1)));
+        const ULONGLONG qwTicksCached = wpdTicksNow();
+        for ( DWORD repeat = 0; repeat < dwCountCached; ++repeat )
+        {
+            wpdHash_Begin( &state, &s_hashKernels[kernel] );
+            wpdHash_Update( &state, &buffer[0], cbCached );
+            wpdHash_End( &state );
+        }
+        const double dSecondsCached = wpdTicksToMicroseconds( wpdTicksNow() - qwTicksCached ) / 1000000.0;
+
+        LOGI( L"    %-6s %6.2f GB/s, cached %6.2f GB/s, hash=%016I64x\n"
+            , s_hashKernels[kernel].pszName
+            , (0.0 < dSeconds)?(4.0 * cbData / dSeconds / 1e9):(0.0)
+            , (0.0 < dSecondsCached)?((double)dwCountCached * cbCached / dSecondsCached / 1e9):(0.0)
+            , qwHash
+            );
+    }
+}
+
+// --dedup: the files of every device scanned go into one table. a size seen once cannot have a copy,
+// the others get a hash of their head and tail, and the files still colliding on that a hash of it all
+#define WPD_DEDUP_PARTIAL   (64U * 1024U)   // bytes hashed at either end first
+#define WPD_DEDUP_BUFFER    (1024U * 1024U)
+
+struct WpdDedupFile
+{
+    std::wstring    pnpDeviceId;
+    std::wstring    objectId;
+    std::wstring    path;
+    ULONGLONG       qwSize;
+    UINT64          qwHashPartial;
+    UINT64          qwHash;     // of all the content
+    bool            hashedPartial;
+    bool            hashed;
+    bool            failed;
+};
+
+struct WpdDedup
+{
+    CRITICAL_SECTION            cs;
+    std::vector<WpdDedupFile>   files;
+};
+
+static
+WpdDedup s_dedup;
+
+void
+wpdDedup_Start(
+    void
+)
+{
+    ::InitializeCriticalSection( &s_dedup.cs );
+}
+
+void
+wpdDedup_Stop(
+    void
+)
+{
+    s_dedup.files.clear();
+    ::DeleteCriticalSection( &s_dedup.cs );
+}
+
+// scan the device into a tree and keep its files for wpdDedup_Run(); pSession is the one the scan holds
+bool
+wpdDedup_Collect(
+    WpdSession* pSession
+    , WpdDeviceScan* pScan
+)
+{
+    WpdTreeStore store;
+    wpdTreeStore_Init( &store );
+    pScan->pTreeStore = &store;
+    pScan->result = wpdEnumContent( pSession->pPortableDeviceContent, pSession->pPortableDeviceProperties, pScan );
+    pScan->pTreeStore = NULL;
+
+    std::vector<WpdDownloadJob> jobs;
+    if ( pScan->result )
+    {
+        wpdDownload_Jobs( &store, &jobs );
+    }
+    wpdTreeStore_Term( &store );
+
+    ::EnterCriticalSection( &s_dedup.cs );
+    for ( size_t index = 0; index < jobs.size(); ++index )
+    {
+        s_dedup.files.push_back( WpdDedupFile() );
+        WpdDedupFile& file = s_dedup.files.back();
+        file.pnpDeviceId.assign( pScan->pszPnPDeviceID );
+        file.objectId.swap( jobs[index].objectId );
+        file.path.swap( jobs[index].path );
+        file.qwSize = jobs[index].qwSize;
+        file.qwHashPartial = 0;
+        file.qwHash = 0;
+        file.hashedPartial = false;
+        file.hashed = false;
+        file.failed = false;
+    }
+    ::LeaveCriticalSection( &s_dedup.cs );
+
+    LOGI( L"%3u: Dedup %u files collected\n", pScan->index, (DWORD)jobs.size() );
+    return pScan->result;
+}
+
+struct WpdDedupReader
+{
+    WpdDeviceStats*             pStats;
+    IPortableDeviceResources*   pResources;
+    std::vector<BYTE>           buffer;
+    ULONGLONG                   qwBytesRead;
+    DWORD                       dwCountStream;
+};
+
+IStream*
+wpdDedup_Open(
+    WpdDedupReader* pReader
+    , const WpdDedupFile& file
+)
+{
+    IStream* pStream = NULL;
+    DWORD dwOptimalBufferSize = 0;
+    const ULONGLONG qwTicksCall = wpdStats_Begin( pReader->pStats );
+    const HRESULT hr = pReader->pResources->GetStream( file.objectId.c_str(), WPD_RESOURCE_DEFAULT, STGM_READ, &dwOptimalBufferSize, &pStream );
+    wpdStats_End( pReader->pStats, WPD_STAT_OP_GET_STREAM, qwTicksCall, hr, 1 );
+    if ( FAILED(hr) )
+    {
+        LOGE( L"! Failed. IPortableDeviceResources::GetStream %s, hr=0x%08x\n", file.objectId.c_str(), hr );
+        return NULL;
+    }
+    pReader->dwCountStream += 1;
+    return pStream;
+}
+
+// up to cb bytes, fewer only at the end of the stream
+bool
+wpdDedup_Read(
+    WpdDedupReader* pReader
+    , IStream* pStream
+    , BYTE* pBuffer
+    , const ULONG cb
+    , ULONG* pcbRead
+)
+{
+    *pcbRead = 0;
+    while ( *pcbRead < cb )
+    {
+        ULONG cbRead = 0;
+        const ULONGLONG qwTicksCall = wpdStats_Begin( pReader->pStats );
+        const HRESULT hr = pStream->Read( pBuffer + *pcbRead, cb - *pcbRead, &cbRead );
+        wpdStats_End( pReader->pStats, WPD_STAT_OP_READ, qwTicksCall, hr, 0 );
+        wpdStats_AddBytes( pReader->pStats, WPD_STAT_OP_READ, cbRead );
+        if ( FAILED(hr) )
+        {
+            LOGE( L"! Failed. IStream::Read, hr=0x%08x\n", hr );
+            return false;
+        }
+        if ( 0 == cbRead )
+        {
+            break;
+        }
+        *pcbRead += cbRead;
+        pReader->qwBytesRead += cbRead;
+    }
+    return true;
+}
+
+// hashes the stream from where it is to its end into pState
+bool
+wpdDedup_HashRest(
+    WpdDedupReader* pReader
+    , IStream* pStream
+    , WpdHashState* pState
+)
+{
+    for ( ;; )
+    {
+        ULONG cbRead = 0;
+        if ( false == wpdDedup_Read( pReader, pStream, &pReader->buffer[0], WPD_DEDUP_BUFFER, &cbRead ) )
+        {
+            return false;
+        }
+        wpdHash_Update( pState, &pReader->buffer[0], cbRead );
+        if ( cbRead < WPD_DEDUP_BUFFER )
+        {
+            return true;
+        }
+    }
+}
+
+// head and tail into one hash; a file no larger than both is hashed whole on the way
+bool
+wpdDedup_HashPartial(
+    WpdDedupReader* pReader
+    , WpdDedupFile* pFile
+)
+{
+    IStream* pStream = wpdDedup_Open( pReader, *pFile );
+    if ( NULL == pStream )
+    {
+        return false;
+    }
+
+    bool result = true;
+    WpdHashState state;
+    wpdHash_Begin( &state, NULL );
+    if ( pFile->qwSize <= 2U * WPD_DEDUP_PARTIAL )
+    {
+        result = wpdDedup_HashRest( pReader, pStream, &state );
+        pFile->qwHash = wpdHash_End( &state );
+        pFile->qwHashPartial = pFile->qwHash;
+        pFile->hashedPartial = result;
+        pFile->hashed = result;
+    }
+    else
+    {
+        ULONG cbRead = 0;
+        result = wpdDedup_Read( pReader, pStream, &pReader->buffer[0], WPD_DEDUP_PARTIAL, &cbRead );
+        wpdHash_Update( &state, &pReader->buffer[0], cbRead );
+
+        // streams without Seek() are read through to the tail
+        LARGE_INTEGER liMove;
+        liMove.QuadPart = (LONGLONG)(pFile->qwSize - WPD_DEDUP_PARTIAL);
+        if ( result && FAILED(pStream->Seek( liMove, STREAM_SEEK_SET, NULL )) )
+        {
+            for ( ULONGLONG qwSkip = pFile->qwSize - 2U * WPD_DEDUP_PARTIAL; result && 0 < qwSkip; )
+            {
+                const ULONG cb = (qwSkip < WPD_DEDUP_BUFFER)?((ULONG)qwSkip):(WPD_DEDUP_BUFFER);
+                result = wpdDedup_Read( pReader, pStream, &pReader->buffer[0], cb, &cbRead ) && cb == cbRead;
+                qwSkip -= cb;
+            }
+        }
+        if ( result )
+        {
+            result = wpdDedup_Read( pReader, pStream, &pReader->buffer[0], WPD_DEDUP_PARTIAL, &cbRead );
+            wpdHash_Update( &state, &pReader->buffer[0], cbRead );
+        }
+        pFile->qwHashPartial = wpdHash_End( &state );
+        pFile->hashedPartial = result;
+    }
+
+    pStream->Release();
+    pStream = NULL;
+    return result;
+}
+
+bool
+wpdDedup_HashFull(
+    WpdDedupReader* pReader
+    , WpdDedupFile* pFile
+)
+{
+    IStream* pStream = wpdDedup_Open( pReader, *pFile );
+    if ( NULL == pStream )
+    {
+        return false;
+    }
+
+    WpdHashState state;
+    wpdHash_Begin( &state, NULL );
+    const bool result = wpdDedup_HashRest( pReader, pStream, &state );
+    pFile->qwHash = wpdHash_End( &state );
+    pFile->hashed = result;
+
+    pStream->Release();
+    pStream = NULL;
+    return result;
+}
+
+// one session per device while its files are read
+void
+wpdDedup_HashDevice(
+    WpdDedupReader* pReader
+    , std::vector<WpdDedupFile>* pFiles
+    , const std::vector<size_t>& indices
+    , const bool full
+)
+{
+    if ( indices.empty() )
+    {
+        return;
+    }
+    LPCWSTR pszPnPDeviceID = (*pFiles)[indices[0]].pnpDeviceId.c_str();
+    pReader->pStats = wpdStats_Device( pszPnPDeviceID );
+    pReader->pResources = NULL;
+
+    WpdSession* pSession = wpdSessionPool_Acquire( pszPnPDeviceID );
+    if ( NULL != pSession )
+    {
+        const HRESULT hr = pSession->pPortableDeviceContent->Transfer( &pReader->pResources );
+        if ( FAILED(hr) )
+        {
+            LOGE( L"! Failed. IPortableDeviceContent::Transfer, hr=0x%08x\n", hr );
+            pReader->pResources = NULL;
+        }
+    }
+
+    bool result = (NULL != pReader->pResources);
+    for ( size_t index = 0; index < indices.size(); ++index )
+    {
+        WpdDedupFile& file = (*pFiles)[indices[index]];
+        const bool hashed = (NULL != pReader->pResources)
+            && ((full)?(wpdDedup_HashFull( pReader, &file )):(wpdDedup_HashPartial( pReader, &file )));
+        if ( false == hashed )
+        {
+            file.failed = true;
+            result = false;
+        }
+    }
+
+    if ( NULL != pReader->pResources )
+    {
+        pReader->pResources->Release();
+        pReader->pResources = NULL;
+    }
+    if ( NULL != pSession )
+    {
+        wpdSessionPool_Release( pSession, result );
+        pSession = NULL;
+    }
+}
+
+// files of groups with more than one member that still need hashing, by device
+void
+wpdDedup_Pending(
+    const std::vector<WpdDedupFile>& files
+    , const std::map< std::pair<ULONGLONG, UINT64>, std::vector<size_t> >& groups
+    , std::map< std::wstring, std::vector<size_t> >* pByDevice
+)
+{
+    pByDevice->clear();
+    for ( std::map< std::pair<ULONGLONG, UINT64>, std::vector<size_t> >::const_iterator it = groups.begin(); it != groups.end(); ++it )
+    {
+        if ( it->second.size() < 2 )
+        {
+            continue;
+        }
+        for ( size_t index = 0; index < it->second.size(); ++index )
+        {
+            const WpdDedupFile& file = files[it->second[index]];
+            if ( false == file.hashed && false == file.failed )
+            {
+                (*pByDevice)[file.pnpDeviceId].push_back( it->second[index] );
+            }
+        }
+    }
+}
+
+struct WpdDedupSet
+{
+    ULONGLONG           qwSize;
+    UINT64              qwHash;
+    std::vector<size_t> files;
+};
+
+bool
+wpdDedupSet_Larger(
+    const WpdDedupSet& a
+    , const WpdDedupSet& b
+)
+{
+    return (a.qwSize * (a.files.size() - 1)) > (b.qwSize * (b.files.size() - 1));
+}
+
+// takes the files collected so far, hashes what may be a copy and reports the copies
+void
+wpdDedup_Run(
+    void
+)
+{
+    wpdHash_Init();
+
+    std::vector<WpdDedupFile> files;
+    ::EnterCriticalSection( &s_dedup.cs );
+    files.swap( s_dedup.files );
+    ::LeaveCriticalSection( &s_dedup.cs );
+
+    const ULONGLONG qwTicksStart = wpdTicksNow();
+    WpdDedupReader reader;
+    reader.pStats = NULL;
+    reader.pResources = NULL;
+    reader.buffer.resize( WPD_DEDUP_BUFFER );
+    reader.qwBytesRead = 0;
+    reader.dwCountStream = 0;
+
+    // by size alone; empty files are all the same and not worth a set
+    typedef std::map< std::pair<ULONGLONG, UINT64>, std::vector<size_t> > WpdDedupGroups;
+    WpdDedupGroups groups;
+    ULONGLONG qwBytesNaive = 0;
+    for ( size_t index = 0; index < files.size(); ++index )
+    {
+        if ( 0 < files[index].qwSize )
+        {
+            groups[std::make_pair( files[index].qwSize, (UINT64)0 )].push_back( index );
+            qwBytesNaive += files[index].qwSize;
+        }
+    }
+
+    std::map< std::wstring, std::vector<size_t> > byDevice;
+    wpdDedup_Pending( files, groups, &byDevice );
+    DWORD dwCountSized = 0;
+    for ( std::map< std::wstring, std::vector<size_t> >::const_iterator it = byDevice.begin(); it != byDevice.end(); ++it )
+    {
+        dwCountSized += (DWORD)it->second.size();
+        wpdDedup_HashDevice( &reader, &files, it->second, false );
+    }
+
+    // by size and head and tail, those still together get read in full
+    groups.clear();
+    for ( size_t index = 0; index < files.size(); ++index )
+    {
+        const WpdDedupFile& file = files[index];
+        if ( file.hashedPartial && false == file.failed )
+        {
+            groups[std::make_pair( file.qwSize, file.qwHashPartial )].push_back( index );
+        }
+    }
+    wpdDedup_Pending( files, groups, &byDevice );
+    DWORD dwCountFull = 0;
+    for ( std::map< std::wstring, std::vector<size_t> >::const_iterator it = byDevice.begin(); it != byDevice.end(); ++it )
+    {
+        dwCountFull += (DWORD)it->second.size();
+        wpdDedup_HashDevice( &reader, &files, it->second, true );
+    }
+
+    // by size and the hash of everything
+    groups.clear();
+    DWORD dwCountFailed = 0;
+    for ( size_t index = 0; index < files.size(); ++index )
+    {
+        const WpdDedupFile& file = files[index];
+        dwCountFailed += (file.failed)?(1):(0);
+        if ( file.hashed && false == file.failed )
+        {
+            groups[std::make_pair( file.qwSize, file.qwHash )].push_back( index );
+        }
+    }
+    std::vector<WpdDedupSet> sets;
+    DWORD dwCountCopy = 0;
+    ULONGLONG qwBytesRedundant = 0;
+    for ( WpdDedupGroups::iterator it = groups.begin(); it != groups.end(); ++it )
+    {
+        if ( it->second.size() < 2 )
+        {
+            continue;
+        }
+        sets.push_back( WpdDedupSet() );
+        WpdDedupSet& set = sets.back();
+        set.qwSize = it->first.first;
+        set.qwHash = it->first.second;
+        set.files.swap( it->second );
+        dwCountCopy += (DWORD)set.files.size() - 1;
+        qwBytesRedundant += set.qwSize * (set.files.size() - 1);
+    }
+    std::sort( sets.begin(), sets.end(), wpdDedupSet_Larger );
+    const double dSeconds = wpdTicksToMicroseconds( wpdTicksNow() - qwTicksStart ) / 1000000.0;
+
+    LOGI( L"Dedup      : %u files, %u share their size, %u share head and tail too, %u failed\n"
+        , (DWORD)files.size()
+        , dwCountSized
+        , dwCountFull
+        , dwCountFailed
+        );
+    LOGI( L"    %u sets of duplicates, %u copies too many, %I64u bytes redundant\n", (DWORD)sets.size(), dwCountCopy, qwBytesRedundant );
+    LOGI( L"    read %I64u bytes from %u streams in %.3f sec, a full hash of every file reads %I64u bytes (%.2f%%), kernel=%s\n"
+        , reader.qwBytesRead
+        , reader.dwCountStream
+        , dSeconds
+        , qwBytesNaive
+        , (0 < qwBytesNaive)?(100.0 * (double)reader.qwBytesRead / (double)qwBytesNaive):(0.0)
+        , s_hashKernels.back().pszName
+        );
+    for ( size_t index = 0; index < sets.size(); ++index )
+    {
+        const WpdDedupSet& set = sets[index];
+        LOGI( L"    %016I64x %I64u bytes x%u\n", set.qwHash, set.qwSize, (DWORD)set.files.size() );
+        for ( size_t member = 0; member < set.files.size(); ++member )
+        {
+            const WpdDedupFile& file = files[set.files[member]];
+            LOGI( L"        %s\t%s\n", file.pnpDeviceId.c_str(), file.path.c_str() );
+        }
+    }
+}
+
+enum WpdWatchEventKind
+{
+    WPD_WATCH_EVENT_ADDED
+    , WPD_WATCH_EVENT_REMOVED
+    , WPD_WATCH_EVENT_UPDATED
+    , WPD_WATCH_EVENT_DEVICE_REMOVED
+};
+
+struct WpdWatchEvent
+{
+    WpdWatchEventKind   kind;
+    std::wstring        objectId;
+    std::wstring        parentId;   // empty when the event does not carry it
+};
+
+// where the watch mode gets its events from: the device, or the script of the simulated one
+class WpdWatchEventSource
+{
+public:
+    virtual ~WpdWatchEventSource() {}
+
+    // false when no event arrived within dwTimeout milliseconds
+    virtual bool wait( const DWORD dwTimeout, WpdWatchEvent* pEvent ) = 0;
+};
+
+// receives the device events on a COM thread and queues them for the watch loop
+class WpdDeviceEventCallback : public IPortableDeviceEventCallback
+{
+public:
+    WpdDeviceEventCallback()
+        : m_cRef(1)
+        , m_hEventQueued(NULL)
+    {
+        ::InitializeCriticalSection( &m_cs );
+        m_hEventQueued = ::CreateEventW( NULL, FALSE, FALSE, NULL );
+    }
+
+    HRESULT STDMETHODCALLTYPE
+    QueryInterface( REFIID riid, void** ppv )
+    {
+        if ( NULL == ppv )
+        {
+            return E_POINTER;
+        }
+        *ppv = NULL;
+
+        if ( ::IsEqualIID( riid, IID_IUnknown )
+            || ::IsEqualIID( riid, IID_IPortableDeviceEventCallback ) )
+        {
+            *ppv = static_cast<IPortableDeviceEventCallback*>(this);
+            this->AddRef();
+            return S_OK;
+        }
+
+        return E_NOINTERFACE;
+    }
+
+    ULONG STDMETHODCALLTYPE
+    AddRef( void )
+    {
+        return ::InterlockedIncrement( &m_cRef );
+    }
+
+    ULONG STDMETHODCALLTYPE
+    Release( void )
+    {
+        const LONG cRef = ::InterlockedDecrement( &m_cRef );
+        if ( 0 == cRef )
+        {
+            delete this;
+        }
+        return cRef;
+    }
+
+    HRESULT STDMETHODCALLTYPE
+    OnEvent( IPortableDeviceValues* pEventParameters )
+    {
+        if ( NULL == pEventParameters )
+        {
+            return S_OK;
+        }
+
+        GUID guidEvent;
+        if ( FAILED(pEventParameters->GetGuidValue( WPD_EVENT_PARAMETER_EVENT_ID, &guidEvent )) )
+        {
+            return S_OK;
+        }
+
+        WpdWatchEvent event;
+        if ( ::IsEqualGUID( guidEvent, WPD_EVENT_OBJECT_ADDED ) )
+        {
+            event.kind = WPD_WATCH_EVENT_ADDED;
+        }
+        else
+        if ( ::IsEqualGUID( guidEvent, WPD_EVENT_OBJECT_REMOVED ) )
+        {
+            event.kind = WPD_WATCH_EVENT_REMOVED;
+        }
+        else
+        if ( ::IsEqualGUID( guidEvent, WPD_EVENT_OBJECT_UPDATED ) )
+        {
+            event.kind = WPD_WATCH_EVENT_UPDATED;
+        }
+        else
+        if ( ::IsEqualGUID( guidEvent, WPD_EVENT_DEVICE_REMOVED ) )
+        {
+            event.kind = WPD_WATCH_EVENT_DEVICE_REMOVED;
+        }
+        else
+        {
+            return S_OK;
+        }
+
+        {
+            LPWSTR pValue = NULL;
+            if ( SUCCEEDED(pEventParameters->GetStringValue( WPD_OBJECT_ID, &pValue )) && NULL != pValue )
+            {
+                event.objectId.assign( pValue );
+            }
+            if ( NULL != pValue )
+            {
+                ::CoTaskMemFree( pValue );
+                pValue = NULL;
+            }
+        }
+        {
+            LPWSTR pValue = NULL;
+            if ( SUCCEEDED(pEventParameters->GetStringValue( WPD_OBJECT_PARENT_ID, &pValue )) && NULL != pValue )
+            {
+                event.parentId.assign( pValue );
+            }
+            if ( NULL != pValue )
+            {
+                ::CoTaskMemFree( pValue );
+                pValue = NULL;
+            }
+        }
+
+        ::EnterCriticalSection( &m_cs );
+        m_queue.push_back( event );
+        ::LeaveCriticalSection( &m_cs );
+        if ( NULL != m_hEventQueued )
+        {
+            ::SetEvent( m_hEventQueued );
+        }
+
+        return S_OK;
+    }
+
+    bool
+    pop( const DWORD dwTimeout, WpdWatchEvent* pEvent )
+    {
+        const DWORD dwStart = ::GetTickCount();
+        for ( ;; )
+        {
+            ::EnterCriticalSection( &m_cs );
+            const bool found = !m_queue.empty();
+            if ( found )
+            {
+                *pEvent = m_queue.front();
+                m_queue.pop_front();
+            }
+            ::LeaveCriticalSection( &m_cs );
+            if ( found )
+            {
+                return true;
+            }
+
+            DWORD dwWait = INFINITE;
+            if ( INFINITE != dwTimeout )
+            {
+                const DWORD dwElapsed = ::GetTickCount() - dwStart;
+                if ( dwTimeout <= dwElapsed )
+                {
+                    return false;
+                }
+                dwWait = dwTimeout - dwElapsed;
+            }
+            if ( NULL == m_hEventQueued || WAIT_OBJECT_0 != ::WaitForSingleObject( m_hEventQueued, dwWait ) )
+            {
+                return false;
+            }
+        }
+    }
+
+private:
+    ~WpdDeviceEventCallback()
+    {
+        if ( NULL != m_hEventQueued )
+        {
+            ::CloseHandle( m_hEventQueued );
+            m_hEventQueued = NULL;
+        }
+        ::DeleteCriticalSection( &m_cs );
+    }
+
+    LONG                        m_cRef;
+    HANDLE                      m_hEventQueued;
+    CRITICAL_SECTION            m_cs;
+    std::deque<WpdWatchEvent>   m_queue;
+};
+
+// events of an opened device, subscribed with IPortableDevice::Advise
+class WpdDeviceEventSource : public WpdWatchEventSource
+{
+public:
+    explicit WpdDeviceEventSource( IPortableDevice* pPortableDevice )
+        : m_pPortableDevice(pPortableDevice)
+        , m_pCallback(NULL)
+        , m_pszCookie(NULL)
+    {
+        m_pCallback = new WpdDeviceEventCallback();
+        const HRESULT hr = m_pPortableDevice->Advise( 0, m_pCallback, NULL, &m_pszCookie );
+        if ( FAILED(hr) )
+        {
+            LOGE( L"! Failed. IPortableDevice::Advise, hr=0x%08x\n", hr );
+            m_pszCookie = NULL;
+        }
+    }
+
+    ~WpdDeviceEventSource()
+    {
+        if ( NULL != m_pszCookie )
+        {
+            const HRESULT hr = m_pPortableDevice->Unadvise( m_pszCookie );
+            if ( FAILED(hr) )
+            {
+                LOGE( L"! Failed. IPortableDevice::Unadvise, hr=0x%08x\n", hr );
+            }
+            ::CoTaskMemFree( m_pszCookie );
+            m_pszCookie = NULL;
+        }
+        if ( NULL != m_pCallback )
+        {
+            m_pCallback->Release();
+            m_pCallback = NULL;
+        }
+    }
+
+    bool
+    isAdvised( void ) const
+    {
+        return NULL != m_pszCookie;
+    }
+
+    bool
+    wait( const DWORD dwTimeout, WpdWatchEvent* pEvent )
+    {
+        return m_pCallback->pop( dwTimeout, pEvent );
+    }
+
+private:
+    IPortableDevice*            m_pPortableDevice;
+    WpdDeviceEventCallback*     m_pCallback;
+    LPWSTR                      m_pszCookie;
+};
+
+// enumerate the children of one folder again and patch the tree with what was added or removed
+bool
+wpdWatch_RescanParent(
+    WpdEnumContext* pContext
+    , const std::wstring& parentId
+)
+{
+    WpdWatchTree* pTree = pContext->pWatchTree;
+    pTree->dwCountRescan += 1;
+
+    std::set<std::wstring> children;
+    {
+        WpdWalkFrame frame;
+        bool result = wpdWalkFrame_Open( &frame, parentId.c_str(), false, 0, pContext );
+        if ( false != result )
+        {
+            // child ids only, properties are fetched for the new children alone
+            frame.fetchAll = true;
+            result = wpdWalkFrame_Fill( &frame, pContext );
+        }
+        if ( false != result )
+        {
+            for ( DWORD dwIndex = 0; dwIndex < frame.dwCountChild; ++dwIndex )
+            {
+                children.insert( frame.pszChildArray[dwIndex] );
+            }
+        }
+        wpdWalkFrame_Close( &frame );
+
+        if ( false == result )
+        {
+            // the folder itself is gone, the rescan of its parent drops it
+            LOGV( L"    watch: %s is gone\n", parentId.c_str() );
+            return true;
+        }
+    }
+
+    std::vector<std::wstring> removed;
+    {
+        const WpdWatchNode& node = pTree->nodes[parentId];
+        for ( std::set<std::wstring>::const_iterator it = node.children.begin(); it != node.children.end(); ++it )
+        {
+            if ( children.end() == children.find( *it ) )
+            {
+                removed.push_back( *it );
+            }
+        }
+    }
+    for ( size_t index = 0; index < removed.size(); ++index )
+    {
+        LOGI( L"    - %s\n", removed[index].c_str() );
+        const DWORD dwCount = wpdWatchTree_Erase( pTree, removed[index] );
+        pTree->dwCountRemoved += dwCount;
+        pContext->dwCountContent -= (dwCount < pContext->dwCountContent)?(dwCount):(pContext->dwCountContent);
+    }
+
+    for ( std::set<std::wstring>::const_iterator it = children.begin(); it != children.end(); ++it )
+    {
+        if ( pTree->nodes.end() != pTree->nodes.find( *it ) )
+        {
+            continue;
+        }
+
+        LOGI( L"    + %s\n", it->c_str() );
+        const DWORD dwCountBefore = pContext->dwCountContent;
+        wpdWatchTree_Insert( pTree, parentId.c_str(), it->c_str() );
+        pContext->dwCountContent += 1;
+
+        // walk the new object like the initial scan did
+        std::vector<WpdWalkFrame> stack;
+        WpdWalkFrame frame;
+        bool result = wpdWalkFrame_Open( &frame, it->c_str(), true, 0, pContext );
+        if ( false != result )
+        {
+            stack.push_back( frame );
+        }
+        else
+        {
+            wpdWalkFrame_Close( &frame );
+        }
+        while ( !stack.empty() )
+        {
+            LPCWSTR pszChildObjectId = NULL;
+            bool needChildProperties = true;
+            result = wpdWalkFrame_NextChild( &stack.back(), pContext, &pszChildObjectId, &needChildProperties );
+            if ( false == result || NULL == pszChildObjectId )
+            {
+                wpdWalkFrame_Close( &stack.back() );
+                stack.pop_back();
+                continue;
+            }
+
+            WpdWalkFrame frameChild;
+            if ( false == wpdWalkFrame_Open( &frameChild, pszChildObjectId, needChildProperties, 0, pContext ) )
+            {
+                wpdWalkFrame_Close( &frameChild );
+                continue;
+            }
+            stack.push_back( frameChild );
+        }
+        pTree->dwCountAdded += pContext->dwCountContent - dwCountBefore;
+    }
+
+    return true;
+}
+
+// apply the coalesced events of one debounce window
+void
+wpdWatch_Apply(
+    WpdEnumContext* pContext
+    , const std::set<std::wstring>& dirtyParents
+    , const std::set<std::wstring>& updatedObjects
+)
+{
+    WpdWatchTree* pTree = pContext->pWatchTree;
+
+    for ( std::set<std::wstring>::const_iterator it = dirtyParents.begin(); it != dirtyParents.end(); ++it )
+    {
+        wpdWatch_RescanParent( pContext, *it );
+    }
+
+    for ( std::set<std::wstring>::const_iterator it = updatedObjects.begin(); it != updatedObjects.end(); ++it )
+    {
+        // a rescan already fetched new objects, and removed ones have nothing left to fetch
+        std::map<std::wstring, WpdWatchNode>::const_iterator itNode = pTree->nodes.find( *it );
+        if ( pTree->nodes.end() == itNode || dirtyParents.end() != dirtyParents.find( itNode->second.parent ) )
+        {
+            continue;
+        }
+        LOGI( L"    ~ %s\n", it->c_str() );
+        wpdEnumContent_GetValues( it->c_str(), pContext->pKeysFile, pContext );
+        pTree->dwCountUpdated += 1;
+    }
+}
+
+// the parent an event refers to, looked up in the tree or asked from the device
+bool
+wpdWatch_ParentOf(
+    WpdEnumContext* pContext
+    , const WpdWatchEvent& event
+    , std::wstring* pParentId
+)
+{
+    if ( !event.parentId.empty() )
+    {
+        pParentId->assign( event.parentId );
+        return true;
+    }
+
+    std::map<std::wstring, WpdWatchNode>::const_iterator itNode = pContext->pWatchTree->nodes.find( event.objectId );
+    if ( pContext->pWatchTree->nodes.end() != itNode && !itNode->second.parent.empty() )
+    {
+        pParentId->assign( itNode->second.parent );
+        return true;
+    }
+
+    if ( WPD_WATCH_EVENT_ADDED != event.kind )
+    {
+        return false;
+    }
+
+    IPortableDeviceValues* pAttributes = NULL;
+    {
+        const ULONGLONG qwTicksCall = wpdStats_Begin( pContext->pStats );
+        const HRESULT hr = pContext->pPortableDeviceProperties->GetValues( event.objectId.c_str(), NULL, &pAttributes );
+        wpdStats_End( pContext->pStats, WPD_STAT_OP_GET_VALUES, qwTicksCall, hr, 1 );
+        if ( FAILED(hr) )
+        {
+            LOGE( L"! Failed. IPortableDeviceProperties GetValues, hr=0x%08x\n", hr );
+            return false;
+        }
+    }
+
+    bool result = false;
+    LPWSTR pValue = NULL;
+    if ( SUCCEEDED(pAttributes->GetStringValue( WPD_OBJECT_PARENT_ID, &pValue )) && NULL != pValue )
+    {
+        pParentId->assign( pValue );
+        result = true;
+    }
+    if ( NULL != pValue )
+    {
+        ::CoTaskMemFree( pValue );
+        pValue = NULL;
+    }
+    pAttributes->Release();
+    pAttributes = NULL;
+
+    return result;
+}
+
+// follow the events of the device until --watch= seconds passed or the device went away;
+// events are coalesced until the device was quiet for --watch-debounce= milliseconds
+bool
+wpdWatch_Run(
+    WpdEnumContext* pContext
+    , WpdWatchEventSource* pSource
+)
+{
+    WpdWatchTree* pTree = pContext->pWatchTree;
+    const DWORD dwDuration = s_optWatchSeconds * 1000U;
+    // an endless burst still gets applied once in a while
+    const DWORD dwHoldMax = s_optWatchDebounce * 10U;
+
+    std::set<std::wstring> dirtyParents;
+    std::set<std::wstring> updatedObjects;
+    DWORD dwFirst = 0;
+    DWORD dwLast = 0;
+
+    const DWORD dwStart = ::GetTickCount();
+    bool deviceRemoved = false;
+    for ( ;; )
+    {
+        const DWORD dwNow = ::GetTickCount();
+        const bool pending = !dirtyParents.empty() || !updatedObjects.empty();
+        const bool expired = (0 != dwDuration && dwDuration <= dwNow - dwStart);
+
+        DWORD dwTimeout = INFINITE;
+        if ( pending )
+        {
+            const DWORD dwQuiet = dwNow - dwLast;
+            const DWORD dwHold = dwNow - dwFirst;
+            dwTimeout = 0;
+            if ( dwQuiet < s_optWatchDebounce && dwHold < dwHoldMax && false == expired && false == deviceRemoved )
+            {
+                const DWORD dwRemainQuiet = s_optWatchDebounce - dwQuiet;
+                const DWORD dwRemainHold = dwHoldMax - dwHold;
+                dwTimeout = (dwRemainQuiet < dwRemainHold)?(dwRemainQuiet):(dwRemainHold);
+            }
+        }
+        else
+        {
+            if ( expired || deviceRemoved )
+            {
+                break;
+            }
+            if ( 0 != dwDuration )
+            {
+                dwTimeout = dwDuration - (dwNow - dwStart);
+            }
+        }
+
+        WpdWatchEvent event;
+        if ( 0 != dwTimeout && pSource->wait( dwTimeout, &event ) )
+        {
+            pTree->dwCountEvent += 1;
+            if ( WPD_WATCH_EVENT_DEVICE_REMOVED == event.kind )
+            {
+                LOGI( L"    watch: device removed\n" );
+                deviceRemoved = true;
+                dirtyParents.clear();
+                updatedObjects.clear();
+                continue;
+            }
+
+            if ( false == pending )
+            {
+                dwFirst = ::GetTickCount();
+            }
+            dwLast = ::GetTickCount();
+
+            if ( WPD_WATCH_EVENT_UPDATED == event.kind )
+            {
+                updatedObjects.insert( event.objectId );
+            }
+            else
+            {
+                std::wstring parentId;
+                if ( wpdWatch_ParentOf( pContext, event, &parentId ) )
+                {
+                    dirtyParents.insert( parentId );
+                }
+                else
+                {
+                    LOGV( L"    watch: no parent for %s\n", event.objectId.c_str() );
+                }
+            }
+            continue;
+        }
+
+        if ( pending )
+        {
+            wpdWatch_Apply( pContext, dirtyParents, updatedObjects );
+            dirtyParents.clear();
+            updatedObjects.clear();
+            LOGI( L"%3u: Content count=%u\n", (NULL != pContext->pScan)?(pContext->pScan->index):(0U), pContext->dwCountContent );
+        }
+    }
+
+    LOGI( L"    watch: events=%u, rescans=%u, added=%u, removed=%u, updated=%u\n"
+        , pTree->dwCountEvent
+        , pTree->dwCountRescan
+        , pTree->dwCountAdded
+        , pTree->dwCountRemoved
+        , pTree->dwCountUpdated
+        );
+
+    return false == deviceRemoved;
+}
+
+// one full walk, then patch pTree from events instead of walking again. pSource NULL subscribes to the device's
+// own events once the walk is done
+bool
+wpdWatchDevice(
+    IPortableDevice* pPortableDevice
+    , IPortableDeviceContent* pPortableDeviceContent
+    , WpdDeviceScan* pScan
+    , WpdWatchEventSource* pSource
+    , WpdWatchTree* pTree
+)
+{
+    WpdEnumContext context;
+    if ( false == wpdEnumContext_Init( &context, pPortableDeviceContent, NULL, pScan ) )
+    {
+        return false;
+    }
+
+    pTree->nodes.clear();
+    pTree->dwCountEvent = 0;
+    pTree->dwCountRescan = 0;
+    pTree->dwCountAdded = 0;
+    pTree->dwCountRemoved = 0;
+    pTree->dwCountUpdated = 0;
+    wpdWatchTree_Insert( pTree, NULL, WPD_DEVICE_OBJECT_ID );
+    context.pWatchTree = pTree;
+
+    bool result = wpdEnumContent_IterativeEnumerate( &context );
+    pScan->dwCountContent = context.dwCountContent;
+    pScan->dwCountEnumerate += 1;
+    LOGI( L"%3u: Content count=%u\n", pScan->index, pScan->dwCountContent );
+
+    if ( false != result && NULL != pSource )
+    {
+        result = wpdWatch_Run( &context, pSource );
+        pScan->dwCountContent = context.dwCountContent;
+    }
+    else
+    if ( false != result )
+    {
+        WpdDeviceEventSource source( pPortableDevice );
+        result = source.isAdvised();
+        if ( false != result )
+        {
+            result = wpdWatch_Run( &context, &source );
+            pScan->dwCountContent = context.dwCountContent;
+        }
+    }
+
+    context.pWatchTree = NULL;
+    wpdEnumContext_Report( &context );
+    wpdEnumContext_Term( &context );
+
+    return result;
+}
+
+// --tree and --catalog=: every walk builds its own store
+void
+wpdScanDevice_BeginTree(
+    WpdDeviceScan* pScan
+)
+{
+    if ( s_optTree || NULL != s_optCatalog )
+    {
+        pScan->pTreeStore = new WpdTreeStore();
+        wpdTreeStore_Init( pScan->pTreeStore );
+    }
+}
+
+void
+wpdScanDevice_EndTree(
+    WpdDeviceScan* pScan
+    , const ULONGLONG qwTicksStart
+)
+{
+    if ( NULL == pScan->pTreeStore )
+    {
+        return;
+    }
+    const double dMicroseconds = (0 != qwTicksStart)?(wpdTicksToMicroseconds( wpdTicksNow() - qwTicksStart )):(0.0);
+    wpdTreeStore_Report( pScan->pTreeStore, dMicroseconds );
+    if ( NULL != s_optCatalog )
+    {
+        wpdCatalog_Save( pScan->pTreeStore, pScan->pszPnPDeviceID, pScan->index );
+    }
+    wpdTreeStore_Term( pScan->pTreeStore );
+    delete pScan->pTreeStore;
+    pScan->pTreeStore = NULL;
+}
+
+bool
+wpdScanDevice(
+    WpdDeviceScan* pScan
+)
+{
+    if ( NULL == pScan || NULL == pScan->pszPnPDeviceID )
+    {
+        return false;
+    }
+
+    // sessions are pooled across scans, a worker holds its own while it scans
+    WpdSession* pSession = wpdSessionPool_Acquire( pScan->pszPnPDeviceID );
+
+    if ( NULL != pSession )
+    {
+        IPortableDevice* pPortableDevice = pSession->pPortableDevice;
+        IPortableDeviceContent* pPortableDeviceContent = pSession->pPortableDeviceContent;
+        IPortableDeviceProperties* pPortableDeviceProperties = pSession->pPortableDeviceProperties;
+
+        if ( NULL != s_optResolve )
+        {
+            pScan->result = wpdResolve_Run( pPortableDeviceContent, pPortableDeviceProperties, pScan->pszPnPDeviceID );
+        }
+        else
+        if ( NULL != s_optDownload )
+        {
+            pScan->result = wpdDownload_Device( pSession, pScan, NULL );
+        }
+        else
+        if ( s_optDedup )
+        {
+            pScan->result = wpdDedup_Collect( pSession, pScan );
+        }
+        else
+        if ( s_optWatch )
+        {
+            wpdScanDevice_BeginTree( pScan );
+            WpdWatchTree tree;
+            pScan->result = wpdWatchDevice( pPortableDevice, pPortableDeviceContent, pScan, NULL, &tree );
+            wpdScanDevice_EndTree( pScan, 0 );
+        }
+
+        for ( size_t index = 0; index < pScan->dwCountWalk && false == s_optWatch && NULL == s_optResolve && NULL == s_optDownload && false == s_optDedup; ++index )
+        {
+            pScan->dwCountContent = 0;
+            const ULONGLONG qwTicksStart = wpdTicksNow();
+            wpdScanDevice_BeginTree( pScan );
+            pScan->result = wpdEnumContent( pPortableDeviceContent, pPortableDeviceProperties, pScan );
+            wpdScanDevice_EndTree( pScan, qwTicksStart );
+            pScan->dwCountEnumerate += 1;
+            LOGI( L"%3u: Content count=%u\n", pScan->index, pScan->dwCountContent );
+            if ( false == pScan->result )
+            {
+                break;
+            }
+
+            if ( index + 1 < pScan->dwCountWalk )
+            {
+                ::Sleep( 1 * 1000 );
+            }
+        }
+
+        wpdSessionPool_Release( pSession, pScan->result );
+        pSession = NULL;
+    }
+
+    return pScan->result;
+}
+
+struct WpdScanPool
+{
+    WpdDeviceScan*  pScanArray;
+    LONG            nCountScan;
+    volatile LONG   nNextScan;
+};
+
+unsigned __stdcall
+wpdScanPool_Worker( void* pParam )
+{
+    WpdScanPool* pPool = reinterpret_cast<WpdScanPool*>(pParam);
+    if ( NULL == pPool )
+    {
+        return 1;
+    }
+
+    bool needCoUninitialize = false;
+    {
+        const DWORD dwCoInit = COINIT_MULTITHREADED | COINIT_DISABLE_OLE1DDE;
+        const HRESULT hr = ::CoInitializeEx( NULL, dwCoInit );
+        if ( FAILED(hr) )
+        {
+            LOGE( L"! Failed. worker CoInitializeEx, hr=0x%08x\n", hr );
+            return 1;
+        }
+        needCoUninitialize = true;
+    }
+
+    // reused by every device this worker scans
+    WpdScratchPool scratchPool;
+
+    for ( ;; )
+    {
+        const LONG nIndex = ::InterlockedIncrement( &pPool->nNextScan ) - 1;
+        if ( pPool->nCountScan <= nIndex )
+        {
+            break;
+        }
+
+        pPool->pScanArray[nIndex].pScratchPool = &scratchPool;
+        wpdScanDevice( &pPool->pScanArray[nIndex] );
+        pPool->pScanArray[nIndex].pScratchPool = NULL;
+    }
+
+    wpdScratchPool_Term( &scratchPool );
+
+    if ( needCoUninitialize )
+    {
+        ::CoUninitialize();
+    }
+
+    return 0;
+}
+
+// --jobs= workers take the scans in order, with one job the calling thread does them all
+void
+wpdScanPool_Run(
+    WpdDeviceScan* pScanArray
+    , const LONG nCountScan
+)
+{
+    WpdScanPool pool;
+    pool.pScanArray = pScanArray;
+    pool.nCountScan = nCountScan;
+    pool.nNextScan = 0;
+
+    DWORD dwCountWorker = s_optCountOfJobs;
+    if ( (DWORD)nCountScan < dwCountWorker )
+    {
+        dwCountWorker = (DWORD)nCountScan;
+    }
+
+    if ( dwCountWorker <= 1 )
+    {
+        // same thread as before, no pool
+        wpdScanPool_Worker( &pool );
+    }
+    else
+    {
+        HANDLE* phWorkerArray = new HANDLE[dwCountWorker];
+        for ( DWORD index = 0; index < dwCountWorker; ++index )
+        {
+            phWorkerArray[index] = reinterpret_cast<HANDLE>(
+                ::_beginthreadex( NULL, 0, wpdScanPool_Worker, &pool, 0, NULL )
+                );
+            if ( NULL == phWorkerArray[index] )
+            {
+                LOGE( L"! Failed. _beginthreadex scan worker %u\n", index );
+            }
+        }
+
+        for ( DWORD index = 0; index < dwCountWorker; ++index )
+        {
+            if ( NULL != phWorkerArray[index] )
+            {
+                ::WaitForSingleObject( phWorkerArray[index], INFINITE );
+                ::CloseHandle( phWorkerArray[index] );
+                phWorkerArray[index] = NULL;
+            }
+        }
+
+        delete [] phWorkerArray;
+        phWorkerArray = NULL;
+    }
+}
+
+void
+wpdScanDevices(
+    LPWSTR* pDeviceIdArray
+    , const DWORD dwCountDeviceId
+)
+{
+    if ( NULL == pDeviceIdArray || 0 == dwCountDeviceId )
+    {
+        return;
+    }
+
+    WpdDeviceScan* pScanArray = new WpdDeviceScan[dwCountDeviceId];
+    LONG nCountScan = 0;
+    for ( size_t index = 0; index < dwCountDeviceId; ++index )
+    {
+        if ( NULL == pDeviceIdArray[index] )
+        {
+            continue;
+        }
+
+        WpdDeviceScan& scan = pScanArray[nCountScan];
+        ::memset( &scan, 0, sizeof(scan) );
+        scan.pszPnPDeviceID = pDeviceIdArray[index];
+        scan.index = index;
+        scan.dwCountWalk = 30;
+        nCountScan += 1;
+    }
+
+    wpdScanPool_Run( pScanArray, nCountScan );
+
+    if ( s_optDedup )
+    {
+        wpdDedup_Run();
+    }
+
+    for ( LONG index = 0; index < nCountScan; ++index )
+    {
+        const WpdDeviceScan& scan = pScanArray[index];
+        LOGI( L"%3u: %s Content count=%u, walks=%u\n"
+            , scan.index
+            , (scan.result)?(L"ok    "):(L"failed")
+            , scan.dwCountContent
+            , scan.dwCountEnumerate
+            );
+    }
+
+    delete [] pScanArray;
+    pScanArray = NULL;
+}
+
+// --simulate: a device in memory behind the same COM interfaces, for measuring the walk without a phone.
+// every call holds the device like an MTP session does and burns its modelled latency
+enum WpdSimKind
+{
+    WPD_SIM_KIND_FOLDER
+    , WPD_SIM_KIND_STORAGE
+    , WPD_SIM_KIND_IMAGE
+    , WPD_SIM_KIND_VIDEO
+    , WPD_SIM_KIND_AUDIO
+    , WPD_SIM_KIND_DOCUMENT
+};
+
+struct WpdSimNode
+{
+    DWORD               parent;
+    WpdSimKind          kind;
+    DWORD               dwSerial;   // file name number
+    ULONGLONG           qwSize;
+    DWORD               dwContent;  // node whose bytes a file holds, itself unless a copy
+    DWORD               dwVariant;  // not 0 for a copy changed in the middle
+    DATE                dateModified;
+    std::wstring        name;       // folders only, files are named from kind and serial
+    std::vector<DWORD>  children;
+};
+
+// the first simulated device; --sim-devices= numbers the others from 2
+#define WPD_SIM_PNP_DEVICE_ID   L"SIMULATED"
+// names the --cache= file of the simulated device
+#define WPD_SIM_SERIAL          L"SIM-0001"
+
+struct WpdSimDevice
+{
+    std::wstring            pnpDeviceId;
+    std::wstring            serial;
+    std::vector<WpdSimNode> nodes;
+    // device time spent per folder: EnumObjects, Next and GetValues of its children, in microseconds
+    std::vector<LONG>       folderMicroseconds;
+    DWORD                   dwCountFolder;
+
+    // latency model in microseconds, Next costs fixed + per id
+    DWORD               dwLatencyEnum;
+    DWORD               dwLatencyNext;
+    DWORD               dwLatencyNextPerId;
+    DWORD               dwLatencyValues;
+
+    CRITICAL_SECTION    cs;
+    DWORD               dwRandom;
+
+    volatile LONG       nCountEnumObjects;
+    volatile LONG       nCountNext;
+    volatile LONG       nCountGetValues;
+    volatile LONG       nCountBulk;         // batches of the bulk requests
+    volatile LONG       nCountRead;
+    volatile LONG       nCountKill;         // walks --sim-kill= cut short
+    // blocks the device itself allocated: enumerators and the object ids Next hands out
+    volatile LONG       nCountHeapAlloc;
+    volatile LONG       nCountCoTaskAlloc;
+};
+
+DWORD
+wpdSimDevice_Random(
+    WpdSimDevice* pDevice
+)
+{
+    // xorshift32, the same device on every run
+    DWORD x = pDevice->dwRandom;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    pDevice->dwRandom = x;
+    return x;
+}
+
+DWORD
+wpdSimDevice_Add(
+    WpdSimDevice* pDevice
+    , const DWORD parent
+    , const WpdSimKind kind
+    , LPCWSTR pszName
+)
+{
+    const DWORD index = (DWORD)pDevice->nodes.size();
+    pDevice->nodes.push_back( WpdSimNode() );
+    WpdSimNode& node = pDevice->nodes.back();
+    node.parent = parent;
+    node.kind = kind;
+    node.dwSerial = 0;
+    node.qwSize = 0;
+    node.dwContent = index;
+    node.dwVariant = 0;
+    // somewhere in 2015..2020
+    node.dateModified = 42005.0 + (wpdSimDevice_Random( pDevice ) % (365U * 5U)) + (wpdSimDevice_Random( pDevice ) % 86400U) / 86400.0;
+    if ( NULL != pszName )
+    {
+        node.name.assign( pszName );
+    }
+    if ( WPD_SIM_KIND_FOLDER == kind || WPD_SIM_KIND_STORAGE == kind )
+    {
+        pDevice->dwCountFolder += 1;
+    }
+    if ( index != parent )
+    {
+        pDevice->nodes[parent].children.push_back( index );
+    }
+    return index;
+}
+
+void
+wpdSimDevice_AddFiles(
+    WpdSimDevice* pDevice
+    , const DWORD parent
+    , const DWORD dwCount
+    , const WpdSimKind kind
+    , const ULONGLONG qwSizeMin
+    , const ULONGLONG qwSizeMax
+)
+{
+    for ( DWORD index = 0; index < dwCount; ++index )
+    {
+        // camera folders mix in a video now and then
+        const WpdSimKind kindFile = (WPD_SIM_KIND_IMAGE == kind && 0 == (wpdSimDevice_Random( pDevice ) % 20U))?(WPD_SIM_KIND_VIDEO):(kind);
+        const DWORD node = wpdSimDevice_Add( pDevice, parent, kindFile, NULL );
+        pDevice->nodes[node].dwSerial = index + 1;
+        const ULONGLONG qwRange = qwSizeMax - qwSizeMin + 1;
+        pDevice->nodes[node].qwSize = qwSizeMin + ((((ULONGLONG)wpdSimDevice_Random( pDevice )) << 16) ^ wpdSimDevice_Random( pDevice )) % qwRange;
+        if ( WPD_SIM_KIND_VIDEO == kindFile )
+        {
+            pDevice->nodes[node].qwSize *= 20U;
+        }
+    }
+}
+
+void
+wpdSimDevice_BuildTree(
+    WpdSimDevice* pDevice
+    , const DWORD parent
+    , const DWORD dwDepth
+)
+{
+    wpdSimDevice_AddFiles( pDevice, parent, s_optSimFiles, WPD_SIM_KIND_DOCUMENT, 1024U, 1024U * 1024U );
+    if ( 0 == dwDepth )
+    {
+        return;
+    }
+    for ( DWORD index = 0; index < s_optSimFanout; ++index )
+    {
+        WCHAR szName[32];
+        ::_snwprintf_s( szName, sizeof(szName)/sizeof(szName[0]), _TRUNCATE, L"dir%u", index );
+        const DWORD folder = wpdSimDevice_Add( pDevice, parent, WPD_SIM_KIND_FOLDER, szName );
+        wpdSimDevice_BuildTree( pDevice, folder, dwDepth - 1 );
+    }
+}
+
+// a phone: one huge DCIM/Camera folder and a long tail of small ones
+void
+wpdSimDevice_BuildCamera(
+    WpdSimDevice* pDevice
+    , const DWORD storage
+)
+{
+    const DWORD dwCountCamera = (0 < s_optSimFiles)?(s_optSimFiles):(50000U);
+
+    const DWORD dcim = wpdSimDevice_Add( pDevice, storage, WPD_SIM_KIND_FOLDER, L"DCIM" );
+    const DWORD camera = wpdSimDevice_Add( pDevice, dcim, WPD_SIM_KIND_FOLDER, L"Camera" );
+    wpdSimDevice_AddFiles( pDevice, camera, dwCountCamera, WPD_SIM_KIND_IMAGE, 2U * 1024U * 1024U, 6U * 1024U * 1024U );
+    const DWORD thumbnails = wpdSimDevice_Add( pDevice, dcim, WPD_SIM_KIND_FOLDER, L".thumbnails" );
+    wpdSimDevice_AddFiles( pDevice, thumbnails, dwCountCamera / 10U, WPD_SIM_KIND_IMAGE, 8U * 1024U, 32U * 1024U );
+
+    const DWORD pictures = wpdSimDevice_Add( pDevice, storage, WPD_SIM_KIND_FOLDER, L"Pictures" );
+    const DWORD screenshots = wpdSimDevice_Add( pDevice, pictures, WPD_SIM_KIND_FOLDER, L"Screenshots" );
+    wpdSimDevice_AddFiles( pDevice, screenshots, dwCountCamera / 50U, WPD_SIM_KIND_IMAGE, 100U * 1024U, 900U * 1024U );
+
+    const DWORD download = wpdSimDevice_Add( pDevice, storage, WPD_SIM_KIND_FOLDER, L"Download" );
+    wpdSimDevice_AddFiles( pDevice, download, 100U, WPD_SIM_KIND_DOCUMENT, 10U * 1024U, 20U * 1024U * 1024U );
+
+    const DWORD music = wpdSimDevice_Add( pDevice, storage, WPD_SIM_KIND_FOLDER, L"Music" );
+    for ( DWORD index = 0; index < s_optSimFanout; ++index )
+    {
+        WCHAR szName[32];
+        ::_snwprintf_s( szName, sizeof(szName)/sizeof(szName[0]), _TRUNCATE, L"Artist %u", index );
+        const DWORD artist = wpdSimDevice_Add( pDevice, music, WPD_SIM_KIND_FOLDER, szName );
+        for ( DWORD album = 0; album < 2; ++album )
+        {
+            ::_snwprintf_s( szName, sizeof(szName)/sizeof(szName[0]), _TRUNCATE, L"Album %u", album );
+            const DWORD folder = wpdSimDevice_Add( pDevice, artist, WPD_SIM_KIND_FOLDER, szName );
+            wpdSimDevice_AddFiles( pDevice, folder, 12U, WPD_SIM_KIND_AUDIO, 3U * 1024U * 1024U, 9U * 1024U * 1024U );
+        }
+    }
+
+    // many near-empty application folders, the part that costs round trips rather than bytes
+    const DWORD android = wpdSimDevice_Add( pDevice, storage, WPD_SIM_KIND_FOLDER, L"Android" );
+    const DWORD data = wpdSimDevice_Add( pDevice, android, WPD_SIM_KIND_FOLDER, L"data" );
+    for ( DWORD index = 0; index < s_optSimFanout * s_optSimFanout; ++index )
+    {
+        WCHAR szName[32];
+        ::_snwprintf_s( szName, sizeof(szName)/sizeof(szName[0]), _TRUNCATE, L"com.example.app%u", index );
+        const DWORD app = wpdSimDevice_Add( pDevice, data, WPD_SIM_KIND_FOLDER, szName );
+        const DWORD files = wpdSimDevice_Add( pDevice, app, WPD_SIM_KIND_FOLDER, L"files" );
+        wpdSimDevice_AddFiles( pDevice, files, wpdSimDevice_Random( pDevice ) % 4U, WPD_SIM_KIND_DOCUMENT, 100U, 64U * 1024U );
+    }
+
+    // --sim-copies= camera files shared once more through WhatsApp, every 8th of them re-encoded in the middle
+    if ( 0 < s_optSimCopies && !pDevice->nodes[camera].children.empty() )
+    {
+        const std::vector<DWORD> sources( pDevice->nodes[camera].children );
+        const DWORD whatsapp = wpdSimDevice_Add( pDevice, storage, WPD_SIM_KIND_FOLDER, L"WhatsApp" );
+        const DWORD media = wpdSimDevice_Add( pDevice, whatsapp, WPD_SIM_KIND_FOLDER, L"Media" );
+        const DWORD images = wpdSimDevice_Add( pDevice, media, WPD_SIM_KIND_FOLDER, L"WhatsApp Images" );
+        const DWORD sent = wpdSimDevice_Add( pDevice, images, WPD_SIM_KIND_FOLDER, L"Sent" );
+        for ( DWORD index = 0; index < s_optSimCopies; ++index )
+        {
+            const DWORD source = sources[wpdSimDevice_Random( pDevice ) % sources.size()];
+            const DWORD node = wpdSimDevice_Add( pDevice, sent, pDevice->nodes[source].kind, NULL );
+            pDevice->nodes[node].dwSerial = index + 1;
+            pDevice->nodes[node].qwSize = pDevice->nodes[source].qwSize;
+            pDevice->nodes[node].dwContent = pDevice->nodes[source].dwContent;
+            if ( 0 == index % 8 )
+            {
+                pDevice->nodes[node].dwVariant = 1 + wpdSimDevice_Random( pDevice ) % 255U;
+            }
+        }
+    }
+}
+
+void
+wpdSimDevice_Init(
+    WpdSimDevice* pDevice
+)
+{
+    pDevice->pnpDeviceId.assign( WPD_SIM_PNP_DEVICE_ID );
+    pDevice->serial.assign( WPD_SIM_SERIAL );
+    pDevice->dwCountFolder = 0;
+    pDevice->dwRandom = 0x12345678U;
+    pDevice->nCountEnumObjects = 0;
+    pDevice->nCountNext = 0;
+    pDevice->nCountGetValues = 0;
+    pDevice->nCountBulk = 0;
+    pDevice->nCountRead = 0;
+    pDevice->nCountKill = 0;
+    pDevice->nCountHeapAlloc = 0;
+    pDevice->nCountCoTaskAlloc = 0;
+    ::InitializeCriticalSection( &pDevice->cs );
+
+    const DWORD root = wpdSimDevice_Add( pDevice, 0, WPD_SIM_KIND_STORAGE, L"Simulated device" );
+    const DWORD storage = wpdSimDevice_Add( pDevice, root, WPD_SIM_KIND_STORAGE, L"Internal shared storage" );
+    if ( 0 == ::_wcsicmp( s_optSimulate, L"tree" ) )
+    {
+        wpdSimDevice_BuildTree( pDevice, storage, s_optSimDepth );
+    }
+    else
+    {
+        wpdSimDevice_BuildCamera( pDevice, storage );
+    }
+
+    pDevice->folderMicroseconds.assign( pDevice->nodes.size(), 0 );
+}
+
+void
+wpdSimDevice_Term(
+    WpdSimDevice* pDevice
+)
+{
+    ::DeleteCriticalSection( &pDevice->cs );
+    pDevice->nodes.clear();
+    pDevice->folderMicroseconds.clear();
+}
+
+const GUID&
+wpdSimDevice_ContentType(
+    const WpdSimKind kind
+)
+{
+    switch ( kind )
+    {
+    case WPD_SIM_KIND_FOLDER:   return WPD_CONTENT_TYPE_FOLDER;
+    case WPD_SIM_KIND_STORAGE:  return WPD_CONTENT_TYPE_FUNCTIONAL_OBJECT;
+    case WPD_SIM_KIND_IMAGE:    return WPD_CONTENT_TYPE_IMAGE;
+    case WPD_SIM_KIND_VIDEO:    return WPD_CONTENT_TYPE_VIDEO;
+    case WPD_SIM_KIND_AUDIO:    return WPD_CONTENT_TYPE_AUDIO;
+    default:                    break;
+    }
+    return WPD_CONTENT_TYPE_DOCUMENT;
+}
+
+// --sim-change=: files rewritten since the last run. the folders above one get its date, which is all
+// --cache= sees of a change below a folder
+DWORD
+wpdSimDevice_Change(
+    WpdSimDevice* pDevice
+)
+{
+    DWORD dwCountChanged = 0;
+    for ( size_t index = 1; index < pDevice->nodes.size(); ++index )
+    {
+        WpdSimNode& node = pDevice->nodes[index];
+        if ( WPD_SIM_KIND_FOLDER == node.kind || WPD_SIM_KIND_STORAGE == node.kind
+            || s_optSimChange <= wpdSimDevice_Random( pDevice ) % 1000U )
+        {
+            continue;
+        }
+        node.dateModified += 1.0;
+        for ( DWORD parent = node.parent; 0 != parent; parent = pDevice->nodes[parent].parent )
+        {
+            if ( pDevice->nodes[parent].dateModified < node.dateModified )
+            {
+                pDevice->nodes[parent].dateModified = node.dateModified;
+            }
+        }
+        dwCountChanged += 1;
+    }
+    return dwCountChanged;
+}
+
+// what --only= and --exclude-folders= leave of the device: objects walked below the root,
+// folders pruned (their contents never walked) and files filtered out
+void
+wpdSimDevice_CountFilter(
+    const WpdSimDevice* pDevice
+    , DWORD* pdwCountObject
+    , DWORD* pdwCountFolder
+    , DWORD* pdwCountFile
+)
+{
+    *pdwCountObject = 0;
+    *pdwCountFolder = 0;
+    *pdwCountFile = 0;
+
+    std::vector<DWORD> pending( pDevice->nodes[0].children );
+    while ( !pending.empty() )
+    {
+        const WpdSimNode& node = pDevice->nodes[pending.back()];
+        pending.pop_back();
+        *pdwCountObject += 1;
+        if ( WPD_SIM_KIND_FOLDER == node.kind || WPD_SIM_KIND_STORAGE == node.kind )
+        {
+            if ( NULL != s_optExcludeFolders && wpdFilter_MatchFolder( s_optExcludeFolders, node.name.c_str() ) )
+            {
+                *pdwCountFolder += 1;
+                continue;
+            }
+            pending.insert( pending.end(), node.children.begin(), node.children.end() );
+        }
+        else
+        if ( NULL != s_optOnly && false == wpdFilter_MatchContentType( s_optOnly, wpdSimDevice_ContentType( node.kind ) ) )
+        {
+            *pdwCountFile += 1;
+        }
+    }
+}
+
+// WPD_DEVICE_OBJECT_ID is the root, everything else is "o<index>"
+bool
+wpdSimDevice_Find(
+    WpdSimDevice* pDevice
+    , LPCWSTR pszObjectId
+    , DWORD* pIndex
+)
+{
+    if ( NULL == pszObjectId )
+    {
+        return false;
+    }
+    if ( 0 == ::wcscmp( pszObjectId, WPD_DEVICE_OBJECT_ID ) )
+    {
+        *pIndex = 0;
+        return true;
+    }
+    if ( L'o' != pszObjectId[0] )
+    {
+        return false;
+    }
+    LPWSTR endptr = NULL;
+    const unsigned long index = ::wcstoul( &pszObjectId[1], &endptr, 10 );
+    if ( NULL == endptr || L'\0' != *endptr || pDevice->nodes.size() <= index )
+    {
+        return false;
+    }
+    *pIndex = (DWORD)index;
+    return true;
+}
+
+void
+wpdSimDevice_ObjectId(
+    const DWORD index
+    , LPWSTR pszObjectId
+    , const size_t cchObjectId
+)
+{
+    if ( 0 == index )
+    {
+        ::wcscpy_s( pszObjectId, cchObjectId, WPD_DEVICE_OBJECT_ID );
+        return;
+    }
+    ::_snwprintf_s( pszObjectId, cchObjectId, _TRUNCATE, L"o%u", index );
+}
+
+// one device round trip: wait for the session, then burn the modelled latency
+void
+wpdSimDevice_Call(
+    WpdSimDevice* pDevice
+    , const DWORD dwMicroseconds
+    , const DWORD folder
+    , const ULONGLONG qwTicksStart
+)
+{
+    ::EnterCriticalSection( &pDevice->cs );
+    {
+        const ULONGLONG qwTicksBusy = wpdTicksNow();
+        while ( wpdTicksToMicroseconds( wpdTicksNow() - qwTicksBusy ) < (double)dwMicroseconds )
+        {
+            // spin, Sleep() is far too coarse for a round trip
+        }
+    }
+    ::LeaveCriticalSection( &pDevice->cs );
+
+    if ( folder < pDevice->folderMicroseconds.size() )
+    {
+        ::InterlockedExchangeAdd( &pDevice->folderMicroseconds[folder], (LONG)wpdTicksToMicroseconds( wpdTicksNow() - qwTicksStart ) );
+    }
+}
+
+class WpdSimEnum : public IEnumPortableDeviceObjectIDs
+{
+public:
+    WpdSimEnum( WpdSimDevice* pDevice, const DWORD folder )
+        : m_cRef(1)
+        , m_pDevice(pDevice)
+        , m_folder(folder)
+        , m_dwNext(0)
+    {
+    }
+
+    HRESULT STDMETHODCALLTYPE
+    QueryInterface( REFIID riid, void** ppv )
+    {
+        if ( NULL == ppv )
+        {
+            return E_POINTER;
+        }
+        *ppv = NULL;
+
+        if ( ::IsEqualIID( riid, IID_IUnknown )
+            || ::IsEqualIID( riid, IID_IEnumPortableDeviceObjectIDs ) )
+        {
+            *ppv = static_cast<IEnumPortableDeviceObjectIDs*>(this);
+            this->AddRef();
+            return S_OK;
+        }
+
+        return E_NOINTERFACE;
+    }
+
+    ULONG STDMETHODCALLTYPE
+    AddRef( void )
+    {
+        return ::InterlockedIncrement( &m_cRef );
+    }
+
+    ULONG STDMETHODCALLTYPE
+    Release( void )
+    {
+        const LONG cRef = ::InterlockedDecrement( &m_cRef );
+        if ( 0 == cRef )
+        {
+            delete this;
+        }
+        return cRef;
+    }
+
+    HRESULT STDMETHODCALLTYPE
+    Next( ULONG cObjects, LPWSTR* pObjIDs, ULONG* pcFetched )
+    {
+        if ( NULL == pObjIDs || NULL == pcFetched )
+        {
+            return E_POINTER;
+        }
+
+        const ULONGLONG qwTicksStart = wpdTicksNow();
+        ::InterlockedIncrement( &m_pDevice->nCountNext );
+
+        *pcFetched = 0;
+        if ( 0 < s_optSimKill )
+        {
+            ::EnterCriticalSection( &m_pDevice->cs );
+            const DWORD dwDice = wpdSimDevice_Random( m_pDevice ) % 1000U;
+            ::LeaveCriticalSection( &m_pDevice->cs );
+            if ( dwDice < s_optSimKill )
+            {
+                ::InterlockedIncrement( &m_pDevice->nCountKill );
+                wpdSimDevice_Call( m_pDevice, m_pDevice->dwLatencyNext, m_folder, qwTicksStart );
+                return HRESULT_FROM_WIN32(ERROR_DEVICE_NOT_CONNECTED);
+            }
+        }
+
+        const std::vector<DWORD>& children = m_pDevice->nodes[m_folder].children;
+        ULONG nFetched = 0;
+        while ( nFetched < cObjects && m_dwNext < children.size() )
+        {
+            WCHAR szObjectId[32];
+            wpdSimDevice_ObjectId( children[m_dwNext], szObjectId, sizeof(szObjectId)/sizeof(szObjectId[0]) );
+            const size_t cb = (::wcslen( szObjectId ) + 1) * sizeof(WCHAR);
+            pObjIDs[nFetched] = reinterpret_cast<LPWSTR>(::CoTaskMemAlloc( cb ));
+            if ( NULL == pObjIDs[nFetched] )
+            {
+                break;
+            }
+            ::InterlockedIncrement( &m_pDevice->nCountCoTaskAlloc );
+            ::memcpy( pObjIDs[nFetched], szObjectId, cb );
+            nFetched += 1;
+            m_dwNext += 1;
+        }
+        *pcFetched = nFetched;
+
+        wpdSimDevice_Call( m_pDevice, m_pDevice->dwLatencyNext + m_pDevice->dwLatencyNextPerId * nFetched, m_folder, qwTicksStart );
+
+        return (cObjects == nFetched)?(S_OK):(S_FALSE);
+    }
+
+    HRESULT STDMETHODCALLTYPE
+    Skip( ULONG cObjects )
+    {
+        const DWORD dwCount = (DWORD)m_pDevice->nodes[m_folder].children.size();
+        m_dwNext = (dwCount - m_dwNext < cObjects)?(dwCount):(m_dwNext + cObjects);
+        return (dwCount == m_dwNext)?(S_FALSE):(S_OK);
+    }
+
+    HRESULT STDMETHODCALLTYPE
+    Reset( void )
+    {
+        m_dwNext = 0;
+        return S_OK;
+    }
+
+    HRESULT STDMETHODCALLTYPE
+    Clone( IEnumPortableDeviceObjectIDs** /*ppEnum*/ )
+    {
+        return E_NOTIMPL;
+    }
+
+    HRESULT STDMETHODCALLTYPE
+    Cancel( void )
+    {
+        return S_OK;
+    }
+
+private:
+    ~WpdSimEnum()
+    {
+    }
+
+    LONG            m_cRef;
+    WpdSimDevice*   m_pDevice;
+    DWORD           m_folder;
+    DWORD           m_dwNext;
+};
+
+// a request queued on the simulated IPortableDevicePropertiesBulk, run by Start
+struct WpdSimBulkRequest
+{
+    GUID                                    guidContext;
+    std::vector<std::wstring>               objectIds;
+    IPortableDeviceKeyCollection*           pKeys;
+    IPortableDevicePropertiesBulkCallback*  pCallback;
+};
+
+// objects per OnProgress of the simulated bulk requests, each batch is one round trip
+#define WPD_SIM_BULK_BATCH      (32U)
+
+class WpdSimProperties : public IPortableDeviceProperties, public IPortableDevicePropertiesBulk
+{
+public:
+    WpdSimProperties( WpdSimDevice* pDevice )
+        : m_cRef(1)
+        , m_pDevice(pDevice)
+        , m_dwBulkSerial(0)
+    {
+        ::InitializeCriticalSection( &m_csBulk );
+    }
+
+    HRESULT STDMETHODCALLTYPE
+    QueryInterface( REFIID riid, void** ppv )
+    {
+        if ( NULL == ppv )
+        {
+            return E_POINTER;
+        }
+        *ppv = NULL;
+
+        if ( ::IsEqualIID( riid, IID_IUnknown )
+            || ::IsEqualIID( riid, IID_IPortableDeviceProperties ) )
+        {
+            *ppv = static_cast<IPortableDeviceProperties*>(this);
+            this->AddRef();
+            return S_OK;
+        }
+        if ( ::IsEqualIID( riid, IID_IPortableDevicePropertiesBulk ) )
+        {
+            *ppv = static_cast<IPortableDevicePropertiesBulk*>(this);
+            this->AddRef();
+            return S_OK;
+        }
+
+        return E_NOINTERFACE;
+    }
+
+    ULONG STDMETHODCALLTYPE
+    AddRef( void )
+    {
+        return ::InterlockedIncrement( &m_cRef );
+    }
+
+    ULONG STDMETHODCALLTYPE
+    Release( void )
+    {
+        const LONG cRef = ::InterlockedDecrement( &m_cRef );
+        if ( 0 == cRef )
+        {
+            delete this;
+        }
+        return cRef;
+    }
+
+    HRESULT STDMETHODCALLTYPE
+    GetSupportedProperties( LPCWSTR /*pszObjectID*/, IPortableDeviceKeyCollection** /*ppKeys*/ )
+    {
+        return E_NOTIMPL;
+    }
+
+    HRESULT STDMETHODCALLTYPE
+    GetPropertyAttributes( LPCWSTR /*pszObjectID*/, REFPROPERTYKEY /*Key*/, IPortableDeviceValues** /*ppAttributes*/ )
+    {
+        return E_NOTIMPL;
+    }
+
+    HRESULT STDMETHODCALLTYPE
+    GetValues( LPCWSTR pszObjectID, IPortableDeviceKeyCollection* pKeys, IPortableDeviceValues** ppValues )
+    {
+        if ( NULL == ppValues )
+        {
+            return E_POINTER;
+        }
+        *ppValues = NULL;
+
+        DWORD index = 0;
+        if ( false == wpdSimDevice_Find( m_pDevice, pszObjectID, &index ) )
+        {
+            return HRESULT_FROM_WIN32(ERROR_NOT_FOUND);
+        }
+
+        const ULONGLONG qwTicksStart = wpdTicksNow();
+        ::InterlockedIncrement( &m_pDevice->nCountGetValues );
+
+        const HRESULT hr = values( index, pKeys, ppValues );
+
+        wpdSimDevice_Call( m_pDevice, m_pDevice->dwLatencyValues, (0 != index)?(m_pDevice->nodes[index].parent):(0), qwTicksStart );
+
+        return hr;
+    }
+
+    HRESULT STDMETHODCALLTYPE
+    SetValues( LPCWSTR /*pszObjectID*/, IPortableDeviceValues* /*pValues*/, IPortableDeviceValues** /*ppResults*/ )
+    {
+        return E_NOTIMPL;
+    }
+
+    HRESULT STDMETHODCALLTYPE
+    Delete( LPCWSTR /*pszObjectID*/, IPortableDeviceKeyCollection* /*pKeys*/ )
+    {
+        return E_NOTIMPL;
+    }
+
+    HRESULT STDMETHODCALLTYPE
+    Cancel( void )
+    {
+        return S_OK;
+    }
+
+    HRESULT STDMETHODCALLTYPE
+    QueueGetValuesByObjectList(
+        IPortableDevicePropVariantCollection* pObjectIDs
+        , IPortableDeviceKeyCollection* pKeys
+        , IPortableDevicePropertiesBulkCallback* pCallback
+        , GUID* pContext
+    )
+    {
+        if ( NULL == pObjectIDs || NULL == pCallback || NULL == pContext )
+        {
+            return E_POINTER;
+        }
+
+        WpdSimBulkRequest request;
+        ::memset( &request.guidContext, 0, sizeof(request.guidContext) );
+        request.pKeys = pKeys;
+        request.pCallback = pCallback;
+
+        DWORD dwCount = 0;
+        {
+            const HRESULT hr = pObjectIDs->GetCount( &dwCount );
+            if ( FAILED(hr) )
+            {
+                return hr;
+            }
+        }
+        request.objectIds.reserve( dwCount );
+        for ( DWORD dwIndex = 0; dwIndex < dwCount; ++dwIndex )
+        {
+            PROPVARIANT pv;
+            ::PropVariantInit( &pv );
+            if ( SUCCEEDED(pObjectIDs->GetAt( dwIndex, &pv )) && VT_LPWSTR == pv.vt && NULL != pv.pwszVal )
+            {
+                request.objectIds.push_back( pv.pwszVal );
+            }
+            ::PropVariantClear( &pv );
+        }
+
+        if ( NULL != request.pKeys )
+        {
+            request.pKeys->AddRef();
+        }
+        request.pCallback->AddRef();
+
+        ::EnterCriticalSection( &m_csBulk );
+        m_dwBulkSerial += 1;
+        request.guidContext.Data1 = m_dwBulkSerial;
+        m_bulkRequests.push_back( request );
+        ::LeaveCriticalSection( &m_csBulk );
+
+        *pContext = request.guidContext;
+        return S_OK;
+    }
+
+    HRESULT STDMETHODCALLTYPE
+    QueueGetValuesByObjectFormat(
+        REFGUID /*pguidObjectFormat*/
+        , LPCWSTR /*pszParentObjectID*/
+        , DWORD /*dwDepth*/
+        , IPortableDeviceKeyCollection* /*pKeys*/
+        , IPortableDevicePropertiesBulkCallback* /*pCallback*/
+        , GUID* /*pContext*/
+    )
+    {
+        return E_NOTIMPL;
+    }
+
+    HRESULT STDMETHODCALLTYPE
+    QueueSetValuesByObjectList(
+        IPortableDeviceValuesCollection* /*pObjectValues*/
+        , IPortableDevicePropertiesBulkCallback* /*pCallback*/
+        , GUID* /*pContext*/
+    )
+    {
+        return E_NOTIMPL;
+    }
+
+    // runs the request on the calling thread, OnEnd comes before Start returns
+    HRESULT STDMETHODCALLTYPE
+    Start( REFGUID Context )
+    {
+        WpdSimBulkRequest request;
+        if ( false == takeRequest( Context, &request ) )
+        {
+            return HRESULT_FROM_WIN32(ERROR_NOT_FOUND);
+        }
+
+        request.pCallback->OnStart( Context );
+
+        HRESULT hrEnd = S_OK;
+        for ( size_t dwBegin = 0; dwBegin < request.objectIds.size() && SUCCEEDED(hrEnd); dwBegin += WPD_SIM_BULK_BATCH )
+        {
+            const size_t dwEnd = (request.objectIds.size() - dwBegin < WPD_SIM_BULK_BATCH)?(request.objectIds.size()):(dwBegin + WPD_SIM_BULK_BATCH);
+            const ULONGLONG qwTicksStart = wpdTicksNow();
+            ::InterlockedIncrement( &m_pDevice->nCountBulk );
+
+            IPortableDeviceValuesCollection* pResults = NULL;
+            hrEnd = ::CoCreateInstance(
+                CLSID_PortableDeviceValuesCollection
+                , NULL
+                , CLSCTX_INPROC_SERVER
+                , IID_PPV_ARGS(&pResults)
+                );
+            if ( FAILED(hrEnd) )
+            {
+                break;
+            }
+
+            DWORD folder = 0;
+            for ( size_t dwIndex = dwBegin; dwIndex < dwEnd; ++dwIndex )
+            {
+                DWORD index = 0;
+                if ( false == wpdSimDevice_Find( m_pDevice, request.objectIds[dwIndex].c_str(), &index ) )
+                {
+                    continue;
+                }
+                if ( 0 < s_optSimBulkShort )
+                {
+                    // --sim-bulk-short= the driver leaves the object out of its batch
+                    ::EnterCriticalSection( &m_pDevice->cs );
+                    const DWORD dwDice = wpdSimDevice_Random( m_pDevice ) % 1000U;
+                    ::LeaveCriticalSection( &m_pDevice->cs );
+                    if ( dwDice < s_optSimBulkShort )
+                    {
+                        continue;
+                    }
+                }
+
+                IPortableDeviceValues* pValues = NULL;
+                if ( SUCCEEDED(values( index, request.pKeys, &pValues )) )
+                {
+                    // a bulk result names its object whatever keys were asked for
+                    pValues->SetStringValue( WPD_OBJECT_ID, request.objectIds[dwIndex].c_str() );
+                    pResults->Add( pValues );
+                    pValues->Release();
+                    pValues = NULL;
+                }
+                folder = (0 != index)?(m_pDevice->nodes[index].parent):(0);
+            }
+
+            wpdSimDevice_Call( m_pDevice, m_pDevice->dwLatencyValues + m_pDevice->dwLatencyNextPerId * (DWORD)(dwEnd - dwBegin), folder, qwTicksStart );
+
+            request.pCallback->OnProgress( Context, pResults );
+            pResults->Release();
+            pResults = NULL;
+        }
+
+        request.pCallback->OnEnd( Context, hrEnd );
+
+        releaseRequest( &request );
+        return S_OK;
+    }
+
+    HRESULT STDMETHODCALLTYPE
+    Cancel( REFGUID Context )
+    {
+        WpdSimBulkRequest request;
+        if ( false == takeRequest( Context, &request ) )
+        {
+            return HRESULT_FROM_WIN32(ERROR_NOT_FOUND);
+        }
+        request.pCallback->OnEnd( Context, HRESULT_FROM_WIN32(ERROR_CANCELLED) );
+        releaseRequest( &request );
+        return S_OK;
+    }
+
+private:
+    ~WpdSimProperties()
+    {
+        for ( size_t index = 0; index < m_bulkRequests.size(); ++index )
+        {
+            releaseRequest( &m_bulkRequests[index] );
+        }
+        m_bulkRequests.clear();
+        ::DeleteCriticalSection( &m_csBulk );
+    }
+
+    bool
+    takeRequest( REFGUID Context, WpdSimBulkRequest* pRequest )
+    {
+        bool found = false;
+        ::EnterCriticalSection( &m_csBulk );
+        for ( size_t index = 0; index < m_bulkRequests.size(); ++index )
+        {
+            if ( ::IsEqualGUID( m_bulkRequests[index].guidContext, Context ) )
+            {
+                *pRequest = m_bulkRequests[index];
+                m_bulkRequests.erase( m_bulkRequests.begin() + index );
+                found = true;
+                break;
+            }
+        }
+        ::LeaveCriticalSection( &m_csBulk );
+        return found;
+    }
+
+    static void
+    releaseRequest( WpdSimBulkRequest* pRequest )
+    {
+        if ( NULL != pRequest->pKeys )
+        {
+            pRequest->pKeys->Release();
+            pRequest->pKeys = NULL;
+        }
+        if ( NULL != pRequest->pCallback )
+        {
+            pRequest->pCallback->Release();
+            pRequest->pCallback = NULL;
+        }
+    }
+
+    // the values of node index, without the round trip
+    HRESULT
+    values( const DWORD index, IPortableDeviceKeyCollection* pKeys, IPortableDeviceValues** ppValues )
+    {
+        IPortableDeviceValues* pValues = NULL;
+        {
+            const HRESULT hr = ::CoCreateInstance(
+                CLSID_PortableDeviceValues
+                , NULL
+                , CLSCTX_INPROC_SERVER
+                , IID_PPV_ARGS(&pValues)
+                );
+            if ( FAILED(hr) )
+            {
+                return hr;
+            }
+        }
+
+        const WpdSimNode& node = m_pDevice->nodes[index];
+        const bool isFolder = (WPD_SIM_KIND_FOLDER == node.kind || WPD_SIM_KIND_STORAGE == node.kind);
+
+        WCHAR szText[64];
+        wpdSimDevice_ObjectId( index, szText, sizeof(szText)/sizeof(szText[0]) );
+        if ( wanted( pKeys, WPD_OBJECT_ID ) )
+        {
+            pValues->SetStringValue( WPD_OBJECT_ID, szText );
+        }
+        if ( wanted( pKeys, WPD_OBJECT_PERSISTENT_UNIQUE_ID ) )
+        {
+            WCHAR szPuid[64];
+            ::_snwprintf_s( szPuid, sizeof(szPuid)/sizeof(szPuid[0]), _TRUNCATE, L"{SIM-%08X}", index );
+            pValues->SetStringValue( WPD_OBJECT_PERSISTENT_UNIQUE_ID, szPuid );
+        }
+        if ( 0 == index && wanted( pKeys, WPD_DEVICE_SERIAL_NUMBER ) )
+        {
+            pValues->SetStringValue( WPD_DEVICE_SERIAL_NUMBER, m_pDevice->serial.c_str() );
+        }
+        if ( 0 != index && wanted( pKeys, WPD_OBJECT_PARENT_ID ) )
+        {
+            wpdSimDevice_ObjectId( node.parent, szText, sizeof(szText)/sizeof(szText[0]) );
+            pValues->SetStringValue( WPD_OBJECT_PARENT_ID, szText );
+        }
+
+        LPCWSTR pszName = node.name.c_str();
+        if ( false == isFolder )
+        {
+            LPCWSTR pszFormat = L"DOC_%06u.pdf";
+            if ( WPD_SIM_KIND_IMAGE == node.kind )
+            {
+                pszFormat = L"IMG_%06u.jpg";
+            }
+            else
+            if ( WPD_SIM_KIND_VIDEO == node.kind )
+            {
+                pszFormat = L"VID_%06u.mp4";
+            }
+            else
+            if ( WPD_SIM_KIND_AUDIO == node.kind )
+            {
+                pszFormat = L"%02u Track.mp3";
+            }
+            ::_snwprintf_s( szText, sizeof(szText)/sizeof(szText[0]), _TRUNCATE, pszFormat, node.dwSerial );
+            pszName = szText;
+        }
+        if ( wanted( pKeys, WPD_OBJECT_NAME ) )
+        {
+            pValues->SetStringValue( WPD_OBJECT_NAME, pszName );
+        }
+        if ( false == isFolder && wanted( pKeys, WPD_OBJECT_ORIGINAL_FILE_NAME ) )
+        {
+            pValues->SetStringValue( WPD_OBJECT_ORIGINAL_FILE_NAME, pszName );
+        }
+
+        if ( wanted( pKeys, WPD_OBJECT_CONTENT_TYPE ) )
+        {
+            pValues->SetGuidValue( WPD_OBJECT_CONTENT_TYPE, wpdSimDevice_ContentType( node.kind ) );
+        }
+        if ( false == isFolder && wanted( pKeys, WPD_OBJECT_SIZE ) )
+        {
+            pValues->SetUnsignedLargeIntegerValue( WPD_OBJECT_SIZE, node.qwSize );
+        }
+        if ( wanted( pKeys, WPD_OBJECT_DATE_MODIFIED ) || wanted( pKeys, WPD_OBJECT_DATE_CREATED ) )
+        {
+            PROPVARIANT pv;
+            ::PropVariantInit( &pv );
+            pv.vt = VT_DATE;
+            pv.date = node.dateModified;
+            if ( wanted( pKeys, WPD_OBJECT_DATE_MODIFIED ) )
+            {
+                pValues->SetValue( WPD_OBJECT_DATE_MODIFIED, &pv );
+            }
+            if ( wanted( pKeys, WPD_OBJECT_DATE_CREATED ) )
+            {
+                pValues->SetValue( WPD_OBJECT_DATE_CREATED, &pv );
+            }
+        }
+
+        *ppValues = pValues;
+        return S_OK;
+    }
+
+    // NULL keys ask for everything
+    static bool
+    wanted( IPortableDeviceKeyCollection* pKeys, REFPROPERTYKEY key )
+    {
+        if ( NULL == pKeys )
+        {
+            return true;
+        }
+        DWORD dwCount = 0;
+        if ( FAILED(pKeys->GetCount( &dwCount )) )
+        {
+            return true;
+        }
+        for ( DWORD index = 0; index < dwCount; ++index )
+        {
+            PROPERTYKEY keyAt;
+            if ( SUCCEEDED(pKeys->GetAt( index, &keyAt )) && IsEqualPropertyKey( keyAt, key ) )
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    LONG                            m_cRef;
+    WpdSimDevice*                   m_pDevice;
+    CRITICAL_SECTION                m_csBulk;
+    DWORD                           m_dwBulkSerial;
+    std::vector<WpdSimBulkRequest>  m_bulkRequests;
+};
+
+// what the simulated device reports as its optimal transfer size
+#define WPD_SIM_OPTIMAL_BUFFER  (256U * 1024U)
+
+// synthetic content of a file: a function of its content id and the offset only, so a copy can be checked.
+// a variant differs from its original in 4 KiB in the middle
+void
+wpdSimDevice_Fill(
+    const WpdSimNode& node
+    , const ULONGLONG qwOffset
+    , BYTE* pBuffer
+    , const ULONG cb
+)
+{
+    const UINT32 dwSeed = node.dwContent * 2654435761U;
+    const ULONGLONG qwVariant = node.qwSize / 2;
+    for ( ULONG position = 0; position < cb; ++position )
+    {
+        const ULONGLONG qwPosition = qwOffset + position;
+        pBuffer[position] = (BYTE)((qwPosition * 131U) ^ (qwPosition >> 11) ^ (dwSeed >> ((qwPosition & 3) * 8)));
+        if ( 0 != node.dwVariant && qwVariant <= qwPosition && qwPosition < qwVariant + 4096U )
+        {
+            pBuffer[position] ^= (BYTE)node.dwVariant;
+        }
+    }
+}
+
+// WPD_RESOURCE_DEFAULT of a simulated file; every Read is a round trip plus its bytes at --sim-bandwidth=
+class WpdSimStream : public IStream
+{
+public:
+    WpdSimStream( WpdSimDevice* pDevice, const DWORD index )
+        : m_cRef(1)
+        , m_pDevice(pDevice)
+        , m_index(index)
+        , m_qwSize(pDevice->nodes[index].qwSize)
+        , m_qwPosition(0)
+        , m_disconnected(false)
+    {
+    }
+
+    HRESULT STDMETHODCALLTYPE
+    QueryInterface( REFIID riid, void** ppv )
+    {
+        if ( NULL == ppv )
+        {
+            return E_POINTER;
+        }
+        *ppv = NULL;
+
+        if ( ::IsEqualIID( riid, IID_IUnknown )
+            || ::IsEqualIID( riid, IID_ISequentialStream )
+            || ::IsEqualIID( riid, IID_IStream ) )
+        {
+            *ppv = static_cast<IStream*>(this);
+            this->AddRef();
+            return S_OK;
+        }
+
+        return E_NOINTERFACE;
+    }
+
+    ULONG STDMETHODCALLTYPE
+    AddRef( void )
+    {
+        return ::InterlockedIncrement( &m_cRef );
+    }
+
+    ULONG STDMETHODCALLTYPE
+    Release( void )
+    {
+        const LONG cRef = ::InterlockedDecrement( &m_cRef );
+        if ( 0 == cRef )
+        {
+            delete this;
+        }
+        return cRef;
+    }
+
+    HRESULT STDMETHODCALLTYPE
+    Read( void* pv, ULONG cb, ULONG* pcbRead )
+    {
+        if ( NULL == pv )
+        {
+            return E_POINTER;
+        }
+
+        const ULONGLONG qwTicksStart = wpdTicksNow();
+        ::InterlockedIncrement( &m_pDevice->nCountRead );
+
+        if ( NULL != pcbRead )
+        {
+            *pcbRead = 0;
+        }
+        if ( m_disconnected )
+        {
+            return HRESULT_FROM_WIN32(ERROR_DEVICE_NOT_CONNECTED);
+        }
+
+        ULONG cbRead = 0;
+        if ( m_qwPosition < m_qwSize )
+        {
+            cbRead = (m_qwSize - m_qwPosition < (ULONGLONG)cb)?((ULONG)(m_qwSize - m_qwPosition)):(cb);
+        }
+        if ( 0 < s_optSimDisconnect && 0 < cbRead )
+        {
+            ::EnterCriticalSection( &m_pDevice->cs );
+            const DWORD dwDice = wpdSimDevice_Random( m_pDevice ) % 1000U;
+            const DWORD dwCut = wpdSimDevice_Random( m_pDevice );
+            ::LeaveCriticalSection( &m_pDevice->cs );
+
+            // part of the bytes still arrive, the next Read fails
+            if ( dwDice < s_optSimDisconnect )
+            {
+                m_disconnected = true;
+                cbRead = dwCut % cbRead;
+                if ( 0 == cbRead )
+                {
+                    return HRESULT_FROM_WIN32(ERROR_DEVICE_NOT_CONNECTED);
+                }
+            }
+        }
+        wpdSimDevice_Fill( m_pDevice->nodes[m_index], m_qwPosition, reinterpret_cast<BYTE*>(pv), cbRead );
+        m_qwPosition += cbRead;
+
+        const ULONGLONG qwMicrosecondsBytes = (0 < s_optSimBandwidth)
+            ?((ULONGLONG)cbRead * 1000000U / ((ULONGLONG)s_optSimBandwidth * 1024U * 1024U))
+            :(0);
+        wpdSimDevice_Call( m_pDevice, m_pDevice->dwLatencyValues + (DWORD)qwMicrosecondsBytes, (DWORD)m_pDevice->folderMicroseconds.size(), qwTicksStart );
+
+        if ( NULL != pcbRead )
+        {
+            *pcbRead = cbRead;
+        }
+        return (cbRead < cb)?(S_FALSE):(S_OK);
+    }
+
+    HRESULT STDMETHODCALLTYPE
+    Write( const void* /*pv*/, ULONG /*cb*/, ULONG* /*pcbWritten*/ )
+    {
+        return STG_E_ACCESSDENIED;
+    }
+
+    HRESULT STDMETHODCALLTYPE
+    Seek( LARGE_INTEGER dlibMove, DWORD dwOrigin, ULARGE_INTEGER* plibNewPosition )
+    {
+        LONGLONG llBase = 0;
+        switch ( dwOrigin )
+        {
+        case STREAM_SEEK_SET:   llBase = 0; break;
+        case STREAM_SEEK_CUR:   llBase = (LONGLONG)m_qwPosition; break;
+        case STREAM_SEEK_END:   llBase = (LONGLONG)m_qwSize; break;
+        default:
+            return STG_E_INVALIDFUNCTION;
+        }
+        if ( llBase + dlibMove.QuadPart < 0 )
+        {
+            return STG_E_INVALIDFUNCTION;
+        }
+        m_qwPosition = (ULONGLONG)(llBase + dlibMove.QuadPart);
+        if ( NULL != plibNewPosition )
+        {
+            plibNewPosition->QuadPart = m_qwPosition;
+        }
+        return S_OK;
+    }
+
+    HRESULT STDMETHODCALLTYPE
+    SetSize( ULARGE_INTEGER /*libNewSize*/ )
+    {
+        return STG_E_ACCESSDENIED;
+    }
+
+    HRESULT STDMETHODCALLTYPE
+    CopyTo( IStream* /*pstm*/, ULARGE_INTEGER /*cb*/, ULARGE_INTEGER* /*pcbRead*/, ULARGE_INTEGER* /*pcbWritten*/ )
+    {
+        return E_NOTIMPL;
+    }
+
+    HRESULT STDMETHODCALLTYPE
+    Commit( DWORD /*grfCommitFlags*/ )
+    {
+        return S_OK;
+    }
+
+    HRESULT STDMETHODCALLTYPE
+    Revert( void )
+    {
+        return S_OK;
+    }
+
+    HRESULT STDMETHODCALLTYPE
+    LockRegion( ULARGE_INTEGER /*libOffset*/, ULARGE_INTEGER /*cb*/, DWORD /*dwLockType*/ )
+    {
+        return STG_E_INVALIDFUNCTION;
+    }
+
+    HRESULT STDMETHODCALLTYPE
+    UnlockRegion( ULARGE_INTEGER /*libOffset*/, ULARGE_INTEGER /*cb*/, DWORD /*dwLockType*/ )
+    {
+        return STG_E_INVALIDFUNCTION;
+    }
+
+    HRESULT STDMETHODCALLTYPE
+    Stat( STATSTG* pstatstg, DWORD /*grfStatFlag*/ )
+    {
+        if ( NULL == pstatstg )
+        {
+            return E_POINTER;
+        }
+        ::memset( pstatstg, 0, sizeof(*pstatstg) );
+        pstatstg->type = STGTY_STREAM;
+        pstatstg->cbSize.QuadPart = m_qwSize;
+        return S_OK;
+    }
+
+    HRESULT STDMETHODCALLTYPE
+    Clone( IStream** /*ppstm*/ )
+    {
+        return E_NOTIMPL;
+    }
+
+private:
+    ~WpdSimStream()
+    {
+    }
+
+    LONG            m_cRef;
+    WpdSimDevice*   m_pDevice;
+    DWORD           m_index;
+    ULONGLONG       m_qwSize;
+    ULONGLONG       m_qwPosition;
+    bool            m_disconnected; // --sim-disconnect= dropped it, for good
+};
+
+class WpdSimResources : public IPortableDeviceResources
+{
+public:
+    WpdSimResources( WpdSimDevice* pDevice )
+        : m_cRef(1)
+        , m_pDevice(pDevice)
+    {
+    }
+
+    HRESULT STDMETHODCALLTYPE
+    QueryInterface( REFIID riid, void** ppv )
+    {
+        if ( NULL == ppv )
+        {
+            return E_POINTER;
+        }
+        *ppv = NULL;
+
+        if ( ::IsEqualIID( riid, IID_IUnknown )
+            || ::IsEqualIID( riid, IID_IPortableDeviceResources ) )
+        {
+            *ppv = static_cast<IPortableDeviceResources*>(this);
+            this->AddRef();
+            return S_OK;
+        }
+
+        return E_NOINTERFACE;
+    }
+
+    ULONG STDMETHODCALLTYPE
+    AddRef( void )
+    {
+        return ::InterlockedIncrement( &m_cRef );
+    }
+
+    ULONG STDMETHODCALLTYPE
+    Release( void )
+    {
+        const LONG cRef = ::InterlockedDecrement( &m_cRef );
+        if ( 0 == cRef )
+        {
+            delete this;
+        }
+        return cRef;
+    }
+
+    HRESULT STDMETHODCALLTYPE
+    GetSupportedResources( LPCWSTR /*pszObjectID*/, IPortableDeviceKeyCollection** /*ppKeys*/ )
+    {
+        return E_NOTIMPL;
+    }
+
+    HRESULT STDMETHODCALLTYPE
+    GetResourceAttributes( LPCWSTR /*pszObjectID*/, REFPROPERTYKEY /*Key*/, IPortableDeviceValues** /*ppResourceAttributes*/ )
+    {
+        return E_NOTIMPL;
+    }
+
+    HRESULT STDMETHODCALLTYPE
+    GetStream( LPCWSTR pszObjectID, REFPROPERTYKEY Key, DWORD /*dwMode*/, DWORD* pdwOptimalBufferSize, IStream** ppStream )
+    {
+        if ( NULL == ppStream )
+        {
+            return E_POINTER;
+        }
+        *ppStream = NULL;
+
+        DWORD index = 0;
+        if ( false == wpdSimDevice_Find( m_pDevice, pszObjectID, &index ) )
+        {
+            return HRESULT_FROM_WIN32(ERROR_NOT_FOUND);
+        }
+        const WpdSimNode& node = m_pDevice->nodes[index];
+        if ( WPD_SIM_KIND_FOLDER == node.kind || WPD_SIM_KIND_STORAGE == node.kind
+            || false == IsEqualPropertyKey( Key, WPD_RESOURCE_DEFAULT ) )
+        {
+            return E_INVALIDARG;
+        }
+
+        // opening the object is one round trip
+        wpdSimDevice_Call( m_pDevice, m_pDevice->dwLatencyValues, (DWORD)m_pDevice->folderMicroseconds.size(), wpdTicksNow() );
+        if ( NULL != pdwOptimalBufferSize )
+        {
+            *pdwOptimalBufferSize = WPD_SIM_OPTIMAL_BUFFER;
+        }
+        *ppStream = new WpdSimStream( m_pDevice, index );
+        return S_OK;
+    }
+
+    HRESULT STDMETHODCALLTYPE
+    Delete( LPCWSTR /*pszObjectID*/, IPortableDeviceKeyCollection* /*pKeys*/ )
+    {
+        return E_NOTIMPL;
+    }
+
+    HRESULT STDMETHODCALLTYPE
+    Cancel( void )
+    {
+        return S_OK;
+    }
+
+    HRESULT STDMETHODCALLTYPE
+    CreateResource( IPortableDeviceValues* /*pResourceAttributes*/, IStream** /*ppData*/, DWORD* /*pdwOptimalWriteBufferSize*/, LPWSTR* /*ppszCookie*/ )
+    {
+        return E_NOTIMPL;
+    }
+
+private:
+    ~WpdSimResources()
+    {
+    }
+
+    LONG            m_cRef;
+    WpdSimDevice*   m_pDevice;
+};
+
+class WpdSimContent : public IPortableDeviceContent
+{
+public:
+    WpdSimContent( WpdSimDevice* pDevice )
+        : m_cRef(1)
+        , m_pDevice(pDevice)
+        , m_pProperties(new WpdSimProperties( pDevice ))
+    {
+    }
+
+    HRESULT STDMETHODCALLTYPE
+    QueryInterface( REFIID riid, void** ppv )
+    {
+        if ( NULL == ppv )
+        {
+            return E_POINTER;
+        }
+        *ppv = NULL;
+
+        if ( ::IsEqualIID( riid, IID_IUnknown )
+            || ::IsEqualIID( riid, IID_IPortableDeviceContent ) )
+        {
+            *ppv = static_cast<IPortableDeviceContent*>(this);
+            this->AddRef();
+            return S_OK;
+        }
+
+        return E_NOINTERFACE;
+    }
+
+    ULONG STDMETHODCALLTYPE
+    AddRef( void )
+    {
+        return ::InterlockedIncrement( &m_cRef );
+    }
+
+    ULONG STDMETHODCALLTYPE
+    Release( void )
+    {
+        const LONG cRef = ::InterlockedDecrement( &m_cRef );
+        if ( 0 == cRef )
+        {
+            delete this;
+        }
+        return cRef;
+    }
+
+    HRESULT STDMETHODCALLTYPE
+    EnumObjects( DWORD /*dwFlags*/, LPCWSTR pszParentObjectID, IPortableDeviceValues* /*pFilter*/, IEnumPortableDeviceObjectIDs** ppEnum )
+    {
+        if ( NULL == ppEnum )
+        {
+            return E_POINTER;
+        }
+        *ppEnum = NULL;
+
+        DWORD folder = 0;
+        if ( false == wpdSimDevice_Find( m_pDevice, pszParentObjectID, &folder ) )
+        {
+            return HRESULT_FROM_WIN32(ERROR_NOT_FOUND);
+        }
+
+        const ULONGLONG qwTicksStart = wpdTicksNow();
+        ::InterlockedIncrement( &m_pDevice->nCountEnumObjects );
+        ::InterlockedIncrement( &m_pDevice->nCountHeapAlloc );
+        *ppEnum = new WpdSimEnum( m_pDevice, folder );
+        wpdSimDevice_Call( m_pDevice, m_pDevice->dwLatencyEnum, folder, qwTicksStart );
+        return S_OK;
+    }
+
+    HRESULT STDMETHODCALLTYPE
+    Properties( IPortableDeviceProperties** ppProperties )
+    {
+        if ( NULL == ppProperties )
+        {
+            return E_POINTER;
+        }
+        m_pProperties->AddRef();
+        *ppProperties = m_pProperties;
+        return S_OK;
+    }
+
+    HRESULT STDMETHODCALLTYPE
+    Transfer( IPortableDeviceResources** ppResources )
+    {
+        if ( NULL == ppResources )
+        {
+            return E_POINTER;
+        }
+        *ppResources = new WpdSimResources( m_pDevice );
+        return S_OK;
+    }
+
+    HRESULT STDMETHODCALLTYPE
+    CreateObjectWithPropertiesOnly( IPortableDeviceValues* /*pValues*/, LPWSTR* /*ppszObjectID*/ )
+    {
+        return E_NOTIMPL;
+    }
+
+    HRESULT STDMETHODCALLTYPE
+    CreateObjectWithPropertiesAndData( IPortableDeviceValues* /*pValues*/, IStream** /*ppData*/, DWORD* /*pdwOptimalWriteBufferSize*/, LPWSTR* /*ppszCookie*/ )
+    {
+        return E_NOTIMPL;
+    }
+
+    HRESULT STDMETHODCALLTYPE
+    Delete( DWORD /*dwOptions*/, IPortableDevicePropVariantCollection* /*pObjectIDs*/, IPortableDevicePropVariantCollection** /*ppResults*/ )
+    {
+        return E_NOTIMPL;
+    }
+
+    HRESULT STDMETHODCALLTYPE
+    GetObjectIDsFromPersistentUniqueIDs( IPortableDevicePropVariantCollection* /*pPersistentUniqueIDs*/, IPortableDevicePropVariantCollection** /*ppObjectIDs*/ )
+    {
+        return E_NOTIMPL;
+    }
+
+    HRESULT STDMETHODCALLTYPE
+    Cancel( void )
+    {
+        return S_OK;
+    }
+
+    HRESULT STDMETHODCALLTYPE
+    Move( IPortableDevicePropVariantCollection* /*pObjectIDs*/, LPCWSTR /*pszDestinationFolderObjectID*/, IPortableDevicePropVariantCollection** /*ppResults*/ )
+    {
+        return E_NOTIMPL;
+    }
+
+    HRESULT STDMETHODCALLTYPE
+    Copy( IPortableDevicePropVariantCollection* /*pObjectIDs*/, LPCWSTR /*pszDestinationFolderObjectID*/, IPortableDevicePropVariantCollection** /*ppResults*/ )
+    {
+        return E_NOTIMPL;
+    }
+
+private:
+    ~WpdSimContent()
+    {
+        if ( NULL != m_pProperties )
+        {
+            m_pProperties->Release();
+            m_pProperties = NULL;
+        }
+    }
+
+    LONG                m_cRef;
+    WpdSimDevice*       m_pDevice;
+    WpdSimProperties*   m_pProperties;
+};
+
+// the devices wpdSimDevice_OpenPortableDevice() and the simulated manager know
+static
+std::vector<WpdSimDevice*> s_simDevices;
+
+WpdSimDevice*
+wpdSimDevice_FromPnPDeviceId(
+    LPCWSTR pszPnPDeviceID
+)
+{
+    for ( size_t index = 0; NULL != pszPnPDeviceID && index < s_simDevices.size(); ++index )
+    {
+        if ( 0 == ::wcscmp( pszPnPDeviceID, s_simDevices[index]->pnpDeviceId.c_str() ) )
+        {
+            return s_simDevices[index];
+        }
+    }
+    return NULL;
+}
+
+// the session of the simulated device, Open() costs --sim-open= microseconds
+class WpdSimPortableDevice : public IPortableDevice
+{
+public:
+    WpdSimPortableDevice( WpdSimDevice* pDevice )
+        : m_cRef(1)
+        , m_pDevice(pDevice)
+        , m_opened(false)
+    {
+    }
+
+    HRESULT STDMETHODCALLTYPE
+    QueryInterface( REFIID riid, void** ppv )
+    {
+        if ( NULL == ppv )
+        {
+            return E_POINTER;
+        }
+        *ppv = NULL;
+
+        if ( ::IsEqualIID( riid, IID_IUnknown )
+            || ::IsEqualIID( riid, IID_IPortableDevice ) )
+        {
+            *ppv = static_cast<IPortableDevice*>(this);
+            this->AddRef();
+            return S_OK;
+        }
+
+        return E_NOINTERFACE;
+    }
+
+    ULONG STDMETHODCALLTYPE
+    AddRef( void )
+    {
+        return ::InterlockedIncrement( &m_cRef );
+    }
+
+    ULONG STDMETHODCALLTYPE
+    Release( void )
+    {
+        const LONG cRef = ::InterlockedDecrement( &m_cRef );
+        if ( 0 == cRef )
+        {
+            delete this;
+        }
+        return cRef;
+    }
+
+    HRESULT STDMETHODCALLTYPE
+    Open( LPCWSTR /*pszPnPDeviceID*/, IPortableDeviceValues* /*pClientInfo*/ )
+    {
+        wpdSimDevice_Call( m_pDevice, s_optSimOpen, (DWORD)m_pDevice->folderMicroseconds.size(), wpdTicksNow() );
+        m_opened = true;
+        return S_OK;
+    }
+
+    HRESULT STDMETHODCALLTYPE
+    SendCommand( DWORD /*dwFlags*/, IPortableDeviceValues* /*pParameters*/, IPortableDeviceValues** /*ppResults*/ )
+    {
+        return E_NOTIMPL;
+    }
+
+    HRESULT STDMETHODCALLTYPE
+    Content( IPortableDeviceContent** ppContent )
+    {
+        if ( NULL == ppContent )
+        {
+            return E_POINTER;
+        }
+        *ppContent = NULL;
+        if ( false == m_opened )
+        {
+            return E_WPD_DEVICE_NOT_OPEN;
+        }
+        *ppContent = new WpdSimContent( m_pDevice );
+        return S_OK;
+    }
+
+    HRESULT STDMETHODCALLTYPE
+    Capabilities( IPortableDeviceCapabilities** /*ppCapabilities*/ )
+    {
+        return E_NOTIMPL;
+    }
+
+    HRESULT STDMETHODCALLTYPE
+    Cancel( void )
+    {
+        return S_OK;
+    }
+
+    HRESULT STDMETHODCALLTYPE
+    Close( void )
+    {
+        m_opened = false;
+        return S_OK;
+    }
+
+    HRESULT STDMETHODCALLTYPE
+    Advise( DWORD /*dwFlags*/, IPortableDeviceEventCallback* /*pCallback*/, IPortableDeviceValues* /*pParameters*/, LPWSTR* /*ppszCookie*/ )
+    {
+        return E_NOTIMPL;
+    }
+
+    HRESULT STDMETHODCALLTYPE
+    Unadvise( LPCWSTR /*pszCookie*/ )
+    {
+        return E_NOTIMPL;
+    }
+
+    HRESULT STDMETHODCALLTYPE
+    GetPnPDeviceID( LPWSTR* ppszPnPDeviceID )
+    {
+        if ( NULL == ppszPnPDeviceID )
+        {
+            return E_POINTER;
+        }
+        const size_t cb = (m_pDevice->pnpDeviceId.size() + 1) * sizeof(WCHAR);
+        *ppszPnPDeviceID = reinterpret_cast<LPWSTR>(::CoTaskMemAlloc( cb ));
+        if ( NULL == *ppszPnPDeviceID )
+        {
+            return E_OUTOFMEMORY;
+        }
+        ::memcpy( *ppszPnPDeviceID, m_pDevice->pnpDeviceId.c_str(), cb );
+        return S_OK;
+    }
+
+private:
+    ~WpdSimPortableDevice()
+    {
+    }
+
+    LONG            m_cRef;
+    WpdSimDevice*   m_pDevice;
+    bool            m_opened;
+};
+
+IPortableDevice*
+wpdSimDevice_OpenPortableDevice(
+    LPCWSTR pszPnPDeviceID
+)
+{
+    WpdSimDevice* pDevice = wpdSimDevice_FromPnPDeviceId( pszPnPDeviceID );
+    if ( NULL == pDevice )
+    {
+        return wpdOpenPortableDevice( pszPnPDeviceID );
+    }
+
+    IPortableDevice* pPortableDevice = new WpdSimPortableDevice( pDevice );
+    WpdDeviceStats* pStats = wpdStats_Device( pszPnPDeviceID );
+    const ULONGLONG qwTicksCall = wpdStats_Begin( pStats );
+    const HRESULT hr = pPortableDevice->Open( pszPnPDeviceID, NULL );
+    wpdStats_End( pStats, WPD_STAT_OP_OPEN, qwTicksCall, hr, 0 );
+    return pPortableDevice;
+}
+
+// --sim-plug=: milliseconds after the script started, a device of s_simDevices arrives or leaves
+struct WpdSimPlug
+{
+    DWORD   dwAt;
+    bool    arrive;
+    DWORD   device;
+};
+
+// the device manager of the simulated devices, counts what dispDeviceInfo asks it. without a plug script every
+// device is there, with one a device is listed from its arrival until its removal
+class WpdSimDeviceManager : public IPortableDeviceManager
+{
+public:
+    WpdSimDeviceManager()
+        : m_cRef(1)
+        , m_nCountCall(0)
+        , m_dwStart(0)
+    {
+    }
+
+    void
+    Plug( const std::vector<WpdSimPlug>& plugs )
+    {
+        m_plugs = plugs;
+        m_dwStart = ::GetTickCount();
+    }
+
+    bool
+    IsPresent( const DWORD device ) const
+    {
+        if ( m_plugs.empty() )
+        {
+            return device < s_simDevices.size();
+        }
+        const DWORD dwElapsed = ::GetTickCount() - m_dwStart;
+        bool present = false;
+        for ( size_t index = 0; index < m_plugs.size(); ++index )
+        {
+            if ( device == m_plugs[index].device && m_plugs[index].dwAt <= dwElapsed )
+            {
+                present = m_plugs[index].arrive;
+            }
+        }
+        return present;
+    }
+
+    HRESULT STDMETHODCALLTYPE
+    QueryInterface( REFIID riid, void** ppv )
+    {
+        if ( NULL == ppv )
+        {
+            return E_POINTER;
+        }
+        *ppv = NULL;
+
+        if ( ::IsEqualIID( riid, IID_IUnknown )
+            || ::IsEqualIID( riid, IID_IPortableDeviceManager ) )
+        {
+            *ppv = static_cast<IPortableDeviceManager*>(this);
+            this->AddRef();
+            return S_OK;
+        }
+
+        return E_NOINTERFACE;
+    }
+
+    ULONG STDMETHODCALLTYPE
+    AddRef( void )
+    {
+        return ::InterlockedIncrement( &m_cRef );
+    }
+
+    ULONG STDMETHODCALLTYPE
+    Release( void )
+    {
+        const LONG cRef = ::InterlockedDecrement( &m_cRef );
+        if ( 0 == cRef )
+        {
+            delete this;
+        }
+        return cRef;
+    }
+
+    HRESULT STDMETHODCALLTYPE
+    GetDevices( LPWSTR* pPnPDeviceIDs, DWORD* pcPnPDeviceIDs )
+    {
+        ::InterlockedIncrement( &m_nCountCall );
+        if ( NULL == pcPnPDeviceIDs )
+        {
+            return E_POINTER;
+        }
+        DWORD dwCount = 0;
+        for ( DWORD device = 0; device < (DWORD)s_simDevices.size(); ++device )
+        {
+            if ( false == this->IsPresent( device ) )
+            {
+                continue;
+            }
+            if ( NULL != pPnPDeviceIDs )
+            {
+                if ( *pcPnPDeviceIDs <= dwCount )
+                {
+                    break;
+                }
+                const std::wstring& pnpDeviceId = s_simDevices[device]->pnpDeviceId;
+                const size_t cb = (pnpDeviceId.size() + 1) * sizeof(WCHAR);
+                pPnPDeviceIDs[dwCount] = reinterpret_cast<LPWSTR>(::CoTaskMemAlloc( cb ));
+                if ( NULL == pPnPDeviceIDs[dwCount] )
+                {
+                    return E_OUTOFMEMORY;
+                }
+                ::memcpy( pPnPDeviceIDs[dwCount], pnpDeviceId.c_str(), cb );
+            }
+            dwCount += 1;
+        }
+        *pcPnPDeviceIDs = dwCount;
+        return S_OK;
+    }
+
+    HRESULT STDMETHODCALLTYPE
+    RefreshDeviceList( void )
+    {
+        ::InterlockedIncrement( &m_nCountCall );
+        return S_OK;
+    }
+
+    HRESULT STDMETHODCALLTYPE
+    GetDeviceFriendlyName( LPCWSTR pszPnPDeviceID, WCHAR* pDeviceFriendlyName, DWORD* pcchDeviceFriendlyName )
+    {
+        return this->GetString( pszPnPDeviceID, L"Simulated device", pDeviceFriendlyName, pcchDeviceFriendlyName );
+    }
+
+    HRESULT STDMETHODCALLTYPE
+    GetDeviceDescription( LPCWSTR pszPnPDeviceID, WCHAR* pDeviceDescription, DWORD* pcchDeviceDescription )
+    {
+        // longer than WPD_DEVICE_INFO_BUFFER_MIN, so the second call is taken as well
+        return this->GetString( pszPnPDeviceID
+            , L"In-memory device walked by --simulate, latencies from --sim-latency= and --sim-open="
+            , pDeviceDescription
+            , pcchDeviceDescription
+            );
+    }
+
+    HRESULT STDMETHODCALLTYPE
+    GetDeviceManufacturer( LPCWSTR pszPnPDeviceID, WCHAR* pDeviceManufacturer, DWORD* pcchDeviceManufacturer )
+    {
+        return this->GetString( pszPnPDeviceID, L"test_enum_wpd", pDeviceManufacturer, pcchDeviceManufacturer );
+    }
+
+    HRESULT STDMETHODCALLTYPE
+    GetDeviceProperty( LPCWSTR /*pszPnPDeviceID*/, LPCWSTR /*pszDevicePropertyName*/, BYTE* /*pData*/, DWORD* /*pcbData*/, DWORD* /*pdwType*/ )
+    {
+        ::InterlockedIncrement( &m_nCountCall );
+        return E_NOTIMPL;
+    }
+
+    HRESULT STDMETHODCALLTYPE
+    GetPrivateDevices( LPWSTR* /*pPnPDeviceIDs*/, DWORD* pcPnPDeviceIDs )
+    {
+        ::InterlockedIncrement( &m_nCountCall );
+        if ( NULL == pcPnPDeviceIDs )
+        {
+            return E_POINTER;
+        }
+        *pcPnPDeviceIDs = 0;
+        return S_OK;
+    }
+
+    LONG
+    CountCall( void ) const
+    {
+        return m_nCountCall;
+    }
+
+private:
+    ~WpdSimDeviceManager()
+    {
+    }
+
+    // same contract as the real manager: NULL or a short buffer gets the needed length back
+    HRESULT
+    GetString( LPCWSTR pszPnPDeviceID, LPCWSTR pszValue, WCHAR* pBuffer, DWORD* pcchBuffer )
+    {
+        ::InterlockedIncrement( &m_nCountCall );
+        if ( NULL == pszPnPDeviceID || NULL == pcchBuffer )
+        {
+            return E_POINTER;
+        }
+        DWORD device = 0;
+        while ( device < s_simDevices.size() && 0 != ::wcscmp( pszPnPDeviceID, s_simDevices[device]->pnpDeviceId.c_str() ) )
+        {
+            device += 1;
+        }
+        if ( false == this->IsPresent( device ) )
+        {
+            return HRESULT_FROM_WIN32(ERROR_NOT_FOUND);
+        }
+
+        const DWORD cchValue = (DWORD)::wcslen( pszValue ) + 1;
+        if ( NULL == pBuffer )
+        {
+            *pcchBuffer = cchValue;
+            return S_OK;
+        }
+        if ( *pcchBuffer < cchValue )
+        {
+            *pcchBuffer = cchValue;
+            return HRESULT_FROM_WIN32(ERROR_INSUFFICIENT_BUFFER);
+        }
+        ::memcpy( pBuffer, pszValue, cchValue * sizeof(WCHAR) );
+        *pcchBuffer = cchValue;
+        return S_OK;
+    }
+
+    LONG                    m_cRef;
+    volatile LONG           m_nCountCall;
+    std::vector<WpdSimPlug> m_plugs;
+    DWORD                   m_dwStart;
+};
+
+struct WpdBenchResult
+{
+    DWORD       dwCountObject;
+    DWORD       dwCountFolder;
+    double      dSeconds;
+    double      dObjectsPerSec;
+    LONG        nCountEnumObjects;
+    LONG        nCountNext;
+    LONG        nCountGetValues;
+    LONG        nCountBulk;
+    double      dCallsPerObject;
+    LONG        nFolderP50;
+    LONG        nFolderP99;
+    ULONGLONG   qwPeakWorkingSet;
+    ULONGLONG   qwPeakPrivate;
+    double      dStatsOverhead;     // percent of the scan, --stats only
+};
+
+bool
+wpdBench_WriteJson(
+    LPCWSTR pszPath
+    , const WpdBenchResult& result
+)
+{
+    FILE* fp = NULL;
+    if ( 0 != ::_wfopen_s( &fp, pszPath, L"w" ) || NULL == fp )
+    {
+        LOGE( L"! Failed. open bench json %s\n", pszPath );
+        return false;
+    }
+
+    // flat, one key per line: wpdBench_ReadJson only looks for "key":number
+    ::fprintf( fp, "{\n" );
+    ::fprintf( fp, "  \"profile\": \"%S\",\n", s_optSimulate );
+    ::fprintf( fp, "  \"walkers\": %u,\n", s_optCountOfWalkers );
+    ::fprintf( fp, "  \"fetch\": %u,\n", s_optCountOfFetch );
+    ::fprintf( fp, "  \"runs\": %u,\n", s_optSimRuns );
+    ::fprintf( fp, "  \"objects\": %u,\n", result.dwCountObject );
+    ::fprintf( fp, "  \"folders\": %u,\n", result.dwCountFolder );
+    ::fprintf( fp, "  \"seconds\": %.3f,\n", result.dSeconds );
+    ::fprintf( fp, "  \"objects_per_sec\": %.1f,\n", result.dObjectsPerSec );
+    ::fprintf( fp, "  \"calls_enum_objects\": %ld,\n", result.nCountEnumObjects );
+    ::fprintf( fp, "  \"calls_next\": %ld,\n", result.nCountNext );
+    ::fprintf( fp, "  \"calls_get_values\": %ld,\n", result.nCountGetValues );
+    ::fprintf( fp, "  \"calls_bulk\": %ld,\n", result.nCountBulk );
+    ::fprintf( fp, "  \"calls_per_object\": %.3f,\n", result.dCallsPerObject );
+    ::fprintf( fp, "  \"folder_p50_us\": %ld,\n", result.nFolderP50 );
+    ::fprintf( fp, "  \"folder_p99_us\": %ld,\n", result.nFolderP99 );
+    ::fprintf( fp, "  \"peak_working_set\": %I64u,\n", result.qwPeakWorkingSet );
+    ::fprintf( fp, "  \"peak_private\": %I64u,\n", result.qwPeakPrivate );
+    ::fprintf( fp, "  \"stats_overhead_pct\": %.4f\n", result.dStatsOverhead );
+    ::fprintf( fp, "}\n" );
+
+    const bool ok = (0 == ::ferror( fp ));
+    ::fclose( fp );
+    fp = NULL;
+    if ( false == ok )
+    {
+        LOGE( L"! Failed. write bench json %s\n", pszPath );
+    }
+    return ok;
+}
+
+bool
+wpdBench_ReadJson(
+    const std::string& json
+    , const char* pszKey
+    , double* pValue
+)
+{
+    std::string key( "\"" );
+    key.append( pszKey );
+    key.append( "\":" );
+    const size_t pos = json.find( key );
+    if ( std::string::npos == pos )
+    {
+        return false;
+    }
+    char* endptr = NULL;
+    const double value = ::strtod( json.c_str() + pos + key.size(), &endptr );
+    if ( json.c_str() + pos + key.size() == endptr )
+    {
+        return false;
+    }
+    *pValue = value;
+    return true;
+}
+
+void
+wpdBench_Compare(
+    LPCWSTR pszPath
+    , const WpdBenchResult& result
+)
+{
+    FILE* fp = NULL;
+    if ( 0 != ::_wfopen_s( &fp, pszPath, L"r" ) || NULL == fp )
+    {
+        LOGE( L"! Failed. open bench baseline %s\n", pszPath );
+        return;
+    }
+    std::string json;
+    {
+        char buff[4096];
+        size_t len = 0;
+        while ( 0 < (len = ::fread( buff, 1, sizeof(buff), fp )) )
+        {
+            json.append( buff, len );
+        }
+    }
+    ::fclose( fp );
+    fp = NULL;
+
+    struct Metric
+    {
+        const char* pszKey;
+        LPCWSTR     pszName;
+        double      dValue;
+        bool        higherIsBetter;
+    };
+    const Metric metrics[] =
+    {
+        { "objects_per_sec",    L"objects/sec    ", result.dObjectsPerSec,          true  },
+        { "calls_per_object",   L"calls/object   ", result.dCallsPerObject,         false },
+        { "folder_p50_us",      L"folder p50 us  ", (double)result.nFolderP50,      false },
+        { "folder_p99_us",      L"folder p99 us  ", (double)result.nFolderP99,      false },
+        { "peak_private",       L"peak private   ", (double)result.qwPeakPrivate,   false },
+    };
+
+    LOGI( L"Baseline   : %s\n", pszPath );
+    for ( size_t index = 0; index < sizeof(metrics)/sizeof(metrics[0]); ++index )
+    {
+        const Metric& metric = metrics[index];
+        double dBase = 0.0;
+        if ( false == wpdBench_ReadJson( json, metric.pszKey, &dBase ) )
+        {
+            LOGI( L"    %s %12.1f (no baseline)\n", metric.pszName, metric.dValue );
+            continue;
+        }
+        const double dChange = (0.0 != dBase)?((metric.dValue - dBase) * 100.0 / dBase):(0.0);
+        const bool better = metric.higherIsBetter ? (0.0 < dChange) : (dChange < 0.0);
+        LOGI( L"    %s %12.1f -> %12.1f (%+.1f%%%s)\n"
+            , metric.pszName
+            , dBase
+            , metric.dValue
+            , dChange
+            , (0.0 == dChange)?(L""):((better)?(L", better"):(L", worse"))
+            );
+    }
+}
+
+// every copy --download= finished must hold what the simulated device serves, read back from disk
+bool
+wpdSimDevice_VerifyDownload(
+    WpdSimDevice* pDevice
+    , const std::vector<WpdDownloadJob>& jobs
+)
+{
+    std::wstring directory;
+    wpdDownload_Directory( &directory );
+
+    std::vector<BYTE> bufferFile( 1024U * 1024U );
+    std::vector<BYTE> bufferDevice( bufferFile.size() );
+    DWORD dwCountMatch = 0;
+    DWORD dwCountDiffer = 0;
+    for ( size_t index = 0; index < jobs.size(); ++index )
+    {
+        const WpdDownloadJob& job = jobs[index];
+        DWORD node = 0;
+        if ( false == job.done || false == wpdSimDevice_Find( pDevice, job.objectId.c_str(), &node ) )
+        {
+            continue;
+        }
+
+        const std::wstring path( directory + L"\\" + job.path );
+        HANDLE hFile = ::CreateFileW( path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL );
+        if ( INVALID_HANDLE_VALUE == hFile )
+        {
+            LOGE( L"! Failed. CreateFile %s, error=%u\n", path.c_str(), ::GetLastError() );
+            dwCountDiffer += 1;
+            continue;
+        }
+
+        const ULONGLONG qwSize = pDevice->nodes[node].qwSize;
+        UINT32 dwCrcFile = 0;
+        UINT32 dwCrcDevice = 0;
+        ULONGLONG qwOffset = 0;
+        for ( ;; )
+        {
+            DWORD cbRead = 0;
+            if ( FALSE == ::ReadFile( hFile, &bufferFile[0], (DWORD)bufferFile.size(), &cbRead, NULL ) || 0 == cbRead )
+            {
+                break;
+            }
+            dwCrcFile = wpdCrc32( dwCrcFile, &bufferFile[0], cbRead );
+            qwOffset += cbRead;
+        }
+        ::CloseHandle( hFile );
+        hFile = NULL;
+
+        for ( ULONGLONG qwDevice = 0; qwDevice < qwSize; )
+        {
+            const ULONG cb = (qwSize - qwDevice < (ULONGLONG)bufferDevice.size())?((ULONG)(qwSize - qwDevice)):((ULONG)bufferDevice.size());
+            wpdSimDevice_Fill( pDevice->nodes[node], qwDevice, &bufferDevice[0], cb );
+            dwCrcDevice = wpdCrc32( dwCrcDevice, &bufferDevice[0], cb );
+            qwDevice += cb;
+        }
+
+        if ( qwOffset == qwSize && dwCrcFile == dwCrcDevice && (false == job.hasCrc || job.dwCrc == dwCrcDevice) )
+        {
+            dwCountMatch += 1;
+            continue;
+        }
+        dwCountDiffer += 1;
+        LOGE( L"! Failed. %s differs, %I64u bytes crc32=%08x, streamed crc32=%08x, device %I64u bytes crc32=%08x\n"
+            , path.c_str()
+            , qwOffset
+            , dwCrcFile
+            , job.dwCrc
+            , qwSize
+            , dwCrcDevice
+            );
+    }
+
+    LOGI( L"    Verify: %u files match the device, %u differ, disconnects=%u/1000 reads\n", dwCountMatch, dwCountDiffer, s_optSimDisconnect );
+    return 0 == dwCountDiffer;
+}
+
+// --tree: every stored object hangs below its parent on the device and the device object is the only root.
+// complete: nothing was filtered out, so every object of the device is stored
+bool
+wpdSimDevice_VerifyTree(
+    WpdSimDevice* pDevice
+    , const WpdTreeStore* pStore
+    , const bool complete
+)
+{
+    const UINT32 dwCount = wpdTreeStore_Count( pStore );
+    DWORD dwCountRoot = 0;
+    DWORD dwCountMisplaced = 0;
+    for ( UINT32 dwNode = 0; dwNode < dwCount; ++dwNode )
+    {
+        DWORD node = 0;
+        if ( false == wpdSimDevice_Find( pDevice, wpdArena_Get( &pStore->strings, pStore->objectId[dwNode] ), &node ) )
+        {
+            dwCountMisplaced += 1;
+            continue;
+        }
+        const UINT32 dwParent = pStore->parent[dwNode];
+        if ( WPD_HANDLE_NONE == dwParent )
+        {
+            dwCountRoot += 1;
+            dwCountMisplaced += (0 == node)?(0):(1);
+            continue;
+        }
+        DWORD nodeParent = 0;
+        if ( 0 == node
+            || false == wpdSimDevice_Find( pDevice, wpdArena_Get( &pStore->strings, pStore->objectId[dwParent] ), &nodeParent )
+            || pDevice->nodes[node].parent != nodeParent )
+        {
+            dwCountMisplaced += 1;
+        }
+    }
+
+    const bool result = (1 == dwCountRoot && 0 == dwCountMisplaced && (false == complete || dwCount == pDevice->nodes.size()));
+    if ( false == result )
+    {
+        LOGE( L"! Failed. tree of %u objects, device has %u, roots=%u, misplaced=%u\n", dwCount, (DWORD)pDevice->nodes.size(), dwCountRoot, dwCountMisplaced );
+    }
+    else
+    {
+        LOGI( L"    Verify: tree of %u objects matches the device\n", dwCount );
+    }
+    return result;
+}
+
+// walks a --sim-kill= run may take before it gives up
+#define WPD_SIM_RESUME_MAX  (10000U)
+// blocks of each kind the --alloc-stats counters are checked with
+#define WPD_SIM_ALLOC_CHECK (16U)
+// files the first burst of the --watch script adds
+#define WPD_SIM_WATCH_BURST (5U)
+
+// one change of the --watch script: the object, or the folder a new file goes to, and the delay before it
+struct WpdSimWatchStep
+{
+    DWORD               dwDelay;
+    WpdWatchEventKind   kind;
+    DWORD               node;
+};
+
+// --watch under --simulate: a script changes the simulated device and reports each change as a device would.
+// a burst of additions and a removal with an addition each fall within --watch-debounce= and have to become
+// one rescan each, an update comes alone and is only fetched, then the device goes away
+class WpdSimEventScript : public WpdWatchEventSource
+{
+public:
+    explicit WpdSimEventScript( WpdSimDevice* pDevice )
+        : m_pDevice(pDevice)
+        , m_next(0)
+        , m_dwDue(0)
+    {
+        // two leaves still on the device: one is removed and the other updated, their folders get the new files
+        DWORD first = 0;
+        DWORD last = 0;
+        std::vector<DWORD> pending( pDevice->nodes[0].children );
+        while ( !pending.empty() )
+        {
+            const DWORD index = pending.back();
+            pending.pop_back();
+            if ( pDevice->nodes[index].children.empty() )
+            {
+                first = (0 == first)?(index):(first);
+                last = index;
+            }
+            pending.insert( pending.end(), pDevice->nodes[index].children.begin(), pDevice->nodes[index].children.end() );
+        }
+
+        const DWORD dwBurst = s_optWatchDebounce / 5;
+        const DWORD dwQuiet = s_optWatchDebounce * 3;
+        WpdSimWatchStep step;
+        for ( DWORD index = 0; index < WPD_SIM_WATCH_BURST; ++index )
+        {
+            step.dwDelay = (0 == index)?(0):(dwBurst);
+            step.kind = WPD_WATCH_EVENT_ADDED;
+            step.node = pDevice->nodes[last].parent;
+            m_steps.push_back( step );
+        }
+        step.dwDelay = dwQuiet;
+        step.kind = WPD_WATCH_EVENT_REMOVED;
+        step.node = first;
+        m_steps.push_back( step );
+        step.dwDelay = dwBurst;
+        step.kind = WPD_WATCH_EVENT_ADDED;
+        step.node = pDevice->nodes[first].parent;
+        m_steps.push_back( step );
+        step.dwDelay = dwQuiet;
+        step.kind = WPD_WATCH_EVENT_UPDATED;
+        step.node = last;
+        m_steps.push_back( step );
+        step.dwDelay = dwQuiet;
+        step.kind = WPD_WATCH_EVENT_DEVICE_REMOVED;
+        step.node = 0;
+        m_steps.push_back( step );
+    }
+
+    bool
+    wait( const DWORD dwTimeout, WpdWatchEvent* pEvent )
+    {
+        if ( m_steps.size() <= m_next )
+        {
+            return false;
+        }
+
+        const DWORD dwNow = ::GetTickCount();
+        if ( 0 == m_next )
+        {
+            m_dwDue = dwNow;
+        }
+        const WpdSimWatchStep& step = m_steps[m_next];
+        const DWORD dwDue = m_dwDue + step.dwDelay;
+        if ( (int)(dwDue - dwNow) > 0 )
+        {
+            if ( INFINITE != dwTimeout && dwTimeout < dwDue - dwNow )
+            {
+                ::Sleep( dwTimeout );
+                return false;
+            }
+            ::Sleep( dwDue - dwNow );
+        }
+        m_dwDue = dwDue;
+        m_next += 1;
+
+        WCHAR szObjectId[32];
+        pEvent->kind = step.kind;
+        pEvent->objectId.clear();
+        pEvent->parentId.clear();
+        ::EnterCriticalSection( &m_pDevice->cs );
+        if ( WPD_WATCH_EVENT_ADDED == step.kind )
+        {
+            const DWORD node = wpdSimDevice_Add( m_pDevice, step.node, WPD_SIM_KIND_IMAGE, NULL );
+            m_pDevice->nodes[node].dwSerial = 90000U + node;
+            m_pDevice->nodes[node].qwSize = 1000000U;
+            m_pDevice->folderMicroseconds.push_back( 0 );
+            wpdSimDevice_ObjectId( node, szObjectId, _countof(szObjectId) );
+            pEvent->objectId.assign( szObjectId );
+            // the device names the folder, the tree has never seen the new object
+            wpdSimDevice_ObjectId( step.node, szObjectId, _countof(szObjectId) );
+            pEvent->parentId.assign( szObjectId );
+        }
+        else
+        if ( WPD_WATCH_EVENT_REMOVED == step.kind )
+        {
+            std::vector<DWORD>& children = m_pDevice->nodes[m_pDevice->nodes[step.node].parent].children;
+            const std::vector<DWORD>::iterator it = std::find( children.begin(), children.end(), step.node );
+            if ( children.end() != it )
+            {
+                children.erase( it );
+            }
+            // the tree knows the parent
+            wpdSimDevice_ObjectId( step.node, szObjectId, _countof(szObjectId) );
+            pEvent->objectId.assign( szObjectId );
+        }
+        else
+        if ( WPD_WATCH_EVENT_UPDATED == step.kind )
+        {
+            m_pDevice->nodes[step.node].dateModified += 1.0;
+            wpdSimDevice_ObjectId( step.node, szObjectId, _countof(szObjectId) );
+            pEvent->objectId.assign( szObjectId );
+        }
+        ::LeaveCriticalSection( &m_pDevice->cs );
+        return true;
+    }
+
+    // the patched tree holds what the device holds now, and the debounce windows came out as scripted
+    bool
+    verify( const WpdWatchTree& tree, const DWORD dwCountContent ) const
+    {
+        DWORD dwCountExpected = 0;
+        DWORD dwCountFolder = 0;
+        DWORD dwCountFile = 0;
+        wpdSimDevice_CountFilter( m_pDevice, &dwCountExpected, &dwCountFolder, &dwCountFile );
+        if ( m_next != m_steps.size()
+            || (DWORD)m_steps.size() != tree.dwCountEvent
+            || 2 != tree.dwCountRescan
+            || WPD_SIM_WATCH_BURST + 1 != tree.dwCountAdded
+            || 1 != tree.dwCountRemoved
+            || 1 != tree.dwCountUpdated
+            || dwCountExpected != dwCountContent )
+        {
+            LOGE( L"! Failed. watch script events=%u, rescans=%u, added=%u, removed=%u, updated=%u, objects=%u, expected %u, 2, %u, 1, 1, %u\n"
+                , tree.dwCountEvent
+                , tree.dwCountRescan
+                , tree.dwCountAdded
+                , tree.dwCountRemoved
+                , tree.dwCountUpdated
+                , dwCountContent
+                , (DWORD)m_steps.size()
+                , WPD_SIM_WATCH_BURST + 1
+                , dwCountExpected
+                );
+            return false;
+        }
+        return true;
+    }
+
+private:
+    WpdSimDevice*                   m_pDevice;
+    std::vector<WpdSimWatchStep>    m_steps;
+    size_t                          m_next;
+    DWORD                           m_dwDue;
+};
+
+// --alloc-stats has to count exactly what was allocated, nothing else runs yet
+bool
+wpdSimDevice_VerifyAllocCounters(
+    void
+)
+{
+    // every other block through the nothrow form, which has to be counted all the same
+    void* blocks[WPD_SIM_ALLOC_CHECK];
+    const LONG nCountHeapStart = s_nCountHeapAlloc;
+    const LONG nCountHeapThreadStart = s_nCountHeapAllocThread;
+    for ( DWORD index = 0; index < WPD_SIM_ALLOC_CHECK; ++index )
+    {
+        blocks[index] = (0 == index % 2)?(::operator new( 16 )):(::operator new( 16, std::nothrow ));
+    }
+    const LONG nCountHeap = s_nCountHeapAlloc - nCountHeapStart;
+    const LONG nCountHeapThread = s_nCountHeapAllocThread - nCountHeapThreadStart;
+    for ( DWORD index = 0; index < WPD_SIM_ALLOC_CHECK; ++index )
+    {
+        if ( 0 == index % 2 )
+        {
+            ::operator delete( blocks[index] );
+        }
+        else
+        {
+            ::operator delete( blocks[index], std::nothrow );
+        }
+        blocks[index] = NULL;
+    }
+
+    const LONG nCountCoTaskStart = s_nCountCoTaskAlloc;
+    for ( DWORD index = 0; index < WPD_SIM_ALLOC_CHECK; ++index )
+    {
+        blocks[index] = ::CoTaskMemAlloc( 16 );
+    }
+    const LONG nCountCoTask = s_nCountCoTaskAlloc - nCountCoTaskStart;
+    for ( DWORD index = 0; index < WPD_SIM_ALLOC_CHECK; ++index )
+    {
+        ::CoTaskMemFree( blocks[index] );
+        blocks[index] = NULL;
+    }
+
+    const bool result = (WPD_SIM_ALLOC_CHECK == (DWORD)nCountHeap && WPD_SIM_ALLOC_CHECK == (DWORD)nCountHeapThread && WPD_SIM_ALLOC_CHECK == (DWORD)nCountCoTask);
+    if ( false == result )
+    {
+        LOGE( L"! Failed. alloc counters saw heap=%ld, this thread %ld, CoTaskMem=%ld of %u blocks each\n", nCountHeap, nCountHeapThread, nCountCoTask, WPD_SIM_ALLOC_CHECK );
+    }
+    return result;
+}
+
+// the index-th of several simulated devices, all built alike but with their own PnP id and serial
+WpdSimDevice*
+wpdSimDevice_New(
+    const DWORD index
+)
+{
+    WpdSimDevice* pDevice = new WpdSimDevice();
+    pDevice->dwLatencyEnum = s_optSimLatency[0];
+    pDevice->dwLatencyNext = s_optSimLatency[1];
+    pDevice->dwLatencyNextPerId = s_optSimLatency[2];
+    pDevice->dwLatencyValues = s_optSimLatency[3];
+    wpdSimDevice_Init( pDevice );
+    if ( 0 < index )
+    {
+        WCHAR szText[32];
+        ::_snwprintf_s( szText, _countof(szText), _TRUNCATE, WPD_SIM_PNP_DEVICE_ID L"#%u", index + 1 );
+        pDevice->pnpDeviceId.assign( szText );
+        ::_snwprintf_s( szText, _countof(szText), _TRUNCATE, L"SIM-%04u", index + 1 );
+        pDevice->serial.assign( szText );
+    }
+    return pDevice;
+}
+
+// --sim-devices=<n>: n simulated devices scanned by the --jobs= pool as enumWPDcore scans real ones. every device
+// has its own session lock, so jobs overlap like phones on separate ports and only the processor is shared
+bool
+wpdSimulate_Devices(
+    WpdBenchResult* pResult
+)
+{
+    std::vector<WpdSimDevice*> devices;
+    for ( DWORD index = 0; index < s_optSimDevices; ++index )
+    {
+        devices.push_back( wpdSimDevice_New( index ) );
+    }
+
+    // the devices are built alike, each walk has to reach all objects of one
+    DWORD dwCountExpected = 0;
+    DWORD dwCountExpectedFolder = 0;
+    DWORD dwCountExpectedFile = 0;
+    wpdSimDevice_CountFilter( devices[0], &dwCountExpected, &dwCountExpectedFolder, &dwCountExpectedFile );
+    LOGI( L"Simulate   : %s, devices=%u, jobs=%u, objects=%u each\n", s_optSimulate, s_optSimDevices, s_optCountOfJobs, dwCountExpected );
+
+    s_simDevices = devices;
+    s_sessionPool.pfnOpen = wpdSimDevice_OpenPortableDevice;
+
+    bool resultAll = true;
+    DWORD dwCountObject = 0;
+    double dSeconds = 0.0;
+    WpdDeviceScan* pScanArray = new WpdDeviceScan[s_optSimDevices];
+    for ( DWORD run = 0; run < s_optSimRuns; ++run )
+    {
+        for ( DWORD index = 0; index < s_optSimDevices; ++index )
+        {
+            WpdDeviceScan& scan = pScanArray[index];
+            ::memset( &scan, 0, sizeof(scan) );
+            scan.pszPnPDeviceID = devices[index]->pnpDeviceId.c_str();
+            scan.index = index;
+            scan.dwCountWalk = 1;
+        }
+
+        const ULONGLONG qwTicksStart = wpdTicksNow();
+        wpdScanPool_Run( pScanArray, (LONG)s_optSimDevices );
+        const double dSecondsRun = wpdTicksToMicroseconds( wpdTicksNow() - qwTicksStart ) / 1000000.0;
+
+        DWORD dwCountObjectRun = 0;
+        for ( DWORD index = 0; index < s_optSimDevices; ++index )
+        {
+            const WpdDeviceScan& scan = pScanArray[index];
+            if ( false == scan.result || scan.dwCountContent != dwCountExpected )
+            {
+                LOGE( L"! Failed. simulated device %s walked %u objects, expected %u\n", scan.pszPnPDeviceID, scan.dwCountContent, dwCountExpected );
+                resultAll = false;
+            }
+            dwCountObjectRun += scan.dwCountContent;
+        }
+        LOGI( L"%3u: Simulated run, devices=%u, objects=%u, %.3fs\n", run, s_optSimDevices, dwCountObjectRun, dSecondsRun );
+        dwCountObject += dwCountObjectRun;
+        dSeconds += dSecondsRun;
+    }
+    delete [] pScanArray;
+    pScanArray = NULL;
+
+    WpdBenchResult result;
+    ::memset( &result, 0, sizeof(result) );
+    std::vector<LONG> folderMicroseconds;
+    for ( DWORD index = 0; index < s_optSimDevices; ++index )
+    {
+        WpdSimDevice* pDevice = devices[index];
+        wpdSessionPool_Close( pDevice->pnpDeviceId.c_str() );
+        result.dwCountFolder += pDevice->dwCountFolder;
+        result.nCountEnumObjects += pDevice->nCountEnumObjects;
+        result.nCountNext += pDevice->nCountNext;
+        result.nCountGetValues += pDevice->nCountGetValues;
+        result.nCountBulk += pDevice->nCountBulk;
+        for ( size_t node = 0; node < pDevice->folderMicroseconds.size(); ++node )
+        {
+            if ( 0 < pDevice->folderMicroseconds[node] )
+            {
+                folderMicroseconds.push_back( pDevice->folderMicroseconds[node] );
+            }
+        }
+    }
+    s_sessionPool.pfnOpen = wpdOpenPortableDevice;
+    s_simDevices.clear();
+    for ( DWORD index = 0; index < s_optSimDevices; ++index )
+    {
+        wpdSimDevice_Term( devices[index] );
+        delete devices[index];
+        devices[index] = NULL;
+    }
+
+    result.dwCountObject = dwCountObject;
+    result.dSeconds = dSeconds;
+    result.dObjectsPerSec = (0.0 < dSeconds)?(dwCountObject / dSeconds):(0.0);
+    result.dCallsPerObject = (0 < dwCountObject)
+        ?((double)(result.nCountEnumObjects + result.nCountNext + result.nCountGetValues + result.nCountBulk) / dwCountObject)
+        :(0.0);
+    if ( !folderMicroseconds.empty() )
+    {
+        std::sort( folderMicroseconds.begin(), folderMicroseconds.end() );
+        result.nFolderP50 = folderMicroseconds[(folderMicroseconds.size() - 1) * 50 / 100];
+        result.nFolderP99 = folderMicroseconds[(folderMicroseconds.size() - 1) * 99 / 100];
+    }
+
+    LOGI( L"Simulate   : %s, devices=%u, jobs=%u, objects=%u in %.3fs, %.1f objects/sec\n"
+        , (resultAll)?(L"ok"):(L"failed")
+        , s_optSimDevices
+        , s_optCountOfJobs
+        , result.dwCountObject
+        , result.dSeconds
+        , result.dObjectsPerSec
+        );
+    *pResult = result;
+    return resultAll;
+}
+
+bool
+wpdSimulate(
+    WpdBenchResult* pResult
+)
+{
+    if ( 1 < s_optSimDevices )
+    {
+        return wpdSimulate_Devices( pResult );
+    }
+
+    WpdSimDevice device;
+    device.dwLatencyEnum = s_optSimLatency[0];
+    device.dwLatencyNext = s_optSimLatency[1];
+    device.dwLatencyNextPerId = s_optSimLatency[2];
+    device.dwLatencyValues = s_optSimLatency[3];
+    wpdSimDevice_Init( &device );
+
+    LOGI( L"Simulate   : %s, objects=%u, folders=%u\n", s_optSimulate, (DWORD)device.nodes.size() - 1, device.dwCountFolder - 1 );
+
+    // what every full walk has to report, all objects unless --only= or --exclude-folders= prune some
+    DWORD dwCountExpected = 0;
+    DWORD dwCountExpectedFolder = 0;
+    DWORD dwCountExpectedFile = 0;
+    wpdSimDevice_CountFilter( &device, &dwCountExpected, &dwCountExpectedFolder, &dwCountExpectedFile );
+    if ( NULL != s_optOnly || NULL != s_optExcludeFolders )
+    {
+        LOGI( L"    Filter expects objects=%u, folders pruned=%u, files filtered=%u\n", dwCountExpected, dwCountExpectedFolder, dwCountExpectedFile );
+    }
+
+    // sessions of the simulated device come from the pool like real ones
+    s_simDevices.assign( 1, &device );
+    s_sessionPool.pfnOpen = wpdSimDevice_OpenPortableDevice;
+
+    // device info comes from the cache after the first run
+    WpdSimDeviceManager* pSimDeviceManager = new WpdSimDeviceManager();
+    std::vector<WCHAR> scratchDeviceInfo;
+    wpdDeviceInfoCache_Invalidate( WPD_SIM_PNP_DEVICE_ID );
+
+    WpdScratchPool scratchPool;
+    std::vector<LONG> folderMicroseconds;
+    bool resultAll = (false == s_optAllocStats || wpdSimDevice_VerifyAllocCounters());
+    DWORD dwCountObject = 0;
+    double dSeconds = 0.0;
+    // the first run fills --cache=, the ones after it measure what the cache saves
+    if ( NULL != s_optCacheDir )
+    {
+        std::wstring pathCache( s_optCacheDir );
+        if ( !pathCache.empty() && L'\\' != pathCache[pathCache.size()-1] && L'/' != pathCache[pathCache.size()-1] )
+        {
+            pathCache.push_back( L'\\' );
+        }
+        pathCache.append( device.serial );
+        pathCache.append( L".wpdcache" );
+        ::DeleteFileW( pathCache.c_str() );
+    }
+
+    for ( DWORD run = 0; run < s_optSimRuns; ++run )
+    {
+        if ( 0 < run && 0 < s_optSimChange )
+        {
+            LOGI( L"    Changed %u files\n", wpdSimDevice_Change( &device ) );
+        }
+
+        WpdDeviceScan scan;
+        ::memset( &scan, 0, sizeof(scan) );
+        scan.pszPnPDeviceID = WPD_SIM_PNP_DEVICE_ID;
+        scan.pScratchPool = &scratchPool;
+
+        dispDeviceInfo( pSimDeviceManager, scan.pszPnPDeviceID, &scratchDeviceInfo );
+
+        // the scan pays for its session like enumWPDcore does
+        const ULONGLONG qwTicksStart = wpdTicksNow();
+        WpdSession* pSession = wpdSessionPool_Acquire( scan.pszPnPDeviceID );
+        if ( NULL != pSession && NULL != s_optResolve )
+        {
+            // a fresh resolver per run, so every run starts cold
+            scan.result = wpdResolve_Run( pSession->pPortableDeviceContent, pSession->pPortableDeviceProperties, scan.pszPnPDeviceID );
+            wpdSessionPool_Release( pSession, scan.result );
+            pSession = NULL;
+        }
+        if ( NULL != pSession && NULL != s_optDownload )
+        {
+            std::vector<WpdDownloadJob> jobs;
+            scan.result = wpdDownload_Device( pSession, &scan, &jobs );
+            wpdSessionPool_Release( pSession, scan.result );
+            pSession = NULL;
+            scan.result = wpdSimDevice_VerifyDownload( &device, jobs ) && scan.result;
+        }
+        if ( NULL != pSession && s_optDedup )
+        {
+            scan.result = wpdDedup_Collect( pSession, &scan );
+            wpdSessionPool_Release( pSession, scan.result );
+            pSession = NULL;
+            wpdDedup_Run();
+        }
+        if ( NULL != pSession && s_optWatch )
+        {
+            // the script ends by taking the device away, the watch fails on that and the script decides
+            WpdSimEventScript script( &device );
+            WpdWatchTree tree;
+            wpdScanDevice_BeginTree( &scan );
+            wpdWatchDevice( pSession->pPortableDevice, pSession->pPortableDeviceContent, &scan, &script, &tree );
+            wpdScanDevice_EndTree( &scan, 0 );
+            scan.result = script.verify( tree, scan.dwCountContent );
+            wpdSessionPool_Release( pSession, scan.result );
+            pSession = NULL;
+        }
+        if ( NULL != pSession )
+        {
+            // a checkpoint of an earlier run would make this one a resume
+            if ( NULL != s_optResumeFile )
+            {
+                ::DeleteFileW( s_optResumeFile );
+            }
+            wpdScanDevice_BeginTree( &scan );
+            const LONG nCountDeviceHeapStart = device.nCountHeapAlloc;
+            const LONG nCountDeviceCoTaskStart = device.nCountCoTaskAlloc;
+            scan.result = wpdEnumContent( pSession->pPortableDeviceContent, pSession->pPortableDeviceProperties, &scan );
+            const LONG nCountDeviceHeap = device.nCountHeapAlloc - nCountDeviceHeapStart;
+            const LONG nCountDeviceCoTask = device.nCountCoTaskAlloc - nCountDeviceCoTaskStart;
+            // a walk --sim-kill= cut short goes on from its checkpoint on a fresh session, as a rerun with --resume= would
+            DWORD dwCountResume = 0;
+            while ( false == scan.result && NULL != s_optResumeFile && 0 < s_optSimKill && dwCountResume < WPD_SIM_RESUME_MAX )
+            {
+                dwCountResume += 1;
+                wpdSessionPool_Release( pSession, false );
+                pSession = wpdSessionPool_Acquire( scan.pszPnPDeviceID );
+                if ( NULL == pSession )
+                {
+                    break;
+                }
+                scan.result = wpdEnumContent( pSession->pPortableDeviceContent, pSession->pPortableDeviceProperties, &scan );
+            }
+            if ( 0 < dwCountResume )
+            {
+                LOGI( L"    Resumed %u times, objects=%u, expected %u\n", dwCountResume, scan.dwCountContent, dwCountExpected );
+            }
+            // the counters saw at least what the device allocated for the walk; the rest is the walk's own
+            if ( s_optAllocStats && 0 == dwCountResume )
+            {
+                const double dCount = (0 < scan.dwCountContent)?((double)scan.dwCountContent):(1.0);
+                LOGI( L"    Alloc walk heap=%ld (%.2f/object), CoTaskMem=%ld (%.2f/object), device heap=%ld, CoTaskMem=%ld\n"
+                    , scan.nCountHeapAlloc - nCountDeviceHeap
+                    , (scan.nCountHeapAlloc - nCountDeviceHeap) / dCount
+                    , scan.nCountCoTaskAlloc - nCountDeviceCoTask
+                    , (scan.nCountCoTaskAlloc - nCountDeviceCoTask) / dCount
+                    , nCountDeviceHeap
+                    , nCountDeviceCoTask
+                    );
+                if ( scan.nCountHeapAlloc < nCountDeviceHeap || scan.nCountCoTaskAlloc < nCountDeviceCoTask )
+                {
+                    LOGE( L"! Failed. alloc counters saw heap=%ld, CoTaskMem=%ld, the device alone allocated %ld, %ld\n"
+                        , scan.nCountHeapAlloc
+                        , scan.nCountCoTaskAlloc
+                        , nCountDeviceHeap
+                        , nCountDeviceCoTask
+                        );
+                    scan.result = false;
+                }
+            }
+            // resumed or not, filtered or not, the walk counts every object it reached once. a --cache= skip counts
+            // what it reused, only a cache of a filtered walk holds less than the device
+            if ( scan.result && (NULL == s_optCacheDir || (NULL == s_optOnly && NULL == s_optExcludeFolders))
+                && scan.dwCountContent != dwCountExpected )
+            {
+                LOGE( L"! Failed. simulated scan walked %u objects, expected %u\n", scan.dwCountContent, dwCountExpected );
+                scan.result = false;
+            }
+            // each pruned object was neither opened nor enumerated; a resumed walk only counts its last part
+            if ( scan.result && NULL == s_optCacheDir && NULL == s_optResumeFile
+                && (NULL != s_optOnly || NULL != s_optExcludeFolders)
+                && (scan.dwCountFilterFolder != dwCountExpectedFolder
+                    || scan.dwCountFilterFile != dwCountExpectedFile
+                    || scan.dwCountFilterEnumSaved != dwCountExpectedFolder + dwCountExpectedFile) )
+            {
+                LOGE( L"! Failed. simulated scan pruned folders=%u, filtered files=%u, EnumObjects saved=%u, expected %u, %u, %u\n"
+                    , scan.dwCountFilterFolder
+                    , scan.dwCountFilterFile
+                    , scan.dwCountFilterEnumSaved
+                    , dwCountExpectedFolder
+                    , dwCountExpectedFile
+                    , dwCountExpectedFolder + dwCountExpectedFile
+                    );
+                scan.result = false;
+            }
+            if ( scan.result && NULL != scan.pTreeStore && NULL == s_optCacheDir && NULL == s_optResumeFile )
+            {
+                scan.result = wpdSimDevice_VerifyTree( &device, scan.pTreeStore, NULL == s_optOnly && NULL == s_optExcludeFolders );
+            }
+            wpdScanDevice_EndTree( &scan, qwTicksStart );
+            // each walked object and the root had its properties handled once, however --bulk batched them.
+            // a --cache= skip or a --resume= walk counts objects it did not fetch
+            if ( scan.result && NULL == s_optCacheDir && NULL == s_optResumeFile
+                && scan.dwCountObjectValues != scan.dwCountContent + 1 )
+            {
+                LOGE( L"! Failed. simulated scan handled the properties of %u objects, walked %u\n", scan.dwCountObjectValues, scan.dwCountContent + 1 );
+                scan.result = false;
+            }
+            if ( NULL != pSession )
+            {
+                wpdSessionPool_Release( pSession, scan.result );
+                pSession = NULL;
+            }
+        }
+        const double dSecondsRun = wpdTicksToMicroseconds( wpdTicksNow() - qwTicksStart ) / 1000000.0;
+        LOGI( L"%3u: Simulated run, objects=%u, %.3fs\n", run, scan.dwCountContent, dSecondsRun );
+
+        resultAll = resultAll && scan.result;
+        dwCountObject += scan.dwCountContent;
+        dSeconds += dSecondsRun;
+
+        for ( size_t index = 0; index < device.nodes.size(); ++index )
+        {
+            if ( 0 < device.folderMicroseconds[index] )
+            {
+                folderMicroseconds.push_back( device.folderMicroseconds[index] );
+                device.folderMicroseconds[index] = 0;
+            }
+        }
+    }
+
+    wpdSessionPool_Close( WPD_SIM_PNP_DEVICE_ID );
+    s_sessionPool.pfnOpen = wpdOpenPortableDevice;
+    s_simDevices.clear();
+    wpdScratchPool_Term( &scratchPool );
+
+    const LONG nCountManagerCall = pSimDeviceManager->CountCall();
+    pSimDeviceManager->Release();
+    pSimDeviceManager = NULL;
+
+    WpdBenchResult result;
+    ::memset( &result, 0, sizeof(result) );
+    result.dwCountObject = dwCountObject;
+    result.dwCountFolder = device.dwCountFolder;
+    result.dSeconds = dSeconds;
+    result.dObjectsPerSec = (0.0 < dSeconds)?(dwCountObject / dSeconds):(0.0);
+    result.nCountEnumObjects = device.nCountEnumObjects;
+    result.nCountNext = device.nCountNext;
+    result.nCountGetValues = device.nCountGetValues;
+    result.nCountBulk = device.nCountBulk;
+    result.dCallsPerObject = (0 < dwCountObject)
+        ?((double)(result.nCountEnumObjects + result.nCountNext + result.nCountGetValues + result.nCountBulk) / dwCountObject)
+        :(0.0);
+
+    {
+        if ( !folderMicroseconds.empty() )
+        {
+            std::sort( folderMicroseconds.begin(), folderMicroseconds.end() );
+            result.nFolderP50 = folderMicroseconds[(folderMicroseconds.size() - 1) * 50 / 100];
+            result.nFolderP99 = folderMicroseconds[(folderMicroseconds.size() - 1) * 99 / 100];
+        }
+    }
+
+    {
+        PROCESS_MEMORY_COUNTERS counters;
+        ::memset( &counters, 0, sizeof(counters) );
+        counters.cb = sizeof(counters);
+        if ( ::GetProcessMemoryInfo( ::GetCurrentProcess(), &counters, sizeof(counters) ) )
+        {
+            result.qwPeakWorkingSet = counters.PeakWorkingSetSize;
+            result.qwPeakPrivate = counters.PeakPagefileUsage;
+        }
+    }
+
+    LOGI( L"Simulate   : %s, objects=%u in %.3fs, %.1f objects/sec\n"
+        , (resultAll)?(L"ok"):(L"failed")
+        , result.dwCountObject
+        , result.dSeconds
+        , result.dObjectsPerSec
+        );
+    LOGI( L"    Calls EnumObjects=%ld, Next=%ld, GetValues=%ld, Bulk=%ld, %.3f/object\n"
+        , result.nCountEnumObjects
+        , result.nCountNext
+        , result.nCountGetValues
+        , result.nCountBulk
+        , result.dCallsPerObject
+        );
+    LOGI( L"    Folder device time p50=%ldus, p99=%ldus\n", result.nFolderP50, result.nFolderP99 );
+    LOGI( L"    Device info manager calls=%ld for %u runs\n", nCountManagerCall, s_optSimRuns );
+    LOGI( L"    Peak working set=%I64u, private=%I64u\n", result.qwPeakWorkingSet, result.qwPeakPrivate );
+
+    if ( s_optStats )
+    {
+        // every device call paid one Begin/End pair
+        const double dCostPerCall = wpdStats_Calibrate();
+        const double dCountCall = (double)(result.nCountEnumObjects + result.nCountNext + result.nCountGetValues);
+        result.dStatsOverhead = (0.0 < dSeconds)?(dCostPerCall * dCountCall * 100.0 / (dSeconds * 1000000.0)):(0.0);
+        LOGI( L"    Stats overhead %.3fus/call, %.4f%% of the scan\n", dCostPerCall, result.dStatsOverhead );
+    }
+
+    wpdSimDevice_Term( &device );
+    *pResult = result;
+    return resultAll;
+}
+
+// --sim-compare=<what>: the simulated device walked once per setting, the first one the baseline of the others
+struct WpdSimVariant
+{
+    std::wstring    name;
+    bool            result;
+    WpdBenchResult  bench;
+};
+
+void
+wpdSimCompare_Add(
+    std::vector<WpdSimVariant>* pVariants
+    , LPCWSTR pszName
+)
+{
+    LOGI( L"Compare    : %s\n", pszName );
+    WpdSimVariant variant;
+    variant.name.assign( pszName );
+    variant.result = wpdSimulate( &variant.bench );
+    pVariants->push_back( variant );
+}
+
+// per object GetValues against batches of --bulk-batch= objects
+bool
+wpdSimCompare_Bulk(
+    std::vector<WpdSimVariant>* pVariants
+)
+{
+    const bool useBulk = s_optUseBulk;
+    s_optUseBulk = false;
+    wpdSimCompare_Add( pVariants, L"per-object" );
+    s_optUseBulk = true;
+    wpdSimCompare_Add( pVariants, L"bulk" );
+    s_optUseBulk = useBulk;
+
+    const WpdBenchResult& perObject = (*pVariants)[0].bench;
+    const WpdBenchResult& bulk = (*pVariants)[1].bench;
+    if ( bulk.dwCountObject != perObject.dwCountObject )
+    {
+        LOGE( L"! Failed. bulk walked %u objects, per object %u\n", bulk.dwCountObject, perObject.dwCountObject );
+        return false;
+    }
+    // a batch stands for up to --bulk-batch= GetValues, only the root and refetches stay single
+    if ( perObject.nCountGetValues <= bulk.nCountGetValues + bulk.nCountBulk )
+    {
+        LOGE( L"! Failed. bulk made %ld property calls, per object %ld\n", bulk.nCountGetValues + bulk.nCountBulk, perObject.nCountGetValues );
+        return false;
+    }
+    return true;
+}
+
+// the --sim-devices= devices, default 4, one after the other and then by --jobs= workers, default one per device
+bool
+wpdSimCompare_Jobs(
+    std::vector<WpdSimVariant>* pVariants
+)
+{
+    const DWORD dwCountDevice = s_optSimDevices;
+    const DWORD dwCountJob = s_optCountOfJobs;
+    s_optSimDevices = (1 < dwCountDevice)?(dwCountDevice):(4U);
+    s_optCountOfJobs = 1;
+    wpdSimCompare_Add( pVariants, L"jobs=1" );
+    s_optCountOfJobs = (1 < dwCountJob)?(dwCountJob):(s_optSimDevices);
+    WCHAR szName[32];
+    ::_snwprintf_s( szName, _countof(szName), _TRUNCATE, L"jobs=%u", s_optCountOfJobs );
+    wpdSimCompare_Add( pVariants, szName );
+    s_optSimDevices = dwCountDevice;
+    s_optCountOfJobs = dwCountJob;
+
+    const WpdBenchResult& serial = (*pVariants)[0].bench;
+    const WpdBenchResult& parallel = (*pVariants)[1].bench;
+    if ( parallel.dwCountObject != serial.dwCountObject )
+    {
+        LOGE( L"! Failed. %s walked %u objects, jobs=1 %u\n", (*pVariants)[1].name.c_str(), parallel.dwCountObject, serial.dwCountObject );
+        return false;
+    }
+    return true;
+}
+
+// --walkers= 1, 2, 4 and 8 over the one device. every walker has a session, but the sessions of a simulated
+// device take turns like MTP transactions do, so the walkers gain only what the walk spends between round trips
+bool
+wpdSimCompare_Walkers(
+    std::vector<WpdSimVariant>* pVariants
+)
+{
+    if ( NULL != s_optResumeFile || NULL != s_optCacheDir )
+    {
+        LOGE( L"! Failed. --sim-compare=walkers walks with one walker under --resume= or --cache=\n" );
+        return false;
+    }
+
+    const DWORD dwCountWalker = s_optCountOfWalkers;
+    for ( DWORD dwWalkers = 1; dwWalkers <= 8; dwWalkers *= 2 )
+    {
+        s_optCountOfWalkers = dwWalkers;
+        WCHAR szName[32];
+        ::_snwprintf_s( szName, _countof(szName), _TRUNCATE, L"walkers=%u", dwWalkers );
+        wpdSimCompare_Add( pVariants, szName );
+    }
+    s_optCountOfWalkers = dwCountWalker;
+
+    bool result = true;
+    for ( size_t index = 1; index < pVariants->size(); ++index )
+    {
+        const WpdSimVariant& variant = (*pVariants)[index];
+        if ( variant.bench.dwCountObject != (*pVariants)[0].bench.dwCountObject )
+        {
+            LOGE( L"! Failed. %s walked %u objects, walkers=1 %u\n", variant.name.c_str(), variant.bench.dwCountObject, (*pVariants)[0].bench.dwCountObject );
+            result = false;
+        }
+    }
+    return result;
+}
+
+// --fetch= as given, --fetch= at --fetch-max= and --fetch=auto starting from --fetch=
+bool
+wpdSimCompare_Fetch(
+    std::vector<WpdSimVariant>* pVariants
+)
+{
+    const bool adaptiveFetch = s_optAdaptiveFetch;
+    const DWORD dwCountFetch = s_optCountOfFetch;
+    WCHAR szName[32];
+    s_optAdaptiveFetch = false;
+    ::_snwprintf_s( szName, _countof(szName), _TRUNCATE, L"fetch=%u", dwCountFetch );
+    wpdSimCompare_Add( pVariants, szName );
+    s_optCountOfFetch = s_optCountOfFetchMax;
+    ::_snwprintf_s( szName, _countof(szName), _TRUNCATE, L"fetch=%u", s_optCountOfFetchMax );
+    wpdSimCompare_Add( pVariants, szName );
+    s_optCountOfFetch = dwCountFetch;
+    s_optAdaptiveFetch = true;
+    wpdSimCompare_Add( pVariants, L"fetch=auto" );
+    s_optAdaptiveFetch = adaptiveFetch;
+
+    bool result = true;
+    for ( size_t index = 1; index < pVariants->size(); ++index )
+    {
+        const WpdSimVariant& variant = (*pVariants)[index];
+        if ( variant.bench.dwCountObject != (*pVariants)[0].bench.dwCountObject )
+        {
+            LOGE( L"! Failed. %s walked %u objects, %s %u\n", variant.name.c_str(), variant.bench.dwCountObject, (*pVariants)[0].name.c_str(), (*pVariants)[0].bench.dwCountObject );
+            result = false;
+        }
+    }
+    return result;
+}
+
+void
+wpdSimCompare_Run(
+    void
+)
+{
+    std::vector<WpdSimVariant> variants;
+    bool result = false;
+    if ( 0 == ::wcscmp( s_optSimCompare, L"bulk" ) )
+    {
+        result = wpdSimCompare_Bulk( &variants );
+    }
+    else
+    if ( 0 == ::wcscmp( s_optSimCompare, L"jobs" ) )
+    {
+        result = wpdSimCompare_Jobs( &variants );
+    }
+    else
+    if ( 0 == ::wcscmp( s_optSimCompare, L"walkers" ) )
+    {
+        result = wpdSimCompare_Walkers( &variants );
+    }
+    else
+    if ( 0 == ::wcscmp( s_optSimCompare, L"fetch" ) )
+    {
+        result = wpdSimCompare_Fetch( &variants );
+    }
+    else
+    {
+        LOGE( L"! Failed. unknown --sim-compare=%s\n", s_optSimCompare );
+        return;
+    }
+
+    for ( size_t index = 0; index < variants.size(); ++index )
+    {
+        const WpdSimVariant& variant = variants[index];
+        result = result && variant.result;
+        LOGI( L"    %-12s objects=%u in %.3fs, %.1f objects/sec, x%.2f, calls EnumObjects=%ld, Next=%ld, GetValues=%ld, Bulk=%ld, %.3f/object\n"
+            , variant.name.c_str()
+            , variant.bench.dwCountObject
+            , variant.bench.dSeconds
+            , variant.bench.dObjectsPerSec
+            , (0.0 < variant.bench.dSeconds)?(variants[0].bench.dSeconds / variant.bench.dSeconds):(0.0)
+            , variant.bench.nCountEnumObjects
+            , variant.bench.nCountNext
+            , variant.bench.nCountGetValues
+            , variant.bench.nCountBulk
+            , variant.bench.dCallsPerObject
+            );
+    }
+    LOGI( L"Compare    : %s, %s\n", s_optSimCompare, (result)?(L"ok"):(L"failed") );
+}
+
+// --daemon: device trees stay resident and are served over a local named pipe, rescanned every --daemon-refresh= seconds.
+// requests and responses are UTF-16 messages; a response starts with "ok" or "error <reason>".
+//   devices | ls <device> [path] | stat <device> [path] | du <device> [path] | quit
+// <device> is the index shown by "devices" or the PnP id, path components are names separated by '\' or '/'
+#if !defined(PIPE_REJECT_REMOTE_CLIENTS)
+#define PIPE_REJECT_REMOTE_CLIENTS  (0x00000008)
+#endif
+
+#define WPD_DAEMON_PIPE_PREFIX      L"\\\\.\\pipe\\"
+#define WPD_DAEMON_PIPE_DEFAULT     L"test_enum_wpd"
+#define WPD_DAEMON_REQUEST_MAX      (4096U)
+#define WPD_DAEMON_BUFFER_SIZE      (64U * 1024U)
+// how many paths the load test learns from the daemon before it starts
+#define WPD_DAEMON_LOAD_PATH_MAX    (4096U)
+
+// a published tree is only read; a refresh builds the next one next to it and swaps
+struct WpdDaemonTree
+{
+    WpdTreeStore            store;
+    UINT32                  dwRoot;
+    std::vector<ULONGLONG>  subtreeBytes;       // the node and everything below
+    std::vector<UINT32>     subtreeObjects;     // below the node
+    std::vector<UINT32>     subtreeFolders;
+    ULONGLONG               qwTicksBuilt;
+    double                  dMicrosecondsScan;
+    volatile LONG           nRef;
+};
+
+struct WpdDaemonDevice
+{
+    std::wstring    pnpDeviceId;
+    WpdDaemonTree*  pTree;
+    DWORD           dwCountRefresh;
+};
+
+struct WpdDaemon
+{
+    std::wstring                    pipeName;
+    IPortableDeviceManager*         pPortableDeviceManager;
+    CRITICAL_SECTION                cs;
+    std::vector<WpdDaemonDevice>    devices;
+    HANDLE                          hEventStop;
+    HANDLE                          hThreadRefresh;
+    std::vector<HANDLE>             servers;
+    volatile LONG                   nCountConnection;
+    volatile LONG                   nCountQuery;
+    volatile LONG                   nCountError;
+    volatile LONG                   nCountRefresh;
+};
+
+void
+wpdDaemon_PipeName(
+    std::wstring* pPipeName
+)
+{
+    LPCWSTR pszName = (NULL != s_optPipe)?(s_optPipe):(WPD_DAEMON_PIPE_DEFAULT);
+    pPipeName->clear();
+    if ( 0 != ::wcsncmp( pszName, L"\\\\", 2 ) )
+    {
+        pPipeName->assign( WPD_DAEMON_PIPE_PREFIX );
+    }
+    pPipeName->append( pszName );
+}
+
+void
+wpdDaemonTree_Release(
+    WpdDaemonTree* pTree
+)
+{
+    if ( NULL == pTree )
+    {
+        return;
+    }
+    if ( 0 == ::InterlockedDecrement( &pTree->nRef ) )
+    {
+        wpdTreeStore_Term( &pTree->store );
+        delete pTree;
+    }
+}
+
+bool
+wpdDaemonTree_IsFolder(
+    const WpdDaemonTree* pTree
+    , const UINT32 dwNode
+)
+{
+    return 0 != pTree->store.folder[dwNode] || WPD_HANDLE_NONE != pTree->store.firstChild[dwNode];
+}
+
+LPCWSTR
+wpdDaemonTree_Name(
+    const WpdDaemonTree* pTree
+    , const UINT32 dwNode
+)
+{
+    LPCWSTR pszName = wpdArena_Get( &pTree->store.strings, pTree->store.name[dwNode] );
+    if ( NULL == pszName )
+    {
+        pszName = wpdArena_Get( &pTree->store.strings, pTree->store.objectId[dwNode] );
+    }
+    return pszName;
+}
+
+// du answers from these without walking
+void
+wpdDaemonTree_Totals(
+    WpdDaemonTree* pTree
+)
+{
+    const WpdTreeStore* pStore = &pTree->store;
+    const UINT32 dwCount = wpdTreeStore_Count( pStore );
+    pTree->subtreeBytes.assign( dwCount, 0 );
+    pTree->subtreeObjects.assign( dwCount, 0 );
+    pTree->subtreeFolders.assign( dwCount, 0 );
+
+    // walking the parent first order backwards finishes every child before its parent
+    std::vector<UINT32> order;
+    wpdTreeStore_Order( pStore, &order );
+    for ( size_t index = order.size(); 0 < index--; )
+    {
+        const UINT32 dwNode = order[index];
+        pTree->subtreeBytes[dwNode] += pStore->size[dwNode];
+        const UINT32 dwParent = pStore->parent[dwNode];
+        if ( WPD_HANDLE_NONE == dwParent )
+        {
+            continue;
+        }
+        pTree->subtreeBytes[dwParent] += pTree->subtreeBytes[dwNode];
+        pTree->subtreeObjects[dwParent] += pTree->subtreeObjects[dwNode] + 1;
+        pTree->subtreeFolders[dwParent] += pTree->subtreeFolders[dwNode] + ((wpdDaemonTree_IsFolder( pTree, dwNode ))?(1):(0));
+    }
+}
+
+// node of path below the device object, WPD_HANDLE_NONE when there is none
+UINT32
+wpdDaemonTree_Resolve(
+    const WpdDaemonTree* pTree
+    , const std::wstring& path
+)
+{
+    const WpdTreeStore* pStore = &pTree->store;
+    UINT32 dwNode = pTree->dwRoot;
+    size_t pos = 0;
+    while ( WPD_HANDLE_NONE != dwNode && pos < path.size() )
+    {
+        size_t end = path.find_first_of( L"\\/", pos );
+        if ( std::wstring::npos == end )
+        {
+            end = path.size();
+        }
+        const size_t len = end - pos;
+        LPCWSTR pszComponent = path.c_str() + pos;
+        pos = end + 1;
+        if ( 0 == len || (1 == len && L'.' == pszComponent[0]) )
+        {
+            continue;
+        }
+
+        UINT32 dwChild = pStore->firstChild[dwNode];
+        for ( ; WPD_HANDLE_NONE != dwChild; dwChild = pStore->nextSibling[dwChild] )
+        {
+            LPCWSTR pszName = wpdDaemonTree_Name( pTree, dwChild );
+            if ( NULL != pszName && 0 == ::_wcsnicmp( pszName, pszComponent, len ) && L'\0' == pszName[len] )
+            {
+                break;
+            }
+        }
+        dwNode = dwChild;
+    }
+    return dwNode;
+}
+
+// one walk of the device into a tree of its own, NULL when the walk failed
+WpdDaemonTree*
+wpdDaemon_Scan(
+    LPCWSTR pszPnPDeviceID
+    , WpdScratchPool* pScratchPool
+)
+{
+    WpdDaemonTree* pTree = new WpdDaemonTree();
+    wpdTreeStore_Init( &pTree->store );
+    pTree->dwRoot = WPD_HANDLE_NONE;
+    pTree->qwTicksBuilt = 0;
+    pTree->dMicrosecondsScan = 0.0;
+    pTree->nRef = 1;
+
+    WpdDeviceScan scan;
+    ::memset( &scan, 0, sizeof(scan) );
+    scan.pszPnPDeviceID = pszPnPDeviceID;
+    scan.pTreeStore = &pTree->store;
+    scan.pScratchPool = pScratchPool;
+
+    const ULONGLONG qwTicksStart = wpdTicksNow();
+    WpdSession* pSession = wpdSessionPool_Acquire( pszPnPDeviceID );
+    if ( NULL != pSession )
+    {
+        scan.result = wpdEnumContent( pSession->pPortableDeviceContent, pSession->pPortableDeviceProperties, &scan );
+        wpdSessionPool_Release( pSession, scan.result );
+        pSession = NULL;
+    }
+    if ( false == scan.result )
+    {
+        wpdDaemonTree_Release( pTree );
+        return NULL;
+    }
+
+    pTree->dwRoot = wpdTreeStore_Find( &pTree->store, WPD_DEVICE_OBJECT_ID );
+    wpdDaemonTree_Totals( pTree );
+    pTree->qwTicksBuilt = wpdTicksNow();
+    pTree->dMicrosecondsScan = wpdTicksToMicroseconds( pTree->qwTicksBuilt - qwTicksStart );
+    return pTree;
+}
+
+// rescan every listed device; a device whose walk fails keeps the tree it had
+void
+wpdDaemon_Refresh(
+    WpdDaemon* pDaemon
+    , WpdScratchPool* pScratchPool
+)
+{
+    IPortableDeviceManager* pPortableDeviceManager = pDaemon->pPortableDeviceManager;
+    {
+        const HRESULT hr = pPortableDeviceManager->RefreshDeviceList();
+        if ( FAILED(hr) )
+        {
+            LOGE( L"! Failed. IPortableDeviceManager::RefreshDeviceList, hr=0x%08x\n", hr );
+        }
+    }
+
+    DWORD dwCountDeviceId = 0;
+    {
+        const HRESULT hr = pPortableDeviceManager->GetDevices( NULL, &dwCountDeviceId );
+        if ( FAILED(hr) )
+        {
+            LOGE( L"! Failed. IPortableDeviceManager::GetDevices get count, hr=0x%08x\n", hr );
+            return;
+        }
+    }
+    std::vector<LPWSTR> deviceIds( dwCountDeviceId, NULL );
+    if ( 0 < dwCountDeviceId )
+    {
+        const HRESULT hr = pPortableDeviceManager->GetDevices( &deviceIds[0], &dwCountDeviceId );
+        if ( FAILED(hr) )
+        {
+            LOGE( L"! Failed. IPortableDeviceManager::GetDevices get id and count, hr=0x%08x\n", hr );
+            return;
+        }
+    }
+
+    std::set<std::wstring> present;
+    for ( DWORD index = 0; index < dwCountDeviceId; ++index )
+    {
+        if ( NULL == deviceIds[index] )
+        {
+            continue;
+        }
+        present.insert( deviceIds[index] );
+
+        WpdDaemonTree* pTree = wpdDaemon_Scan( deviceIds[index], pScratchPool );
+        if ( NULL != pTree )
+        {
+            LOGI( L"Daemon     : %s, objects=%u, %.3f sec\n"
+                , deviceIds[index]
+                , wpdTreeStore_Count( &pTree->store )
+                , pTree->dMicrosecondsScan / 1000000.0
+                );
+
+            WpdDaemonTree* pTreeOld = NULL;
+            ::EnterCriticalSection( &pDaemon->cs );
+            {
+                size_t indexDevice = 0;
+                for ( ; indexDevice < pDaemon->devices.size(); ++indexDevice )
+                {
+                    if ( pDaemon->devices[indexDevice].pnpDeviceId == deviceIds[index] )
+                    {
+                        break;
+                    }
+                }
+                if ( pDaemon->devices.size() == indexDevice )
+                {
+                    WpdDaemonDevice device;
+                    device.pnpDeviceId.assign( deviceIds[index] );
+                    device.pTree = NULL;
+                    device.dwCountRefresh = 0;
+                    pDaemon->devices.push_back( device );
+                }
+                WpdDaemonDevice& device = pDaemon->devices[indexDevice];
+                pTreeOld = device.pTree;
+                device.pTree = pTree;
+                device.dwCountRefresh += 1;
+            }
+            ::LeaveCriticalSection( &pDaemon->cs );
+
+            // readers still holding the old tree keep it alive
+            wpdDaemonTree_Release( pTreeOld );
+            pTreeOld = NULL;
+        }
+
+        ::CoTaskMemFree( deviceIds[index] );
+        deviceIds[index] = NULL;
+    }
+
+    std::vector<WpdDaemonDevice> removed;
+    ::EnterCriticalSection( &pDaemon->cs );
+    for ( size_t index = 0; index < pDaemon->devices.size(); )
+    {
+        if ( present.end() == present.find( pDaemon->devices[index].pnpDeviceId ) )
+        {
+            removed.push_back( pDaemon->devices[index] );
+            pDaemon->devices.erase( pDaemon->devices.begin() + index );
+        }
+        else
+        {
+            ++index;
+        }
+    }
+    ::LeaveCriticalSection( &pDaemon->cs );
+
+    for ( size_t index = 0; index < removed.size(); ++index )
+    {
+        LOGI( L"Daemon     : %s, removed\n", removed[index].pnpDeviceId.c_str() );
+        wpdDaemonTree_Release( removed[index].pTree );
+        removed[index].pTree = NULL;
+        wpdSessionPool_Close( removed[index].pnpDeviceId.c_str() );
+    }
+
+    ::InterlockedIncrement( &pDaemon->nCountRefresh );
+}
+
+unsigned __stdcall
+wpdDaemon_RefreshThread( void* pParam )
+{
+    WpdDaemon* pDaemon = reinterpret_cast<WpdDaemon*>(pParam);
+    if ( NULL == pDaemon )
+    {
+        return 1;
+    }
+
+    bool needCoUninitialize = false;
+    {
+        const DWORD dwCoInit = COINIT_MULTITHREADED | COINIT_DISABLE_OLE1DDE;
+        const HRESULT hr = ::CoInitializeEx( NULL, dwCoInit );
+        if ( FAILED(hr) )
+        {
+            LOGE( L"! Failed. refresh CoInitializeEx, hr=0x%08x\n", hr );
+            return 1;
+        }
+        needCoUninitialize = true;
+    }
+
+    WpdScratchPool scratchPool;
+    while ( WAIT_TIMEOUT == ::WaitForSingleObject( pDaemon->hEventStop, s_optDaemonRefresh * 1000U ) )
+    {
+        wpdDaemon_Refresh( pDaemon, &scratchPool );
+    }
+    wpdScratchPool_Term( &scratchPool );
+
+    if ( needCoUninitialize )
+    {
+        ::CoUninitialize();
+    }
+
+    return 0;
+}
+
+// tree of a device by index or PnP id, AddRef'd; NULL when unknown or not scanned yet
+WpdDaemonTree*
+wpdDaemon_AcquireTree(
+    WpdDaemon* pDaemon
+    , const std::wstring& device
+)
+{
+    WpdDaemonTree* pTree = NULL;
+    ::EnterCriticalSection( &pDaemon->cs );
+    {
+        size_t indexDevice = pDaemon->devices.size();
+        if ( !device.empty() && std::wstring::npos == device.find_first_not_of( L"0123456789" ) )
+        {
+            indexDevice = (size_t)::wcstoul( device.c_str(), NULL, 10 );
+        }
+        else
+        {
+            for ( indexDevice = 0; indexDevice < pDaemon->devices.size(); ++indexDevice )
+            {
+                if ( 0 == ::_wcsicmp( pDaemon->devices[indexDevice].pnpDeviceId.c_str(), device.c_str() ) )
+                {
+                    break;
+                }
+            }
+        }
+        if ( indexDevice < pDaemon->devices.size() )
+        {
+            pTree = pDaemon->devices[indexDevice].pTree;
+            if ( NULL != pTree )
+            {
+                ::InterlockedIncrement( &pTree->nRef );
+            }
+        }
+    }
+    ::LeaveCriticalSection( &pDaemon->cs );
+    return pTree;
+}
+
+// word at *pPos, *pPos moves past it and the blanks after it
+void
+wpdDaemon_NextToken(
+    const std::wstring& text
+    , size_t* pPos
+    , std::wstring* pToken
+)
+{
+    size_t end = text.find_first_of( L" \t", *pPos );
+    if ( std::wstring::npos == end )
+    {
+        end = text.size();
+    }
+    pToken->assign( text, *pPos, end - *pPos );
+    *pPos = text.find_first_not_of( L" \t", end );
+    if ( std::wstring::npos == *pPos )
+    {
+        *pPos = text.size();
+    }
+}
+
+void
+wpdDaemon_AppendNumber(
+    std::wstring* pResponse
+    , const ULONGLONG qwValue
+)
+{
+    WCHAR szValue[32];
+    ::_snwprintf_s( szValue, _countof(szValue), _TRUNCATE, L"%I64u", qwValue );
+    pResponse->append( szValue );
+}
+
+// false when the request asked the daemon to stop
+bool
+wpdDaemon_Handle(
+    WpdDaemon* pDaemon
+    , const std::wstring& request
+    , std::wstring* pResponse
+)
+{
+    pResponse->clear();
+
+    size_t pos = request.find_first_not_of( L" \t" );
+    if ( std::wstring::npos == pos )
+    {
+        pos = request.size();
+    }
+    std::wstring verb;
+    std::wstring device;
+    wpdDaemon_NextToken( request, &pos, &verb );
+    wpdDaemon_NextToken( request, &pos, &device );
+    std::wstring path( request, pos, std::wstring::npos );
+    while ( !path.empty() && (L'\r' == path[path.size() - 1] || L'\n' == path[path.size() - 1]) )
+    {
+        path.erase( path.size() - 1 );
+    }
+
+    if ( L"quit" == verb )
+    {
+        pResponse->assign( L"ok\n" );
+        return false;
+    }
+
+    if ( L"devices" == verb )
+    {
+        ::EnterCriticalSection( &pDaemon->cs );
+        // every published tree was built before this
+        const ULONGLONG qwTicksNow = wpdTicksNow();
+        pResponse->assign( L"ok " );
+        wpdDaemon_AppendNumber( pResponse, pDaemon->devices.size() );
+        pResponse->push_back( L'\n' );
+        for ( size_t index = 0; index < pDaemon->devices.size(); ++index )
+        {
+            const WpdDaemonDevice& entry = pDaemon->devices[index];
+            wpdDaemon_AppendNumber( pResponse, index );
+            pResponse->push_back( L'\t' );
+            wpdDaemon_AppendNumber( pResponse, (NULL != entry.pTree)?(wpdTreeStore_Count( &entry.pTree->store )):(0) );
+            pResponse->push_back( L'\t' );
+            wpdDaemon_AppendNumber( pResponse, (NULL != entry.pTree)?((ULONGLONG)(wpdTicksToMicroseconds( qwTicksNow - entry.pTree->qwTicksBuilt ) / 1000000.0)):(0) );
+            pResponse->push_back( L'\t' );
+            pResponse->append( entry.pnpDeviceId );
+            pResponse->push_back( L'\n' );
+        }
+        ::LeaveCriticalSection( &pDaemon->cs );
+        return true;
+    }
+
+    if ( L"ls" != verb && L"stat" != verb && L"du" != verb )
+    {
+        pResponse->assign( L"error unknown request\n" );
+        return true;
+    }
+
+    WpdDaemonTree* pTree = wpdDaemon_AcquireTree( pDaemon, device );
+    if ( NULL == pTree )
+    {
+        pResponse->assign( L"error no such device\n" );
+        return true;
+    }
+
+    const WpdTreeStore* pStore = &pTree->store;
+    const UINT32 dwNode = wpdDaemonTree_Resolve( pTree, path );
+    if ( WPD_HANDLE_NONE == dwNode )
+    {
+        pResponse->assign( L"error no such path\n" );
+    }
+    else
+    if ( L"ls" == verb )
+    {
+        if ( false == wpdDaemonTree_IsFolder( pTree, dwNode ) )
+        {
+            pResponse->assign( L"error not a folder\n" );
+        }
+        else
+        {
+            DWORD dwCountChild = 0;
+            for ( UINT32 dwChild = pStore->firstChild[dwNode]; WPD_HANDLE_NONE != dwChild; dwChild = pStore->nextSibling[dwChild] )
+            {
+                dwCountChild += 1;
+            }
+            pResponse->assign( L"ok " );
+            wpdDaemon_AppendNumber( pResponse, dwCountChild );
+            pResponse->push_back( L'\n' );
+            for ( UINT32 dwChild = pStore->firstChild[dwNode]; WPD_HANDLE_NONE != dwChild; dwChild = pStore->nextSibling[dwChild] )
+            {
+                pResponse->append( (wpdDaemonTree_IsFolder( pTree, dwChild ))?(L"d\t"):(L"f\t") );
+                wpdDaemon_AppendNumber( pResponse, pTree->subtreeBytes[dwChild] );
+                pResponse->push_back( L'\t' );
+                pResponse->append( wpdDaemonTree_Name( pTree, dwChild ) );
+                pResponse->push_back( L'\n' );
+            }
+        }
+    }
+    else
+    if ( L"stat" == verb )
+    {
+        DWORD dwCountChild = 0;
+        for ( UINT32 dwChild = pStore->firstChild[dwNode]; WPD_HANDLE_NONE != dwChild; dwChild = pStore->nextSibling[dwChild] )
+        {
+            dwCountChild += 1;
+        }
+        pResponse->assign( L"ok\ntype\t" );
+        pResponse->append( (wpdDaemonTree_IsFolder( pTree, dwNode ))?(L"folder"):(L"file") );
+        pResponse->append( L"\nsize\t" );
+        wpdDaemon_AppendNumber( pResponse, pStore->size[dwNode] );
+        pResponse->append( L"\nchildren\t" );
+        wpdDaemon_AppendNumber( pResponse, dwCountChild );
+        pResponse->append( L"\nname\t" );
+        pResponse->append( wpdDaemonTree_Name( pTree, dwNode ) );
+        pResponse->append( L"\nid\t" );
+        pResponse->append( wpdArena_Get( &pStore->strings, pStore->objectId[dwNode] ) );
+        pResponse->push_back( L'\n' );
+    }
+    else
+    {
+        const UINT32 dwCountObject = pTree->subtreeObjects[dwNode];
+        const UINT32 dwCountFolder = pTree->subtreeFolders[dwNode];
+        pResponse->assign( L"ok\nobjects\t" );
+        wpdDaemon_AppendNumber( pResponse, dwCountObject );
+        pResponse->append( L"\nfolders\t" );
+        wpdDaemon_AppendNumber( pResponse, dwCountFolder );
+        pResponse->append( L"\nfiles\t" );
+        wpdDaemon_AppendNumber( pResponse, dwCountObject - dwCountFolder );
+        pResponse->append( L"\nbytes\t" );
+        wpdDaemon_AppendNumber( pResponse, pTree->subtreeBytes[dwNode] );
+        pResponse->push_back( L'\n' );
+    }
+
+    wpdDaemonTree_Release( pTree );
+    pTree = NULL;
+    return true;
+}
+
+// finishes an overlapped call on the pipe given what it returned, waiting on the stop event as well.
+// a stop cancels the call and fails it with ERROR_OPERATION_ABORTED, so an idle client cannot hold the server
+BOOL
+wpdDaemon_Complete(
+    const WpdDaemon* pDaemon
+    , HANDLE hPipe
+    , OVERLAPPED* pOverlapped
+    , const BOOL ok
+    , DWORD* pcbTransferred
+)
+{
+    if ( FALSE == ok )
+    {
+        const DWORD dwError = ::GetLastError();
+        if ( ERROR_MORE_DATA == dwError )
+        {
+            return ::GetOverlappedResult( hPipe, pOverlapped, pcbTransferred, FALSE );
+        }
+        if ( ERROR_IO_PENDING != dwError )
+        {
+            return FALSE;
+        }
+        const HANDLE handles[2] = { pOverlapped->hEvent, pDaemon->hEventStop };
+        if ( WAIT_OBJECT_0 != ::WaitForMultipleObjects( _countof(handles), handles, FALSE, INFINITE ) )
+        {
+            ::CancelIo( hPipe );
+            ::GetOverlappedResult( hPipe, pOverlapped, pcbTransferred, TRUE );
+            ::SetLastError( ERROR_OPERATION_ABORTED );
+            return FALSE;
+        }
+    }
+    return ::GetOverlappedResult( hPipe, pOverlapped, pcbTransferred, FALSE );
+}
+
+// one pipe instance; a client keeps its connection for as many requests as it likes
+unsigned __stdcall
+wpdDaemon_Server( void* pParam )
+{
+    WpdDaemon* pDaemon = reinterpret_cast<WpdDaemon*>(pParam);
+    if ( NULL == pDaemon )
+    {
+        return 1;
+    }
+
+    HANDLE hPipe = ::CreateNamedPipeW(
+        pDaemon->pipeName.c_str()
+        , PIPE_ACCESS_DUPLEX | FILE_FLAG_OVERLAPPED
+        , PIPE_TYPE_MESSAGE | PIPE_READMODE_MESSAGE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS
+        , PIPE_UNLIMITED_INSTANCES
+        , WPD_DAEMON_BUFFER_SIZE
+        , WPD_DAEMON_BUFFER_SIZE
+        , 0
+        , NULL
+        );
+    if ( INVALID_HANDLE_VALUE == hPipe )
+    {
+        LOGE( L"! Failed. CreateNamedPipe %s, error=%u\n", pDaemon->pipeName.c_str(), ::GetLastError() );
+        return 1;
+    }
+    OVERLAPPED overlapped;
+    ::memset( &overlapped, 0, sizeof(overlapped) );
+    overlapped.hEvent = ::CreateEventW( NULL, TRUE, FALSE, NULL );
+    if ( NULL == overlapped.hEvent )
+    {
+        LOGE( L"! Failed. CreateEvent daemon server, error=%u\n", ::GetLastError() );
+        ::CloseHandle( hPipe );
+        hPipe = NULL;
+        return 1;
+    }
+
+    std::vector<WCHAR> buffer( WPD_DAEMON_REQUEST_MAX + 1 );
+    const DWORD cbBuffer = WPD_DAEMON_REQUEST_MAX * sizeof(WCHAR);
+    std::wstring request;
+    std::wstring response;
+    for ( ;; )
+    {
+        DWORD cbTransferred = 0;
+        BOOL connected = ::ConnectNamedPipe( hPipe, &overlapped );
+        if ( FALSE == connected && ERROR_PIPE_CONNECTED == ::GetLastError() )
+        {
+            connected = TRUE;
+        }
+        else
+        {
+            connected = wpdDaemon_Complete( pDaemon, hPipe, &overlapped, connected, &cbTransferred );
+        }
+        if ( WAIT_OBJECT_0 == ::WaitForSingleObject( pDaemon->hEventStop, 0 ) )
+        {
+            ::DisconnectNamedPipe( hPipe );
+            break;
+        }
+
+        if ( FALSE != connected )
+        {
+            ::InterlockedIncrement( &pDaemon->nCountConnection );
+            for ( ;; )
+            {
+                DWORD cbRead = 0;
+                BOOL ok = wpdDaemon_Complete( pDaemon, hPipe, &overlapped, ::ReadFile( hPipe, &buffer[0], cbBuffer, NULL, &overlapped ), &cbRead );
+                bool tooLong = false;
+                while ( FALSE == ok && ERROR_MORE_DATA == ::GetLastError() )
+                {
+                    tooLong = true;
+                    ok = wpdDaemon_Complete( pDaemon, hPipe, &overlapped, ::ReadFile( hPipe, &buffer[0], cbBuffer, NULL, &overlapped ), &cbRead );
+                }
+                if ( FALSE == ok )
+                {
+                    // ERROR_BROKEN_PIPE when the client hung up, ERROR_OPERATION_ABORTED on stop
+                    break;
+                }
+
+                bool running = true;
+                ::InterlockedIncrement( &pDaemon->nCountQuery );
+                if ( tooLong )
+                {
+                    response.assign( L"error request too long\n" );
+                }
+                else
+                {
+                    request.assign( &buffer[0], cbRead / sizeof(WCHAR) );
+                    running = wpdDaemon_Handle( pDaemon, request, &response );
+                }
+                if ( 0 == response.compare( 0, 5, L"error" ) )
+                {
+                    ::InterlockedIncrement( &pDaemon->nCountError );
+                }
+
+                DWORD cbWritten = 0;
+                const BOOL written = wpdDaemon_Complete( pDaemon, hPipe, &overlapped
+                    , ::WriteFile( hPipe, response.c_str(), (DWORD)(response.size() * sizeof(WCHAR)), NULL, &overlapped )
+                    , &cbWritten
+                    );
+                if ( false == running )
+                {
+                    ::SetEvent( pDaemon->hEventStop );
+                }
+                if ( FALSE == written )
+                {
+                    break;
+                }
+            }
+        }
+
+        ::DisconnectNamedPipe( hPipe );
+    }
+
+    ::CloseHandle( overlapped.hEvent );
+    overlapped.hEvent = NULL;
+    ::CloseHandle( hPipe );
+    hPipe = NULL;
+
+    return 0;
+}
+
+bool
+wpdDaemon_Start(
+    WpdDaemon* pDaemon
+    , IPortableDeviceManager* pPortableDeviceManager
+)
+{
+    wpdDaemon_PipeName( &pDaemon->pipeName );
+    pDaemon->hThreadRefresh = NULL;
+    pDaemon->nCountConnection = 0;
+    pDaemon->nCountQuery = 0;
+    pDaemon->nCountError = 0;
+    pDaemon->nCountRefresh = 0;
+
+    pDaemon->hEventStop = ::CreateEventW( NULL, TRUE, FALSE, NULL );
+    if ( NULL == pDaemon->hEventStop )
+    {
+        LOGE( L"! Failed. CreateEvent daemon stop, error=%u\n", ::GetLastError() );
+        return false;
+    }
+    ::InitializeCriticalSection( &pDaemon->cs );
+    pPortableDeviceManager->AddRef();
+    pDaemon->pPortableDeviceManager = pPortableDeviceManager;
+
+    // the first trees are there before the first client
+    {
+        WpdScratchPool scratchPool;
+        wpdDaemon_Refresh( pDaemon, &scratchPool );
+        wpdScratchPool_Term( &scratchPool );
+    }
+
+    if ( 0 < s_optDaemonRefresh )
+    {
+        pDaemon->hThreadRefresh = reinterpret_cast<HANDLE>(
+            ::_beginthreadex( NULL, 0, wpdDaemon_RefreshThread, pDaemon, 0, NULL )
+            );
+        if ( NULL == pDaemon->hThreadRefresh )
+        {
+            LOGE( L"! Failed. _beginthreadex daemon refresh\n" );
+        }
+    }
+
+    for ( DWORD index = 0; index < s_optDaemonThreads; ++index )
+    {
+        HANDLE hThread = reinterpret_cast<HANDLE>(
+            ::_beginthreadex( NULL, 0, wpdDaemon_Server, pDaemon, 0, NULL )
+            );
+        if ( NULL == hThread )
+        {
+            LOGE( L"! Failed. _beginthreadex daemon server %u\n", index );
+            continue;
+        }
+        pDaemon->servers.push_back( hThread );
+    }
+
+    LOGI( L"Daemon     : %s, devices=%u, servers=%u\n"
+        , pDaemon->pipeName.c_str()
+        , (DWORD)pDaemon->devices.size()
+        , (DWORD)pDaemon->servers.size()
+        );
+    return true;
+}
+
+void
+wpdDaemon_Stop(
+    WpdDaemon* pDaemon
+)
+{
+    ::SetEvent( pDaemon->hEventStop );
+
+    if ( NULL != pDaemon->hThreadRefresh )
+    {
+        ::WaitForSingleObject( pDaemon->hThreadRefresh, INFINITE );
+        ::CloseHandle( pDaemon->hThreadRefresh );
+        pDaemon->hThreadRefresh = NULL;
+    }
+
+    // every server waits on the stop event next to its pipe, so neither a pending connect
+    // nor a client that connected and went quiet keeps it; one in the middle of a request answers it first
+    for ( size_t index = 0; index < pDaemon->servers.size(); ++index )
+    {
+        ::WaitForSingleObject( pDaemon->servers[index], INFINITE );
+        ::CloseHandle( pDaemon->servers[index] );
+        pDaemon->servers[index] = NULL;
+    }
+    pDaemon->servers.clear();
+
+    for ( size_t index = 0; index < pDaemon->devices.size(); ++index )
+    {
+        wpdDaemonTree_Release( pDaemon->devices[index].pTree );
+        pDaemon->devices[index].pTree = NULL;
+    }
+    pDaemon->devices.clear();
+
+    LOGI( L"Daemon     : connections=%ld, queries=%ld, errors=%ld, refreshes=%ld\n"
+        , pDaemon->nCountConnection
+        , pDaemon->nCountQuery
+        , pDaemon->nCountError
+        , pDaemon->nCountRefresh
+        );
+
+    if ( NULL != pDaemon->pPortableDeviceManager )
+    {
+        pDaemon->pPortableDeviceManager->Release();
+        pDaemon->pPortableDeviceManager = NULL;
+    }
+    ::DeleteCriticalSection( &pDaemon->cs );
+    ::CloseHandle( pDaemon->hEventStop );
+    pDaemon->hEventStop = NULL;
+}
+
+HANDLE
+wpdDaemonClient_Open(
+    LPCWSTR pszPipeName
+)
+{
+    for ( ;; )
+    {
+        HANDLE hPipe = ::CreateFileW( pszPipeName, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, 0, NULL );
+        if ( INVALID_HANDLE_VALUE != hPipe )
+        {
+            DWORD dwMode = PIPE_READMODE_MESSAGE;
+            if ( FALSE == ::SetNamedPipeHandleState( hPipe, &dwMode, NULL, NULL ) )
+            {
+                LOGE( L"! Failed. SetNamedPipeHandleState %s, error=%u\n", pszPipeName, ::GetLastError() );
+                ::CloseHandle( hPipe );
+                return INVALID_HANDLE_VALUE;
+            }
+            return hPipe;
+        }
+
+        const DWORD dwError = ::GetLastError();
+        if ( ERROR_PIPE_BUSY != dwError || FALSE == ::WaitNamedPipeW( pszPipeName, 5U * 1000U ) )
+        {
+            LOGE( L"! Failed. open pipe %s, error=%u\n", pszPipeName, dwError );
+            return INVALID_HANDLE_VALUE;
+        }
+    }
+}
+
+bool
+wpdDaemonClient_Query(
+    HANDLE hPipe
+    , const std::wstring& request
+    , std::vector<WCHAR>* pBuffer
+    , std::wstring* pResponse
+)
+{
+    pResponse->clear();
+    if ( pBuffer->size() < WPD_DAEMON_BUFFER_SIZE / sizeof(WCHAR) )
+    {
+        pBuffer->resize( WPD_DAEMON_BUFFER_SIZE / sizeof(WCHAR) );
+    }
+    const DWORD cbBuffer = (DWORD)(pBuffer->size() * sizeof(WCHAR));
+
+    DWORD cbRead = 0;
+    BOOL ok = ::TransactNamedPipe(
+        hPipe
+        , const_cast<WCHAR*>(request.c_str())
+        , (DWORD)(request.size() * sizeof(WCHAR))
+        , &(*pBuffer)[0]
+        , cbBuffer
+        , &cbRead
+        , NULL
+        );
+    for ( ;; )
+    {
+        if ( FALSE == ok && ERROR_MORE_DATA != ::GetLastError() )
+        {
+            return false;
+        }
+        pResponse->append( &(*pBuffer)[0], cbRead / sizeof(WCHAR) );
+        if ( FALSE != ok )
+        {
+            return true;
+        }
+        // the rest of a long listing
+        cbRead = 0;
+        ok = ::ReadFile( hPipe, &(*pBuffer)[0], cbBuffer, &cbRead, NULL );
+    }
+}
+
+// --query=<request> against a running daemon
+bool
+wpdDaemon_QueryOnce(
+    LPCWSTR pszRequest
+)
+{
+    std::wstring pipeName;
+    wpdDaemon_PipeName( &pipeName );
+
+    HANDLE hPipe = wpdDaemonClient_Open( pipeName.c_str() );
+    if ( INVALID_HANDLE_VALUE == hPipe )
+    {
+        return false;
+    }
+
+    std::vector<WCHAR> buffer;
+    std::wstring response;
+    const bool result = wpdDaemonClient_Query( hPipe, pszRequest, &buffer, &response );
+    if ( result )
+    {
+        ::fputws( response.c_str(), stdout );
+    }
+    else
+    {
+        LOGE( L"! Failed. query %s, error=%u\n", pszRequest, ::GetLastError() );
+    }
+
+    ::CloseHandle( hPipe );
+    hPipe = NULL;
+    return result;
+}
+
+struct WpdDaemonLoadClient
+{
+    LPCWSTR                             pszPipeName;
+    const std::vector<std::wstring>*    pPaths;
+    const std::vector<bool>*            pFolders;
+    HANDLE                              hEventGo;
+    DWORD                               dwCountQuery;
+    DWORD                               dwRandom;
+    DWORD                               dwCountError;
+    std::vector<LONG>                   latencies;      // microseconds
+};
+
+unsigned __stdcall
+wpdDaemonLoad_Client( void* pParam )
+{
+    WpdDaemonLoadClient* pClient = reinterpret_cast<WpdDaemonLoadClient*>(pParam);
+    if ( NULL == pClient )
+    {
+        return 1;
+    }
+
+    HANDLE hPipe = wpdDaemonClient_Open( pClient->pszPipeName );
+    ::WaitForSingleObject( pClient->hEventGo, INFINITE );
+    if ( INVALID_HANDLE_VALUE == hPipe )
+    {
+        pClient->dwCountError = pClient->dwCountQuery;
+        return 1;
+    }
+
+    static const LPCWSTR s_verbs[] = { L"ls 0 ", L"stat 0 ", L"du 0 ", L"devices" };
+    std::vector<WCHAR> buffer;
+    std::wstring request;
+    std::wstring response;
+    pClient->latencies.reserve( pClient->dwCountQuery );
+    for ( DWORD index = 0; index < pClient->dwCountQuery; ++index )
+    {
+        // xorshift32, one stream per client
+        pClient->dwRandom ^= pClient->dwRandom << 13;
+        pClient->dwRandom ^= pClient->dwRandom >> 17;
+        pClient->dwRandom ^= pClient->dwRandom << 5;
+
+        const size_t indexPath = pClient->dwRandom % pClient->pPaths->size();
+        size_t indexVerb = (pClient->dwRandom >> 16) % _countof(s_verbs);
+        if ( 0 == indexVerb && false == (*pClient->pFolders)[indexPath] )
+        {
+            indexVerb = 1;
+        }
+        request.assign( s_verbs[indexVerb] );
+        if ( 3 != indexVerb )
+        {
+            request.append( (*pClient->pPaths)[indexPath] );
+        }
+
+        const ULONGLONG qwTicksStart = wpdTicksNow();
+        const bool result = wpdDaemonClient_Query( hPipe, request, &buffer, &response );
+        pClient->latencies.push_back( (LONG)wpdTicksToMicroseconds( wpdTicksNow() - qwTicksStart ) );
+        if ( false == result || 0 != response.compare( 0, 2, L"ok" ) )
+        {
+            pClient->dwCountError += 1;
+            if ( false == result )
+            {
+                break;
+            }
+        }
+    }
+
+    ::CloseHandle( hPipe );
+    hPipe = NULL;
+    return 0;
+}
+
+// --daemon-load=N: N clients with a connection each, random ls/stat/du/devices on paths of device 0
+bool
+wpdDaemon_Load(
+    LPCWSTR pszPipeName
+)
+{
+    // the paths to ask for come from the daemon itself, breadth first
+    std::vector<std::wstring> paths( 1, std::wstring() );
+    std::vector<bool> folders( 1, true );
+    {
+        HANDLE hPipe = wpdDaemonClient_Open( pszPipeName );
+        if ( INVALID_HANDLE_VALUE == hPipe )
+        {
+            return false;
+        }
+        std::vector<WCHAR> buffer;
+        std::wstring response;
+        for ( size_t index = 0; index < paths.size() && paths.size() < WPD_DAEMON_LOAD_PATH_MAX; ++index )
+        {
+            if ( false == folders[index] )
+            {
+                continue;
+            }
+            if ( false == wpdDaemonClient_Query( hPipe, L"ls 0 " + paths[index], &buffer, &response )
+                || 0 != response.compare( 0, 2, L"ok" ) )
+            {
+                continue;
+            }
+            // "d\t<bytes>\t<name>" per line after the count
+            size_t pos = response.find( L'\n' );
+            while ( std::wstring::npos != pos && pos + 1 < response.size() && paths.size() < WPD_DAEMON_LOAD_PATH_MAX )
+            {
+                const size_t begin = pos + 1;
+                pos = response.find( L'\n', begin );
+                const size_t end = (std::wstring::npos == pos)?(response.size()):(pos);
+                const size_t tab = response.find( L'\t', begin + 2 );
+                if ( std::wstring::npos == tab || end <= tab )
+                {
+                    continue;
+                }
+                std::wstring path( paths[index] );
+                if ( !path.empty() )
+                {
+                    path.push_back( L'\\' );
+                }
+                path.append( response, tab + 1, end - tab - 1 );
+                paths.push_back( path );
+                folders.push_back( L'd' == response[begin] );
+            }
+        }
+        ::CloseHandle( hPipe );
+        hPipe = NULL;
+    }
+
+    HANDLE hEventGo = ::CreateEventW( NULL, TRUE, FALSE, NULL );
+    if ( NULL == hEventGo )
+    {
+        LOGE( L"! Failed. CreateEvent daemon load, error=%u\n", ::GetLastError() );
+        return false;
+    }
+
+    const DWORD dwCountClient = s_optDaemonLoad;
+    std::vector<WpdDaemonLoadClient> clients( dwCountClient );
+    std::vector<HANDLE> threads( dwCountClient, (HANDLE)NULL );
+    for ( DWORD index = 0; index < dwCountClient; ++index )
+    {
+        WpdDaemonLoadClient& client = clients[index];
+        client.pszPipeName = pszPipeName;
+        client.pPaths = &paths;
+        client.pFolders = &folders;
+        client.hEventGo = hEventGo;
+        client.dwCountQuery = s_optDaemonLoadQueries;
+        client.dwRandom = 2463534242U + index * 2654435761U;
+        client.dwCountError = 0;
+        threads[index] = reinterpret_cast<HANDLE>(
+            ::_beginthreadex( NULL, 0, wpdDaemonLoad_Client, &client, 0, NULL )
+            );
+        if ( NULL == threads[index] )
+        {
+            LOGE( L"! Failed. _beginthreadex daemon load client %u\n", index );
+        }
+    }
+
+    const ULONGLONG qwTicksStart = wpdTicksNow();
+    ::SetEvent( hEventGo );
+    for ( DWORD index = 0; index < dwCountClient; ++index )
+    {
+        if ( NULL != threads[index] )
+        {
+            ::WaitForSingleObject( threads[index], INFINITE );
+            ::CloseHandle( threads[index] );
+            threads[index] = NULL;
+        }
+    }
+    const double dSeconds = wpdTicksToMicroseconds( wpdTicksNow() - qwTicksStart ) / 1000000.0;
+    ::CloseHandle( hEventGo );
+    hEventGo = NULL;
+
+    std::vector<LONG> latencies;
+    DWORD dwCountError = 0;
+    for ( DWORD index = 0; index < dwCountClient; ++index )
+    {
+        latencies.insert( latencies.end(), clients[index].latencies.begin(), clients[index].latencies.end() );
+        dwCountError += clients[index].dwCountError;
+    }
+    std::sort( latencies.begin(), latencies.end() );
+
+    LOGI( L"Daemon load: clients=%u, paths=%u, queries=%u, errors=%u, %.3f sec, %.1f queries/sec\n"
+        , dwCountClient
+        , (DWORD)paths.size()
+        , (DWORD)latencies.size()
+        , dwCountError
+        , dSeconds
+        , (0.0 < dSeconds)?(latencies.size() / dSeconds):(0.0)
+        );
+    if ( !latencies.empty() )
+    {
+        const size_t last = latencies.size() - 1;
+        LOGI( L"    latency p50=%ldus, p90=%ldus, p99=%ldus, p99.9=%ldus, max=%ldus\n"
+            , latencies[last * 50 / 100]
+            , latencies[last * 90 / 100]
+            , latencies[last * 99 / 100]
+            , latencies[last * 999 / 1000]
+            , latencies[last]
+            );
+    }
+
+    return 0 == dwCountError;
+}
+
+// --daemon: serve until --daemon-seconds= ran out or a client sent quit; with --daemon-load= serve the load test and stop
+void
+wpdDaemon_Run(
+    void
+)
+{
+    // --simulate puts the in-memory device behind the daemon
+    WpdSimDevice device;
+    IPortableDeviceManager* pPortableDeviceManager = NULL;
+    if ( NULL != s_optSimulate )
+    {
+        device.dwLatencyEnum = s_optSimLatency[0];
+        device.dwLatencyNext = s_optSimLatency[1];
+        device.dwLatencyNextPerId = s_optSimLatency[2];
+        device.dwLatencyValues = s_optSimLatency[3];
+        wpdSimDevice_Init( &device );
+        s_simDevices.assign( 1, &device );
+        s_sessionPool.pfnOpen = wpdSimDevice_OpenPortableDevice;
+        pPortableDeviceManager = new WpdSimDeviceManager();
+    }
+    else
+    {
+        pPortableDeviceManager = wpdSessionPool_Manager();
+    }
+
+    if ( NULL != pPortableDeviceManager )
+    {
+        WpdDaemon daemon;
+        if ( wpdDaemon_Start( &daemon, pPortableDeviceManager ) )
+        {
+            if ( 0 < s_optDaemonLoad )
+            {
+                wpdDaemon_Load( daemon.pipeName.c_str() );
+            }
+            else
+            {
+                ::WaitForSingleObject( daemon.hEventStop, (0 < s_optDaemonSeconds)?(s_optDaemonSeconds * 1000U):(INFINITE) );
+            }
+            wpdDaemon_Stop( &daemon );
+        }
+
+        pPortableDeviceManager->Release();
+        pPortableDeviceManager = NULL;
+    }
+
+    if ( NULL != s_optSimulate )
+    {
+        wpdSessionPool_Close( WPD_SIM_PNP_DEVICE_ID );
+        s_sessionPool.pfnOpen = wpdOpenPortableDevice;
+        s_simDevices.clear();
+        wpdSimDevice_Term( &device );
+    }
+}
+
+// device arrival notifications on a message-only window of its own thread
+struct WpdDeviceDiscovery
+{
+    HANDLE          hThread;
+    HANDLE          hEventReady;
+    HANDLE          hEventArrival;
+    HWND            hWnd;
+    volatile LONG   nCountArrival;
+};
+
+#define WPD_DEVICE_DISCOVERY_CLASS      L"test_enum_wpd.discovery"
+// polling fallback, doubled after each empty poll
+#define WPD_DEVICE_DISCOVERY_POLL_MIN   (50U)
+#define WPD_DEVICE_DISCOVERY_POLL_MAX   (2U * 1000U)
+
+LRESULT CALLBACK
+wpdDeviceDiscovery_WndProc( HWND hWnd, UINT uMsg, WPARAM wParam, LPARAM lParam )
+{
+    if ( WM_DEVICECHANGE == uMsg )
+    {
+        WpdDeviceDiscovery* pDiscovery = reinterpret_cast<WpdDeviceDiscovery*>( ::GetWindowLongPtrW( hWnd, GWLP_USERDATA ) );
+        if ( DBT_DEVICEARRIVAL == wParam && NULL != pDiscovery )
+        {
+            ::InterlockedIncrement( &pDiscovery->nCountArrival );
+            ::SetEvent( pDiscovery->hEventArrival );
+        }
+        if ( (DBT_DEVICEARRIVAL == wParam || DBT_DEVICEREMOVECOMPLETE == wParam) && 0 != lParam )
+        {
+            const DEV_BROADCAST_HDR* pHeader = reinterpret_cast<const DEV_BROADCAST_HDR*>(lParam);
+            if ( DBT_DEVTYP_DEVICEINTERFACE == pHeader->dbch_devicetype )
+            {
+                // the interface name is the PnP id, a device coming back may carry other names
+                wpdDeviceInfoCache_Invalidate( reinterpret_cast<const DEV_BROADCAST_DEVICEINTERFACE_W*>(lParam)->dbcc_name );
+            }
+        }
+        return TRUE;
+    }
+    if ( WM_CLOSE == uMsg )
+    {
+        ::DestroyWindow( hWnd );
+        return 0;
+    }
+    if ( WM_DESTROY == uMsg )
+    {
+        ::PostQuitMessage( 0 );
+        return 0;
+    }
+    return ::DefWindowProcW( hWnd, uMsg, wParam, lParam );
+}
+
+unsigned __stdcall
+wpdDeviceDiscovery_Thread( void* pParam )
+{
+    WpdDeviceDiscovery* pDiscovery = reinterpret_cast<WpdDeviceDiscovery*>(pParam);
+    if ( NULL == pDiscovery )
+    {
+        return 1;
+    }
+
+    const HINSTANCE hInstance = ::GetModuleHandleW( NULL );
+    WNDCLASSEXW wc;
+    ::memset( &wc, 0, sizeof(wc) );
+    wc.cbSize = sizeof(wc);
+    wc.lpfnWndProc = wpdDeviceDiscovery_WndProc;
+    wc.hInstance = hInstance;
+    wc.lpszClassName = WPD_DEVICE_DISCOVERY_CLASS;
+    const ATOM atom = ::RegisterClassExW( &wc );
+    if ( 0 == atom )
+    {
+        LOGE( L"! Failed. RegisterClassExW, err=%u\n", ::GetLastError() );
+        ::SetEvent( pDiscovery->hEventReady );
+        return 1;
+    }
+
+    HWND hWnd = ::CreateWindowExW( 0, WPD_DEVICE_DISCOVERY_CLASS, NULL, 0, 0, 0, 0, 0, HWND_MESSAGE, NULL, hInstance, NULL );
+    HDEVNOTIFY hDevNotify = NULL;
+    if ( NULL == hWnd )
+    {
+        LOGE( L"! Failed. CreateWindowExW, err=%u\n", ::GetLastError() );
+    }
+    else
+    {
+        ::SetWindowLongPtrW( hWnd, GWLP_USERDATA, reinterpret_cast<LONG_PTR>(pDiscovery) );
+
+        DEV_BROADCAST_DEVICEINTERFACE_W filter;
+        ::memset( &filter, 0, sizeof(filter) );
+        filter.dbcc_size = sizeof(filter);
+        filter.dbcc_devicetype = DBT_DEVTYP_DEVICEINTERFACE;
+        filter.dbcc_classguid = GUID_DEVINTERFACE_WPD;
+        hDevNotify = ::RegisterDeviceNotificationW( hWnd, &filter, DEVICE_NOTIFY_WINDOW_HANDLE );
+        if ( NULL == hDevNotify )
+        {
+            LOGE( L"! Failed. RegisterDeviceNotificationW, err=%u\n", ::GetLastError() );
+            ::DestroyWindow( hWnd );
+            hWnd = NULL;
+        }
+    }
+    pDiscovery->hWnd = hWnd;
+    ::SetEvent( pDiscovery->hEventReady );
+
+    if ( NULL != hWnd )
+    {
+        MSG msg;
+        while ( 0 < ::GetMessageW( &msg, NULL, 0, 0 ) )
+        {
+            ::TranslateMessage( &msg );
+            ::DispatchMessageW( &msg );
+        }
+    }
+
+    if ( NULL != hDevNotify )
+    {
+        ::UnregisterDeviceNotification( hDevNotify );
+        hDevNotify = NULL;
+    }
+    ::UnregisterClassW( WPD_DEVICE_DISCOVERY_CLASS, hInstance );
+
+    return 0;
+}
+
+// false when notifications are not available, the caller then only polls
+bool
+wpdDeviceDiscovery_Start(
+    WpdDeviceDiscovery* pDiscovery
+)
+{
+    ::memset( pDiscovery, 0, sizeof(*pDiscovery) );
+    pDiscovery->hEventReady = ::CreateEventW( NULL, TRUE, FALSE, NULL );
+    pDiscovery->hEventArrival = ::CreateEventW( NULL, FALSE, FALSE, NULL );
+    if ( NULL == pDiscovery->hEventReady || NULL == pDiscovery->hEventArrival )
+    {
+        return false;
+    }
+
+    pDiscovery->hThread = reinterpret_cast<HANDLE>(
+        ::_beginthreadex( NULL, 0, wpdDeviceDiscovery_Thread, pDiscovery, 0, NULL )
+        );
+    if ( NULL == pDiscovery->hThread )
+    {
+        LOGE( L"! Failed. _beginthreadex discovery\n" );
+        return false;
+    }
+
+    // registered before the first poll, an arrival in between is not lost
+    ::WaitForSingleObject( pDiscovery->hEventReady, INFINITE );
+    return NULL != pDiscovery->hWnd;
+}
+
+void
+wpdDeviceDiscovery_Stop(
+    WpdDeviceDiscovery* pDiscovery
+)
+{
+    if ( NULL != pDiscovery->hThread )
+    {
+        if ( NULL != pDiscovery->hWnd )
+        {
+            ::PostMessageW( pDiscovery->hWnd, WM_CLOSE, 0, 0 );
+        }
+        ::WaitForSingleObject( pDiscovery->hThread, INFINITE );
+        ::CloseHandle( pDiscovery->hThread );
+        pDiscovery->hThread = NULL;
+    }
+    pDiscovery->hWnd = NULL;
+    if ( NULL != pDiscovery->hEventReady )
+    {
+        ::CloseHandle( pDiscovery->hEventReady );
+        pDiscovery->hEventReady = NULL;
+    }
+    if ( NULL != pDiscovery->hEventArrival )
+    {
+        ::CloseHandle( pDiscovery->hEventArrival );
+        pDiscovery->hEventArrival = NULL;
+    }
+}
+
+// wait until at least one device is present or --discovery-timeout= passed;
+// wakes on device arrival, and polls with backoff in case a notification is missed
+DWORD
+wpdWaitDevices(
+    IPortableDeviceManager* pPortableDeviceManager
+)
+{
+    WpdDeviceDiscovery discovery;
+    const bool useNotification = wpdDeviceDiscovery_Start( &discovery );
+
+    const DWORD dwStart = ::GetTickCount();
+    DWORD dwPoll = WPD_DEVICE_DISCOVERY_POLL_MIN;
+    DWORD dwCountPoll = 0;
+    DWORD dwCountDeviceId = 0;
+    for ( ;; )
+    {
+        dwCountPoll += 1;
+        {
+            const HRESULT hr = pPortableDeviceManager->GetDevices( NULL, &dwCountDeviceId );
+            if ( FAILED(hr) )
+            {
+                LOGE( L"! Failed. IPortableDeviceManager::GetDevices get count, hr=0x%08x\n", hr );
+                dwCountDeviceId = 0;
+            }
+            else
+            {
+                LOGV( L"IPortableDeviceManager::GetDevices get count, device count=%u\n", dwCountDeviceId );
+            }
+        }
+        if ( 0 < dwCountDeviceId )
+        {
+            break;
+        }
+
+        const DWORD dwElapsed = ::GetTickCount() - dwStart;
+        if ( s_optDiscoveryTimeout <= dwElapsed )
+        {
+            break;
+        }
+        const DWORD dwRemain = s_optDiscoveryTimeout - dwElapsed;
+        const DWORD dwWait = (dwPoll < dwRemain)?(dwPoll):(dwRemain);
+
+        bool arrived = false;
+        if ( useNotification )
+        {
+            arrived = (WAIT_OBJECT_0 == ::WaitForSingleObject( discovery.hEventArrival, dwWait ));
+        }
+        else
+        {
+            ::Sleep( dwWait );
+        }
+
+        if ( arrived )
+        {
+            // the device list may lag the arrival a little: poll again soon
+            dwPoll = WPD_DEVICE_DISCOVERY_POLL_MIN;
+        }
+        else
+        {
+            dwPoll = (dwPoll < WPD_DEVICE_DISCOVERY_POLL_MAX / 2U)?(dwPoll * 2U):(WPD_DEVICE_DISCOVERY_POLL_MAX);
+        }
+
+        {
+            const HRESULT hr = pPortableDeviceManager->RefreshDeviceList();
+            if ( FAILED(hr) )
+            {
+                LOGE( L"! Failed. IPortableDeviceManager::RefreshDeviceList, hr=0x%08x\n", hr );
+            }
+        }
+    }
+
+    LOGI( L"IPortableDeviceManager::GetDevices get count, device count=%u, %u ms, polls=%u, arrivals=%u%s\n"
+        , dwCountDeviceId
+        , ::GetTickCount() - dwStart
+        , dwCountPoll
+        , (DWORD)discovery.nCountArrival
+        , (useNotification)?(L""):(L", polling only")
+        );
+
+    wpdDeviceDiscovery_Stop( &discovery );
+
+    return dwCountDeviceId;
+}
+
+void
+enumWPDcore(void)
+{
+    IPortableDeviceManager* pPortableDeviceManager = wpdSessionPool_Manager();
+
+    DWORD dwCountDeviceId = 0;
+    if ( NULL != pPortableDeviceManager )
+    {
+        dwCountDeviceId = wpdWaitDevices( pPortableDeviceManager );
+    }
+
+    LPWSTR* pDeviceIdArray = NULL;
+    if ( 0 < dwCountDeviceId && NULL != pPortableDeviceManager )
+    {
+        pDeviceIdArray = new PWSTR[dwCountDeviceId];
+        for ( size_t index = 0; index < dwCountDeviceId; ++index )
+        {
+            pDeviceIdArray[index] = NULL;
+        }
+
+        if ( NULL != pDeviceIdArray )
+        {
+            {
+                const HRESULT hr = pPortableDeviceManager->GetDevices( pDeviceIdArray, &dwCountDeviceId );
+                if ( FAILED(hr) )
+                {
+                    LOGE( L"! Failed. IPortableDeviceManager::GetDevice get id and count, hr=0x%08x\n", hr );
+                }
+                else
+                {
+                    /*
+                    for ( size_t index = 0; index < dwCountDeviceId; ++index )
+                    {
+                        LOGV( L"%3u: %s\n", index, pDeviceIdArray[index] );
+                    }
+                    */
+                }
+            }
+        }
+    }
+
+    if ( NULL != pDeviceIdArray )
+    {
+        wpdDeviceInfoCache_Retain( pDeviceIdArray, dwCountDeviceId );
+    }
+
+    if ( NULL != pDeviceIdArray && NULL != pPortableDeviceManager )
+    {
+        std::vector<WCHAR> scratch;
+        for ( size_t index = 0; index < dwCountDeviceId; ++index )
+        {
+            if ( NULL == pDeviceIdArray[index] )
+            {
+                continue;
+            }
+
+            LOGV( L"%3u: %s\n", index, pDeviceIdArray[index] );
+            dispDeviceInfo( pPortableDeviceManager, pDeviceIdArray[index], &scratch );
+        }
+    }
+
+
+#if defined(_MSC_VER) && (_MSC_VER > 1500)
+    {
+        if ( ::IsEqualCLSID( myCLSID_PortableDeviceFTM, CLSID_PortableDeviceFTM ) )
+        {
+            LOGV( L"myCLSID_PortableDeviceFTM matched CLSID_PortableDeviceFTM\n" );
+        }
+        else
+        {
+            LOGE( L"myCLSID_PortableDeviceFTM not match CLSID_PortableDeviceFTM\n" );
+            ::DebugBreak();
+        }
+    }
+#endif
+
+    if ( NULL != pDeviceIdArray )
+    {
+        wpdScanDevices( pDeviceIdArray, dwCountDeviceId );
+    }
+
+    //FreePortableDevicePnPIDs( pDeviceIdArray, dwCountDeviceId );
+    if ( NULL != pDeviceIdArray )
+    {
+        for ( size_t index = 0; index < dwCountDeviceId; ++index )
+        {
+            if ( NULL != pDeviceIdArray[index] )
+            {
+                ::CoTaskMemFree( pDeviceIdArray[index] );
+                pDeviceIdArray[index] = NULL;
+            }
+        }
+    }
+    if ( NULL != pDeviceIdArray )
+    {
+        delete [] pDeviceIdArray;
+        pDeviceIdArray = NULL;
+    }
+
+    if ( NULL != pPortableDeviceManager )
+    {
+        const DWORD dwCount = pPortableDeviceManager->Release();
+        LOGV( L"IPortableDeviceManager::Release, count=%u\n", dwCount );
+        pPortableDeviceManager = NULL;
+    }
+
+}
+
+// how much later than its scripted arrival discovery may see the first device
+#define WPD_SIM_DISCOVERY_SLACK     (4U * WPD_DEVICE_DISCOVERY_POLL_MIN)
+
+struct WpdSimPlugNotify
+{
+    std::vector<WpdSimPlug> plugs;
+    HANDLE                  hEventStop;
+    DWORD                   dwStart;
+};
+
+// tells the discovery window of every scripted arrival and removal, as Windows would
+unsigned __stdcall
+wpdSimulate_PlugNotify( void* pParam )
+{
+    WpdSimPlugNotify* pNotify = reinterpret_cast<WpdSimPlugNotify*>(pParam);
+    for ( size_t index = 0; index < pNotify->plugs.size(); ++index )
+    {
+        const DWORD dwElapsed = ::GetTickCount() - pNotify->dwStart;
+        const DWORD dwWait = (dwElapsed < pNotify->plugs[index].dwAt)?(pNotify->plugs[index].dwAt - dwElapsed):(0);
+        if ( WAIT_TIMEOUT != ::WaitForSingleObject( pNotify->hEventStop, dwWait ) )
+        {
+            break;
+        }
+        const HWND hWnd = ::FindWindowExW( HWND_MESSAGE, NULL, WPD_DEVICE_DISCOVERY_CLASS, NULL );
+        if ( NULL != hWnd )
+        {
+            ::SendMessageW( hWnd, WM_DEVICECHANGE, (pNotify->plugs[index].arrive)?(DBT_DEVICEARRIVAL):(DBT_DEVICEREMOVECOMPLETE), 0 );
+        }
+    }
+    return 0;
+}
+
+// --sim-plug=: parsed in time order, the devices numbered in the order they arrive
+bool
+wpdSimulate_ParsePlug(
+    LPCWSTR pszScript
+    , std::vector<WpdSimPlug>* pPlugs
+    , DWORD* pdwCountDevice
+)
+{
+    std::deque<DWORD> present;
+    DWORD dwCountDevice = 0;
+    DWORD dwAt = 0;
+    LPCWSTR p = pszScript;
+    while ( L'\0' != *p )
+    {
+        const bool arrive = (L'+' == *p);
+        if ( false == arrive && L'-' != *p )
+        {
+            return false;
+        }
+        WCHAR* endptr = NULL;
+        const unsigned long value = ::wcstoul( p + 1, &endptr, 10 );
+        if ( endptr == p + 1 || (L'\0' != *endptr && L',' != *endptr) || value < dwAt || 60000UL < value )
+        {
+            return false;
+        }
+        WpdSimPlug plug;
+        plug.dwAt = dwAt = (DWORD)value;
+        plug.arrive = arrive;
+        if ( arrive )
+        {
+            plug.device = dwCountDevice++;
+            present.push_back( plug.device );
+        }
+        else
+        {
+            if ( present.empty() )
+            {
+                return false;
+            }
+            plug.device = present.front();
+            present.pop_front();
+        }
+        pPlugs->push_back( plug );
+        p = (L',' == *endptr)?(endptr + 1):(endptr);
+    }
+    *pdwCountDevice = dwCountDevice;
+    return 0 < dwCountDevice && pPlugs->front().arrive;
+}
+
+// --simulate --sim-plug=: enumWPDcore's discovery against devices that come and go on a script. the first device
+// has to be seen within WPD_SIM_DISCOVERY_SLACK of its arrival and walked, and when the script is over the manager
+// has to list exactly the devices still plugged in
+void
+wpdSimulate_Discovery(
+    void
+)
+{
+    std::vector<WpdSimPlug> plugs;
+    DWORD dwCountDevice = 0;
+    if ( false == wpdSimulate_ParsePlug( s_optSimPlug, &plugs, &dwCountDevice ) )
+    {
+        LOGE( L"! Failed. --sim-plug=%s, expected +<ms> or -<ms> in time order starting with an arrival\n", s_optSimPlug );
+        return;
+    }
+
+    std::vector<WpdSimDevice*> devices;
+    for ( DWORD index = 0; index < dwCountDevice; ++index )
+    {
+        devices.push_back( wpdSimDevice_New( index ) );
+    }
+    DWORD dwCountExpected = 0;
+    DWORD dwCountExpectedFolder = 0;
+    DWORD dwCountExpectedFile = 0;
+    wpdSimDevice_CountFilter( devices[0], &dwCountExpected, &dwCountExpectedFolder, &dwCountExpectedFile );
+    s_simDevices = devices;
+    s_sessionPool.pfnOpen = wpdSimDevice_OpenPortableDevice;
+
+    WpdSimDeviceManager* pManager = new WpdSimDeviceManager();
+    pManager->Plug( plugs );
+    WpdSimPlugNotify notify;
+    notify.plugs = plugs;
+    notify.hEventStop = ::CreateEventW( NULL, TRUE, FALSE, NULL );
+    notify.dwStart = ::GetTickCount();
+    HANDLE hThread = NULL;
+    if ( NULL != notify.hEventStop )
+    {
+        hThread = reinterpret_cast<HANDLE>( ::_beginthreadex( NULL, 0, wpdSimulate_PlugNotify, &notify, 0, NULL ) );
+    }
+
+    bool result = true;
+    const DWORD dwCountFirst = wpdWaitDevices( pManager );
+    const DWORD dwFirst = ::GetTickCount() - notify.dwStart;
+    if ( 0 == dwCountFirst || plugs[0].dwAt + WPD_SIM_DISCOVERY_SLACK < dwFirst )
+    {
+        LOGE( L"! Failed. discovery saw %u devices after %u ms, the first arrived at %u ms\n", dwCountFirst, dwFirst, plugs[0].dwAt );
+        result = false;
+    }
+
+    // what enumWPDcore does next: take the ids and walk them
+    if ( 0 < dwCountFirst )
+    {
+        DWORD dwCountDeviceId = dwCountFirst;
+        std::vector<LPWSTR> deviceIds( dwCountDeviceId, (LPWSTR)NULL );
+        if ( FAILED(pManager->GetDevices( &deviceIds[0], &dwCountDeviceId )) )
+        {
+            dwCountDeviceId = 0;
+        }
+        WpdDeviceScan* pScanArray = new WpdDeviceScan[dwCountFirst];
+        for ( DWORD index = 0; index < dwCountDeviceId; ++index )
+        {
+            WpdDeviceScan& scan = pScanArray[index];
+            ::memset( &scan, 0, sizeof(scan) );
+            scan.pszPnPDeviceID = deviceIds[index];
+            scan.index = index;
+            scan.dwCountWalk = 1;
+        }
+        wpdScanPool_Run( pScanArray, (LONG)dwCountDeviceId );
+        for ( DWORD index = 0; index < dwCountDeviceId; ++index )
+        {
+            if ( false == pScanArray[index].result || dwCountExpected != pScanArray[index].dwCountContent )
+            {
+                LOGE( L"! Failed. simulated device %s walked %u objects, expected %u\n", deviceIds[index], pScanArray[index].dwCountContent, dwCountExpected );
+                result = false;
+            }
+            ::CoTaskMemFree( deviceIds[index] );
+            deviceIds[index] = NULL;
+        }
+        delete [] pScanArray;
+        pScanArray = NULL;
+    }
+
+    // the rest of the script, then the list has to match it
+    {
+        const DWORD dwElapsed = ::GetTickCount() - notify.dwStart;
+        if ( dwElapsed < plugs.back().dwAt )
+        {
+            ::Sleep( plugs.back().dwAt - dwElapsed );
+        }
+        DWORD dwCountPlugged = 0;
+        for ( size_t index = 0; index < plugs.size(); ++index )
+        {
+            dwCountPlugged = (plugs[index].arrive)?(dwCountPlugged + 1):(dwCountPlugged - 1);
+        }
+        DWORD dwCountListed = 0;
+        pManager->GetDevices( NULL, &dwCountListed );
+        for ( DWORD index = 0; index < dwCountDevice; ++index )
+        {
+            DWORD cchName = 0;
+            const bool listed = SUCCEEDED(pManager->GetDeviceFriendlyName( devices[index]->pnpDeviceId.c_str(), NULL, &cchName ));
+            if ( listed != pManager->IsPresent( index ) )
+            {
+                LOGE( L"! Failed. simulated device %s answers GetDeviceFriendlyName=%s while %s\n"
+                    , devices[index]->pnpDeviceId.c_str()
+                    , (listed)?(L"ok"):(L"not found")
+                    , (pManager->IsPresent( index ))?(L"plugged in"):(L"pulled")
+                    );
+                result = false;
+            }
+        }
+        LOGI( L"Discovery  : first device after %u ms, arrived at %u ms, devices at the end=%u, expected %u\n"
+            , dwFirst
+            , plugs[0].dwAt
+            , dwCountListed
+            , dwCountPlugged
+            );
+        if ( dwCountListed != dwCountPlugged )
+        {
+            LOGE( L"! Failed. the simulated manager lists %u devices after the script, expected %u\n", dwCountListed, dwCountPlugged );
+            result = false;
+        }
+    }
+
+    if ( NULL != hThread )
+    {
+        ::SetEvent( notify.hEventStop );
+        ::WaitForSingleObject( hThread, INFINITE );
+        ::CloseHandle( hThread );
+        hThread = NULL;
+    }
+    if ( NULL != notify.hEventStop )
+    {
+        ::CloseHandle( notify.hEventStop );
+        notify.hEventStop = NULL;
+    }
+    pManager->Release();
+    pManager = NULL;
+
+    for ( DWORD index = 0; index < dwCountDevice; ++index )
+    {
+        wpdSessionPool_Close( devices[index]->pnpDeviceId.c_str() );
+    }
+    s_sessionPool.pfnOpen = wpdOpenPortableDevice;
+    s_simDevices.clear();
+    for ( DWORD index = 0; index < dwCountDevice; ++index )
+    {
+        wpdSimDevice_Term( devices[index] );
+        delete devices[index];
+        devices[index] = NULL;
+    }
+
+    LOGI( L"Discovery  : %s\n", (result)?(L"ok"):(L"failed") );
+}
+
+
+
+int _tmain(int argc, _TCHAR* argv[])
+{
+    wpdLog_Start();
+
+    if ( NULL != argv )
+    {
+        for ( int index = 1; index < argc; ++index )
+        {
+            if ( NULL == argv[index] )
+            {
+                continue;
+            }
+
+            if ( 0 == _tcscmp( argv[index], L"--verbose" ) )
+            {
+                s_optVerbose = true;
+            }
+            else
+            if ( 0 == _tcscmp( argv[index], L"--use-deviceftm" ) )
+            {
+                s_optUsePortableDeviceFTM = true;
+            }
+            else
+            if ( 0 == _tcscmp( argv[index], L"--fetch-count=auto" ) )
+            {
+                s_optAdaptiveFetch = true;
+            }
+            else
+            if ( 0 == _tcsncmp( argv[index], L"--fetch-count-max=", _tcslen(L"--fetch-count-max=") ) )
+            {
+                TCHAR* endptr = NULL;
+                TCHAR* p = &argv[index][_tcslen(L"--fetch-count-max=")];
+                const unsigned long result = _tcstoul( p, &endptr, 10 );
+                if ( ULONG_MAX != result && 0 < result )
+                {
+                    if ( NULL != endptr && _T('\0') == *endptr )
+                    {
+                        s_optCountOfFetchMax = result;
+                    }
+                }
+            }
+            else
+            if ( 0 == _tcsncmp( argv[index], L"--fetch-count=", _tcslen(L"--fetch-count=") ) )
+            {
+                TCHAR* endptr = NULL;
+                TCHAR* p = &argv[index][_tcslen(L"--fetch-count=")];
+                const unsigned long result = _tcstoul( p, &endptr, 10 );
+                if ( ULONG_MAX != result )
+                {
+                    if ( NULL != endptr && _T('\0') == *endptr )
+                    {
+                        s_optCountOfFetch = result;
+                    }
+                }
+            }
+            else
+            if ( 0 == _tcsncmp( argv[index], L"--jobs=", _tcslen(L"--jobs=") ) )
+            {
+                TCHAR* endptr = NULL;
+                TCHAR* p = &argv[index][_tcslen(L"--jobs=")];
+                const unsigned long result = _tcstoul( p, &endptr, 10 );
+                if ( ULONG_MAX != result && 0 < result )
+                {
+                    if ( NULL != endptr && _T('\0') == *endptr )
+                    {
+                        s_optCountOfJobs = result;
+                    }
+                }
+            }
+            else
+            if ( 0 == _tcsncmp( argv[index], L"--walkers=", _tcslen(L"--walkers=") ) )
+            {
+                TCHAR* endptr = NULL;
+                TCHAR* p = &argv[index][_tcslen(L"--walkers=")];
+                const unsigned long result = _tcstoul( p, &endptr, 10 );
+                if ( ULONG_MAX != result && 0 < result )
+                {
+                    if ( NULL != endptr && _T('\0') == *endptr )
+                    {
+                        s_optCountOfWalkers = result;
+                    }
+                }
+            }
+            else
+            if ( 0 == _tcsncmp( argv[index], L"--resume=", _tcslen(L"--resume=") ) )
+            {
+                s_optResumeFile = &argv[index][_tcslen(L"--resume=")];
+            }
+            else
+            if ( 0 == _tcsncmp( argv[index], L"--checkpoint-interval=", _tcslen(L"--checkpoint-interval=") ) )
+            {
+                TCHAR* endptr = NULL;
+                TCHAR* p = &argv[index][_tcslen(L"--checkpoint-interval=")];
+                const unsigned long result = _tcstoul( p, &endptr, 10 );
+                if ( ULONG_MAX != result && 0 < result )
+                {
+                    if ( NULL != endptr && _T('\0') == *endptr )
+                    {
+                        s_optCheckpointInterval = result;
+                    }
+                }
+            }
+            else
+            if ( 0 == _tcscmp( argv[index], L"--watch" ) )
+            {
+                s_optWatch = true;
+            }
+            else
+            if ( 0 == _tcsncmp( argv[index], L"--watch=", _tcslen(L"--watch=") ) )
+            {
+                // wpdWatch_Run multiplies the seconds by 1000 and the debounce by 10, both in a DWORD
+                TCHAR* endptr = NULL;
+                TCHAR* p = &argv[index][_tcslen(L"--watch=")];
+                const unsigned long result = _tcstoul( p, &endptr, 10 );
+                if ( ULONG_MAX != result && result <= ULONG_MAX / 1000UL && NULL != endptr && _T('\0') == *endptr )
+                {
+                    s_optWatch = true;
+                    s_optWatchSeconds = result;
+                }
+                else
+                {
+                    LOGE( L"! Failed. --watch=<seconds>, got %s\n", p );
+                }
+            }
+            else
+            if ( 0 == _tcsncmp( argv[index], L"--watch-debounce=", _tcslen(L"--watch-debounce=") ) )
+            {
+                TCHAR* endptr = NULL;
+                TCHAR* p = &argv[index][_tcslen(L"--watch-debounce=")];
+                const unsigned long result = _tcstoul( p, &endptr, 10 );
+                if ( 0 < result && result <= ULONG_MAX / 10UL && NULL != endptr && _T('\0') == *endptr )
+                {
+                    s_optWatchDebounce = result;
+                }
+                else
+                {
+                    LOGE( L"! Failed. --watch-debounce=<milliseconds> above 0, got %s\n", p );
+                }
+            }
+            else
+            if ( 0 == _tcsncmp( argv[index], L"--discovery-timeout=", _tcslen(L"--discovery-timeout=") ) )
+            {
+                TCHAR* endptr = NULL;
+                TCHAR* p = &argv[index][_tcslen(L"--discovery-timeout=")];
+                const unsigned long result = _tcstoul( p, &endptr, 10 );
+                if ( ULONG_MAX != result )
+                {
+                    if ( NULL != endptr && _T('\0') == *endptr )
+                    {
+                        s_optDiscoveryTimeout = result;
+                    }
+                }
+            }
+            else
+            if ( 0 == _tcsncmp( argv[index], L"--only=", _tcslen(L"--only=") ) )
+            {
+                s_optOnly = &argv[index][_tcslen(L"--only=")];
+            }
+            else
+            if ( 0 == _tcsncmp( argv[index], L"--exclude-folders=", _tcslen(L"--exclude-folders=") ) )
+            {
+                s_optExcludeFolders = &argv[index][_tcslen(L"--exclude-folders=")];
+            }
+            else
+            if ( 0 == _tcsncmp( argv[index], L"--output=", _tcslen(L"--output=") ) )
+            {
+                s_optOutputFile = &argv[index][_tcslen(L"--output=")];
+                s_logger.toStderr = (0 == ::wcscmp( s_optOutputFile, L"-" ));
+            }
+            else
+            if ( 0 == _tcsncmp( argv[index], L"--format=", _tcslen(L"--format=") ) )
+            {
+                s_optOutputFormat = &argv[index][_tcslen(L"--format=")];
+            }
+            else
+            if ( 0 == _tcsncmp( argv[index], L"--output-bench=", _tcslen(L"--output-bench=") ) )
+            {
+                TCHAR* endptr = NULL;
+                TCHAR* p = &argv[index][_tcslen(L"--output-bench=")];
+                const unsigned long result = _tcstoul( p, &endptr, 10 );
+                if ( ULONG_MAX != result )
+                {
+                    if ( NULL != endptr && _T('\0') == *endptr )
+                    {
+                        s_optOutputBench = result;
+                    }
+                }
+            }
+            else
+            if ( 0 == _tcsncmp( argv[index], L"--log-bench=", _tcslen(L"--log-bench=") ) )
+            {
+                TCHAR* endptr = NULL;
+                TCHAR* p = &argv[index][_tcslen(L"--log-bench=")];
+                const unsigned long result = _tcstoul( p, &endptr, 10 );
+                if ( ULONG_MAX != result )
+                {
+                    if ( NULL != endptr && _T('\0') == *endptr )
+                    {
+                        s_optLogBench = result;
+                    }
+                }
+            }
+            else
+            if ( 0 == _tcscmp( argv[index], L"--tree" ) )
+            {
+                s_optTree = true;
+            }
+            else
+            if ( 0 == _tcsncmp( argv[index], L"--tree-bench=", _tcslen(L"--tree-bench=") ) )
+            {
+                TCHAR* endptr = NULL;
+                TCHAR* p = &argv[index][_tcslen(L"--tree-bench=")];
+                const unsigned long result = _tcstoul( p, &endptr, 10 );
+                if ( ULONG_MAX != result )
+                {
+                    if ( NULL != endptr && _T('\0') == *endptr )
+                    {
+                        s_optTreeBench = result;
+                    }
+                }
+            }
+            else
+            if ( 0 == _tcscmp( argv[index], L"--simulate" ) )
+            {
+                s_optSimulate = L"camera";
+            }
+            else
+            if ( 0 == _tcsncmp( argv[index], L"--simulate=", _tcslen(L"--simulate=") ) )
+            {
+                s_optSimulate = &argv[index][_tcslen(L"--simulate=")];
+            }
+            else
+            if ( 0 == _tcsncmp( argv[index], L"--sim-depth=", _tcslen(L"--sim-depth=") ) )
+            {
+                TCHAR* endptr = NULL;
+                TCHAR* p = &argv[index][_tcslen(L"--sim-depth=")];
+                const unsigned long result = _tcstoul( p, &endptr, 10 );
+                if ( ULONG_MAX != result )
+                {
+                    if ( NULL != endptr && _T('\0') == *endptr )
+                    {
+                        s_optSimDepth = result;
+                    }
+                }
+            }
+            else
+            if ( 0 == _tcsncmp( argv[index], L"--sim-fanout=", _tcslen(L"--sim-fanout=") ) )
+            {
+                TCHAR* endptr = NULL;
+                TCHAR* p = &argv[index][_tcslen(L"--sim-fanout=")];
+                const unsigned long result = _tcstoul( p, &endptr, 10 );
+                if ( ULONG_MAX != result )
+                {
+                    if ( NULL != endptr && _T('\0') == *endptr )
+                    {
+                        s_optSimFanout = result;
+                    }
+                }
+            }
+            else
+            if ( 0 == _tcsncmp( argv[index], L"--sim-files=", _tcslen(L"--sim-files=") ) )
+            {
+                TCHAR* endptr = NULL;
+                TCHAR* p = &argv[index][_tcslen(L"--sim-files=")];
+                const unsigned long result = _tcstoul( p, &endptr, 10 );
+                if ( ULONG_MAX != result )
+                {
+                    if ( NULL != endptr && _T('\0') == *endptr )
+                    {
+                        s_optSimFiles = result;
+                    }
+                }
+            }
+            else
+            if ( 0 == _tcsncmp( argv[index], L"--sim-latency=", _tcslen(L"--sim-latency=") ) )
+            {
+                // enum,next,per-id,values in microseconds, trailing ones may be left out
+                TCHAR* p = &argv[index][_tcslen(L"--sim-latency=")];
+                for ( size_t indexLatency = 0; indexLatency < sizeof(s_optSimLatency)/sizeof(s_optSimLatency[0]); ++indexLatency )
+                {
+                    TCHAR* endptr = NULL;
+                    const unsigned long result = _tcstoul( p, &endptr, 10 );
+                    if ( ULONG_MAX == result || NULL == endptr || p == endptr )
+                    {
+                        break;
+                    }
+                    s_optSimLatency[indexLatency] = result;
+                    if ( _T(',') != *endptr )
+                    {
+                        break;
+                    }
+                    p = endptr + 1;
+                }
+            }
+            else
+            if ( 0 == _tcsncmp( argv[index], L"--sim-open=", _tcslen(L"--sim-open=") ) )
+            {
+                TCHAR* endptr = NULL;
+                TCHAR* p = &argv[index][_tcslen(L"--sim-open=")];
+                const unsigned long result = _tcstoul( p, &endptr, 10 );
+                if ( ULONG_MAX != result )
+                {
+                    if ( NULL != endptr && _T('\0') == *endptr )
+                    {
+                        s_optSimOpen = result;
+                    }
+                }
+            }
+            else
+            if ( 0 == _tcsncmp( argv[index], L"--sim-runs=", _tcslen(L"--sim-runs=") ) )
+            {
+                TCHAR* endptr = NULL;
+                TCHAR* p = &argv[index][_tcslen(L"--sim-runs=")];
+                const unsigned long result = _tcstoul( p, &endptr, 10 );
+                if ( ULONG_MAX != result && 0 < result )
+                {
+                    if ( NULL != endptr && _T('\0') == *endptr )
+                    {
+                        s_optSimRuns = result;
+                    }
+                }
+            }
+            else
+            if ( 0 == _tcscmp( argv[index], L"--no-session-pool" ) )
+            {
+                s_optNoSessionPool = true;
+            }
+            else
+            if ( 0 == _tcsncmp( argv[index], L"--bench-json=", _tcslen(L"--bench-json=") ) )
+            {
+                s_optBenchJson = &argv[index][_tcslen(L"--bench-json=")];
+            }
+            else
+            if ( 0 == _tcsncmp( argv[index], L"--bench-baseline=", _tcslen(L"--bench-baseline=") ) )
+            {
+                s_optBenchBaseline = &argv[index][_tcslen(L"--bench-baseline=")];
+            }
+            else
+            if ( 0 == _tcscmp( argv[index], L"--stats" ) )
+            {
+                s_optStats = true;
+            }
+            else
+            if ( 0 == _tcsncmp( argv[index], L"--stats-json=", _tcslen(L"--stats-json=") ) )
+            {
+                s_optStats = true;
+                s_optStatsJson = &argv[index][_tcslen(L"--stats-json=")];
+            }
+            else
+            if ( 0 == _tcscmp( argv[index], L"--daemon" ) )
+            {
+                s_optDaemon = true;
+            }
+            else
+            if ( 0 == _tcsncmp( argv[index], L"--pipe=", _tcslen(L"--pipe=") ) )
+            {
+                s_optPipe = &argv[index][_tcslen(L"--pipe=")];
+            }
+            else
+            if ( 0 == _tcsncmp( argv[index], L"--daemon-refresh=", _tcslen(L"--daemon-refresh=") ) )
+            {
+                TCHAR* endptr = NULL;
+                TCHAR* p = &argv[index][_tcslen(L"--daemon-refresh=")];
+                const unsigned long result = _tcstoul( p, &endptr, 10 );
+                if ( ULONG_MAX != result )
+                {
+                    if ( NULL != endptr && _T('\0') == *endptr )
+                    {
+                        s_optDaemonRefresh = result;
+                    }
+                }
+            }
+            else
+            if ( 0 == _tcsncmp( argv[index], L"--daemon-seconds=", _tcslen(L"--daemon-seconds=") ) )
+            {
+                TCHAR* endptr = NULL;
+                TCHAR* p = &argv[index][_tcslen(L"--daemon-seconds=")];
+                const unsigned long result = _tcstoul( p, &endptr, 10 );
+                if ( ULONG_MAX != result )
+                {
+                    if ( NULL != endptr && _T('\0') == *endptr )
+                    {
+                        s_optDaemonSeconds = result;
+                    }
+                }
+            }
+            else
+            if ( 0 == _tcsncmp( argv[index], L"--daemon-threads=", _tcslen(L"--daemon-threads=") ) )
+            {
+                TCHAR* endptr = NULL;
+                TCHAR* p = &argv[index][_tcslen(L"--daemon-threads=")];
+                const unsigned long result = _tcstoul( p, &endptr, 10 );
+                if ( ULONG_MAX != result && 0 < result )
+                {
+                    if ( NULL != endptr && _T('\0') == *endptr )
+                    {
+                        s_optDaemonThreads = result;
+                    }
+                }
+            }
+            else
+            if ( 0 == _tcsncmp( argv[index], L"--daemon-load-queries=", _tcslen(L"--daemon-load-queries=") ) )
+            {
+                TCHAR* endptr = NULL;
+                TCHAR* p = &argv[index][_tcslen(L"--daemon-load-queries=")];
+                const unsigned long result = _tcstoul( p, &endptr, 10 );
+                if ( ULONG_MAX != result && 0 < result )
+                {
+                    if ( NULL != endptr && _T('\0') == *endptr )
+                    {
+                        s_optDaemonLoadQueries = result;
+                    }
+                }
+            }
+            else
+            if ( 0 == _tcsncmp( argv[index], L"--daemon-load=", _tcslen(L"--daemon-load=") ) )
+            {
+                TCHAR* endptr = NULL;
+                TCHAR* p = &argv[index][_tcslen(L"--daemon-load=")];
+                const unsigned long result = _tcstoul( p, &endptr, 10 );
+                if ( ULONG_MAX != result && 0 < result )
+                {
+                    if ( NULL != endptr && _T('\0') == *endptr )
+                    {
+                        s_optDaemonLoad = result;
+                    }
+                }
+            }
+            else
+            if ( 0 == _tcsncmp( argv[index], L"--query=", _tcslen(L"--query=") ) )
+            {
+                s_optQuery = &argv[index][_tcslen(L"--query=")];
+            }
+            else
+            if ( 0 == _tcsncmp( argv[index], L"--resolve=", _tcslen(L"--resolve=") ) )
+            {
+                s_optResolve = &argv[index][_tcslen(L"--resolve=")];
+            }
+            else
+            if ( 0 == _tcsncmp( argv[index], L"--download=", _tcslen(L"--download=") ) )
+            {
+                s_optDownload = &argv[index][_tcslen(L"--download=")];
+            }
+            else
+            if ( 0 == _tcsncmp( argv[index], L"--download-jobs=", _tcslen(L"--download-jobs=") ) )
+            {
+                TCHAR* endptr = NULL;
+                TCHAR* p = &argv[index][_tcslen(L"--download-jobs=")];
+                const unsigned long result = _tcstoul( p, &endptr, 10 );
+                if ( ULONG_MAX != result && 0 < result )
+                {
+                    if ( NULL != endptr && _T('\0') == *endptr )
+                    {
+                        s_optDownloadJobs = result;
+                    }
+                }
+            }
+            else
+            if ( 0 == _tcsncmp( argv[index], L"--download-buffer=", _tcslen(L"--download-buffer=") ) )
+            {
+                TCHAR* endptr = NULL;
+                TCHAR* p = &argv[index][_tcslen(L"--download-buffer=")];
+                const unsigned long result = _tcstoul( p, &endptr, 10 );
+                if ( ULONG_MAX != result && 0 < result )
+                {
+                    if ( NULL != endptr && _T('\0') == *endptr )
+                    {
+                        s_optDownloadBuffer = result;
+                    }
+                }
+            }
+            else
+            if ( 0 == _tcsncmp( argv[index], L"--sim-bandwidth=", _tcslen(L"--sim-bandwidth=") ) )
+            {
+                TCHAR* endptr = NULL;
+                TCHAR* p = &argv[index][_tcslen(L"--sim-bandwidth=")];
+                const unsigned long result = _tcstoul( p, &endptr, 10 );
+                if ( ULONG_MAX != result )
+                {
+                    if ( NULL != endptr && _T('\0') == *endptr )
+                    {
+                        s_optSimBandwidth = result;
+                    }
+                }
+            }
+            else
+            if ( 0 == _tcsncmp( argv[index], L"--diff=", _tcslen(L"--diff=") ) )
+            {
+                s_optDiff = &argv[index][_tcslen(L"--diff=")];
+            }
+            else
+            if ( 0 == _tcsncmp( argv[index], L"--diff-bench=", _tcslen(L"--diff-bench=") ) )
+            {
+                TCHAR* endptr = NULL;
+                TCHAR* p = &argv[index][_tcslen(L"--diff-bench=")];
+                const unsigned long result = _tcstoul( p, &endptr, 10 );
+                if ( ULONG_MAX != result )
+                {
+                    if ( NULL != endptr && _T('\0') == *endptr )
+                    {
+                        s_optDiffBench = result;
+                    }
+                }
+            }
+            else
+            if ( 0 == _tcsncmp( argv[index], L"--catalog=", _tcslen(L"--catalog=") ) )
+            {
+                s_optCatalog = &argv[index][_tcslen(L"--catalog=")];
+            }
+            else
+            if ( 0 == _tcsncmp( argv[index], L"--catalog-query=", _tcslen(L"--catalog-query=") ) )
+            {
+                s_optCatalogQuery = &argv[index][_tcslen(L"--catalog-query=")];
+            }
+            else
+            if ( 0 == _tcsncmp( argv[index], L"--catalog-bench=", _tcslen(L"--catalog-bench=") ) )
+            {
+                TCHAR* endptr = NULL;
+                TCHAR* p = &argv[index][_tcslen(L"--catalog-bench=")];
+                const unsigned long result = _tcstoul( p, &endptr, 10 );
+                if ( ULONG_MAX != result )
+                {
+                    if ( NULL != endptr && _T('\0') == *endptr )
+                    {
+                        s_optCatalogBench = result;
+                    }
+                }
+            }
+            else
+            if ( 0 == _tcscmp( argv[index], L"--dedup" ) )
+            {
+                s_optDedup = true;
             }
-        }
-
-    }
-
-#if defined(_MSC_VER) && (_MSC_VER > 1500)
-    {
-        if ( ::IsEqualCLSID( myCLSID_PortableDeviceFTM, CLSID_PortableDeviceFTM ) )
-        {
-            LOGV( L"myCLSID_PortableDeviceFTM matched CLSID_PortableDeviceFTM\n" );
-        }
-        else
-        {
-            LOGE( L"myCLSID_PortableDeviceFTM not match CLSID_PortableDeviceFTM\n" );
-            ::DebugBreak();
-        }
-    }
-#endif
-
-    if ( NULL != pDeviceIdArray )
-    {
-        for ( size_t index = 0; index < dwCountDeviceId; ++index )
-        {
-            if ( NULL == pDeviceIdArray[index] )
+            else
+            if ( 0 == _tcsncmp( argv[index], L"--hash-bench=", _tcslen(L"--hash-bench=") ) )
             {
-                continue;
+                TCHAR* endptr = NULL;
+                TCHAR* p = &argv[index][_tcslen(L"--hash-bench=")];
+                const unsigned long result = _tcstoul( p, &endptr, 10 );
+                if ( ULONG_MAX != result )
+                {
+                    if ( NULL != endptr && _T('\0') == *endptr )
+                    {
+                        s_optHashBench = result;
+                    }
+                }
             }
-
-            bool readyPortableDevice = false;
-            IPortableDevice* pPortableDevice = NULL;
+            else
+            if ( 0 == _tcsncmp( argv[index], L"--sim-copies=", _tcslen(L"--sim-copies=") ) )
             {
-                const IID& rclsid = (s_optUsePortableDeviceFTM)?(myCLSID_PortableDeviceFTM):(CLSID_PortableDevice);
-                const HRESULT hr = ::CoCreateInstance(
-                    rclsid
-                    , NULL
-                    , CLSCTX_INPROC_SERVER
-                    , IID_PPV_ARGS(&pPortableDevice)
-                    );
-                if ( FAILED(hr) )
+                TCHAR* endptr = NULL;
+                TCHAR* p = &argv[index][_tcslen(L"--sim-copies=")];
+                const unsigned long result = _tcstoul( p, &endptr, 10 );
+                if ( ULONG_MAX != result )
                 {
-                    LOGE( L"! Failed. CoCreateInstance CLSID_PortableDevice, hr=0x%08x\n", hr );
+                    if ( NULL != endptr && _T('\0') == *endptr )
+                    {
+                        s_optSimCopies = result;
+                    }
                 }
             }
-
-            if ( NULL != pPortableDevice )
+            else
+            if ( 0 == _tcsncmp( argv[index], L"--download-retries=", _tcslen(L"--download-retries=") ) )
             {
+                TCHAR* endptr = NULL;
+                TCHAR* p = &argv[index][_tcslen(L"--download-retries=")];
+                const unsigned long result = _tcstoul( p, &endptr, 10 );
+                if ( ULONG_MAX != result )
                 {
-                    const HRESULT hr = pPortableDevice->Open( pDeviceIdArray[index], pPortableDeviceValues );
-                    if ( FAILED(hr) )
+                    if ( NULL != endptr && _T('\0') == *endptr )
                     {
-                        LOGE( L"! Failed. IPortableDevice::Open, hr=0x%08x\n", hr );
+                        s_optDownloadRetries = result;
                     }
-                    else
+                }
+            }
+            else
+            if ( 0 == _tcsncmp( argv[index], L"--sim-disconnect=", _tcslen(L"--sim-disconnect=") ) )
+            {
+                TCHAR* endptr = NULL;
+                TCHAR* p = &argv[index][_tcslen(L"--sim-disconnect=")];
+                const unsigned long result = _tcstoul( p, &endptr, 10 );
+                if ( ULONG_MAX != result && result < 1000 )
+                {
+                    if ( NULL != endptr && _T('\0') == *endptr )
                     {
-                        readyPortableDevice = true;
+                        s_optSimDisconnect = result;
                     }
                 }
             }
-
-            if ( NULL != pPortableDevice )
+            else
+            if ( 0 == _tcsncmp( argv[index], L"--sim-bulk-short=", _tcslen(L"--sim-bulk-short=") ) )
             {
-                if ( readyPortableDevice )
+                TCHAR* endptr = NULL;
+                TCHAR* p = &argv[index][_tcslen(L"--sim-bulk-short=")];
+                const unsigned long result = _tcstoul( p, &endptr, 10 );
+                if ( ULONG_MAX != result && result < 1000 )
                 {
-                    IPortableDeviceContent* pPortableDeviceContent = NULL;
+                    if ( NULL != endptr && _T('\0') == *endptr )
                     {
-                        const HRESULT hr = pPortableDevice->Content( &pPortableDeviceContent );
-                        if ( FAILED(hr) )
-                        {
-                            LOGE( L"! Failed. IPortableDevice::Content, hr=0x%08x\n", hr );
-                        }
+                        s_optSimBulkShort = result;
                     }
-
-                    for ( size_t index = 0; index < 30; ++index )
+                }
+            }
+            else
+            if ( 0 == _tcsncmp( argv[index], L"--sim-compare=", _tcslen(L"--sim-compare=") ) )
+            {
+                s_optSimCompare = &argv[index][_tcslen(L"--sim-compare=")];
+            }
+            else
+            if ( 0 == _tcsncmp( argv[index], L"--sim-plug=", _tcslen(L"--sim-plug=") ) )
+            {
+                s_optSimPlug = &argv[index][_tcslen(L"--sim-plug=")];
+            }
+            else
+            if ( 0 == _tcsncmp( argv[index], L"--sim-devices=", _tcslen(L"--sim-devices=") ) )
+            {
+                TCHAR* endptr = NULL;
+                TCHAR* p = &argv[index][_tcslen(L"--sim-devices=")];
+                const unsigned long result = _tcstoul( p, &endptr, 10 );
+                if ( ULONG_MAX != result && 0 < result && result <= 64 )
+                {
+                    if ( NULL != endptr && _T('\0') == *endptr )
                     {
-                        if ( NULL != pPortableDeviceContent )
-                        {
-                            s_dwCountContent = 0;
-                            const bool result = wpdEnumContent_RecursiveEnumerate( WPD_DEVICE_OBJECT_ID, pPortableDeviceContent );
-                            LOGI( L"    Content count=%u\n", s_dwCountContent );
-                            if ( false == result )
-                            {
-                                break;
-                            }
-                        }
-
-                        ::Sleep( 1 * 1000 );
+                        s_optSimDevices = result;
                     }
-
-                    if ( NULL != pPortableDeviceContent )
+                }
+            }
+            else
+            if ( 0 == _tcsncmp( argv[index], L"--sim-change=", _tcslen(L"--sim-change=") ) )
+            {
+                TCHAR* endptr = NULL;
+                TCHAR* p = &argv[index][_tcslen(L"--sim-change=")];
+                const unsigned long result = _tcstoul( p, &endptr, 10 );
+                if ( ULONG_MAX != result && result <= 1000 )
+                {
+                    if ( NULL != endptr && _T('\0') == *endptr )
                     {
-                        const DWORD dwCount = pPortableDeviceContent->Release();
-                        LOGV( L"IPortableDeviceContent::Release, count=%u\n", dwCount );
-                        pPortableDeviceContent = NULL;
+                        s_optSimChange = result;
                     }
                 }
             }
-
-            if ( NULL != pPortableDevice )
+            else
+            if ( 0 == _tcsncmp( argv[index], L"--sim-kill=", _tcslen(L"--sim-kill=") ) )
             {
-                const DWORD dwCount = pPortableDevice->Release();
-                LOGV( L"IPortableDevice::Release, count=%u\n", dwCount );
-                pPortableDevice = NULL;
+                TCHAR* endptr = NULL;
+                TCHAR* p = &argv[index][_tcslen(L"--sim-kill=")];
+                const unsigned long result = _tcstoul( p, &endptr, 10 );
+                if ( ULONG_MAX != result && result < 1000 )
+                {
+                    if ( NULL != endptr && _T('\0') == *endptr )
+                    {
+                        s_optSimKill = result;
+                    }
+                }
             }
-        }
-    }
-
-
-    if ( NULL != pPortableDeviceValues )
-    {
-        const DWORD dwCount = pPortableDeviceValues->Release();
-        LOGV( L"IPortableDeviceValues::Release, count=%u\n", dwCount );
-        pPortableDeviceValues = NULL;
-    }
-
-    //FreePortableDevicePnPIDs( pDeviceIdArray, dwCountDeviceId );
-    if ( NULL != pDeviceIdArray )
-    {
-        for ( size_t index = 0; index < dwCountDeviceId; ++index )
-        {
-            if ( NULL != pDeviceIdArray[index] )
+            else
+            if ( 0 == _tcscmp( argv[index], L"--alloc-stats" ) )
             {
-                ::CoTaskMemFree( pDeviceIdArray[index] );
-                pDeviceIdArray[index] = NULL;
+                s_optAllocStats = true;
             }
-        }
-    }
-    if ( NULL != pDeviceIdArray )
-    {
-        delete [] pDeviceIdArray;
-        pDeviceIdArray = NULL;
-    }
-
-    if ( NULL != pPortableDeviceManager )
-    {
-        const DWORD dwCount = pPortableDeviceManager->Release();
-        LOGV( L"IPortableDeviceManager::Release, count=%u\n", dwCount );
-        pPortableDeviceManager = NULL;
-    }
-
-}
-
-
-
-int _tmain(int argc, _TCHAR* argv[])
-{
-    if ( NULL != argv )
-    {
-        for ( int index = 1; index < argc; ++index )
-        {
-            if ( NULL == argv[index] )
+            else
+            if ( 0 == _tcsncmp( argv[index], L"--cache=", _tcslen(L"--cache=") ) )
             {
-                continue;
+                s_optCacheDir = &argv[index][_tcslen(L"--cache=")];
             }
-
-            if ( 0 == _tcscmp( argv[index], L"--verbose" ) )
+            else
+            if ( 0 == _tcsncmp( argv[index], L"--props=", _tcslen(L"--props=") ) )
             {
-                s_optVerbose = true;
+                s_optProps = &argv[index][_tcslen(L"--props=")];
             }
             else
-            if ( 0 == _tcscmp( argv[index], L"--use-deviceftm" ) )
+            if ( 0 == _tcscmp( argv[index], L"--bulk" ) )
             {
-                s_optUsePortableDeviceFTM = true;
+                s_optUseBulk = true;
             }
             else
-            if ( 0 == _tcsncmp( argv[index], L"--fetch-count=", _tcslen(L"--fetch-count=") ) )
+            if ( 0 == _tcsncmp( argv[index], L"--bulk-batch=", _tcslen(L"--bulk-batch=") ) )
             {
                 TCHAR* endptr = NULL;
-                TCHAR* p = &argv[index][_tcslen(L"--fetch-count=")];
+                TCHAR* p = &argv[index][_tcslen(L"--bulk-batch=")];
                 const unsigned long result = _tcstoul( p, &endptr, 10 );
-                if ( ULONG_MAX != result )
+                if ( ULONG_MAX != result && 0 < result )
                 {
                     if ( NULL != endptr && _T('\0') == *endptr )
                     {
-                        s_optCountOfFetch = result;
+                        s_optUseBulk = true;
+                        s_optBulkBatch = result;
                     }
                 }
             }
         }
     }
 
-    LOGI( L"Fetch Count: %u\n", s_optCountOfFetch );
+    // a folder --cache= reuses is not walked: the tree store, output records, downloads, hashes and watch trees would miss it
+    if ( NULL != s_optCacheDir
+        && (s_optTree || NULL != s_optCatalog || NULL != s_optDownload || s_optDedup || s_optDaemon || NULL != s_optOutputFile || s_optWatch) )
+    {
+        LOGE( L"! Failed. --cache= cannot be combined with --tree, --catalog=, --download=, --dedup, --daemon, --output= or --watch\n" );
+        wpdLog_Stop();
+        return 1;
+    }
+
+    ::QueryPerformanceFrequency( &s_qpcFrequency );
+
+    if ( s_optAdaptiveFetch )
+    {
+        LOGI( L"Fetch Count: auto, start %u, max %u\n", s_optCountOfFetch, s_optCountOfFetchMax );
+    }
+    else
+    {
+        LOGI( L"Fetch Count: %u\n", s_optCountOfFetch );
+    }
+    if ( s_optUseBulk )
+    {
+        LOGI( L"Bulk Batch : %u\n", s_optBulkBatch );
+    }
+    if ( NULL != s_optProps )
+    {
+        LOGI( L"Props      : %s\n", s_optProps );
+    }
+    if ( NULL != s_optOnly )
+    {
+        LOGI( L"Only       : %s\n", s_optOnly );
+    }
+    if ( NULL != s_optExcludeFolders )
+    {
+        LOGI( L"Exclude    : %s\n", s_optExcludeFolders );
+    }
+    LOGI( L"Discovery  : %u ms\n", s_optDiscoveryTimeout );
+    LOGI( L"Jobs       : %u\n", s_optCountOfJobs );
+    LOGI( L"Walkers    : %u\n", s_optCountOfWalkers );
+    if ( NULL != s_optResumeFile )
+    {
+        LOGI( L"Resume     : %s, every %u objects\n", s_optResumeFile, s_optCheckpointInterval );
+    }
+    if ( NULL != s_optCacheDir )
+    {
+        LOGI( L"Cache      : %s\n", s_optCacheDir );
+    }
+    if ( s_optWatch )
+    {
+        LOGI( L"Watch      : %u sec, debounce %u ms\n", s_optWatchSeconds, s_optWatchDebounce );
+    }
+    if ( NULL != s_optOutputFile )
+    {
+        LOGI( L"Output     : %s, %s\n", s_optOutputFile, s_optOutputFormat );
+    }
+    if ( s_optAllocStats )
+    {
+        LOGI( L"AllocStats : heap and CoTaskMem allocations per object\n" );
+    }
+    if ( s_optStats )
+    {
+        LOGI( L"Stats      : per device operation, json=%s\n", (NULL != s_optStatsJson)?(s_optStatsJson):(L"none") );
+    }
+    if ( NULL != s_optSimulate )
+    {
+        LOGI( L"Simulate   : %s, runs=%u, depth=%u, fanout=%u, files=%u, latency open=%uus, enum=%uus, next=%uus+%uus/id, values=%uus\n"
+            , s_optSimulate
+            , s_optSimRuns
+            , s_optSimDepth
+            , s_optSimFanout
+            , s_optSimFiles
+            , s_optSimOpen
+            , s_optSimLatency[0]
+            , s_optSimLatency[1]
+            , s_optSimLatency[2]
+            , s_optSimLatency[3]
+            );
+        if ( NULL != s_optSimCompare )
+        {
+            LOGI( L"Compare    : %s\n", s_optSimCompare );
+        }
+    }
+
+    if ( NULL != s_optResolve )
+    {
+        LOGI( L"Resolve    : %s\n", s_optResolve );
+    }
+    if ( NULL != s_optDownload )
+    {
+        LOGI( L"Download   : %s, jobs=%u, buffer=%u KiB, retries=%u\n", s_optDownload, s_optDownloadJobs, s_optDownloadBuffer, s_optDownloadRetries );
+    }
+    if ( s_optDaemon )
+    {
+        LOGI( L"Daemon     : pipe=%s, servers=%u, refresh=%u sec, run=%u sec\n"
+            , (NULL != s_optPipe)?(s_optPipe):(WPD_DAEMON_PIPE_DEFAULT)
+            , s_optDaemonThreads
+            , s_optDaemonRefresh
+            , s_optDaemonSeconds
+            );
+    }
+    if ( 0 < s_optDaemonLoad )
+    {
+        LOGI( L"Daemon load: clients=%u, queries=%u each\n", s_optDaemonLoad, s_optDaemonLoadQueries );
+    }
 
     bool needCoUninitialize = false;
     {
@@ -1046,10 +17647,148 @@ int _tmain(int argc, _TCHAR* argv[])
         }
     }
 
-    for ( size_t index = 0; index < 10; ++index )
+    if ( NULL != s_optOutputFile )
+    {
+        s_pOutputSink = wpdOutput_Create( s_optOutputFile, s_optOutputFormat );
+    }
+
+    wpdStats_Start();
+    wpdSessionPool_Start();
+    wpdDeviceInfoCache_Start();
+    wpdDedup_Start();
+
+    WpdMallocSpy* pMallocSpy = NULL;
+    if ( s_optAllocStats )
+    {
+        pMallocSpy = new WpdMallocSpy();
+        const HRESULT hr = ::CoRegisterMallocSpy( pMallocSpy );
+        if ( FAILED(hr) )
+        {
+            LOGE( L"! Failed. CoRegisterMallocSpy, hr=0x%08x\n", hr );
+        }
+    }
+
+    if ( 0 < s_optLogBench )
+    {
+        wpdLog_Bench( s_optLogBench );
+    }
+    else
+    if ( 0 < s_optTreeBench )
+    {
+        wpdTreeStore_Bench( s_optTreeBench );
+    }
+    else
+    if ( 0 < s_optHashBench )
+    {
+        wpdHash_Bench( s_optHashBench );
+    }
+    else
+    if ( 0 < s_optDiffBench )
+    {
+        wpdDiff_Bench( s_optDiffBench );
+    }
+    else
+    if ( NULL != s_optDiff )
+    {
+        wpdDiff_Command( s_optDiff );
+    }
+    else
+    if ( 0 < s_optCatalogBench )
+    {
+        wpdCatalog_Bench( s_optCatalogBench );
+    }
+    else
+    if ( NULL != s_optCatalogQuery )
+    {
+        wpdCatalog_Command( s_optCatalogQuery );
+    }
+    else
+    if ( 0 < s_optOutputBench )
+    {
+        if ( NULL != s_pOutputSink )
+        {
+            wpdOutput_Bench( s_optOutputBench );
+        }
+    }
+    else
+    if ( NULL != s_optQuery )
+    {
+        wpdDaemon_QueryOnce( s_optQuery );
+    }
+    else
+    if ( s_optDaemon )
+    {
+        wpdDaemon_Run();
+    }
+    else
+    if ( 0 < s_optDaemonLoad )
+    {
+        std::wstring pipeName;
+        wpdDaemon_PipeName( &pipeName );
+        wpdDaemon_Load( pipeName.c_str() );
+    }
+    else
+    if ( NULL != s_optSimulate && NULL != s_optSimPlug )
+    {
+        wpdSimulate_Discovery();
+    }
+    else
+    if ( NULL != s_optSimulate && NULL != s_optSimCompare )
+    {
+        wpdSimCompare_Run();
+    }
+    else
+    if ( NULL != s_optSimulate )
+    {
+        WpdBenchResult result;
+        wpdSimulate( &result );
+        if ( NULL != s_optBenchJson )
+        {
+            wpdBench_WriteJson( s_optBenchJson, result );
+        }
+        if ( NULL != s_optBenchBaseline )
+        {
+            wpdBench_Compare( s_optBenchBaseline, result );
+        }
+    }
+    else
+    {
+        for ( size_t index = 0; index < 10; ++index )
+        {
+            enumWPDcore();
+            ::Sleep( 1 * 1000 );
+        }
+    }
+
+    if ( NULL != s_pOutputSink )
+    {
+        LOGI( L"Output     : records=%I64u, bytes=%I64u\n", s_pOutputSink->getCountRecord(), s_pOutputSink->getCountBytes() );
+        delete s_pOutputSink;
+        s_pOutputSink = NULL;
+    }
+
+    wpdSessionPool_Report();
+    wpdSessionPool_Stop();
+    wpdDeviceInfoCache_Report();
+    wpdDeviceInfoCache_Stop();
+    wpdDedup_Stop();
+
+    if ( s_optStats )
+    {
+        wpdStats_Report();
+        if ( NULL != s_optStatsJson )
+        {
+            wpdStats_WriteJson( s_optStatsJson );
+        }
+    }
+    wpdStats_Stop();
+
+    if ( NULL != pMallocSpy )
     {
-        enumWPDcore();
-        ::Sleep( 1 * 1000 );
+        // fails with E_ACCESSDENIED while spied blocks are alive, COM keeps its reference then
+        ::CoRevokeMallocSpy();
+        pMallocSpy->Release();
+        pMallocSpy = NULL;
     }
 
     if ( needCoUninitialize )
@@ -1057,6 +17796,8 @@ int _tmain(int argc, _TCHAR* argv[])
         ::CoUninitialize();
     }
 
+    wpdLog_Stop();
+
 #if 0
     if ( ::IsDebuggerPresent() )
     {